@@ -27,6 +27,7 @@ THE SOFTWARE.
 namespace Calc
 {
     class Buffer;
+    class Event;
     class CALC_API Primitives
     {
     public:
@@ -34,6 +35,9 @@ namespace Calc
         virtual ~Primitives() = default;
 
         virtual void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+        // Copy input elements with non-zero predicate to output keeping their order and write their number to new_size,
+        // the whole predicate buffer is processed. Call is blocking if passed nullptr for an event.
+        virtual void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* input, Buffer* output, Buffer* new_size, Event** e) = 0;
 
 
     private:
@@ -604,6 +604,33 @@ namespace Calc
             m_pp.SortRadix((int)queueidx, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size);
         }
 
+        void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* input, Buffer* output, Buffer* new_size, Event** e) override
+        {
+            try
+            {
+                // Compact takes element counts from the buffers
+                auto predicate_clw = CLWBuffer<cl_int>::CreateFromClBuffer(static_cast<BufferClw const*>(predicate)->GetData());
+                auto input_clw = CLWBuffer<cl_int>::CreateFromClBuffer(static_cast<BufferClw const*>(input)->GetData());
+                auto output_clw = CLWBuffer<cl_int>::CreateFromClBuffer(static_cast<BufferClw*>(output)->GetData());
+                auto new_size_clw = CLWBuffer<cl_int>::CreateFromClBuffer(static_cast<BufferClw*>(new_size)->GetData());
+
+                CLWEvent event = m_pp.Compact(queueidx, predicate_clw, input_clw, output_clw, new_size_clw);
+
+                if (e)
+                {
+                    *e = new EventClw(event);
+                }
+                else
+                {
+                    event.Wait();
+                }
+            }
+            catch (CLWException& ex)
+            {
+                throw ExceptionClw(ex.what());
+            }
+        }
+
     private:
         CLWParallelPrimitives m_pp;
     };
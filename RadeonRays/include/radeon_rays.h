@@ -71,6 +71,8 @@ namespace RadeonRays
             kOpenCL = 0x1,
             kVulkan = 0x2,
             kEmbree = 0x4,
+            // Native SIMD CPU device, always available
+            kNativeCpu = 0x8,
 
             kAny = 0xFF
         };
@@ -166,6 +168,55 @@ namespace RadeonRays
         kMapWrite = 0x2
     };
 
+    // Rays in structure-of-arrays layout.
+    // origins and directions hold 3 planes of numrays floats (all x, then all y, then all z),
+    // maxt holds numrays floats and masks holds numrays ints.
+    // maxt and masks might be nullptr, which means unlimited rays visible to all shapes.
+    struct RaySoA
+    {
+        Buffer const* origins;
+        Buffer const* directions;
+        Buffer const* maxt;
+        Buffer const* masks;
+    };
+
+    // Closest hits in structure-of-arrays layout.
+    // t, primids and shapeids hold numrays elements (float, Id, Id),
+    // uvs holds 2 planes of numrays floats (all u, then all v).
+    // Buffers set to nullptr are not written.
+    struct IntersectionSoA
+    {
+        Buffer* t;
+        Buffer* primids;
+        Buffer* shapeids;
+        Buffer* uvs;
+    };
+
+    // Reduced outputs of intersection queries, inactive rays are reported as misses
+    enum QueryOutput
+    {
+        // Hit distance per ray (float), negative if there is no hit
+        kHitDistance = 0x1,
+        // Shape and primitive Id per ray (pair of Ids), kNullId if there is no hit
+        kHitIds = 0x2,
+        // One bit per ray packed into (numrays + 31) / 32 ints, bit i % 32 of int i / 32
+        // is set if ray i is occluded, QueryOcclusion only
+        kOcclusionMask = 0x4
+    };
+
+    // Maximum number of hits per ray returned by QueryIntersectionMulti
+    const int kMaxHitsPerRay = 8;
+
+    // Query volumes of QueryOverlap
+    enum OverlapVolume
+    {
+        // Axis aligned box per query, min and max corners (2 x float3)
+        kOverlapBox,
+        // Frustum per query, 6 planes (6 x float4) with normals pointing inside,
+        // point p is inside the plane if dot(plane.xyz, p) + plane.w >= 0
+        kOverlapFrustum
+    };
+
     // IntersectionApi is designed to provide fast means for ray-scene intersection
     // for AMD architectures. It effectively absracts underlying AMD hardware and
     // software stack and allows user to issue low-latency batched ray queries.
@@ -188,6 +239,8 @@ namespace RadeonRays
         // Note: this may be sub optimal in some case. to avoid enum all devices
         // across all platforms explicitly before deciding on platform and 
         // device(s) to use
+        // kNativeCpu device has no external dependencies and is enumerated last,
+        // it honors "bvh.*" build options and ignores "acc.type"
         static void SetPlatform(const DeviceInfo::Platform platform);
 
 
@@ -217,6 +270,9 @@ namespace RadeonRays
         // The mesh might be mixed quad\triangle mesh which is determined
         // by numfacevertices array containing numfaces entries describing
         // the number of vertices for current face (3 or 4)
+        // Quad (v0, v1, v2, v3) is intersected as triangles (v0, v1, v2) and (v0, v2, v3),
+        // hits report the quad index as primid, barycentrics of the hit triangle in uvwt.xy
+        // and uvwt.z set to 1 for the second triangle (0 otherwise)
         // The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateMesh(
             // Position data
@@ -283,16 +339,80 @@ namespace RadeonRays
         // The call is asynchronous. Event pointer mights be nullptrs.
         virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
 
+        // Compact output path:
+        // Find closest intersection and write only the part of it selected by output (kHitDistance or kHitIds)
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection and write the occlusion mask (kOcclusionMask)
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+        // Same as above, number of rays is in remote memory, outputs past it are not written
+        virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+
+        // Structure-of-arrays path:
+        // CPU and Embree devices support it for every scene. OpenCL devices support it with acc.type "bvh"
+        // and "fatbvh" and for two level BVHs (scenes with instances or bvh.force2level), other acc.type
+        // values and Vulkan devices throw.
+        // Find closest intersection, rays and hits are described by RaySoA and IntersectionSoA
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection, hitresults holds numrays ints as for AoS rays.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        virtual void QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+
+        // Multi-hit path:
+        // Find up to k (1..kMaxHitsPerRay) closest intersections in a single traversal, hits holds k Intersections
+        // per ray sorted by distance, entries past the last hit have shapeid == kNullId.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Closest point path:
+        // Find the closest surface point within maxdist for each of numpoints points (float3, w is ignored).
+        // results holds an Intersection per point with uvwt = (barycentric u, barycentric v, 0, distance),
+        // shapeid == kNullId if no surface is within maxdist.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const = 0;
+
+        // Overlap path:
+        // Find primitives overlapping each of numqueries volumes, primitives are tested by their bounds
+        // and frustum tests are conservative, so primitives close to a frustum corner might be reported.
+        // results receives (shapeid, primid) pairs of all queries back to back in query order and needs room for
+        // numqueries * maxhits pairs, counts receives the number of pairs of each query (int), at most maxhits.
+        // GPU devices might report a primitive more than once if the BVH is built with bvh.sah.use_splits.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const = 0;
+
         /******************************************
         Utility
         ******************************************/
         // Supported options:
         // option "bvh.type" values {"bvh" (regular bvh, default), "qbvh" (4 branching factor), "hlbvh" (fast builds)}
+        // option "acc.type" values {"bvh" (default), "fatbvh" (child bounds stored in parent nodes), "cbvh" (fatbvh with child bounds quantized to 16 bits, 48 byte nodes instead of 64),
+        //         "qbvh" (binary bvh collapsed to 4 branching factor, half the depth), "hlbvh" (fast builds),
+        //         "grid" (uniform grid, fastest to build, good for evenly tessellated meshes)}
         // option "bvh.force2level" values {0(default), 1}
         //         by default 2-level BVH is used only if there is instancing in the scene or
         //         motion blur is enabled. 1 forces 2-level BVH for all cases.
-        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default)}
+        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default),
+        //         "lbvh" (sort primitives along Morton curve, fastest to build, multithreaded on the CPU, lower quality)}
         // option "bvh.sah.use_splits" values {0(default),1} (allow spatial splits for BVH)
+        // option "bvh.parallel_build" values {0(default),1} (build BVH subtrees concurrently, the tree is identical to the serial build)
+        // option "bvh.optimize" values {"none"(default), "treelet"} (restructure treelets of the built BVH to reduce its SAH cost, most useful for "median" and "lbvh" builders)
+        // option "bvh.cache.path" values {string, default = ""} (directory to cache built BVHs in, keyed by geometry and build options hash, "bvh", "fatbvh", "cbvh" and "qbvh" only)
+        // option "bvh.refit" values {0(default),1} (when shapes are only moved, update BVH bounds in place instead of rebuilding, 1-level BVH only)
+        // option "bvh.refit.max_sah_ratio" values {float, default = 1.5f} (rebuild if refitted BVH SAH cost exceeds the cost after the last build by this factor)
+        // option "bvh.max_leaf_size" values {int, default = 1} (maximum number of triangles in a BVH leaf, SAH builder decides per leaf, ignored by 2-level BVH, at most 15 for "cbvh")
+        // option "grid.density" values {float, default = 4.f} (target number of grid voxels per primitive, resolution is about (density * N)^(1/3) along the scene extents)
+        // option "grid.parallel_build" values {0,1(default)} (build grid using multiple threads)
+        // option "cpu.packet_size" values {1(default),4,8,16} (native cpu device only, trace groups of consecutive rays as packets,
+        //         groups with mixed direction signs or diverging directions fall back to single rays)
+        // option "embree.packet_width" values {0(default),4,8,16} (embree device only, width of the ray packets traced by each worker,
+        //         0 picks the widest one the CPU and the embree build support, unsupported widths fall back to it)
+        // option "query.sort_rays" values {0(default),1} (reorder batches of 4096 rays or more by direction octant and origin Morton code
+        //         before tracing, results are returned in the original order, helps incoherent secondary rays,
+        //         rays are sorted on the host so the query waits for its input and completes before returning,
+        //         full AoS outputs only)
         // option "bvh.sah.traversal_cost" values {float, default = 10.f for GPU } (cost of node traversal vs triangle intersection)
         // option "bvh.sah.min_overlap" values { float < 1.f, default = 0.005f } 
         //         (overlap area which is considered for a spatial splits, fraction of parent bbox)
@@ -31,6 +31,28 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
+    // Subtrees smaller than this are always built on the calling thread
+    static int const kMinParallelBuildPrims = 4096;
+    // Minimum number of primitives binned by one task in parallel SAH evaluation
+    static int const kMinParallelBinningPrims = 65536;
+    // Maximum number of leaves in a treelet restructured by OptimizeTreelets
+    static int const kTreeletSize = 7;
+    // Number of treelet optimization passes, minimum subtree size doubles every pass
+    static int const kNumTreeletPasses = 3;
+
+    // Deepest level where subtrees are forked into tasks: a few tasks per hardware thread
+    static int CalcMaxForkLevel()
+    {
+        int numthreads = std::max(1, (int)std::thread::hardware_concurrency());
+        int level = 0;
+        while ((1 << level) < 4 * numthreads)
+        {
+            ++level;
+        }
+
+        return level;
+    }
+
     static bool is_nan(float v)
     {
         return v != v;
@@ -63,15 +85,48 @@ namespace RadeonRays
         return &m_nodes[m_nodecnt++];
     }
 
-    void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
+    Bvh::SubtreeInfo Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
     {
-        m_height = std::max(m_height, req.level);
-
-        Node* node = AllocateNode();
+        // Nodes are counted per subtree and summed up by the parent,
+        // so the build never touches shared counters
+        SubtreeInfo info = { req.level, 1 };
+
+        // The subtree for n primitives takes at most 2n - 1 nodes,
+        // so each request owns a fixed range of m_nodes starting at nodeidx.
+        // This gives the same depth-first layout as serial allocation
+        // while letting concurrent tasks allocate without synchronization.
+        // Multi-primitive leaves leave the tail of their range unused.
+        Node* node = &m_nodes[req.nodeidx];
         node->bounds = req.bounds;
 
+        // Choose the maximum extent
+        int axis = req.centroid_bounds.maxdim();
+        float border = req.centroid_bounds.center()[axis];
+
         // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        bool makeleaf = req.numprims < 2;
+
+        if (!makeleaf && m_usesah && (req.level < 10 || req.numprims <= m_max_leaf_size))
+        {
+            SahSplit ss = FindSahSplit(req, bounds, centroids, primindices);
+
+            if (!is_nan(ss.split))
+            {
+                axis = ss.dim;
+                border = ss.split;
+            }
+
+            // Keep the primitives in a leaf if intersecting all of them
+            // (unit cost each) is cheaper than the best split. The root is
+            // always split, fat node layouts need a pair of children there.
+            makeleaf = req.level > 0 && req.numprims <= m_max_leaf_size && req.numprims <= ss.sah;
+        }
+        else if (!makeleaf && !m_usesah)
+        {
+            makeleaf = req.level > 0 && req.numprims <= m_max_leaf_size;
+        }
+
+        if (makeleaf)
         {
 #ifdef USE_TBB
             primitive_mutex_.lock();
@@ -87,21 +142,6 @@ namespace RadeonRays
         {
             node->type = kInternal;
 
-            // Choose the maximum extent
-            int axis = req.centroid_bounds.maxdim();
-            float border = req.centroid_bounds.center()[axis];
-
-            if (m_usesah && req.level < 10)
-            {
-                SahSplit ss = FindSahSplit(req, bounds, centroids, primindices);
-
-                if (!is_nan(ss.split))
-                {
-                    axis = ss.dim;
-                    border = ss.split;
-                }
-            }
-
             // Start partitioning and updating extents for children at the same time
             bbox leftbounds, rightbounds, leftcentroid_bounds, rightcentroid_bounds;
             int splitidx = req.startidx;
@@ -200,23 +240,40 @@ namespace RadeonRays
                 }
             }
 
+            int numleft = splitidx - req.startidx;
+
             // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1 };
+            SplitRequest leftrequest = { req.startidx, numleft, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, req.nodeidx + 1 };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - numleft, &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, req.nodeidx + 2 * numleft };
 
+            if (m_parallel && req.level < m_max_fork_level && req.numprims > kMinParallelBuildPrims)
             {
-                // Put those to stack
-                BuildNode(leftrequest, bounds, centroids, primindices);
-            }
+                // Children touch disjoint index and node ranges, so the left
+                // subtree can be built concurrently with the right one
+                auto left = std::async(std::launch::async, [&]()
+                {
+                    return BuildNode(leftrequest, bounds, centroids, primindices);
+                });
 
+                SubtreeInfo right = BuildNode(rightrequest, bounds, centroids, primindices);
+                SubtreeInfo leftinfo = left.get();
+                info.height = std::max(leftinfo.height, right.height);
+                info.numnodes += leftinfo.numnodes + right.numnodes;
+            }
+            else
             {
-                BuildNode(rightrequest, bounds, centroids, primindices);
+                SubtreeInfo left = BuildNode(leftrequest, bounds, centroids, primindices);
+                SubtreeInfo right = BuildNode(rightrequest, bounds, centroids, primindices);
+                info.height = std::max(left.height, right.height);
+                info.numnodes += left.numnodes + right.numnodes;
             }
         }
 
         // Set parent ptr if any
         if (req.ptr) *req.ptr = node;
+
+        return info;
     }
 
     Bvh::SahSplit Bvh::FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const
@@ -231,6 +288,7 @@ namespace RadeonRays
         SahSplit split;
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = sah;
 
         // if we cannot apply histogram algorithm
         // put NAN sentinel as split border
@@ -255,17 +313,14 @@ namespace RadeonRays
         float invarea = 1.f / req.bounds.surface_area();
         // Precompute min point
         float3 rootmin = req.centroid_bounds.pmin;
+        // Precompute inverse histogram ranges, degenerate dimensions are skipped
+        float3 invcentroid_rng;
+        bool   active[3];
 
-        // Evaluate all dimensions
         for (int axis = 0; axis < 3; ++axis)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            float centroid_rng = centroid_extents[axis];
-            float invcentroid_rng = 1.f / centroid_rng;
-
-            // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
+            active[axis] = centroid_extents[axis] != 0.f;
+            invcentroid_rng[axis] = active[axis] ? 1.f / centroid_extents[axis] : 0.f;
 
             // Initialize bins
             for (unsigned i = 0; i < kNumBins; ++i)
@@ -273,16 +328,86 @@ namespace RadeonRays
                 bins[axis][i].count = 0;
                 bins[axis][i].bounds = bbox();
             }
+        }
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+        // Calc primitive refs histogram for all dimensions in a single pass
+        // over the primitive range, so each bbox and centroid is only loaded once
+        auto bin_primitives = [&](int begin, int end, Bin (*histogram)[kNumBins])
+        {
+            for (int i = begin; i < end; ++i)
             {
                 int idx = primindices[i];
-                int binidx = (int)std::min<float>(kNumBins * ((centroids[idx][axis] - rootminc) * invcentroid_rng), kNumBins - 1);
+                float3 const& c = centroids[idx];
+                bbox const& b = bounds[idx];
+
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    if (!active[axis]) continue;
+
+                    int binidx = (int)std::min<float>(kNumBins * ((c[axis] - rootmin[axis]) * invcentroid_rng[axis]), kNumBins - 1);
+
+                    ++histogram[axis][binidx].count;
+                    histogram[axis][binidx].bounds.grow(b);
+                }
+            }
+        };
+
+        int numtasks = 1;
+        if (m_parallel && req.numprims >= 2 * kMinParallelBinningPrims)
+        {
+            numtasks = std::min(std::max(1, (int)std::thread::hardware_concurrency()), req.numprims / kMinParallelBinningPrims);
+        }
+
+        if (numtasks > 1)
+        {
+            // Each task fills its own histogram for a contiguous chunk of primitives,
+            // the histograms are merged afterwards. Bin bounds and counts are merged
+            // with min/max and integer sums, so the result does not depend on the chunking.
+            std::vector<std::vector<Bin>> histograms(numtasks, std::vector<Bin>(3 * kNumBins, Bin{ bbox(), 0 }));
+            std::vector<std::future<void>> tasks;
+            tasks.reserve(numtasks - 1);
+
+            int chunksize = (req.numprims + numtasks - 1) / numtasks;
+
+            for (int t = 1; t < numtasks; ++t)
+            {
+                int begin = req.startidx + t * chunksize;
+                int end = std::min(begin + chunksize, req.startidx + req.numprims);
+                auto histogram = reinterpret_cast<Bin(*)[kNumBins]>(&histograms[t][0]);
+
+                tasks.push_back(std::async(std::launch::async, [=, &bin_primitives]()
+                {
+                    bin_primitives(begin, end, histogram);
+                }));
+            }
 
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(bounds[idx]);
+            bin_primitives(req.startidx, req.startidx + chunksize, bins);
+
+            for (int t = 1; t < numtasks; ++t)
+            {
+                tasks[t - 1].get();
+
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    for (int i = 0; i < kNumBins; ++i)
+                    {
+                        Bin const& bin = histograms[t][axis * kNumBins + i];
+                        bins[axis][i].count += bin.count;
+                        bins[axis][i].bounds.grow(bin.bounds);
+                    }
+                }
             }
+        }
+        else
+        {
+            bin_primitives(req.startidx, req.startidx + req.numprims, bins);
+        }
+
+        // Evaluate all dimensions
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // If the box is degenerate in that dimension skip it
+            if (!active[axis]) continue;
 
             bbox rightbounds[kNumBins - 1];
 
@@ -324,6 +449,7 @@ namespace RadeonRays
         if (splitidx != -1)
         {
             split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / kNumBins);
+            split.sah = sah;
         }
 
         return split;
@@ -348,7 +474,10 @@ namespace RadeonRays
             centroids[i] = c;
         }
 
-        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0 };
+        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 0 };
+
+        // Fork tasks until there are a few per hardware thread
+        m_max_fork_level = CalcMaxForkLevel();
 
 #ifdef USE_BUILD_STACK
         std::stack<SplitRequest> stack;
@@ -457,20 +586,330 @@ namespace RadeonRays
             if (req.ptr) *req.ptr = node;
         }
 #else
-        BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+        SubtreeInfo info = BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+        m_height = info.height;
+        m_nodecnt = info.numnodes;
 #endif
 
         // Set root_ pointer
         m_root = &m_nodes[0];
     }
 
+    void Bvh::OptimizeTreelets()
+    {
+        if (!m_root || m_root->type == kLeaf)
+        {
+            return;
+        }
+
+        // Per node data is indexed by node position in m_nodes,
+        // trees keeping nodes elsewhere are left as they are
+        std::vector<float> costs(m_nodes.size());
+        std::vector<int> numleaves(m_nodes.size());
+
+        if (InitTreeletData(m_root, 0, &costs[0], &numleaves[0]) < 0)
+        {
+            return;
+        }
+
+        if (m_treelet_passes == 0)
+        {
+            m_built_sah_cost = GetSahCost();
+        }
+
+        m_max_fork_level = CalcMaxForkLevel();
+
+        // Larger subtrees are revisited in later passes as their treelets
+        // change when the nodes below them are restructured
+        int minleaves = kTreeletSize;
+        for (int pass = 0; pass < kNumTreeletPasses; ++pass)
+        {
+            OptimizeNode(m_root, 0, minleaves, &costs[0], &numleaves[0]);
+            minleaves *= 2;
+        }
+
+        m_treelet_passes += kNumTreeletPasses;
+        m_height = InitTreeletData(m_root, 0, &costs[0], &numleaves[0]);
+    }
+
+    float Bvh::GetSahCost() const
+    {
+        if (!m_root)
+        {
+            return 0.f;
+        }
+
+        float area = m_root->bounds.surface_area();
+        return area > 0.f ? CalcSahCost(m_root) / area : 0.f;
+    }
+
+    void Bvh::Refit(bbox const* bounds, int numbounds)
+    {
+        if (!m_root)
+        {
+            return;
+        }
+
+        m_bounds = bbox();
+        for (int i = 0; i < numbounds; ++i)
+        {
+            m_bounds.grow(bounds[i]);
+        }
+
+        m_max_fork_level = CalcMaxForkLevel();
+
+        RefitNode(m_root, 0, bounds);
+    }
+
+    void Bvh::RefitNode(Node* node, int level, bbox const* bounds)
+    {
+        if (node->type == kLeaf)
+        {
+            node->bounds = bbox();
+            for (int i = node->startidx; i < node->startidx + node->numprims; ++i)
+            {
+                node->bounds.grow(bounds[m_indices[i]]);
+            }
+
+            return;
+        }
+
+        if (m_parallel && level < m_max_fork_level && (int)m_indices.size() > kMinParallelBuildPrims)
+        {
+            auto left = std::async(std::launch::async, [&]()
+            {
+                RefitNode(node->lc, level + 1, bounds);
+            });
+
+            RefitNode(node->rc, level + 1, bounds);
+            left.get();
+        }
+        else
+        {
+            RefitNode(node->lc, level + 1, bounds);
+            RefitNode(node->rc, level + 1, bounds);
+        }
+
+        node->bounds = bboxunion(node->lc->bounds, node->rc->bounds);
+    }
+
+    float Bvh::CalcSahCost(Node const* node) const
+    {
+        if (node->type == kLeaf)
+        {
+            return node->numprims * node->bounds.surface_area();
+        }
+
+        return m_traversal_cost * node->bounds.surface_area() + CalcSahCost(node->lc) + CalcSahCost(node->rc);
+    }
+
+    int Bvh::InitTreeletData(Node const* node, int level, float* costs, int* numleaves) const
+    {
+        int idx = (int)(node - &m_nodes[0]);
+        if (node < &m_nodes[0] || idx >= (int)m_nodes.size())
+        {
+            return -1;
+        }
+
+        if (node->type == kLeaf)
+        {
+            costs[idx] = node->numprims * node->bounds.surface_area();
+            numleaves[idx] = 1;
+            return level;
+        }
+
+        int leftheight = InitTreeletData(node->lc, level + 1, costs, numleaves);
+        int rightheight = InitTreeletData(node->rc, level + 1, costs, numleaves);
+
+        if (leftheight < 0 || rightheight < 0)
+        {
+            return -1;
+        }
+
+        int lc = (int)(node->lc - &m_nodes[0]);
+        int rc = (int)(node->rc - &m_nodes[0]);
+        costs[idx] = m_traversal_cost * node->bounds.surface_area() + costs[lc] + costs[rc];
+        numleaves[idx] = numleaves[lc] + numleaves[rc];
+
+        return std::max(leftheight, rightheight);
+    }
+
+    void Bvh::OptimizeNode(Node* node, int level, int minleaves, float* costs, int* numleaves)
+    {
+        int idx = (int)(node - &m_nodes[0]);
+
+        // Nodes below have even less leaves, nothing to do in this subtree
+        if (node->type == kLeaf || numleaves[idx] < minleaves)
+        {
+            return;
+        }
+
+        if (m_parallel && level < m_max_fork_level && numleaves[idx] > kMinParallelBuildPrims)
+        {
+            // Treelets of sibling subtrees never overlap
+            auto left = std::async(std::launch::async, [&]()
+            {
+                OptimizeNode(node->lc, level + 1, minleaves, costs, numleaves);
+            });
+
+            OptimizeNode(node->rc, level + 1, minleaves, costs, numleaves);
+            left.get();
+        }
+        else
+        {
+            OptimizeNode(node->lc, level + 1, minleaves, costs, numleaves);
+            OptimizeNode(node->rc, level + 1, minleaves, costs, numleaves);
+        }
+
+        int lc = (int)(node->lc - &m_nodes[0]);
+        int rc = (int)(node->rc - &m_nodes[0]);
+        costs[idx] = m_traversal_cost * node->bounds.surface_area() + costs[lc] + costs[rc];
+
+        RestructureTreelet(node, costs, numleaves);
+    }
+
+    void Bvh::RestructureTreelet(Node* node, float* costs, int* numleaves)
+    {
+        // Form the treelet by expanding the largest leaf until there are enough of them,
+        // treelet leaves are either BVH leaves or roots of untouched subtrees
+        Node* leaves[kTreeletSize] = { node->lc, node->rc };
+        Node* internals[kTreeletSize - 1] = { node };
+        int numtreeletleaves = 2;
+        int numinternals = 1;
+
+        while (numtreeletleaves < kTreeletSize)
+        {
+            int largest = -1;
+            float largestarea = -1.f;
+            for (int i = 0; i < numtreeletleaves; ++i)
+            {
+                float area = leaves[i]->bounds.surface_area();
+                if (leaves[i]->type == kInternal && area > largestarea)
+                {
+                    largest = i;
+                    largestarea = area;
+                }
+            }
+
+            if (largest == -1) break;
+
+            Node* expanded = leaves[largest];
+            internals[numinternals++] = expanded;
+            leaves[largest] = expanded->lc;
+            leaves[numtreeletleaves++] = expanded->rc;
+        }
+
+        // Two leaves can only be arranged one way
+        if (numtreeletleaves < 3)
+        {
+            return;
+        }
+
+        // Find the optimal topology for every subset of treelet leaves,
+        // subsets are processed in increasing order so their parts are already done
+        int const numsubsets = 1 << numtreeletleaves;
+        bbox subsetbounds[1 << kTreeletSize];
+        float subsetcosts[1 << kTreeletSize];
+        int partitions[1 << kTreeletSize];
+
+        for (int subset = 1; subset < numsubsets; ++subset)
+        {
+            int lowbit = subset & -subset;
+
+            if (subset == lowbit)
+            {
+                int leaf = 0;
+                while ((1 << leaf) != lowbit) ++leaf;
+
+                subsetbounds[subset] = leaves[leaf]->bounds;
+                subsetcosts[subset] = costs[leaves[leaf] - &m_nodes[0]];
+                continue;
+            }
+
+            subsetbounds[subset] = bboxunion(subsetbounds[subset ^ lowbit], subsetbounds[lowbit]);
+
+            // Try all the ways to split the subset in two, each pair once
+            float bestcost = std::numeric_limits<float>::max();
+            for (int part = (subset - 1) & subset; part > 0; part = (part - 1) & subset)
+            {
+                if (!(part & lowbit)) continue;
+
+                float cost = subsetcosts[part] + subsetcosts[subset ^ part];
+                if (cost < bestcost)
+                {
+                    bestcost = cost;
+                    partitions[subset] = part;
+                }
+            }
+
+            subsetcosts[subset] = m_traversal_cost * subsetbounds[subset].surface_area() + bestcost;
+        }
+
+        int idx = (int)(node - &m_nodes[0]);
+        if (!(subsetcosts[numsubsets - 1] < costs[idx] * 0.9999f))
+        {
+            return;
+        }
+
+        // Rebuild the treelet reusing its internal nodes, node stays the root.
+        // Children always get internal nodes after their parents, so walking
+        // the internal nodes backwards updates them bottom up.
+        int subsets[kTreeletSize - 1] = { numsubsets - 1 };
+        int numused = 1;
+
+        for (int i = 0; i < numused; ++i)
+        {
+            Node* parent = internals[i];
+            int part = partitions[subsets[i]];
+            int parts[2] = { part, subsets[i] ^ part };
+            Node** children[2] = { &parent->lc, &parent->rc };
+
+            for (int c = 0; c < 2; ++c)
+            {
+                if ((parts[c] & (parts[c] - 1)) == 0)
+                {
+                    int leaf = 0;
+                    while ((1 << leaf) != parts[c]) ++leaf;
+                    *children[c] = leaves[leaf];
+                }
+                else
+                {
+                    subsets[numused] = parts[c];
+                    *children[c] = internals[numused++];
+                }
+            }
+        }
+
+        for (int i = numused - 1; i >= 0; --i)
+        {
+            Node* current = internals[i];
+            int current_idx = (int)(current - &m_nodes[0]);
+            int lc = (int)(current->lc - &m_nodes[0]);
+            int rc = (int)(current->rc - &m_nodes[0]);
+
+            current->bounds = bboxunion(current->lc->bounds, current->rc->bounds);
+            costs[current_idx] = m_traversal_cost * current->bounds.surface_area() + costs[lc] + costs[rc];
+            numleaves[current_idx] = numleaves[lc] + numleaves[rc];
+        }
+    }
+
     void Bvh::PrintStatistics(std::ostream& os) const
     {
         os << "Class name: " << "Bvh\n";
         os << "SAH: " << (m_usesah ? "enabled\n" : "disabled\n");
+        os << "Parallel build: " << (m_parallel ? "enabled\n" : "disabled\n");
+        os << "Max leaf size: " << m_max_leaf_size << "\n";
         os << "Number of triangles: " << m_indices.size() << "\n";
         os << "Number of nodes: " << m_nodecnt << "\n";
         os << "Tree height: " << GetHeight() << "\n";
+
+        if (m_treelet_passes > 0)
+        {
+            os << "Treelet optimization passes: " << m_treelet_passes << "\n";
+            os << "SAH cost before optimization: " << m_built_sah_cost << "\n";
+        }
+
+        os << "SAH cost: " << GetSahCost() << "\n";
     }
 
 }
@@ -39,10 +39,15 @@ namespace RadeonRays
     class Bvh
     {
     public:
-        Bvh(float traversal_cost, bool usesah = false)
+        Bvh(float traversal_cost, bool usesah = false, bool parallel = false, int max_leaf_size = 1)
             : m_root(nullptr)
             , m_usesah(usesah)
+            , m_parallel(parallel)
             , m_height(0)
+            , m_max_fork_level(0)
+            , m_max_leaf_size(max_leaf_size < 1 ? 1 : max_leaf_size)
+            , m_treelet_passes(0)
+            , m_built_sah_cost(0.f)
             , m_traversal_cost(traversal_cost)
         {
         }
@@ -59,6 +64,17 @@ namespace RadeonRays
         // Get tree height
         int GetHeight() const;
 
+        // Restructure small treelets of the built tree to reduce its SAH cost.
+        // Leaves and primitive indices are kept, only internal nodes are rearranged.
+        void OptimizeTreelets();
+
+        // Get SAH cost of the tree normalized by root area
+        float GetSahCost() const;
+
+        // Update node bounds for moved primitives keeping the tree topology.
+        // bounds should describe the same primitives passed to Build.
+        void Refit(bbox const* bounds, int numbounds);
+
         // Get reordered prim indices Nodes are pointing to
         virtual int const* GetIndices() const;
 
@@ -92,6 +108,8 @@ namespace RadeonRays
             bbox centroid_bounds;
             // Level
             int level;
+            // Index of the node in m_nodes (preallocated builds only)
+            int nodeidx;
         };
 
         struct SahSplit
@@ -102,10 +120,30 @@ namespace RadeonRays
             float overlap;
         };
 
-        void BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices);
+        struct SubtreeInfo
+        {
+            int height;
+            // Number of nodes written to m_nodes
+            int numnodes;
+        };
+
+        // Build the subtree for the request and return its height and node count
+        SubtreeInfo BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices);
 
         SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const;
 
+        // Calculate SAH cost and number of leaves for each node of the subtree,
+        // returns subtree height or -1 if some nodes are not stored in m_nodes
+        int InitTreeletData(Node const* node, int level, float* costs, int* numleaves) const;
+        // Restructure treelets of the subtree bottom up
+        void OptimizeNode(Node* node, int level, int minleaves, float* costs, int* numleaves);
+        // Replace treelet rooted at node with the optimal one for the same leaves
+        void RestructureTreelet(Node* node, float* costs, int* numleaves);
+        // Unnormalized SAH cost of the subtree
+        float CalcSahCost(Node const* node) const;
+        // Recalculate bounds of the subtree bottom up
+        void RefitNode(Node* node, int level, bbox const* bounds);
+
         // Enum for node type
         enum NodeType
         {
@@ -117,7 +155,7 @@ namespace RadeonRays
         std::vector<Node> m_nodes;
         // Identifiers of leaf primitives
         std::vector<int> m_indices;
-        // Node allocator counter, atomic for thread safety
+        // Node count, atomic for thread safe AllocateNode (the recursive build sets it once)
         std::atomic<int> m_nodecnt;
 
         // Bounding box containing all primitives
@@ -126,8 +164,18 @@ namespace RadeonRays
         Node* m_root;
         // SAH flag
         bool m_usesah;
+        // Parallel build flag
+        bool m_parallel;
         // Tree height
         int m_height;
+        // Deepest level where subtrees are still forked into tasks
+        int m_max_fork_level;
+        // Maximum number of primitives SAH is allowed to keep in a leaf
+        int m_max_leaf_size;
+        // Number of treelet optimization passes applied to the tree
+        int m_treelet_passes;
+        // SAH cost of the tree before optimization
+        float m_built_sah_cost;
         // Node traversal cost
         float m_traversal_cost;
 
@@ -138,6 +186,8 @@ namespace RadeonRays
 
         friend class PlainBvhTranslator;
         friend class FatNodeBvhTranslator;
+        friend class CompressedBvhTranslator;
+        friend class QBvhTranslator;
     };
 
     struct Bvh::Node
@@ -0,0 +1,245 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "grid.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
+#include <memory>
+#include <thread>
+
+namespace RadeonRays
+{
+    // Minimum number of primitives processed by one task
+    static int const kMinPrimsPerTask = 16384;
+    // Voxel indices are converted to floats by kernels, keep them exact
+    static size_t const kMaxVoxels = 1 << 24;
+    static int const kMaxResolution = 1024;
+    // Relative padding of the scene bounds, keeps flat scenes from collapsing the grid
+    static float const kBoundsPadding = 1e-3f;
+    // Primitive bounds are extended by this fraction of a voxel when binned
+    static float const kBinningEpsilon = 1e-3f;
+
+    // Run task(t) for t in [0, numtasks), task 0 runs on the calling thread
+    template <typename Task>
+    static void ParallelFor(int numtasks, Task const& task)
+    {
+        std::vector<std::future<void>> tasks;
+        tasks.reserve(numtasks - 1);
+
+        for (int t = 1; t < numtasks; ++t)
+        {
+            tasks.push_back(std::async(std::launch::async, [&task, t]()
+            {
+                task(t);
+            }));
+        }
+
+        task(0);
+
+        for (auto& t : tasks)
+        {
+            t.get();
+        }
+    }
+
+    void Grid::GetVoxelRange(bbox const& box, int* vmin, int* vmax) const
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float lo = (box.pmin[axis] - m_bounds.pmin[axis]) * m_voxelsizeinv[axis];
+            float hi = (box.pmax[axis] - m_bounds.pmin[axis]) * m_voxelsizeinv[axis];
+
+            // Kernels step through voxel boundaries computed in a slightly different way,
+            // so primitives touching a boundary are put on both sides of it
+            vmin[axis] = std::min(std::max((int)std::floor(lo - kBinningEpsilon), 0), m_resolution[axis] - 1);
+            vmax[axis] = std::min(std::max((int)std::floor(hi + kBinningEpsilon), 0), m_resolution[axis] - 1);
+        }
+    }
+
+    void Grid::Build(bbox const* bounds, int numbounds)
+    {
+        m_voxels.clear();
+        m_indices.clear();
+
+        int numtasks = 1;
+        if (m_parallel && numbounds >= 2 * kMinPrimsPerTask)
+        {
+            numtasks = std::min(std::max(1, (int)std::thread::hardware_concurrency()), numbounds / kMinPrimsPerTask);
+        }
+
+        int chunksize = (numbounds + numtasks - 1) / numtasks;
+
+        // Calculate scene bounds
+        std::vector<bbox> taskbounds(numtasks);
+
+        ParallelFor(numtasks, [&](int t)
+        {
+            int end = std::min(numbounds, (t + 1) * chunksize);
+            for (int i = t * chunksize; i < end; ++i)
+            {
+                taskbounds[t].grow(bounds[i]);
+            }
+        });
+
+        m_bounds = bbox();
+        for (auto const& b : taskbounds)
+        {
+            m_bounds.grow(b);
+        }
+
+        if (numbounds == 0)
+        {
+            m_bounds = bbox(float3(0.f, 0.f, 0.f));
+        }
+
+        float3 extents = m_bounds.extents();
+        float padding = std::max(std::max(extents.x, std::max(extents.y, extents.z)) * kBoundsPadding, kBoundsPadding);
+        m_bounds.pmin -= float3(padding, padding, padding);
+        m_bounds.pmax += float3(padding, padding, padding);
+        extents = m_bounds.extents();
+
+        // lambda * N^(1/3) voxels along the cube of the same volume
+        float volume = extents.x * extents.y * extents.z;
+        float scale = std::cbrt(m_density * std::max(numbounds, 1) / volume);
+
+        for (;;)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                m_resolution[axis] = std::min(std::max((int)(extents[axis] * scale), 1), kMaxResolution);
+            }
+
+            if ((size_t)m_resolution[0] * m_resolution[1] * m_resolution[2] <= kMaxVoxels)
+            {
+                break;
+            }
+
+            scale *= 0.9f;
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            m_voxelsize[axis] = extents[axis] / m_resolution[axis];
+            m_voxelsizeinv[axis] = m_resolution[axis] / extents[axis];
+        }
+
+        size_t numvoxels = (size_t)m_resolution[0] * m_resolution[1] * m_resolution[2];
+        int resx = m_resolution[0];
+        int resxy = m_resolution[0] * m_resolution[1];
+
+        // Count references per voxel
+        std::unique_ptr<std::atomic<int>[]> counters(new std::atomic<int>[numvoxels]);
+
+        for (size_t i = 0; i < numvoxels; ++i)
+        {
+            counters[i] = 0;
+        }
+
+        ParallelFor(numtasks, [&](int t)
+        {
+            int vmin[3];
+            int vmax[3];
+
+            int end = std::min(numbounds, (t + 1) * chunksize);
+            for (int i = t * chunksize; i < end; ++i)
+            {
+                GetVoxelRange(bounds[i], vmin, vmax);
+
+                for (int z = vmin[2]; z <= vmax[2]; ++z)
+                    for (int y = vmin[1]; y <= vmax[1]; ++y)
+                        for (int x = vmin[0]; x <= vmax[0]; ++x)
+                        {
+                            counters[z * resxy + y * resx + x].fetch_add(1, std::memory_order_relaxed);
+                        }
+            }
+        });
+
+        // Exclusive scan of the counts gives voxel ranges,
+        // counters are then reused as insertion cursors
+        m_voxels.resize(numvoxels);
+
+        int numindices = 0;
+        for (size_t i = 0; i < numvoxels; ++i)
+        {
+            int count = counters[i];
+            m_voxels[i].startidx = count > 0 ? numindices : -1;
+            m_voxels[i].numprims = count;
+            counters[i] = numindices;
+            numindices += count;
+        }
+
+        m_indices.resize(numindices);
+
+        ParallelFor(numtasks, [&](int t)
+        {
+            int vmin[3];
+            int vmax[3];
+
+            int end = std::min(numbounds, (t + 1) * chunksize);
+            for (int i = t * chunksize; i < end; ++i)
+            {
+                GetVoxelRange(bounds[i], vmin, vmax);
+
+                for (int z = vmin[2]; z <= vmax[2]; ++z)
+                    for (int y = vmin[1]; y <= vmax[1]; ++y)
+                        for (int x = vmin[0]; x <= vmax[0]; ++x)
+                        {
+                            m_indices[counters[z * resxy + y * resx + x].fetch_add(1, std::memory_order_relaxed)] = i;
+                        }
+            }
+        });
+
+        // Scatter order depends on scheduling, sort voxel lists to make builds deterministic
+        if (numtasks > 1)
+        {
+            size_t voxelchunk = (numvoxels + numtasks - 1) / numtasks;
+
+            ParallelFor(numtasks, [&](int t)
+            {
+                size_t end = std::min(numvoxels, (t + 1) * voxelchunk);
+                for (size_t i = t * voxelchunk; i < end; ++i)
+                {
+                    if (m_voxels[i].numprims > 1)
+                    {
+                        int* first = &m_indices[m_voxels[i].startidx];
+                        std::sort(first, first + m_voxels[i].numprims);
+                    }
+                }
+            });
+        }
+    }
+
+    void Grid::PrintStatistics(std::ostream& os) const
+    {
+        size_t numempty = std::count_if(m_voxels.cbegin(), m_voxels.cend(), [](Voxel const& v) { return v.numprims == 0; });
+
+        os << "Class name: " << "Grid\n";
+        os << "Parallel build: " << (m_parallel ? "enabled\n" : "disabled\n");
+        os << "Density: " << m_density << "\n";
+        os << "Resolution: " << m_resolution[0] << "x" << m_resolution[1] << "x" << m_resolution[2] << "\n";
+        os << "Number of voxels: " << m_voxels.size() << "\n";
+        os << "Empty voxels: " << numempty << "\n";
+        os << "Number of references: " << m_indices.size() << "\n";
+    }
+}
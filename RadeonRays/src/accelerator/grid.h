@@ -0,0 +1,147 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <vector>
+#include <iostream>
+
+#include "math/bbox.h"
+
+namespace RadeonRays
+{
+    ///< Uniform grid intersection accelerator.
+    ///< Resolution follows lambda * N^(1/3) heuristic scaled by scene extents,
+    ///< so the number of voxels is roughly proportional to the number of primitives.
+    ///< Each primitive is referenced from every voxel its bounds overlap,
+    ///< the references are counted and scattered over primitive chunks in parallel.
+    ///<
+    class Grid
+    {
+    public:
+        struct Voxel
+        {
+            // Index of the first primitive in GetIndices(), -1 for empty voxels
+            int startidx;
+            // Number of primitives
+            int numprims;
+        };
+
+        Grid(float density = 4.f, bool parallel = true)
+            : m_density(density > 0.f ? density : 4.f)
+            , m_parallel(parallel)
+        {
+            m_resolution[0] = m_resolution[1] = m_resolution[2] = 0;
+        }
+
+        ~Grid();
+
+        // World space bounding box
+        bbox const& Bounds() const;
+
+        // Build function
+        // bounds is an array of bounding boxes
+        void Build(bbox const* bounds, int numbounds);
+
+        // Get number of voxels along the axis
+        int GetResolution(int axis) const;
+
+        // Get voxel size
+        float3 GetVoxelSize() const;
+
+        // Get voxels ordered by (z * resy + y) * resx + x
+        Voxel const* GetVoxels() const;
+
+        // Get number of voxels
+        size_t GetNumVoxels() const;
+
+        // Get primitive indices voxels are pointing to
+        int const* GetIndices() const;
+
+        // Get number of indices, a primitive is referenced once per overlapped voxel
+        size_t GetNumIndices() const;
+
+        // Print grid statistics
+        void PrintStatistics(std::ostream& os) const;
+
+    private:
+        // Calculate voxel range overlapped by the box
+        void GetVoxelRange(bbox const& box, int* vmin, int* vmax) const;
+
+        // Target number of voxels per primitive
+        float m_density;
+        // Use multiple threads to build
+        bool m_parallel;
+        // Grid bounds
+        bbox m_bounds;
+        // Voxel size and its inverse
+        float3 m_voxelsize;
+        float3 m_voxelsizeinv;
+        // Number of voxels along each axis
+        int m_resolution[3];
+        // Voxels
+        std::vector<Voxel> m_voxels;
+        // Primitive references
+        std::vector<int> m_indices;
+
+        Grid(Grid const&);
+        Grid& operator = (Grid const&);
+    };
+
+    inline Grid::~Grid()
+    {
+    }
+
+    inline bbox const& Grid::Bounds() const
+    {
+        return m_bounds;
+    }
+
+    inline int Grid::GetResolution(int axis) const
+    {
+        return m_resolution[axis];
+    }
+
+    inline float3 Grid::GetVoxelSize() const
+    {
+        return m_voxelsize;
+    }
+
+    inline Grid::Voxel const* Grid::GetVoxels() const
+    {
+        return m_voxels.empty() ? nullptr : &m_voxels[0];
+    }
+
+    inline size_t Grid::GetNumVoxels() const
+    {
+        return m_voxels.size();
+    }
+
+    inline int const* Grid::GetIndices() const
+    {
+        return m_indices.empty() ? nullptr : &m_indices[0];
+    }
+
+    inline size_t Grid::GetNumIndices() const
+    {
+        return m_indices.size();
+    }
+}
@@ -0,0 +1,383 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "linear_bvh.h"
+
+#include <algorithm>
+#include <thread>
+#include <future>
+#include <cstdint>
+#include <cassert>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace RadeonRays
+{
+    // Scenes above this size use 63-bit Morton codes (21 bits per axis)
+    // instead of 30-bit ones (10 bits per axis) to keep more codes distinct
+    static int const kMaxPrimsFor30BitCodes = 1 << 20;
+    // Minimum number of primitives processed by one task
+    static int const kMinPrimsPerTask = 16384;
+    // Radix sort digit
+    static int const kRadixBits = 8;
+    static int const kRadixSize = 1 << kRadixBits;
+
+    static int CountLeadingZeros(std::uint32_t v)
+    {
+#ifdef _MSC_VER
+        unsigned long idx;
+        return _BitScanReverse(&idx, v) ? 31 - (int)idx : 32;
+#else
+        return v ? __builtin_clz(v) : 32;
+#endif
+    }
+
+    static int CountLeadingZeros(std::uint64_t v)
+    {
+#ifdef _MSC_VER
+        unsigned long idx;
+        return _BitScanReverse64(&idx, v) ? 63 - (int)idx : 64;
+#else
+        return v ? __builtin_clzll(v) : 64;
+#endif
+    }
+
+    // Insert two zero bits after each of the lower 10 bits
+    static std::uint32_t ExpandBits(std::uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // Insert two zero bits after each of the lower 21 bits
+    static std::uint64_t ExpandBits(std::uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // Run task(t) for t in [0, numtasks), task 0 runs on the calling thread
+    template <typename Task>
+    static void ParallelFor(int numtasks, Task const& task)
+    {
+        std::vector<std::future<void>> tasks;
+        tasks.reserve(numtasks - 1);
+
+        for (int t = 1; t < numtasks; ++t)
+        {
+            tasks.push_back(std::async(std::launch::async, [&task, t]()
+            {
+                task(t);
+            }));
+        }
+
+        task(0);
+
+        for (auto& t : tasks)
+        {
+            t.get();
+        }
+    }
+
+    // Stable LSD radix sort of the lower numbits of keys, values are permuted along.
+    // Each task counts and scatters its own contiguous chunk of the input.
+    template <typename Key>
+    static void RadixSort(std::vector<Key>& keys, std::vector<int>& values, int numbits, int numtasks)
+    {
+        int numkeys = (int)keys.size();
+        int chunksize = (numkeys + numtasks - 1) / numtasks;
+
+        std::vector<Key> tmpkeys(numkeys);
+        std::vector<int> tmpvalues(numkeys);
+        std::vector<int> histograms(numtasks * kRadixSize);
+
+        for (int shift = 0; shift < numbits; shift += kRadixBits)
+        {
+            // Count digits for each chunk
+            ParallelFor(numtasks, [&](int t)
+            {
+                int* histogram = &histograms[t * kRadixSize];
+                std::fill(histogram, histogram + kRadixSize, 0);
+
+                int begin = std::min(t * chunksize, numkeys);
+                int end = std::min(begin + chunksize, numkeys);
+
+                for (int i = begin; i < end; ++i)
+                {
+                    ++histogram[(keys[i] >> shift) & (kRadixSize - 1)];
+                }
+            });
+
+            // Turn counts into output offsets, chunks of the same digit
+            // are written in order which keeps the sort stable
+            int offset = 0;
+            for (int d = 0; d < kRadixSize; ++d)
+            {
+                for (int t = 0; t < numtasks; ++t)
+                {
+                    int count = histograms[t * kRadixSize + d];
+                    histograms[t * kRadixSize + d] = offset;
+                    offset += count;
+                }
+            }
+
+            // Scatter
+            ParallelFor(numtasks, [&](int t)
+            {
+                int* histogram = &histograms[t * kRadixSize];
+
+                int begin = std::min(t * chunksize, numkeys);
+                int end = std::min(begin + chunksize, numkeys);
+
+                for (int i = begin; i < end; ++i)
+                {
+                    int pos = histogram[(keys[i] >> shift) & (kRadixSize - 1)]++;
+                    tmpkeys[pos] = keys[i];
+                    tmpvalues[pos] = values[i];
+                }
+            });
+
+            keys.swap(tmpkeys);
+            values.swap(tmpvalues);
+        }
+    }
+
+    void LinearBvh::BuildImpl(bbox const* bounds, int numbounds)
+    {
+        bbox centroid_bounds;
+        for (int i = 0; i < numbounds; ++i)
+        {
+            centroid_bounds.grow(bounds[i].center());
+        }
+
+        if (numbounds > kMaxPrimsFor30BitCodes)
+        {
+            BuildImpl<std::uint64_t>(bounds, numbounds, centroid_bounds, 21);
+        }
+        else
+        {
+            BuildImpl<std::uint32_t>(bounds, numbounds, centroid_bounds, 10);
+        }
+
+        // Set root_ pointer
+        m_root = &m_nodes[0];
+    }
+
+    template <typename Key>
+    void LinearBvh::BuildImpl(bbox const* bounds, int numbounds, bbox const& centroid_bounds, int bitsperaxis)
+    {
+        int const kKeyBits = (int)sizeof(Key) * 8;
+
+        m_morton_bits = 3 * bitsperaxis;
+
+        int numtasks = 1;
+        if (m_parallel && numbounds >= 2 * kMinPrimsPerTask)
+        {
+            numtasks = std::min(std::max(1, (int)std::thread::hardware_concurrency()), numbounds / kMinPrimsPerTask);
+        }
+
+        // Calculate Morton codes of centroids quantized to the grid over centroid bounds
+        std::vector<Key> codes(numbounds);
+        m_indices.resize(numbounds);
+
+        float const gridsize = (float)(1 << bitsperaxis);
+        float3 extents = centroid_bounds.extents();
+        float3 scale;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            scale[axis] = extents[axis] > 0.f ? gridsize / extents[axis] : 0.f;
+        }
+
+        int chunksize = (numbounds + numtasks - 1) / numtasks;
+
+        ParallelFor(numtasks, [&](int t)
+        {
+            int begin = std::min(t * chunksize, numbounds);
+            int end = std::min(begin + chunksize, numbounds);
+
+            for (int i = begin; i < end; ++i)
+            {
+                float3 c = (bounds[i].center() - centroid_bounds.pmin) * scale;
+
+                Key code = 0;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    Key cell = (Key)std::min(std::max(c[axis], 0.f), gridsize - 1.f);
+                    code |= ExpandBits(cell) << (2 - axis);
+                }
+
+                codes[i] = code;
+                m_indices[i] = i;
+            }
+        });
+
+        RadixSort(codes, m_indices, m_morton_bits, numtasks);
+
+        // Internal nodes go first (the root is node 0), leaves follow in Morton order
+        int numinternal = numbounds - 1;
+        InitNodeAllocator(2 * numbounds - 1);
+        m_nodecnt = 2 * numbounds - 1;
+
+        std::vector<int> parents(2 * numbounds - 1);
+        parents[0] = -1;
+
+        // Length of the common prefix of codes i and j, duplicate codes
+        // are made unique by appending their index
+        auto delta = [&](int i, int j) -> int
+        {
+            if (j < 0 || j >= numbounds)
+            {
+                return -1;
+            }
+
+            if (codes[i] == codes[j])
+            {
+                return kKeyBits + CountLeadingZeros((std::uint32_t)(i ^ j));
+            }
+
+            return CountLeadingZeros(codes[i] ^ codes[j]);
+        };
+
+        int internalchunksize = (numinternal + numtasks - 1) / numtasks;
+
+        // Emit internal nodes
+        ParallelFor(numtasks, [&](int t)
+        {
+            int begin = std::min(t * internalchunksize, numinternal);
+            int end = std::min(begin + internalchunksize, numinternal);
+
+            for (int i = begin; i < end; ++i)
+            {
+                // Direction of the range covered by the node
+                int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+
+                // Find the other end of the range with exponential and binary search
+                int mindelta = delta(i, i - d);
+                int maxlength = 2;
+                while (delta(i, i + maxlength * d) > mindelta)
+                {
+                    maxlength <<= 1;
+                }
+
+                int length = 0;
+                for (int step = maxlength >> 1; step > 0; step >>= 1)
+                {
+                    if (delta(i, i + (length + step) * d) > mindelta)
+                    {
+                        length += step;
+                    }
+                }
+
+                int j = i + length * d;
+
+                // Find the split: the last key sharing more than the node's prefix
+                int nodedelta = delta(i, j);
+                int split = 0;
+                int step = length;
+                do
+                {
+                    step = (step + 1) >> 1;
+                    if (delta(i, i + (split + step) * d) > nodedelta)
+                    {
+                        split += step;
+                    }
+                } while (step > 1);
+
+                split = i + split * d + std::min(d, 0);
+
+                int left = std::min(i, j) == split ? numinternal + split : split;
+                int right = std::max(i, j) == split + 1 ? numinternal + split + 1 : split + 1;
+
+                Node* node = &m_nodes[i];
+                node->type = kInternal;
+                node->lc = &m_nodes[left];
+                node->rc = &m_nodes[right];
+
+                parents[left] = i;
+                parents[right] = i;
+            }
+        });
+
+        // Emit leaves and propagate bounds towards the root. A node is processed
+        // by whichever of its children finishes last, so all the nodes are
+        // visited once without any ordering between the tasks.
+        std::vector<std::atomic<int>> visits(numinternal);
+        std::vector<int> heights(2 * numbounds - 1, 0);
+
+        ParallelFor(numtasks, [&](int t)
+        {
+            int begin = std::min(t * chunksize, numbounds);
+            int end = std::min(begin + chunksize, numbounds);
+
+            for (int i = begin; i < end; ++i)
+            {
+                Node* leaf = &m_nodes[numinternal + i];
+                leaf->type = kLeaf;
+                leaf->bounds = bounds[m_indices[i]];
+                leaf->startidx = i;
+                leaf->numprims = 1;
+
+                int idx = parents[numinternal + i];
+                while (idx != -1 && visits[idx].fetch_add(1) == 1)
+                {
+                    Node* node = &m_nodes[idx];
+                    int lc = (int)(node->lc - &m_nodes[0]);
+                    int rc = (int)(node->rc - &m_nodes[0]);
+
+                    node->bounds = bboxunion(node->lc->bounds, node->rc->bounds);
+                    heights[idx] = 1 + std::max(heights[lc], heights[rc]);
+
+                    idx = parents[idx];
+                }
+            }
+        });
+
+        m_height = heights[0];
+    }
+
+    void LinearBvh::PrintStatistics(std::ostream& os) const
+    {
+        os << "Class name: " << "LinearBvh\n";
+        os << "Morton code bits: " << m_morton_bits << "\n";
+        os << "Parallel build: " << (m_parallel ? "enabled\n" : "disabled\n");
+        os << "Number of triangles: " << m_indices.size() << "\n";
+        os << "Number of nodes: " << m_nodecnt << "\n";
+        os << "Tree height: " << GetHeight() << "\n";
+
+        if (m_treelet_passes > 0)
+        {
+            os << "Treelet optimization passes: " << m_treelet_passes << "\n";
+            os << "SAH cost before optimization: " << m_built_sah_cost << "\n";
+        }
+
+        os << "SAH cost: " << GetSahCost() << "\n";
+    }
+}
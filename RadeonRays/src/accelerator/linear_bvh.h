@@ -0,0 +1,73 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#include "bvh.h"
+
+
+namespace RadeonRays
+{
+    ///< Linear BVH (LBVH) built on the CPU.
+    ///< Primitives are sorted along a Morton curve with a parallel radix sort
+    ///< and the hierarchy is emitted from the sorted codes (Karras 2012),
+    ///< every internal node independently of the others. Build time is linear
+    ///< in the number of primitives at the cost of a lower quality than SAH.
+    ///<
+    class LinearBvh : public Bvh
+    {
+    public:
+        LinearBvh(float traversal_cost, bool parallel = true)
+        : Bvh(traversal_cost, false, parallel)
+        , m_morton_bits(0)
+        {
+        }
+
+        ~LinearBvh();
+
+        // Print BVH statistics
+        void PrintStatistics(std::ostream& os) const override;
+
+    protected:
+        // Build function
+        void BuildImpl(bbox const* bounds, int numbounds) override;
+
+        // Build the tree using Key-sized Morton codes with bitsperaxis bits for each dimension
+        template <typename Key>
+        void BuildImpl(bbox const* bounds, int numbounds, bbox const& centroid_bounds, int bitsperaxis);
+
+    private:
+        // Number of bits in Morton codes used for the last build
+        int m_morton_bits;
+
+        LinearBvh(LinearBvh const&);
+        LinearBvh& operator = (LinearBvh const&);
+
+        friend class PlainBvhTranslator;
+        friend class FatNodeBvhTranslator;
+        friend class CompressedBvhTranslator;
+        friend class QBvhTranslator;
+    };
+
+    inline LinearBvh::~LinearBvh()
+    {
+    }
+}
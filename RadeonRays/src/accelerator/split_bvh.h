@@ -94,6 +94,8 @@ namespace RadeonRays
 
         friend class PlainBvhTranslator;
         friend class FatNodeBvhTranslator;
+        friend class CompressedBvhTranslator;
+        friend class QBvhTranslator;
     };
     
     struct SplitBvh::PrimRef
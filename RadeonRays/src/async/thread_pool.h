@@ -23,12 +23,18 @@ THE SOFTWARE.
 #define THREAD_POOL_H
 
 #include <queue>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <utility>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <future>
-#include <iostream>
 
 namespace RadeonRays
 {
@@ -95,77 +101,256 @@ namespace RadeonRays
     };
 
 
-    ///< Thread pool implementation which is using concurrency
-    ///< available in the system
+    ///< Work-stealing thread pool which is using concurrency
+    ///< available in the system. Every worker owns a deque: it pops
+    ///< its own tasks from the back and steals from the front of the
+    ///< other deques when it runs dry. Idle workers are parked on a
+    ///< condition variable, so submitted work starts right away.
     ///<
     template <typename RetType> class thread_pool
     {
     public:
-        explicit thread_pool(int sleep_time = 50)
-            : sleep_time_(sleep_time)
+        // Uses all hardware threads if num_threads is 0
+        explicit thread_pool(int num_threads = 0)
+            : pending_(0)
+            , next_queue_(0)
+            , done_(false)
         {
-            done_ = false;
-            int num_threads = std::thread::hardware_concurrency();
-            num_threads = num_threads == 0 ? 2 : num_threads;
+            if (num_threads <= 0)
+            {
+                num_threads = std::thread::hardware_concurrency();
+                num_threads = num_threads == 0 ? 2 : num_threads;
+            }
 
-            //#ifdef _DEBUG
-            //        std::cout << num_threads << " hardware threads available\n";
-            //#endif
+            for (int i = 0; i < num_threads; ++i)
+            {
+                queues_.emplace_back(new worker_queue);
+            }
 
-            for (int i=0; i < num_threads; ++i)
+            for (int i = 0; i < num_threads; ++i)
             {
-                threads_.push_back(std::thread(&thread_pool::run_loop, this));
+                threads_.push_back(std::thread(&thread_pool::run_loop, this, i));
             }
         }
 
+        // Finishes the tasks already submitted
         ~thread_pool()
         {
-            done_ = true;
-            std::for_each(threads_.begin(), threads_.end(), std::mem_fun_ref(&std::thread::join));
+            {
+                std::lock_guard<std::mutex> lock(park_mutex_);
+                done_ = true;
+            }
+
+            park_cv_.notify_all();
+            std::for_each(threads_.begin(), threads_.end(), [](std::thread& t) { t.join(); });
         }
 
         // Submit a new task into the pool. Future is returned in
         // order for caller to track the execution of the task
         std::future<RetType> submit(std::function<RetType()>&& f)
         {
-            std::packaged_task<RetType()> task(std::move(f));
-            auto future = task.get_future();
-            work_queue_.push(std::move(task));
+            auto task = std::make_shared<std::packaged_task<RetType()> >(std::move(f));
+            auto future = task->get_future();
+            push([task]() { (*task)(); });
             return future;
         }
 
+        // Submit a task without tracking its completion
+        void post(std::function<void()>&& f)
+        {
+            push(std::move(f));
+        }
+
+        // Call f(chunk_begin, chunk_end) for chunks of up to grain elements covering [begin, end).
+        // The calling thread processes chunks too and returns once all of them are done,
+        // so it can be called from a task. The first exception thrown by f is rethrown here.
+        void parallel_for(int begin, int end, int grain, std::function<void(int, int)> const& f)
+        {
+            if (end <= begin)
+                return;
+
+            grain = std::max(grain, 1);
+            int numchunks = (end - begin + grain - 1) / grain;
+
+            if (numchunks == 1)
+            {
+                f(begin, end);
+                return;
+            }
+
+            auto state = std::make_shared<parallel_for_state>();
+            std::function<void(int, int)> const* func = &f;
+
+            // Helpers which start after all chunks are taken return without touching f,
+            // so they may safely outlive this call
+            auto process = [state, func, begin, end, grain, numchunks]()
+            {
+                int chunk;
+                while ((chunk = state->next++) < numchunks)
+                {
+                    int chunk_begin = begin + chunk * grain;
+
+                    try
+                    {
+                        (*func)(chunk_begin, std::min(chunk_begin + grain, end));
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lock(state->mutex);
+                        if (!state->error)
+                            state->error = std::current_exception();
+                    }
+
+                    if (++state->done == numchunks)
+                    {
+                        std::lock_guard<std::mutex> lock(state->mutex);
+                        state->cv.notify_all();
+                    }
+                }
+            };
+
+            int numhelpers = std::min(numchunks, num_threads()) - 1;
+            for (int i = 0; i < numhelpers; ++i)
+            {
+                push(process);
+            }
+
+            process();
+
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->cv.wait(lock, [state, numchunks]() { return state->done == numchunks; });
+
+            if (state->error)
+                std::rethrow_exception(state->error);
+        }
+
+        // Number of tasks waiting to be picked up
         size_t size() const
         {
-            return work_queue_.size();
+            return static_cast<size_t>(std::max(pending_.load(), 0));
         }
 
-        void setSleepTime(int sleep_time)
+        int num_threads() const
         {
-            sleep_time_ = sleep_time;
+            return static_cast<int>(threads_.size());
         }
 
     private:
-        void run_loop()
+        typedef std::function<void()> task;
+
+        struct worker_queue
+        {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        struct parallel_for_state
         {
-            std::packaged_task<RetType()> f;
-            while(!done_)
+            parallel_for_state() : next(0), done(0) {}
+
+            std::atomic<int> next;
+            std::atomic<int> done;
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::exception_ptr error;
+        };
+
+        // Index of the calling thread among the workers of this pool, -1 for other threads
+        int worker_index() const
+        {
+            return current_worker().first == this ? current_worker().second : -1;
+        }
+
+        static std::pair<thread_pool const*, int>& current_worker()
+        {
+            static thread_local std::pair<thread_pool const*, int> worker(nullptr, -1);
+            return worker;
+        }
+
+        // Workers push into their own deque, other threads spread tasks over all of them
+        void push(task&& t)
+        {
+            int idx = worker_index();
+            if (idx < 0)
             {
-                if (work_queue_.try_pop(f))
+                idx = static_cast<int>(next_queue_++ % queues_.size());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(queues_[idx]->mutex);
+                queues_[idx]->tasks.push_back(std::move(t));
+            }
+
+            // Counting under the parking lock makes sure the wakeup is not lost
+            {
+                std::lock_guard<std::mutex> lock(park_mutex_);
+                ++pending_;
+            }
+
+            park_cv_.notify_one();
+        }
+
+        // Take a task from the back of the own deque or from the front of another one
+        bool pop(int idx, task& t)
+        {
+            int numqueues = static_cast<int>(queues_.size());
+
+            for (int i = 0; i < numqueues; ++i)
+            {
+                worker_queue& queue = *queues_[(idx + i) % numqueues];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+
+                if (!queue.tasks.empty())
                 {
-                    f();
+                    if (i == 0)
+                    {
+                        t = std::move(queue.tasks.back());
+                        queue.tasks.pop_back();
+                    }
+                    else
+                    {
+                        t = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                    }
+
+                    --pending_;
+                    return true;
                 }
-                else
+            }
+
+            return false;
+        }
+
+        void run_loop(int idx)
+        {
+            current_worker() = std::make_pair(this, idx);
+
+            task t;
+            for (;;)
+            {
+                if (pop(idx, t))
                 {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time_));
+                    t();
+                    t = nullptr;
+                    continue;
                 }
+
+                std::unique_lock<std::mutex> lock(park_mutex_);
+                park_cv_.wait(lock, [this]() { return done_ || pending_ > 0; });
+
+                if (done_ && pending_ == 0)
+                    return;
             }
         }
 
-
-        thread_safe_queue<std::packaged_task<RetType()> > work_queue_;
-        std::atomic_bool done_;
+        std::vector<std::unique_ptr<worker_queue> > queues_;
         std::vector<std::thread> threads_;
-        int sleep_time_;
+        // Tasks pushed and not yet popped
+        std::atomic<int> pending_;
+        std::atomic<unsigned> next_queue_;
+        std::mutex park_mutex_;
+        std::condition_variable park_cv_;
+        bool done_;
     };
 }
 
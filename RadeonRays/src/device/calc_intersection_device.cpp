@@ -33,12 +33,22 @@ THE SOFTWARE.
 #include "../strategy/bvhstrategy.h"
 #include "../strategy/bvh2lstrategy.h"
 #include "../strategy/fatbvhstrategy.h"
+#include "../strategy/compressedbvhstrategy.h"
+#include "../strategy/qbvhstrategy.h"
+#include "../strategy/gridstrategy.h"
 #include "../strategy/hlbvh_strategy.h"
 #include "../world/world.h"
+#include "../except/except.h"
 #include <iostream>
 
 namespace RadeonRays
 {
+    // Calc buffer of an optional buffer holder, nullptr if there is no buffer
+    static Calc::Buffer* GetCalcBuffer(Buffer const* buffer)
+    {
+        return buffer ? static_cast<CalcBufferHolder const*>(buffer)->m_buffer.get() : nullptr;
+    }
+
     // TODO: handle different BVH strategies, for now hardcoded
     CalcIntersectionDevice::CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device)
         : m_device(device, [calc](Calc::Device* device) { calc->DeleteDevice(device); })
@@ -123,6 +133,30 @@ namespace RadeonRays
                         m_intersector_string = "fatbvh";
                     }
                 }
+                else if (acctype == "cbvh")
+                {
+                    if (m_intersector_string != "cbvh")
+                    {
+                        m_intersector.reset(new CompressedBvhStrategy(m_device.get()));
+                        m_intersector_string = "cbvh";
+                    }
+                }
+                else if (acctype == "qbvh")
+                {
+                    if (m_intersector_string != "qbvh")
+                    {
+                        m_intersector.reset(new QBvhStrategy(m_device.get()));
+                        m_intersector_string = "qbvh";
+                    }
+                }
+                else if (acctype == "grid")
+                {
+                    if (m_intersector_string != "grid")
+                    {
+                        m_intersector.reset(new GridStrategy(m_device.get()));
+                        m_intersector_string = "grid";
+                    }
+                }
                 else if (acctype == "hlbvh")
                 {
                     if (m_intersector_string != "hlbvh")
@@ -341,4 +375,165 @@ namespace RadeonRays
     {
         m_event_pool.push(e);
     }
+
+    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        CompactQuery(rays, nullptr, numrays, hits, output, waitevent, event);
+    }
+
+    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        CompactQuery(rays, nullptr, numrays, hits, output, waitevent, event);
+    }
+
+    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        CompactQuery(rays, numrays, maxrays, hits, output, waitevent, event);
+    }
+
+    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        CompactQuery(rays, numrays, maxrays, hits, output, waitevent, event);
+    }
+
+    void CalcIntersectionDevice::CompactQuery(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto numrays_buffer = numrays ? static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get() : nullptr;
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            m_intersector->QueryCompact(0, ray_buffer, numrays_buffer, maxrays, output, hit_buffer, e, &calc_event);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event);
+            *event = holder;
+        }
+        else
+        {
+            m_intersector->QueryCompact(0, ray_buffer, numrays_buffer, maxrays, output, hit_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(!rays.origins || !rays.directions, "Ray origins and directions are required.");
+
+        // Extract Calc buffers from their holders
+        CalcRaySoA ray_buffers = { GetCalcBuffer(rays.origins), GetCalcBuffer(rays.directions), GetCalcBuffer(rays.maxt), GetCalcBuffer(rays.masks) };
+        CalcIntersectionSoA hit_buffers = { GetCalcBuffer(hits.t), GetCalcBuffer(hits.primids), GetCalcBuffer(hits.shapeids), GetCalcBuffer(hits.uvs) };
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            m_intersector->QueryIntersectionSoA(0, ray_buffers, numrays, hit_buffers, e, &calc_event);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event);
+            *event = holder;
+        }
+        else
+        {
+            m_intersector->QueryIntersectionSoA(0, ray_buffers, numrays, hit_buffers, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(!rays.origins || !rays.directions, "Ray origins and directions are required.");
+
+        // Extract Calc buffers from their holders
+        CalcRaySoA ray_buffers = { GetCalcBuffer(rays.origins), GetCalcBuffer(rays.directions), GetCalcBuffer(rays.maxt), GetCalcBuffer(rays.masks) };
+        auto hit_buffer = GetCalcBuffer(hits);
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            m_intersector->QueryOcclusionSoA(0, ray_buffers, numrays, hit_buffer, e, &calc_event);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event);
+            *event = holder;
+        }
+        else
+        {
+            m_intersector->QueryOcclusionSoA(0, ray_buffers, numrays, hit_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            Calc::Event* calc_event = nullptr;
+            m_intersector->QueryIntersectionMulti(0, ray_buffer, numrays, k, hit_buffer, e, &calc_event);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event);
+            *event = holder;
+        }
+        else
+        {
+            m_intersector->QueryIntersectionMulti(0, ray_buffer, numrays, k, hit_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        auto point_buffer = static_cast<CalcBufferHolder const*>(points)->m_buffer.get();
+        auto result_buffer = static_cast<CalcBufferHolder const*>(results)->m_buffer.get();
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            Calc::Event* calc_event = nullptr;
+            m_intersector->QueryClosestPoint(0, point_buffer, numpoints, maxdist, result_buffer, e, &calc_event);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event);
+            *event = holder;
+        }
+        else
+        {
+            m_intersector->QueryClosestPoint(0, point_buffer, numpoints, maxdist, result_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        auto volume_buffer = static_cast<CalcBufferHolder const*>(volumes)->m_buffer.get();
+        auto result_buffer = static_cast<CalcBufferHolder const*>(results)->m_buffer.get();
+        auto count_buffer = static_cast<CalcBufferHolder const*>(counts)->m_buffer.get();
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            Calc::Event* calc_event = nullptr;
+            m_intersector->QueryOverlap(0, volume_buffer, numqueries, volume, maxhits, result_buffer, count_buffer, e, &calc_event);
+
+            auto holder = CreateEventHolder();
+            holder->Set(m_device.get(), calc_event);
+            *event = holder;
+        }
+        else
+        {
+            m_intersector->QueryOverlap(0, volume_buffer, numqueries, volume, maxhits, result_buffer, count_buffer, e, nullptr);
+        }
+    }
 }
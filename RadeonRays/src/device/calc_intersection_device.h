@@ -66,11 +66,31 @@ namespace RadeonRays
 
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const override;
+
         Calc::Platform GetPlatform() const { return m_device->GetPlatform(); }
     protected:
         CalcEventHolder* CreateEventHolder() const;
         void      ReleaseEventHolder(CalcEventHolder* e) const;
 
+        // Run a compact output query on the strategy,
+        // numrays might be nullptr, maxrays is the number of rays then
+        void CompactQuery(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const;
+
         std::unique_ptr<Calc::Device, std::function<void(Calc::Device*)>> m_device;
         std::unique_ptr<Strategy> m_intersector;
         std::string m_intersector_string;
@@ -0,0 +1,1906 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "cpu_intersection_device.h"
+
+#include "../accelerator/bvh.h"
+#include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+//count of elements for one thread pool task
+#define TASK_SIZE 256
+
+// Traversal stack entries, each level of the collapsed tree defers up to 3 children
+static int const kMaxStackSize = 128;
+// Max number of rays traced together
+static int const kMaxPacketSize = 16;
+// Min cosine between packet ray directions and their mean direction,
+// less coherent rays are traced one by one
+static float const kPacketCoherence = 0.9f;
+
+namespace RadeonRays
+{
+    //simple RadeonRays::Buffer implementation in host memory
+    class CpuBuffer : public Buffer
+    {
+    public:
+        CpuBuffer(size_t size, void* init)
+            : m_data(new char[size])
+        {
+            if (init)
+                memcpy(m_data, init, size);
+        }
+
+        virtual ~CpuBuffer()
+        {
+            delete[] m_data;
+        }
+
+        void* GetData()
+        {
+            return m_data;
+        }
+
+        const void* GetData() const
+        {
+            return m_data;
+        }
+
+    private:
+        char* m_data;
+    };
+
+    //simple RadeonRays::Event implementation completed by the tasks it counts
+    class CpuEvent : public Event
+    {
+    public:
+        explicit CpuEvent(int numtasks)
+            : m_remaining(numtasks)
+        {
+        }
+
+        virtual ~CpuEvent()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_remaining == 0; });
+        }
+
+        virtual bool Complete() const
+        {
+            return m_remaining == 0;
+        }
+
+        virtual void Wait()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_remaining == 0; });
+
+            if (m_error)
+                std::rethrow_exception(m_error);
+        }
+
+        //run f once the event is complete, right away if it already is
+        void Then(std::function<void()> const& f)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_remaining > 0)
+                {
+                    m_continuations.push_back(f);
+                    return;
+                }
+            }
+
+            f();
+        }
+
+        //called by every finished task, error is kept for Wait
+        void TaskDone(std::exception_ptr error)
+        {
+            std::vector<std::function<void()> > continuations;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (error && !m_error)
+                    m_error = error;
+
+                if (--m_remaining > 0)
+                    return;
+
+                continuations.swap(m_continuations);
+                m_cv.notify_all();
+            }
+
+            //the event might be deleted from here on
+            for (auto& f : continuations)
+                f();
+        }
+
+    private:
+        std::atomic<int> m_remaining;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::vector<std::function<void()> > m_continuations;
+        std::exception_ptr m_error;
+    };
+
+    // Either hand the event over to the caller or block until it is done
+    static void ReturnEvent(CpuEvent* ev, Event** event)
+    {
+        if (event)
+        {
+            *event = ev;
+        }
+        else
+        {
+            std::unique_ptr<CpuEvent> owner(ev);
+            ev->Wait();
+        }
+    }
+
+    // Tasks have to cover whole words of the occlusion mask
+    static_assert(TASK_SIZE % 32 == 0, "TASK_SIZE should be a multiple of 32");
+
+    // Data of an optional cpu buffer, nullptr if there is no buffer
+    template <typename T>
+    static T* GetData(Buffer const* buffer)
+    {
+        if (!buffer)
+        {
+            return nullptr;
+        }
+
+        auto cpubuffer = dynamic_cast<CpuBuffer const*>(buffer); ThrowIf(!cpubuffer, "Invalid cpu buffer.");
+        return static_cast<T*>(const_cast<void*>(cpubuffer->GetData()));
+    }
+
+    // Host pointers to SoA ray planes
+    struct SoARays
+    {
+        SoARays(RaySoA const& rays)
+            : o(GetData<float const>(rays.origins))
+            , d(GetData<float const>(rays.directions))
+            , maxt(GetData<float const>(rays.maxt))
+            , mask(GetData<int const>(rays.masks))
+        {
+            ThrowIf(!o || !d, "Ray origins and directions are required.");
+        }
+
+        // Gather rays [begin, end) into AoS form for traversal
+        void Gather(int numrays, int begin, int end, ray* dst) const
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                ray& r = dst[i - begin];
+                r.o = float3(o[i], o[numrays + i], o[2 * numrays + i]);
+                r.d = float3(d[i], d[numrays + i], d[2 * numrays + i]);
+                r.SetMaxT(maxt ? maxt[i] : std::numeric_limits<float>::max());
+                r.SetTime(0.f);
+                r.SetMask(mask ? mask[i] : 0xFFFFFFFF);
+                r.SetActive(true);
+            }
+        }
+
+        float const* o;
+        float const* d;
+        float const* maxt;
+        int const* mask;
+    };
+
+    // Intersect ray with 4 boxes of the node, returns hit mask
+    // and entry distances for each of the boxes
+    static inline int IntersectBox4(QBvhTranslator::Node const& node, __m128 const* o, __m128 const* invdir, float maxt, float* tnear)
+    {
+        const __m128 fx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmaxx), o[0]), invdir[0]);
+        const __m128 nx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bminx), o[0]), invdir[0]);
+        const __m128 fy = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmaxy), o[1]), invdir[1]);
+        const __m128 ny = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bminy), o[1]), invdir[1]);
+        const __m128 fz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmaxz), o[2]), invdir[2]);
+        const __m128 nz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bminz), o[2]), invdir[2]);
+
+        const __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(fx, nx), _mm_min_ps(_mm_max_ps(fy, ny), _mm_max_ps(fz, nz))), _mm_set1_ps(maxt));
+        const __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(fx, nx), _mm_max_ps(_mm_min_ps(fy, ny), _mm_min_ps(fz, nz))), _mm_setzero_ps());
+
+        // Empty slots are never hit
+        const __m128 used = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(node.count)), _mm_set1_epi32(QBvhTranslator::kEmptySlot)));
+        const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(t1, t0), _mm_cmpgt_ps(t1, _mm_setzero_ps())), used);
+
+        _mm_storeu_ps(tnear, t0);
+        return _mm_movemask_ps(hit);
+    }
+
+    // Returns mask of node children containing shapes visible to the ray
+    static inline int VisibleChildren(int const* nodemasks, int nodeidx, int raymask)
+    {
+        if (!nodemasks)
+            return 0xF;
+
+        const __m128i masks = _mm_loadu_si128(reinterpret_cast<__m128i const*>(nodemasks + 4 * nodeidx));
+        const __m128i hidden = _mm_cmpeq_epi32(_mm_and_si128(masks, _mm_set1_epi32(raymask)), _mm_setzero_si128());
+        return ~_mm_movemask_ps(_mm_castsi128_ps(hidden)) & 0xF;
+    }
+
+    // Insert the hit into the list of k closest hits sorted by distance, the farthest one
+    // is dropped if the list is full. Returns the distance to look for further hits within.
+    static inline float InsertHit(Intersection* hits, int& numhits, int k, Intersection const& hit, float maxt)
+    {
+        // Primitives referenced from several leaves (split BVH) are reported once
+        for (int i = 0; i < numhits; ++i)
+        {
+            if (hits[i].primid == hit.primid && hits[i].shapeid == hit.shapeid)
+            {
+                return numhits < k ? maxt : hits[k - 1].uvwt.w;
+            }
+        }
+
+        int i = numhits < k ? numhits++ : k - 1;
+
+        for (; i > 0 && hits[i - 1].uvwt.w > hit.uvwt.w; --i)
+        {
+            hits[i] = hits[i - 1];
+        }
+
+        hits[i] = hit;
+
+        return numhits < k ? maxt : hits[k - 1].uvwt.w;
+    }
+
+    // Same as IntersectTriangle in CL/common.cl
+    static inline bool IntersectTriangle(ray const& r, float3 const& v1, float3 const& v2, float3 const& v3, float maxt, float& t, float& b1, float& b2)
+    {
+        const float3 e1 = v2 - v1;
+        const float3 e2 = v3 - v1;
+        const float3 s1 = cross(r.d, e2);
+        const float invd = 1.f / dot(s1, e1);
+        const float3 d = r.o - v1;
+        b1 = dot(d, s1) * invd;
+        const float3 s2 = cross(d, e1);
+        b2 = dot(r.d, s2) * invd;
+        t = dot(e2, s2) * invd;
+
+        return !(b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f || t < 0.f || t > maxt);
+    }
+
+    // Squared distances from the point to 4 child boxes, 0 inside
+    static inline void DistanceToBox4(QBvhTranslator::Node const& node, __m128 const* p, float* distsq)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.bminx), p[0]), _mm_sub_ps(p[0], _mm_loadu_ps(node.bmaxx))), zero);
+        const __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.bminy), p[1]), _mm_sub_ps(p[1], _mm_loadu_ps(node.bmaxy))), zero);
+        const __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.bminz), p[2]), _mm_sub_ps(p[2], _mm_loadu_ps(node.bmaxz))), zero);
+
+        _mm_storeu_ps(distsq, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+    }
+
+    // Same as ClosestPointTriangle in CL/common.cl, returns squared distance
+    static inline float ClosestPointTriangle(float3 const& p, float3 const& v1, float3 const& v2, float3 const& v3, float& b1, float& b2)
+    {
+        const float3 e1 = v2 - v1;
+        const float3 e2 = v3 - v1;
+        const float3 d1 = p - v1;
+        const float a1 = dot(e1, d1);
+        const float a2 = dot(e2, d1);
+
+        const float3 d2 = p - v2;
+        const float a3 = dot(e1, d2);
+        const float a4 = dot(e2, d2);
+        const float3 d3 = p - v3;
+        const float a5 = dot(e1, d3);
+        const float a6 = dot(e2, d3);
+
+        const float va = a3 * a6 - a5 * a4;
+        const float vb = a5 * a2 - a1 * a6;
+        const float vc = a1 * a4 - a3 * a2;
+
+        if (a1 <= 0.f && a2 <= 0.f)
+        {
+            b1 = 0.f; b2 = 0.f;
+        }
+        else if (a3 >= 0.f && a4 <= a3)
+        {
+            b1 = 1.f; b2 = 0.f;
+        }
+        else if (vc <= 0.f && a1 >= 0.f && a3 <= 0.f)
+        {
+            b1 = a1 / (a1 - a3); b2 = 0.f;
+        }
+        else if (a6 >= 0.f && a5 <= a6)
+        {
+            b1 = 0.f; b2 = 1.f;
+        }
+        else if (vb <= 0.f && a2 >= 0.f && a6 <= 0.f)
+        {
+            b1 = 0.f; b2 = a2 / (a2 - a6);
+        }
+        else if (va <= 0.f && (a4 - a3) >= 0.f && (a5 - a6) >= 0.f)
+        {
+            b2 = (a4 - a3) / ((a4 - a3) + (a5 - a6));
+            b1 = 1.f - b2;
+        }
+        else
+        {
+            const float denom = 1.f / (va + vb + vc);
+            b1 = vb * denom;
+            b2 = vc * denom;
+        }
+
+        const float3 d = v1 + e1 * b1 + e2 * b2 - p;
+        return dot(d, d);
+    }
+
+    // Read query volume as 6 planes, boxes become their face planes
+    static inline void GetOverlapPlanes(void const* volumes, int idx, OverlapVolume volume, float4* planes)
+    {
+        if (volume == kOverlapBox)
+        {
+            float3 const* box = static_cast<float3 const*>(volumes) + 2 * idx;
+            planes[0] = float4(1.f, 0.f, 0.f, -box[0].x);
+            planes[1] = float4(-1.f, 0.f, 0.f, box[1].x);
+            planes[2] = float4(0.f, 1.f, 0.f, -box[0].y);
+            planes[3] = float4(0.f, -1.f, 0.f, box[1].y);
+            planes[4] = float4(0.f, 0.f, 1.f, -box[0].z);
+            planes[5] = float4(0.f, 0.f, -1.f, box[1].z);
+        }
+        else
+        {
+            std::copy_n(static_cast<float4 const*>(volumes) + 6 * idx, 6, planes);
+        }
+    }
+
+    // Returns mask of node children not fully outside of any plane, same as OverlapPlanes in CL/common.cl
+    static inline int OverlapBox4(QBvhTranslator::Node const& node, float4 const* planes)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        __m128 outside = zero;
+
+        for (int i = 0; i < 6; ++i)
+        {
+            const __m128 nx = _mm_set1_ps(planes[i].x);
+            const __m128 ny = _mm_set1_ps(planes[i].y);
+            const __m128 nz = _mm_set1_ps(planes[i].z);
+            const __m128 dx = _mm_max_ps(_mm_mul_ps(nx, _mm_loadu_ps(node.bminx)), _mm_mul_ps(nx, _mm_loadu_ps(node.bmaxx)));
+            const __m128 dy = _mm_max_ps(_mm_mul_ps(ny, _mm_loadu_ps(node.bminy)), _mm_mul_ps(ny, _mm_loadu_ps(node.bmaxy)));
+            const __m128 dz = _mm_max_ps(_mm_mul_ps(nz, _mm_loadu_ps(node.bminz)), _mm_mul_ps(nz, _mm_loadu_ps(node.bmaxz)));
+            const __m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(dx, dy), dz), _mm_set1_ps(planes[i].w));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(d, zero));
+        }
+
+        const __m128 used = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(node.count)), _mm_set1_epi32(QBvhTranslator::kEmptySlot)));
+        return _mm_movemask_ps(_mm_andnot_ps(outside, used));
+    }
+
+    static inline bool OverlapBounds(float4 const* planes, float3 const& pmin, float3 const& pmax)
+    {
+        for (int i = 0; i < 6; ++i)
+        {
+            float d = std::max(planes[i].x * pmin.x, planes[i].x * pmax.x) +
+                      std::max(planes[i].y * pmin.y, planes[i].y * pmax.y) +
+                      std::max(planes[i].z * pmin.z, planes[i].z * pmax.z) + planes[i].w;
+            if (d < 0.f)
+                return false;
+        }
+
+        return true;
+    }
+
+    struct CpuIntersectionDevice::RayPacket
+    {
+        // Rays in SoA form, lanes are padded to a multiple of 4
+        float ox[kMaxPacketSize];
+        float oy[kMaxPacketSize];
+        float oz[kMaxPacketSize];
+        float dx[kMaxPacketSize];
+        float dy[kMaxPacketSize];
+        float dz[kMaxPacketSize];
+        float ix[kMaxPacketSize];
+        float iy[kMaxPacketSize];
+        float iz[kMaxPacketSize];
+        int mask[kMaxPacketSize];
+        // Closest hit so far, ray max distance initially
+        float t[kMaxPacketSize];
+        float u[kMaxPacketSize];
+        float v[kMaxPacketSize];
+        // 1 if the hit is on the second triangle of a quad
+        float w[kMaxPacketSize];
+        Id shapeid[kMaxPacketSize];
+        Id primid[kMaxPacketSize];
+        // Rays still being traced and rays which found any hit, one bit per lane
+        int live;
+        int hit;
+        int numlanes;
+        // Bounds of the packet origins and inverse directions,
+        // axes with negative direction are flipped to make directions positive
+        float sign[3];
+        float omin[3];
+        float omax[3];
+        float imin[3];
+        float imax[3];
+
+        // Fill the packet, returns false if rays are not coherent enough to share traversal
+        bool Init(ray const* r, int count)
+        {
+            live = 0;
+            hit = 0;
+            numlanes = (count + 3) & ~3;
+
+            int first = -1;
+            int numlive = 0;
+            float3 mean(0.f, 0.f, 0.f);
+
+            for (int k = 0; k < count; ++k)
+            {
+                if (r[k].IsActive() && r[k].GetMaxT() >= 0.f)
+                {
+                    live |= (1 << k);
+                    first = first < 0 ? k : first;
+                    mean += normalize(r[k].d);
+                    ++numlive;
+                }
+            }
+
+            if (numlive < 2)
+            {
+                return false;
+            }
+
+            mean.normalize();
+
+            float const* d0 = &r[first].d.x;
+            for (int a = 0; a < 3; ++a)
+            {
+                sign[a] = d0[a] < 0.f ? -1.f : 1.f;
+                omin[a] = imin[a] = std::numeric_limits<float>::max();
+                omax[a] = imax[a] = -std::numeric_limits<float>::max();
+            }
+
+            for (int k = 0; k < count; ++k)
+            {
+                if (!(live & (1 << k)))
+                    continue;
+
+                float const* o = &r[k].o.x;
+                float const* d = &r[k].d.x;
+
+                // Interval bounds need all directions in one octant
+                for (int a = 0; a < 3; ++a)
+                {
+                    if (d[a] * sign[a] < 1e-20f)
+                        return false;
+
+                    omin[a] = std::min(omin[a], o[a] * sign[a]);
+                    omax[a] = std::max(omax[a], o[a] * sign[a]);
+                    imin[a] = std::min(imin[a], sign[a] / d[a]);
+                    imax[a] = std::max(imax[a], sign[a] / d[a]);
+                }
+
+                if (dot(normalize(r[k].d), mean) < kPacketCoherence)
+                    return false;
+            }
+
+            for (int k = 0; k < numlanes; ++k)
+            {
+                // Padding lanes replicate the first ray and are never live
+                ray const& src = k < count ? r[k] : r[first];
+                ox[k] = src.o.x;
+                oy[k] = src.o.y;
+                oz[k] = src.o.z;
+                dx[k] = src.d.x;
+                dy[k] = src.d.y;
+                dz[k] = src.d.z;
+                ix[k] = 1.f / src.d.x;
+                iy[k] = 1.f / src.d.y;
+                iz[k] = 1.f / src.d.z;
+                mask[k] = src.GetMask();
+                t[k] = k < count ? src.GetMaxT() : -1.f;
+                u[k] = v[k] = w[k] = 0.f;
+                shapeid[k] = primid[k] = kNullId;
+            }
+
+            return true;
+        }
+
+        // Farthest distance any live ray is interested in
+        float MaxT() const
+        {
+            float maxt = 0.f;
+            for (int k = 0; k < numlanes; ++k)
+            {
+                if (live & (1 << k))
+                    maxt = std::max(maxt, t[k]);
+            }
+            return maxt;
+        }
+
+        // Conservative interval arithmetic test of the whole packet against 4 boxes of the node,
+        // returns mask of the boxes which might be hit by at least one ray.
+        // tnear gets a lower bound of the entry distance of every ray into each box
+        int IntersectInterval4(QBvhTranslator::Node const& node, float maxt, float* tnear) const
+        {
+            float const* bmin[3] = { node.bminx, node.bminy, node.bminz };
+            float const* bmax[3] = { node.bmaxx, node.bmaxy, node.bmaxz };
+
+            const __m128 zero = _mm_setzero_ps();
+            __m128 t0 = zero;
+            __m128 t1 = _mm_set1_ps(maxt);
+
+            for (int a = 0; a < 3; ++a)
+            {
+                // Slabs in the flipped space
+                const __m128 s = _mm_set1_ps(sign[a]);
+                const __m128 lo = sign[a] > 0.f ? _mm_loadu_ps(bmin[a]) : _mm_mul_ps(_mm_loadu_ps(bmax[a]), s);
+                const __m128 hi = sign[a] > 0.f ? _mm_loadu_ps(bmax[a]) : _mm_mul_ps(_mm_loadu_ps(bmin[a]), s);
+
+                // Lowest entry and highest exit distance over all origins and directions
+                const __m128 n = _mm_sub_ps(lo, _mm_set1_ps(omax[a]));
+                const __m128 f = _mm_sub_ps(hi, _mm_set1_ps(omin[a]));
+                const __m128 npos = _mm_cmpge_ps(n, zero);
+                const __m128 fpos = _mm_cmpge_ps(f, zero);
+                const __m128 tn = _mm_or_ps(_mm_and_ps(npos, _mm_mul_ps(n, _mm_set1_ps(imin[a]))), _mm_andnot_ps(npos, _mm_mul_ps(n, _mm_set1_ps(imax[a]))));
+                const __m128 tf = _mm_or_ps(_mm_and_ps(fpos, _mm_mul_ps(f, _mm_set1_ps(imax[a]))), _mm_andnot_ps(fpos, _mm_mul_ps(f, _mm_set1_ps(imin[a]))));
+
+                t0 = _mm_max_ps(t0, tn);
+                t1 = _mm_min_ps(t1, tf);
+            }
+
+            const __m128 used = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(node.count)), _mm_set1_epi32(QBvhTranslator::kEmptySlot)));
+
+            _mm_storeu_ps(tnear, t0);
+            return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(t0, t1), used));
+        }
+
+        // Test the live lanes of the 4 ray group starting at lane g against the given children of the node,
+        // returns mask of the children hit by at least one of them. Same math as IntersectBox4 with rays in SIMD lanes.
+        // childmasks are the geometry masks of the children, nullptr if masks are not used
+        int IntersectChildren4(QBvhTranslator::Node const& node, int g, int children, int const* childmasks) const
+        {
+            int lanes = live >> g & 0xF;
+            int hits = 0;
+
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 x = _mm_loadu_ps(ox + g), y = _mm_loadu_ps(oy + g), z = _mm_loadu_ps(oz + g);
+            const __m128 invx = _mm_loadu_ps(ix + g), invy = _mm_loadu_ps(iy + g), invz = _mm_loadu_ps(iz + g);
+            const __m128 maxt = _mm_loadu_ps(t + g);
+            const __m128i raymask = _mm_loadu_si128(reinterpret_cast<__m128i const*>(mask + g));
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(children & (1 << i)))
+                    continue;
+
+                const __m128 fx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmaxx[i]), x), invx);
+                const __m128 nx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bminx[i]), x), invx);
+                const __m128 fy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmaxy[i]), y), invy);
+                const __m128 ny = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bminy[i]), y), invy);
+                const __m128 fz = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmaxz[i]), z), invz);
+                const __m128 nz = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bminz[i]), z), invz);
+
+                const __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(fx, nx), _mm_min_ps(_mm_max_ps(fy, ny), _mm_max_ps(fz, nz))), maxt);
+                const __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(fx, nx), _mm_max_ps(_mm_min_ps(fy, ny), _mm_min_ps(fz, nz))), zero);
+                __m128 hit = _mm_and_ps(_mm_cmpge_ps(t1, t0), _mm_cmpgt_ps(t1, zero));
+
+                if (childmasks)
+                {
+                    const __m128i hidden = _mm_cmpeq_epi32(_mm_and_si128(raymask, _mm_set1_epi32(childmasks[i])), _mm_setzero_si128());
+                    hit = _mm_andnot_ps(_mm_castsi128_ps(hidden), hit);
+                }
+
+                if (_mm_movemask_ps(hit) & lanes)
+                {
+                    hits |= 1 << i;
+                }
+            }
+
+            return hits;
+        }
+    };
+
+    CpuIntersectionDevice::CpuIntersectionDevice()
+        : m_duplicate_faces(false)
+        , m_packet_size(1)
+    {
+    }
+
+    CpuIntersectionDevice::~CpuIntersectionDevice()
+    {
+    }
+
+    void CpuIntersectionDevice::Preprocess(World const& world)
+    {
+        auto packetsize = world.options_.GetOption("cpu.packet_size");
+        m_packet_size = packetsize ? (int)packetsize->AsFloat() : 1;
+        ThrowIf(m_packet_size != 1 && m_packet_size != 4 && m_packet_size != 8 && m_packet_size != kMaxPacketSize,
+            "cpu.packet_size should be 1, 4, 8 or 16");
+
+        // Geometry is flattened, so any change requires a rebuild
+        if (!m_nodes.empty() && !world.has_changed() && world.GetStateChange() == ShapeImpl::kStateChangeNone)
+        {
+            return;
+        }
+
+        m_nodes.clear();
+        m_node_masks.clear();
+        m_vertices.clear();
+        m_faces.clear();
+        m_shapes.clear();
+
+        auto builder = world.options_.GetOption("bvh.builder");
+        auto splits = world.options_.GetOption("bvh.sah.use_splits");
+        auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
+        auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
+        auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+        auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
+        auto parallel = world.options_.GetOption("bvh.parallel_build");
+        auto leafsize = world.options_.GetOption("bvh.max_leaf_size");
+        auto optimize = world.options_.GetOption("bvh.optimize");
+
+        int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
+        float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
+        float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+        float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+        bool parallel_build = parallel ? parallel->AsFloat() > 0.f : false;
+        int max_leaf_size = leafsize ? (int)leafsize->AsFloat() : 1;
+        bool use_sah = builder && builder->AsString() == "sah";
+        bool use_lbvh = builder && builder->AsString() == "lbvh";
+        bool use_splits = splits && splits->AsFloat() > 0.f;
+
+        std::unique_ptr<Bvh> bvh(use_splits ?
+            new SplitBvh(traversal_cost, max_split_depth, min_overlap, extra_node_budget) :
+            use_lbvh ?
+            new LinearBvh(traversal_cost) :
+            new Bvh(traversal_cost, use_sah, parallel_build, max_leaf_size)
+        );
+
+        int numshapes = (int)world.shapes_.size();
+        int numvertices = 0;
+        int numfaces = 0;
+
+        // Mesh start indices, face indices are relative to the mesh
+        std::vector<int> mesh_vertices_start_idx(numshapes);
+        std::vector<int> mesh_faces_start_idx(numshapes);
+        std::vector<Mesh const*> meshes(numshapes);
+
+        m_shapes.resize(numshapes);
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            auto shape = static_cast<ShapeImpl const*>(world.shapes_[i]);
+
+            meshes[i] = shape->is_instance() ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+                static_cast<Mesh const*>(shape);
+
+            mesh_faces_start_idx[i] = numfaces;
+            mesh_vertices_start_idx[i] = numvertices;
+
+            numfaces += meshes[i]->num_faces();
+            numvertices += meshes[i]->num_vertices();
+
+            m_shapes[i].id = shape->GetId();
+            m_shapes[i].mask = shape->GetMask();
+        }
+
+        // Nothing to build, queries find no nodes and report misses
+        if (numfaces == 0)
+        {
+            return;
+        }
+
+        // Transform everything into world space
+        std::vector<bbox> bounds(numfaces);
+        m_vertices.resize(numvertices);
+
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
+        {
+            Mesh const* mesh = meshes[i];
+
+            matrix m, minv;
+            world.shapes_[i]->GetTransform(m, minv);
+
+            float3 const* myvertexdata = mesh->GetVertexData();
+            for (int j = 0; j < mesh->num_vertices(); ++j)
+            {
+                m_vertices[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+            }
+
+            Mesh::Face const* myfacedata = mesh->GetFaceData();
+            for (int j = 0; j < mesh->num_faces(); ++j)
+            {
+                bbox& b = bounds[mesh_faces_start_idx[i] + j];
+                b = bbox(m_vertices[mesh_vertices_start_idx[i] + myfacedata[j].idx[0]]);
+                b.grow(m_vertices[mesh_vertices_start_idx[i] + myfacedata[j].idx[1]]);
+                b.grow(m_vertices[mesh_vertices_start_idx[i] + myfacedata[j].idx[2]]);
+
+                if (myfacedata[j].type_ == Mesh::FaceType::QUAD)
+                {
+                    b.grow(m_vertices[mesh_vertices_start_idx[i] + myfacedata[j].idx[3]]);
+                }
+            }
+        }
+
+        bvh->Build(&bounds[0], numfaces);
+
+        if (optimize && optimize->AsString() == "treelet")
+        {
+            bvh->OptimizeTreelets();
+        }
+
+#ifdef RR_PROFILE
+        bvh->PrintStatistics(std::cout);
+#endif
+
+        QBvhTranslator translator;
+        translator.Process(*bvh);
+
+        if (3 * translator.height_ + 1 > kMaxStackSize)
+        {
+            throw ExceptionImpl("cpu device can cause stack overflow for this scene");
+        }
+
+        // Permute faces according to BVH reordering
+        int numindices = bvh->GetNumIndices();
+        int const* reordering = bvh->GetIndices();
+        m_faces.resize(numindices);
+
+        for (int i = 0; i < numindices; ++i)
+        {
+            int indextolook4 = reordering[i];
+
+            // Find the shape corresponding to current face
+            auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+            int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+            Mesh::Face const* myfacedata = meshes[shapeidx]->GetFaceData();
+            int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+            int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+            m_faces[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
+            m_faces[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
+            m_faces[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+            m_faces[i].idx[3] = myfacedata[faceidx].idx[3] + mystartidx;
+            m_faces[i].shapeidx = shapeidx;
+            m_faces[i].id = faceidx;
+            m_faces[i].cnt = myfacedata[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3;
+        }
+
+        m_duplicate_faces = numindices > numfaces;
+
+        // Culling nodes is only worth it if some shapes are masked out
+        bool masked = std::any_of(m_shapes.cbegin(), m_shapes.cend(), [](ShapeData const& shape) { return shape.mask != ~0; });
+
+        if (masked)
+        {
+            std::vector<int> primmasks(numindices);
+            for (int i = 0; i < numindices; ++i)
+            {
+                primmasks[i] = m_shapes[m_faces[i].shapeidx].mask;
+            }
+
+            translator.ProcessMasks(&primmasks[0]);
+            m_node_masks.swap(translator.masks_);
+        }
+
+        m_nodes.swap(translator.nodes_);
+    }
+
+    Buffer* CpuIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return new CpuBuffer(size, initdata);
+    }
+
+    void CpuIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete buffer;
+    }
+
+    void CpuIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    void CpuIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    {
+        CpuBuffer* buf = dynamic_cast<CpuBuffer*>(buffer);
+        ThrowIf(!buf, "Invalid cpu buffer.");
+
+        if (data)
+        {
+            *data = static_cast<char*>(buf->GetData()) + offset;
+        }
+
+        ReturnEvent(new CpuEvent(0), event);
+    }
+
+    void CpuIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    {
+        ReturnEvent(new CpuEvent(0), event);
+    }
+
+    void CpuIntersectionDevice::ParallelFor(int numrays, std::function<void(int, int)> const& task) const
+    {
+        m_pool.parallel_for(0, numrays, TASK_SIZE, task);
+    }
+
+    void CpuIntersectionDevice::Submit(std::function<void()>&& task, Event const* waitevent, Event** event) const
+    {
+        CpuEvent* ev = new CpuEvent(1);
+        auto shared_task = std::make_shared<std::function<void()> >(std::move(task));
+        thread_pool<void>* pool = &m_pool;
+
+        //the task runs on a worker and splits its rays with ParallelFor from there
+        auto launch = [pool, ev, shared_task]()
+        {
+            pool->post([ev, shared_task]()
+            {
+                std::exception_ptr error;
+                try
+                {
+                    (*shared_task)();
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+                ev->TaskDone(error);
+            });
+        };
+
+        //queries waiting for a cpu event are started by the task which completes it,
+        //other events are waited for here, so they never block a worker
+        CpuEvent* dependency = dynamic_cast<CpuEvent*>(const_cast<Event*>(waitevent));
+        if (dependency)
+        {
+            dependency->Then(launch);
+        }
+        else
+        {
+            if (waitevent)
+                const_cast<Event*>(waitevent)->Wait();
+
+            launch();
+        }
+
+        ReturnEvent(ev, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const CpuBuffer* cpurays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpurays, "Invalid cpu buffer.");
+        CpuBuffer* cpuhits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuhits, "Invalid cpu buffer.");
+
+        Submit([this, cpurays, cpuhits, numrays]()
+        {
+            const ray* r = static_cast<const ray*>(cpurays->GetData());
+            Intersection* isect = static_cast<Intersection*>(cpuhits->GetData());
+
+            ParallelFor(numrays, [this, r, isect](int begin, int end)
+            {
+                TraceClosest(r + begin, end - begin, isect + begin);
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const CpuBuffer* cpurays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpurays, "Invalid cpu buffer.");
+        CpuBuffer* cpuhits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuhits, "Invalid cpu buffer.");
+
+        Submit([this, cpurays, cpuhits, numrays]()
+        {
+            const ray* r = static_cast<const ray*>(cpurays->GetData());
+            int* hitresults = static_cast<int*>(cpuhits->GetData());
+
+            ParallelFor(numrays, [this, r, hitresults](int begin, int end)
+            {
+                TraceAny(r + begin, end - begin, hitresults + begin);
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const CpuBuffer* cpunumrays = dynamic_cast<const CpuBuffer*>(numrays); ThrowIf(!cpunumrays, "Invalid cpu buffer.");
+        const CpuBuffer* cpurays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpurays, "Invalid cpu buffer.");
+        CpuBuffer* cpuhits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuhits, "Invalid cpu buffer.");
+
+        Submit([this, cpurays, cpunumrays, maxrays, cpuhits]()
+        {
+            int count = std::min(*static_cast<const int*>(cpunumrays->GetData()), maxrays);
+            const ray* r = static_cast<const ray*>(cpurays->GetData());
+            Intersection* isect = static_cast<Intersection*>(cpuhits->GetData());
+
+            ParallelFor(count, [this, r, isect](int begin, int end)
+            {
+                TraceClosest(r + begin, end - begin, isect + begin);
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const CpuBuffer* cpunumrays = dynamic_cast<const CpuBuffer*>(numrays); ThrowIf(!cpunumrays, "Invalid cpu buffer.");
+        const CpuBuffer* cpurays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpurays, "Invalid cpu buffer.");
+        CpuBuffer* cpuhits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuhits, "Invalid cpu buffer.");
+
+        Submit([this, cpurays, cpunumrays, maxrays, cpuhits]()
+        {
+            int count = std::min(*static_cast<const int*>(cpunumrays->GetData()), maxrays);
+            const ray* r = static_cast<const ray*>(cpurays->GetData());
+            int* hitresults = static_cast<int*>(cpuhits->GetData());
+
+            ParallelFor(count, [this, r, hitresults](int begin, int end)
+            {
+                TraceAny(r + begin, end - begin, hitresults + begin);
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        const ray* r = GetData<const ray>(rays); ThrowIf(!r, "Invalid cpu buffer.");
+        void* out = GetData<void>(hits); ThrowIf(!out, "Invalid cpu buffer.");
+
+        Submit([this, r, out, numrays, output]()
+        {
+            ParallelFor(numrays, [this, r, out, output](int begin, int end)
+            {
+                TraceCompact(r, begin, end, output, out);
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        QueryIntersection(rays, numrays, hits, output, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        const int* count = GetData<const int>(numrays); ThrowIf(!count, "Invalid cpu buffer.");
+        const ray* r = GetData<const ray>(rays); ThrowIf(!r, "Invalid cpu buffer.");
+        void* out = GetData<void>(hits); ThrowIf(!out, "Invalid cpu buffer.");
+
+        Submit([this, r, count, maxrays, out, output]()
+        {
+            ParallelFor(std::min(*count, maxrays), [this, r, out, output](int begin, int end)
+            {
+                TraceCompact(r, begin, end, output, out);
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        QueryIntersection(rays, numrays, maxrays, hits, output, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const
+    {
+        SoARays src(rays);
+        float* t = GetData<float>(hits.t);
+        Id* primids = GetData<Id>(hits.primids);
+        Id* shapeids = GetData<Id>(hits.shapeids);
+        float* uvs = GetData<float>(hits.uvs);
+
+        Submit([this, src, numrays, t, primids, shapeids, uvs]()
+        {
+            ParallelFor(numrays, [&](int begin, int end)
+            {
+                // Chunks are small enough to be repacked in cache
+                ray r[TASK_SIZE];
+                Intersection isect[TASK_SIZE];
+
+                src.Gather(numrays, begin, end, r);
+                TraceClosest(r, end - begin, isect);
+
+                for (int i = begin; i < end; ++i)
+                {
+                    Intersection const& hit = isect[i - begin];
+                    if (t) t[i] = hit.uvwt.w;
+                    if (primids) primids[i] = hit.primid;
+                    if (shapeids) shapeids[i] = hit.shapeid;
+                    if (uvs)
+                    {
+                        uvs[i] = hit.uvwt.x;
+                        uvs[numrays + i] = hit.uvwt.y;
+                    }
+                }
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        SoARays src(rays);
+        int* hitresults = GetData<int>(hits); ThrowIf(!hitresults, "Invalid cpu buffer.");
+
+        Submit([this, src, numrays, hitresults]()
+        {
+            ParallelFor(numrays, [&](int begin, int end)
+            {
+                ray r[TASK_SIZE];
+
+                src.Gather(numrays, begin, end, r);
+                TraceAny(r, end - begin, hitresults + begin);
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const CpuBuffer* cpurays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpurays, "Invalid cpu buffer.");
+        CpuBuffer* cpuhits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuhits, "Invalid cpu buffer.");
+
+        Submit([this, cpurays, cpuhits, numrays, k]()
+        {
+            const ray* r = static_cast<const ray*>(cpurays->GetData());
+            Intersection* isect = static_cast<Intersection*>(cpuhits->GetData());
+
+            ParallelFor(numrays, [this, r, isect, k](int begin, int end)
+            {
+                for (int i = begin; i < end; ++i)
+                {
+                    if (!r[i].IsActive())
+                        continue;
+
+                    Intersection* rayhits = isect + i * k;
+                    int numhits = IntersectMulti(r[i], k, rayhits);
+
+                    // Default constructed intersections are misses
+                    std::fill(rayhits + numhits, rayhits + k, Intersection());
+                }
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        const CpuBuffer* cpupoints = dynamic_cast<const CpuBuffer*>(points); ThrowIf(!cpupoints, "Invalid cpu buffer.");
+        CpuBuffer* cpuresults = dynamic_cast<CpuBuffer*>(results); ThrowIf(!cpuresults, "Invalid cpu buffer.");
+
+        Submit([this, cpupoints, cpuresults, numpoints, maxdist]()
+        {
+            const float3* p = static_cast<const float3*>(cpupoints->GetData());
+            Intersection* isect = static_cast<Intersection*>(cpuresults->GetData());
+
+            ParallelFor(numpoints, [this, p, isect, maxdist](int begin, int end)
+            {
+                std::vector<std::pair<float, int>> queue;
+
+                for (int i = begin; i < end; ++i)
+                {
+                    ClosestPoint(p[i], maxdist, isect[i], queue);
+                }
+            });
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        const CpuBuffer* cpuvolumes = dynamic_cast<const CpuBuffer*>(volumes); ThrowIf(!cpuvolumes, "Invalid cpu buffer.");
+        CpuBuffer* cpuresults = dynamic_cast<CpuBuffer*>(results); ThrowIf(!cpuresults, "Invalid cpu buffer.");
+        CpuBuffer* cpucounts = dynamic_cast<CpuBuffer*>(counts); ThrowIf(!cpucounts, "Invalid cpu buffer.");
+
+        Submit([this, cpuvolumes, cpuresults, cpucounts, numqueries, volume, maxhits]()
+        {
+            void const* v = cpuvolumes->GetData();
+            Id* ids = static_cast<Id*>(cpuresults->GetData());
+            int* cnt = static_cast<int*>(cpucounts->GetData());
+
+            // Every query fills its own maxhits slots first
+            ParallelFor(numqueries, [this, v, ids, cnt, volume, maxhits](int begin, int end)
+            {
+                std::vector<std::pair<Id, Id>> prims;
+                float4 planes[6];
+
+                for (int i = begin; i < end; ++i)
+                {
+                    GetOverlapPlanes(v, i, volume, planes);
+
+                    prims.clear();
+                    Overlap(planes, prims);
+
+                    cnt[i] = std::min((int)prims.size(), maxhits);
+
+                    for (int j = 0; j < cnt[i]; ++j)
+                    {
+                        ids[2 * (i * maxhits + j)] = prims[j].first;
+                        ids[2 * (i * maxhits + j) + 1] = prims[j].second;
+                    }
+                }
+            });
+
+            // Then slots are packed, lists only move towards the front
+            int offset = 0;
+            for (int i = 0; i < numqueries; ++i)
+            {
+                if (offset != i * maxhits)
+                {
+                    std::memmove(ids + 2 * offset, ids + 2 * i * maxhits, 2 * cnt[i] * sizeof(Id));
+                }
+
+                offset += cnt[i];
+            }
+        }, waitevent, event);
+    }
+
+    bool CpuIntersectionDevice::IntersectFace(ray const& r, Face const& face, float maxt, float4& uvwt) const
+    {
+        float3 const& v1 = m_vertices[face.idx[0]];
+        float3 const& v3 = m_vertices[face.idx[2]];
+
+        float t, b1, b2;
+        bool hit = IntersectTriangle(r, v1, m_vertices[face.idx[1]], v3, maxt, t, b1, b2);
+
+        if (hit)
+        {
+            uvwt = float4(b1, b2, 0.f, t);
+            maxt = t;
+        }
+
+        if (face.cnt == 4 && IntersectTriangle(r, v1, v3, m_vertices[face.idx[3]], maxt, t, b1, b2))
+        {
+            uvwt = float4(b1, b2, 1.f, t);
+            hit = true;
+        }
+
+        return hit;
+    }
+
+    void CpuIntersectionDevice::IntersectClosest(ray const& r, Intersection& isect) const
+    {
+        isect.uvwt = float4(0.f, 0.f, 0.f, r.GetMaxT());
+        isect.shapeid = kNullId;
+        isect.primid = kNullId;
+
+        if (r.GetMaxT() < 0.f || m_nodes.empty())
+            return;
+
+        const __m128 o[3] = { _mm_set1_ps(r.o.x), _mm_set1_ps(r.o.y), _mm_set1_ps(r.o.z) };
+        const __m128 invdir[3] = { _mm_set1_ps(1.f / r.d.x), _mm_set1_ps(1.f / r.d.y), _mm_set1_ps(1.f / r.d.z) };
+
+        int const* nodemasks = m_node_masks.empty() ? nullptr : &m_node_masks[0];
+
+        int stack[kMaxStackSize];
+        int* sptr = stack;
+        *sptr++ = -1;
+
+        int idx = 0;
+        float tnear[4];
+
+        while (idx > -1)
+        {
+            QBvhTranslator::Node const& node = m_nodes[idx];
+
+            int hitmask = IntersectBox4(node, o, invdir, isect.uvwt.w, tnear) & VisibleChildren(nodemasks, idx, r.GetMask());
+
+            // Leaves are intersected right away, internal children
+            // still in range are sorted to be visited front to back
+            float dist[4];
+            int child[4];
+            int numchildren = 0;
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(hitmask & (1 << i)))
+                    continue;
+
+                if (node.count[i] > 0)
+                {
+                    for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+                    {
+                        Face const& face = m_faces[j];
+
+                        if (!(r.GetMask() & m_shapes[face.shapeidx].mask))
+                            continue;
+
+                        if (IntersectFace(r, face, isect.uvwt.w, isect.uvwt))
+                        {
+                            isect.primid = face.id;
+                            isect.shapeid = m_shapes[face.shapeidx].id;
+                        }
+                    }
+                }
+                else
+                {
+                    int k = numchildren++;
+                    for (; k > 0 && dist[k - 1] > tnear[i]; --k)
+                    {
+                        dist[k] = dist[k - 1];
+                        child[k] = child[k - 1];
+                    }
+
+                    dist[k] = tnear[i];
+                    child[k] = node.child[i];
+                }
+            }
+
+            // Drop children behind the closest hit found in this node
+            while (numchildren > 0 && dist[numchildren - 1] > isect.uvwt.w)
+            {
+                --numchildren;
+            }
+
+            if (numchildren > 0)
+            {
+                for (int i = numchildren - 1; i > 0; --i)
+                {
+                    *sptr++ = child[i];
+                }
+
+                idx = child[0];
+                continue;
+            }
+
+            idx = *--sptr;
+        }
+    }
+
+    bool CpuIntersectionDevice::IntersectAny(ray const& r) const
+    {
+        if (r.GetMaxT() < 0.f || m_nodes.empty())
+            return false;
+
+        const __m128 o[3] = { _mm_set1_ps(r.o.x), _mm_set1_ps(r.o.y), _mm_set1_ps(r.o.z) };
+        const __m128 invdir[3] = { _mm_set1_ps(1.f / r.d.x), _mm_set1_ps(1.f / r.d.y), _mm_set1_ps(1.f / r.d.z) };
+        const float maxt = r.GetMaxT();
+        int const* nodemasks = m_node_masks.empty() ? nullptr : &m_node_masks[0];
+
+        int stack[kMaxStackSize];
+        int* sptr = stack;
+        *sptr++ = -1;
+
+        int idx = 0;
+        float tnear[4];
+
+        while (idx > -1)
+        {
+            QBvhTranslator::Node const& node = m_nodes[idx];
+
+            int hitmask = IntersectBox4(node, o, invdir, maxt, tnear) & VisibleChildren(nodemasks, idx, r.GetMask());
+
+            // Any hit terminates traversal, so internal children are not sorted
+            int next = -1;
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(hitmask & (1 << i)))
+                    continue;
+
+                if (node.count[i] > 0)
+                {
+                    for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+                    {
+                        Face const& face = m_faces[j];
+
+                        if (!(r.GetMask() & m_shapes[face.shapeidx].mask))
+                            continue;
+
+                        float4 uvwt;
+                        if (IntersectFace(r, face, maxt, uvwt))
+                        {
+                            return true;
+                        }
+                    }
+                }
+                else
+                {
+                    if (next > -1)
+                    {
+                        *sptr++ = next;
+                    }
+
+                    next = node.child[i];
+                }
+            }
+
+            idx = next > -1 ? next : *--sptr;
+        }
+
+        return false;
+    }
+
+    int CpuIntersectionDevice::IntersectMulti(ray const& r, int k, Intersection* hits) const
+    {
+        if (r.GetMaxT() < 0.f || m_nodes.empty())
+            return 0;
+
+        const __m128 o[3] = { _mm_set1_ps(r.o.x), _mm_set1_ps(r.o.y), _mm_set1_ps(r.o.z) };
+        const __m128 invdir[3] = { _mm_set1_ps(1.f / r.d.x), _mm_set1_ps(1.f / r.d.y), _mm_set1_ps(1.f / r.d.z) };
+        int const* nodemasks = m_node_masks.empty() ? nullptr : &m_node_masks[0];
+
+        // Nodes are culled against the farthest hit once k hits are found
+        float maxt = r.GetMaxT();
+        int numhits = 0;
+
+        int stack[kMaxStackSize];
+        int* sptr = stack;
+        *sptr++ = -1;
+
+        int idx = 0;
+        float tnear[4];
+
+        while (idx > -1)
+        {
+            QBvhTranslator::Node const& node = m_nodes[idx];
+
+            int hitmask = IntersectBox4(node, o, invdir, maxt, tnear) & VisibleChildren(nodemasks, idx, r.GetMask());
+
+            // Front to back order fills the list with close hits early
+            float dist[4];
+            int child[4];
+            int numchildren = 0;
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(hitmask & (1 << i)))
+                    continue;
+
+                if (node.count[i] > 0)
+                {
+                    for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+                    {
+                        Face const& face = m_faces[j];
+
+                        if (!(r.GetMask() & m_shapes[face.shapeidx].mask))
+                            continue;
+
+                        Intersection hit;
+                        if (IntersectFace(r, face, maxt, hit.uvwt))
+                        {
+                            hit.primid = face.id;
+                            hit.shapeid = m_shapes[face.shapeidx].id;
+                            maxt = InsertHit(hits, numhits, k, hit, maxt);
+                        }
+                    }
+                }
+                else
+                {
+                    int c = numchildren++;
+                    for (; c > 0 && dist[c - 1] > tnear[i]; --c)
+                    {
+                        dist[c] = dist[c - 1];
+                        child[c] = child[c - 1];
+                    }
+
+                    dist[c] = tnear[i];
+                    child[c] = node.child[i];
+                }
+            }
+
+            while (numchildren > 0 && dist[numchildren - 1] > maxt)
+            {
+                --numchildren;
+            }
+
+            if (numchildren > 0)
+            {
+                for (int i = numchildren - 1; i > 0; --i)
+                {
+                    *sptr++ = child[i];
+                }
+
+                idx = child[0];
+                continue;
+            }
+
+            idx = *--sptr;
+        }
+
+        return numhits;
+    }
+
+    void CpuIntersectionDevice::ClosestPoint(float3 const& p, float maxdist, Intersection& result, std::vector<std::pair<float, int>>& queue) const
+    {
+        result = Intersection();
+
+        if (m_nodes.empty())
+            return;
+
+        const __m128 pos[3] = { _mm_set1_ps(p.x), _mm_set1_ps(p.y), _mm_set1_ps(p.z) };
+
+        // Nodes are visited in order of their distance to the point
+        // and the search stops once the closest one is farther than the best point
+        float best = maxdist * maxdist;
+        float b1, b2;
+        float distsq[4];
+        std::greater<std::pair<float, int>> farther;
+
+        queue.clear();
+        queue.push_back(std::make_pair(0.f, 0));
+
+        while (!queue.empty())
+        {
+            std::pop_heap(queue.begin(), queue.end(), farther);
+            std::pair<float, int> entry = queue.back();
+            queue.pop_back();
+
+            if (entry.first > best)
+                break;
+
+            QBvhTranslator::Node const& node = m_nodes[entry.second];
+            DistanceToBox4(node, pos, distsq);
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (node.count[i] == QBvhTranslator::kEmptySlot || distsq[i] > best)
+                    continue;
+
+                if (node.count[i] > 0)
+                {
+                    for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+                    {
+                        Face const& face = m_faces[j];
+
+                        float d = ClosestPointTriangle(p, m_vertices[face.idx[0]], m_vertices[face.idx[1]], m_vertices[face.idx[2]], b1, b2);
+                        float second = 0.f;
+
+                        if (face.cnt == 4)
+                        {
+                            float c1, c2;
+                            float d2 = ClosestPointTriangle(p, m_vertices[face.idx[0]], m_vertices[face.idx[2]], m_vertices[face.idx[3]], c1, c2);
+
+                            if (d2 < d)
+                            {
+                                d = d2; b1 = c1; b2 = c2; second = 1.f;
+                            }
+                        }
+
+                        if (d <= best)
+                        {
+                            best = d;
+                            result.uvwt = float4(b1, b2, second, d);
+                            result.primid = face.id;
+                            result.shapeid = m_shapes[face.shapeidx].id;
+                        }
+                    }
+                }
+                else
+                {
+                    queue.push_back(std::make_pair(distsq[i], node.child[i]));
+                    std::push_heap(queue.begin(), queue.end(), farther);
+                }
+            }
+        }
+
+        result.uvwt.w = std::sqrt(result.uvwt.w);
+    }
+
+    void CpuIntersectionDevice::Overlap(float4 const* planes, std::vector<std::pair<Id, Id>>& prims) const
+    {
+        if (m_nodes.empty())
+            return;
+
+        int stack[kMaxStackSize];
+        int* sptr = stack;
+        *sptr++ = -1;
+
+        int idx = 0;
+
+        while (idx > -1)
+        {
+            QBvhTranslator::Node const& node = m_nodes[idx];
+
+            int hitmask = OverlapBox4(node, planes);
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(hitmask & (1 << i)))
+                    continue;
+
+                if (node.count[i] > 0)
+                {
+                    for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+                    {
+                        Face const& face = m_faces[j];
+                        float3 const& v1 = m_vertices[face.idx[0]];
+                        float3 const& v2 = m_vertices[face.idx[1]];
+                        float3 const& v3 = m_vertices[face.idx[2]];
+                        float3 pmin = vmin(vmin(v1, v2), v3);
+                        float3 pmax = vmax(vmax(v1, v2), v3);
+
+                        if (face.cnt == 4)
+                        {
+                            pmin = vmin(pmin, m_vertices[face.idx[3]]);
+                            pmax = vmax(pmax, m_vertices[face.idx[3]]);
+                        }
+
+                        if (OverlapBounds(planes, pmin, pmax))
+                        {
+                            prims.push_back(std::make_pair(m_shapes[face.shapeidx].id, face.id));
+                        }
+                    }
+                }
+                else
+                {
+                    *sptr++ = node.child[i];
+                }
+            }
+
+            idx = *--sptr;
+        }
+
+        // Faces split by the builder are reported once
+        if (m_duplicate_faces)
+        {
+            std::sort(prims.begin(), prims.end());
+            prims.erase(std::unique(prims.begin(), prims.end()), prims.end());
+        }
+    }
+
+    void CpuIntersectionDevice::TraceClosest(ray const* r, int numrays, Intersection* isect) const
+    {
+        RayPacket packet;
+
+        for (int i = 0; i < numrays; i += m_packet_size)
+        {
+            int count = std::min(m_packet_size, numrays - i);
+
+            if (m_packet_size > 1 && packet.Init(r + i, count))
+            {
+                IntersectClosest(packet);
+
+                for (int k = 0; k < count; ++k)
+                {
+                    if (r[i + k].IsActive())
+                    {
+                        isect[i + k].uvwt = float4(packet.u[k], packet.v[k], packet.w[k], packet.t[k]);
+                        isect[i + k].shapeid = packet.shapeid[k];
+                        isect[i + k].primid = packet.primid[k];
+                    }
+                }
+
+                continue;
+            }
+
+            // Incoherent rays are faster to trace one by one
+            for (int k = i; k < i + count; ++k)
+            {
+                if (r[k].IsActive())
+                {
+                    IntersectClosest(r[k], isect[k]);
+                }
+            }
+        }
+    }
+
+    void CpuIntersectionDevice::TraceAny(ray const* r, int numrays, int* hits) const
+    {
+        RayPacket packet;
+
+        for (int i = 0; i < numrays; i += m_packet_size)
+        {
+            int count = std::min(m_packet_size, numrays - i);
+
+            if (m_packet_size > 1 && packet.Init(r + i, count))
+            {
+                IntersectAny(packet);
+
+                for (int k = 0; k < count; ++k)
+                {
+                    if (r[i + k].IsActive())
+                    {
+                        hits[i + k] = (packet.hit & (1 << k)) ? 1 : -1;
+                    }
+                }
+
+                continue;
+            }
+
+            // Incoherent rays are faster to trace one by one
+            for (int k = i; k < i + count; ++k)
+            {
+                if (r[k].IsActive())
+                {
+                    hits[k] = IntersectAny(r[k]) ? 1 : -1;
+                }
+            }
+        }
+    }
+
+    void CpuIntersectionDevice::TraceCompact(ray const* r, int begin, int end, QueryOutput output, void* hits) const
+    {
+        int count = end - begin;
+
+        if (output == kOcclusionMask)
+        {
+            // Inactive rays are not written by TraceAny and stay unoccluded
+            int occluded[TASK_SIZE];
+            std::fill(occluded, occluded + count, -1);
+            TraceAny(r + begin, count, occluded);
+
+            std::uint32_t* mask = static_cast<std::uint32_t*>(hits);
+            for (int i = 0; i < count; i += 32)
+            {
+                std::uint32_t bits = 0;
+                for (int k = i; k < std::min(i + 32, count); ++k)
+                {
+                    bits |= (occluded[k] > 0 ? 1u : 0u) << (k - i);
+                }
+
+                mask[(begin + i) / 32] = bits;
+            }
+
+            return;
+        }
+
+        // Default constructed intersections are misses, which inactive rays keep
+        Intersection isect[TASK_SIZE];
+        TraceClosest(r + begin, count, isect);
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (output == kHitDistance)
+            {
+                static_cast<float*>(hits)[begin + i] = isect[i].shapeid != kNullId ? isect[i].uvwt.w : -1.f;
+            }
+            else
+            {
+                static_cast<Id*>(hits)[2 * (begin + i)] = isect[i].shapeid;
+                static_cast<Id*>(hits)[2 * (begin + i) + 1] = isect[i].primid;
+            }
+        }
+    }
+
+    void CpuIntersectionDevice::IntersectLeaf(RayPacket& packet, int faceidx, int numprims, bool any) const
+    {
+        for (int i = faceidx; i < faceidx + numprims; ++i)
+        {
+            Face const& face = m_faces[i];
+            ShapeData const& shape = m_shapes[face.shapeidx];
+
+            float3 const& v1 = m_vertices[face.idx[0]];
+
+            // Quads are tested as (v0, v1, v2) and (v0, v2, v3)
+            for (int tri = 0; tri < face.cnt - 2; ++tri)
+            {
+                const float3 e1 = m_vertices[face.idx[tri + 1]] - v1;
+                const float3 e2 = m_vertices[face.idx[tri + 2]] - v1;
+
+                const __m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+                const __m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+                const __m128 zero = _mm_setzero_ps();
+                const __m128 one = _mm_set1_ps(1.f);
+
+                // Same math as IntersectTriangle, 4 rays at a time
+                for (int g = 0; g < packet.numlanes; g += 4)
+                {
+                    int lanes = packet.live >> g & 0xF;
+
+                    if (!lanes)
+                        continue;
+
+                    const __m128 dx = _mm_loadu_ps(packet.dx + g), dy = _mm_loadu_ps(packet.dy + g), dz = _mm_loadu_ps(packet.dz + g);
+
+                    const __m128 s1x = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+                    const __m128 s1y = _mm_sub_ps(_mm_mul_ps(e2x, dz), _mm_mul_ps(dx, e2z));
+                    const __m128 s1z = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+                    const __m128 invd = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, e1x), _mm_mul_ps(s1y, e1y)), _mm_mul_ps(s1z, e1z)));
+
+                    const __m128 px = _mm_sub_ps(_mm_loadu_ps(packet.ox + g), _mm_set1_ps(v1.x));
+                    const __m128 py = _mm_sub_ps(_mm_loadu_ps(packet.oy + g), _mm_set1_ps(v1.y));
+                    const __m128 pz = _mm_sub_ps(_mm_loadu_ps(packet.oz + g), _mm_set1_ps(v1.z));
+                    const __m128 b1 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, s1x), _mm_mul_ps(py, s1y)), _mm_mul_ps(pz, s1z)), invd);
+
+                    const __m128 s2x = _mm_sub_ps(_mm_mul_ps(py, e1z), _mm_mul_ps(e1y, pz));
+                    const __m128 s2y = _mm_sub_ps(_mm_mul_ps(e1x, pz), _mm_mul_ps(px, e1z));
+                    const __m128 s2z = _mm_sub_ps(_mm_mul_ps(px, e1y), _mm_mul_ps(py, e1x));
+                    const __m128 b2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, s2x), _mm_mul_ps(dy, s2y)), _mm_mul_ps(dz, s2z)), invd);
+                    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, s2x), _mm_mul_ps(e2y, s2y)), _mm_mul_ps(e2z, s2z)), invd);
+
+                    __m128 hit = _mm_and_ps(_mm_cmpge_ps(b1, zero), _mm_cmple_ps(b1, one));
+                    hit = _mm_and_ps(hit, _mm_cmpge_ps(b2, zero));
+                    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(b1, b2), one));
+                    hit = _mm_and_ps(hit, _mm_cmpge_ps(t, zero));
+                    hit = _mm_and_ps(hit, _mm_cmple_ps(t, _mm_loadu_ps(packet.t + g)));
+
+                    // Geometry mask has to share a bit with the ray mask
+                    const __m128i masked = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(packet.mask + g)), _mm_set1_epi32(shape.mask)), _mm_setzero_si128());
+                    int bits = _mm_movemask_ps(_mm_andnot_ps(_mm_castsi128_ps(masked), hit)) & lanes;
+
+                    if (!bits)
+                        continue;
+
+                    if (any)
+                    {
+                        packet.hit |= bits << g;
+                        packet.live &= ~(bits << g);
+                        continue;
+                    }
+
+                    float tt[4], bb1[4], bb2[4];
+                    _mm_storeu_ps(tt, t);
+                    _mm_storeu_ps(bb1, b1);
+                    _mm_storeu_ps(bb2, b2);
+
+                    for (int k = 0; k < 4; ++k)
+                    {
+                        if (bits & (1 << k))
+                        {
+                            packet.t[g + k] = tt[k];
+                            packet.u[g + k] = bb1[k];
+                            packet.v[g + k] = bb2[k];
+                            packet.w[g + k] = static_cast<float>(tri);
+                            packet.primid[g + k] = face.id;
+                            packet.shapeid[g + k] = shape.id;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void CpuIntersectionDevice::IntersectClosest(RayPacket& packet) const
+    {
+        if (m_nodes.empty())
+            return;
+
+        int const* nodemasks = m_node_masks.empty() ? nullptr : &m_node_masks[0];
+
+        int stack[kMaxStackSize];
+        int* sptr = stack;
+        *sptr++ = -1;
+
+        int idx = 0;
+
+        while (idx > -1)
+        {
+            QBvhTranslator::Node const& node = m_nodes[idx];
+
+            // Early out if no ray in the packet can hit any of the children,
+            // the interval entry distances order the children and cull them against the hits
+            float childdist[4];
+            int childmask = packet.IntersectInterval4(node, packet.MaxT(), childdist);
+
+            // Children are visited by the whole packet once any ray hits them,
+            // groups of 4 rays are tested until each child is either hit or missed by all of them
+            int visit = 0;
+
+            for (int g = 0; visit != childmask && g < packet.numlanes; g += 4)
+            {
+                if (packet.live >> g & 0xF)
+                {
+                    visit |= packet.IntersectChildren4(node, g, childmask & ~visit, nodemasks ? nodemasks + 4 * idx : nullptr);
+                }
+            }
+
+            float dist[4];
+            int child[4];
+            int numchildren = 0;
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(visit & (1 << i)))
+                    continue;
+
+                if (node.count[i] > 0)
+                {
+                    IntersectLeaf(packet, node.child[i], node.count[i], false);
+                }
+                else
+                {
+                    int k = numchildren++;
+                    for (; k > 0 && dist[k - 1] > childdist[i]; --k)
+                    {
+                        dist[k] = dist[k - 1];
+                        child[k] = child[k - 1];
+                    }
+
+                    dist[k] = childdist[i];
+                    child[k] = node.child[i];
+                }
+            }
+
+            // Drop children behind the hits found in this node
+            float maxt = packet.MaxT();
+            while (numchildren > 0 && dist[numchildren - 1] > maxt)
+            {
+                --numchildren;
+            }
+
+            if (numchildren > 0)
+            {
+                for (int i = numchildren - 1; i > 0; --i)
+                {
+                    *sptr++ = child[i];
+                }
+
+                idx = child[0];
+                continue;
+            }
+
+            idx = *--sptr;
+        }
+    }
+
+    void CpuIntersectionDevice::IntersectAny(RayPacket& packet) const
+    {
+        if (m_nodes.empty())
+            return;
+
+        int const* nodemasks = m_node_masks.empty() ? nullptr : &m_node_masks[0];
+
+        int stack[kMaxStackSize];
+        int* sptr = stack;
+        *sptr++ = -1;
+
+        int idx = 0;
+        float tnear[4];
+
+        // Traversal stops once every ray has found a hit
+        while (idx > -1 && packet.live)
+        {
+            QBvhTranslator::Node const& node = m_nodes[idx];
+
+            int childmask = packet.IntersectInterval4(node, packet.MaxT(), tnear);
+            int visit = 0;
+
+            for (int g = 0; visit != childmask && g < packet.numlanes; g += 4)
+            {
+                if (packet.live >> g & 0xF)
+                {
+                    visit |= packet.IntersectChildren4(node, g, childmask & ~visit, nodemasks ? nodemasks + 4 * idx : nullptr);
+                }
+            }
+
+            int next = -1;
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(visit & (1 << i)))
+                    continue;
+
+                if (node.count[i] > 0)
+                {
+                    IntersectLeaf(packet, node.child[i], node.count[i], true);
+                }
+                else
+                {
+                    if (next > -1)
+                    {
+                        *sptr++ = next;
+                    }
+
+                    next = node.child[i];
+                }
+            }
+
+            idx = next > -1 ? next : *--sptr;
+        }
+    }
+}
@@ -0,0 +1,134 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+#include "../translator/qbvh_translator.h"
+#include "../async/thread_pool.h"
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class represents native CPU intersection device.
+    ///< Scene BVH is collapsed into 4-wide nodes which are traversed with
+    ///< SSE box tests, rays are distributed across all hardware threads.
+    ///< Instances are flattened into world space geometry.
+    ///<
+    class CpuIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        //
+        CpuIntersectionDevice();
+        ~CpuIntersectionDevice();
+
+        //IntersectionDevice
+        void Preprocess(World const& world) override;
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        void DeleteBuffer(Buffer* const) const override;
+        void DeleteEvent(Event* const) const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const override;
+
+    protected:
+        struct Face
+        {
+            // Indices into world space vertex array, idx[3] is only used by quads
+            int idx[4];
+            // Shape index
+            int shapeidx;
+            // Primitive ID within the mesh
+            int id;
+            // Index count: 3 for triangles, 4 for quads
+            int cnt;
+        };
+
+        struct ShapeData
+        {
+            // Shape ID
+            Id id;
+            // Geometry mask
+            int mask;
+        };
+
+        struct RayPacket;
+
+        // Split [0, numrays) range into tasks and run them on the thread pool
+        void ParallelFor(int numrays, std::function<void(int, int)> const& task) const;
+        // Run task on the thread pool once waitevent is complete
+        void Submit(std::function<void()>&& task, Event const* waitevent, Event** event) const;
+
+        // Trace a range of rays, coherent groups go as packets, the rest one by one
+        void TraceClosest(ray const* r, int numrays, Intersection* isect) const;
+        void TraceAny(ray const* r, int numrays, int* hits) const;
+        // Trace rays [begin, end) and write the compact output, begin has to be a multiple of 32
+        void TraceCompact(ray const* r, int begin, int end, QueryOutput output, void* hits) const;
+
+        // Intersect the face closer than maxt, quads are split into (v0, v1, v2) and (v0, v2, v3)
+        // and hits on the second triangle have uvwt.z set to 1
+        bool IntersectFace(ray const& r, Face const& face, float maxt, float4& uvwt) const;
+        void IntersectClosest(ray const& r, Intersection& isect) const;
+        bool IntersectAny(ray const& r) const;
+        // Find up to k closest hits sorted by distance, returns the number of hits found
+        int IntersectMulti(ray const& r, int k, Intersection* hits) const;
+        // Best-first search of the closest surface point within maxdist, queue is scratch space
+        void ClosestPoint(float3 const& p, float maxdist, Intersection& result, std::vector<std::pair<float, int>>& queue) const;
+        // Append (shapeid, primid) of the primitives overlapping all 6 planes to prims
+        void Overlap(float4 const* planes, std::vector<std::pair<Id, Id>>& prims) const;
+        void IntersectClosest(RayPacket& packet) const;
+        void IntersectAny(RayPacket& packet) const;
+        void IntersectLeaf(RayPacket& packet, int faceidx, int numprims, bool any) const;
+
+        // Collapsed BVH
+        std::vector<QBvhTranslator::Node> m_nodes;
+        // Geometry masks of node children, empty if no shape is masked out
+        std::vector<int> m_node_masks;
+        // World space vertices
+        std::vector<float3> m_vertices;
+        // Faces in BVH order
+        std::vector<Face> m_faces;
+        std::vector<ShapeData> m_shapes;
+        // Split BVH references some faces from several leaves
+        bool m_duplicate_faces;
+
+        // Number of rays traced together, 1 disables packets
+        int m_packet_size;
+
+        // Thread pool to process ray batches
+        mutable thread_pool<void> m_pool;
+    };
+}
@@ -22,8 +22,13 @@ THE SOFTWARE.
 #include "embree_intersection_device.h"
 
 #include <iostream>
-#include <future>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <algorithm>
 #include "../world/world.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
@@ -35,16 +40,18 @@ THE SOFTWARE.
 #include "embree2/rtcore_ray.h"
 #include "../async/thread_pool.h"
 
+#include <cstdint>
+#include <limits>
 #include <xmmintrin.h>
 #include <pmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
 
 //count of elements for one thread pool task
 #define TASK_SIZE 256
 
-//switch between rtcIntersect4 and rtcIntercetN
-//#define INTERSECTN
-
-
 namespace RadeonRays
 {
     //simple RadeonRays::Buffer implementation
@@ -78,107 +85,306 @@ namespace RadeonRays
         void* m_data;
     };
 
-    //simple RadeonRays::Event implementation
+    //RadeonRays::Event implementation backed by a completion counter.
+    //Queries are split into pool tasks and the last finished task completes the event
+    //and starts the queries which were waiting for it
     class EmbreeEvent : public Event
     {
     public:
-        EmbreeEvent(std::function<void()>&& f)
-            : m_ftr()
+        explicit EmbreeEvent(int numtasks)
+            : m_remaining(numtasks)
         {
-            std::packaged_task<void()> task(std::move(f));
-            m_ftr = task.get_future();
-            std::thread(std::move(task)).detach();
         }
 
         virtual ~EmbreeEvent()
         {
-            Wait();
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_remaining == 0; });
         }
 
         virtual bool Complete() const
         {
-            return m_ftr.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            return m_remaining == 0;
         }
 
         virtual void Wait()
         {
-            m_ftr.wait();
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_remaining == 0; });
+
+            if (m_error)
+                std::rethrow_exception(m_error);
+        }
+
+        //run f once the event is complete, right away if it already is
+        void Then(std::function<void()> const& f)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_remaining > 0)
+                {
+                    m_continuations.push_back(f);
+                    return;
+                }
+            }
+
+            f();
+        }
+
+        //register tasks of a launch, has to be called before the launch itself is done
+        void AddTasks(int numtasks)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_remaining += numtasks;
+        }
+
+        //called by every finished task, error is kept for Wait
+        void TaskDone(std::exception_ptr error)
+        {
+            std::vector<std::function<void()> > continuations;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (error && !m_error)
+                    m_error = error;
+
+                if (--m_remaining > 0)
+                    return;
+
+                continuations.swap(m_continuations);
+                m_cv.notify_all();
+            }
+
+            //the event might be deleted from here on
+            for (auto& f : continuations)
+                f();
         }
+
     private:
-        std::future<void> m_ftr;
+        std::atomic<int> m_remaining;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::vector<std::function<void()> > m_continuations;
+        std::exception_ptr m_error;
+    };
+
+    //either hand the event over to the caller or block until it is done
+    static void ReturnEvent(EmbreeEvent* ev, Event** event)
+    {
+        if (event)
+        {
+            *event = ev;
+        }
+        else
+        {
+            std::unique_ptr<EmbreeEvent> owner(ev);
+            ev->Wait();
+        }
+    }
+
+    void EmbreeIntersectionDevice::Submit(int count, std::function<void(int, int)>&& task, Event const* waitevent, Event** event) const
+    {
+        Submit([count]() { return count; }, std::move(task), waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::Submit(std::function<int()>&& getcount, std::function<void(int, int)>&& task, Event const* waitevent, Event** event) const
+    {
+        //the launch itself is a task, so the event can't complete before the chunks are known
+        EmbreeEvent* ev = new EmbreeEvent(1);
+        {
+            std::lock_guard<std::mutex> lock(m_query_mutex);
+            ++m_num_queries;
+        }
+        ev->Then([this]() { QueryDone(); });
+
+        auto shared_task = std::make_shared<std::function<void(int, int)> >(std::move(task));
+        auto shared_count = std::make_shared<std::function<int()> >(std::move(getcount));
+        thread_pool<void>* pool = &m_pool;
+
+        auto launch = [pool, ev, shared_task, shared_count]()
+        {
+            int count = 0;
+            try
+            {
+                count = (*shared_count)();
+            }
+            catch (...)
+            {
+                ev->TaskDone(std::current_exception());
+                return;
+            }
+
+            ev->AddTasks((count + TASK_SIZE - 1) / TASK_SIZE);
+            for (int i = 0; i < count; i += TASK_SIZE)
+            {
+                int end = std::min(i + TASK_SIZE, count);
+                pool->post([ev, shared_task, i, end]()
+                {
+                    std::exception_ptr error;
+                    try
+                    {
+                        (*shared_task)(i, end);
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+                    ev->TaskDone(error);
+                });
+            }
+
+            ev->TaskDone(nullptr);
+        };
+
+        //queries waiting for an embree event are started by the task which completes it,
+        //other events are waited for here, so they never block a worker
+        EmbreeEvent* dependency = dynamic_cast<EmbreeEvent*>(const_cast<Event*>(waitevent));
+        if (dependency)
+        {
+            dependency->Then(launch);
+        }
+        else
+        {
+            if (waitevent)
+                const_cast<Event*>(waitevent)->Wait();
+
+            launch();
+        }
+
+        ReturnEvent(ev, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryDone() const
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+        if (--m_num_queries == 0)
+            m_query_cv.notify_all();
+    }
+
+    //embree packet type and traversal calls of each packet width
+    template <int N> struct EmbreePacket;
+
+    template <> struct EmbreePacket<4>
+    {
+        typedef RTCRay4 Ray;
+        static void Intersect(const int* valid, RTCScene scene, Ray& ray) { rtcIntersect4(valid, scene, ray); }
+        static void Occluded(const int* valid, RTCScene scene, Ray& ray) { rtcOccluded4(valid, scene, ray); }
+    };
+
+    template <> struct EmbreePacket<8>
+    {
+        typedef RTCRay8 Ray;
+        static void Intersect(const int* valid, RTCScene scene, Ray& ray) { rtcIntersect8(valid, scene, ray); }
+        static void Occluded(const int* valid, RTCScene scene, Ray& ray) { rtcOccluded8(valid, scene, ray); }
     };
 
+    template <> struct EmbreePacket<16>
+    {
+        typedef RTCRay16 Ray;
+        static void Intersect(const int* valid, RTCScene scene, Ray& ray) { rtcIntersect16(valid, scene, ray); }
+        static void Occluded(const int* valid, RTCScene scene, Ray& ray) { rtcOccluded16(valid, scene, ray); }
+    };
+
+    //true if the CPU can run packets of the given width natively
+    static bool CpuSupportsPacket(int width)
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        //AVX and OS saved YMM state
+        bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 0x6) == 0x6;
+        if (width <= 8)
+            return width <= 4 || avx;
+        //AVX-512F and OS saved ZMM state
+        __cpuidex(info, 7, 0);
+        return avx && (info[1] & (1 << 16)) && (_xgetbv(0) & 0xe6) == 0xe6;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        if (width <= 4)
+            return true;
+        return width <= 8 ? __builtin_cpu_supports("avx") != 0 : __builtin_cpu_supports("avx512f") != 0;
+#else
+        return width <= 4;
+#endif
+    }
+
+    //widest packet supported by both embree build and CPU
+    static int GetMaxPacketWidth(RTCDevice device)
+    {
+        if (rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT16) && CpuSupportsPacket(16))
+            return 16;
+        if (rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT8) && CpuSupportsPacket(8))
+            return 8;
+        return 4;
+    }
+
     EmbreeIntersectionDevice::EmbreeIntersectionDevice()
-        : m_pool(1)
+        : m_num_queries(0)
     {
         m_device = rtcNewDevice(nullptr);
         RTCError result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree rtcDevice: " << result << std::endl;
 
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
+        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_DYNAMIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
         result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree scene: " << result << std::endl;
+
+        m_max_packet_width = GetMaxPacketWidth(m_device);
+        m_packet_width = m_max_packet_width;
     }
     
     EmbreeIntersectionDevice::~EmbreeIntersectionDevice()
     {
+        //queries still in flight use the scenes, so they have to finish before anything is deleted
+        {
+            std::unique_lock<std::mutex> lock(m_query_mutex);
+            m_query_cv.wait(lock, [this]() { return m_num_queries == 0; });
+        }
+
+        //instances go before the mesh scenes they reference
+        if (m_scene)
+        {
+            rtcDeleteScene(m_scene);
+            m_scene = nullptr;
+        }
+
+        for (auto& mesh : m_meshes)
+            rtcDeleteScene(mesh.second.scene);
+        m_meshes.clear();
+        m_instances.clear();
+
         if (m_device)
         {
             rtcDeleteDevice(m_device);
             m_device = nullptr;
         }
-
     }
 
     void EmbreeIntersectionDevice::Preprocess(World const& world)
     {
+        auto packetwidth = world.options_.GetOption("embree.packet_width");
+        int width = packetwidth ? (int)packetwidth->AsFloat() : 0;
+        ThrowIf(width != 0 && width != 4 && width != 8 && width != 16, "embree.packet_width should be 0, 4, 8 or 16");
+        //widths the embree build or the CPU doesn't support fall back to the widest supported one
+        m_packet_width = (width == 0 || width > m_max_packet_width) ? m_max_packet_width : width;
+
         for (auto& it : m_instances)
             it.second.updated = false;
 
-        //checking removed shapes
-        for (auto it = world.shapes_.begin(); it != world.shapes_.end(); ++it)
+        //m_scene persists between commits, only instances of new or changed shapes are touched
+        for (auto i : world.shapes_)
         {
-            auto& i = *it;
             const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
-            if (m_instances.count(shape))
-                m_instances[shape].updated = true;
-        }
+            ThrowIf(!shape, "Invalid shape.");
 
-        //cleanup not updated instances
-        auto itr = m_instances.begin();
-        while (itr != m_instances.end())
-        {
-            if (!itr->second.updated)
+            auto found = m_instances.find(shape);
+            if (found != m_instances.end())
             {
-                //if no instances left => clear stored mesh
-                auto& mesh = m_meshes[itr->first];
-                ThrowIf(mesh.instance_count <= 0, "Invalid embree mesh");
-                --mesh.instance_count;
-                if (mesh.instance_count == 0)
-                {
-                    rtcDeleteScene(itr->second.scene);
-                    CheckEmbreeError();
-                    m_meshes.erase(itr->first);
-                }
-                itr = m_instances.erase(itr);
+                found->second.updated = true;
+                UpdateShape(shape);
+                continue;
             }
-            else
-            {
-                ++itr;
-            }
-        }
-        m_instances.clear();
-        rtcDeleteScene(m_scene); CheckEmbreeError();
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN); CheckEmbreeError();
 
-        for (auto i : world.shapes_)
-        {
-            const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
-            ThrowIf(!shape, "Invalid shape.");
-
-            //update only if shape already precessed before
             EmbreeSceneData& data = m_instances[shape];
             data.mesh_id = shape->GetId();
             data.updated = true;
@@ -186,20 +392,19 @@ namespace RadeonRays
             //for each new Shape creating new embree scene with geometry
             //and adding its instance to m_scene
             const Mesh* mesh = dynamic_cast<const Mesh*> (shape);
-            if (mesh)
-            {
-                data.scene = GetEmbreeMesh(mesh);
-            }
-            else // instance
+            if (!mesh) // instance
             {
                 const Instance* inst = dynamic_cast<const Instance*> (shape);
                 ThrowIf(!inst, "Invalid shape.");
                 mesh = dynamic_cast<const Mesh*> (inst->GetBaseShape());
                 ThrowIf(!mesh, "Invalid mesh.");
-                //adding mesh of instance if it's not being processed before
-                data.scene = GetEmbreeMesh(mesh);
-                ++m_meshes[mesh].instance_count;
             }
+            //adding mesh if it's not being processed before
+            data.scene = GetEmbreeMesh(mesh);
+            data.mesh = mesh;
+            ++m_meshes[mesh].instance_count;
+
+            data.faces = m_meshes[mesh].faces.empty() ? nullptr : &m_meshes[mesh].faces;
 
             unsigned geom = rtcNewInstance(m_scene, data.scene);
             CheckEmbreeError();
@@ -213,11 +418,94 @@ namespace RadeonRays
             CheckEmbreeError();
 
             data.geom = geom;
+        }
+
+        //cleanup instances of detached shapes, their meshes are deleted once m_scene no longer references them
+        std::vector<RTCScene> unused;
+        auto itr = m_instances.begin();
+        while (itr != m_instances.end())
+        {
+            if (!itr->second.updated)
+            {
+                rtcDeleteGeometry(m_scene, itr->second.geom);
+                CheckEmbreeError();
 
+                //if no instances left => clear stored mesh
+                auto& mesh = m_meshes[itr->second.mesh];
+                ThrowIf(mesh.instance_count <= 0, "Invalid embree mesh");
+                --mesh.instance_count;
+                if (mesh.instance_count == 0)
+                {
+                    unused.push_back(mesh.scene);
+                    m_meshes.erase(itr->second.mesh);
+                }
+                itr = m_instances.erase(itr);
+            }
+            else
+            {
+                ++itr;
+            }
         }
 
+        //mesh scenes are untouched, commit only rebuilds the top level over the instances
         rtcCommit(m_scene);
         CheckEmbreeError();
+
+        for (auto scene : unused)
+        {
+            rtcDeleteScene(scene);
+            CheckEmbreeError();
+        }
+    }
+
+    //rays are converted one packet at a time right before traversal, so a task's rays stay in cache
+    template <int N>
+    void EmbreeIntersectionDevice::IntersectPackets(const ray* src_ray, Intersection* hit, int count) const
+    {
+        typename EmbreePacket<N>::Ray data;
+        for (int i = 0; i < count; i += N)
+        {
+            int rays_count = (i + N) < count ? N : count - i; // count of valid rays
+            RTCORE_ALIGN(64) int valid[N] = {}; //disable all rays
+            for (int j = 0; j < rays_count; ++j)
+            {
+                valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
+                FillRTCRay(data, j, src_ray[i + j]);
+            }
+            for (int j = rays_count; j < N; ++j)
+                ResetRTCRay(data, j);
+            EmbreePacket<N>::Intersect(valid, m_scene, data); CheckEmbreeError();
+            for (int j = 0; j < rays_count; ++j)
+                FillIntersection(hit[i + j], data, j);
+        }
+    }
+
+    template <int N>
+    void EmbreeIntersectionDevice::OccludePackets(const ray* src_ray, int* hit, int count) const
+    {
+        typename EmbreePacket<N>::Ray data;
+        for (int i = 0; i < count; i += N)
+        {
+            int rays_count = (i + N) < count ? N : count - i; // count of valid rays
+            RTCORE_ALIGN(64) int valid[N] = {}; //disable all rays
+            for (int j = 0; j < rays_count; ++j)
+            {
+                valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
+                FillRTCRay(data, j, src_ray[i + j]);
+            }
+            for (int j = rays_count; j < N; ++j)
+                ResetRTCRay(data, j);
+            EmbreePacket<N>::Occluded(valid, m_scene, data); CheckEmbreeError();
+            for (int j = 0; j < rays_count; ++j)
+            {
+                if (data.instID[j] == RTC_INVALID_GEOMETRY_ID || data.geomID[j] == RTC_INVALID_GEOMETRY_ID)
+                {
+                    hit[i + j] = RTC_INVALID_GEOMETRY_ID;
+                    continue;
+                }
+                hit[i + j] = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, data.instID[j]))->mesh_id;
+            }
+        }
     }
 
     Buffer* EmbreeIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
@@ -237,7 +525,6 @@ namespace RadeonRays
 
     void EmbreeIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
         if (data)
         {
             EmbreeBuffer* buf = dynamic_cast<EmbreeBuffer*>(buffer);
@@ -245,254 +532,378 @@ namespace RadeonRays
             *data = buf->GetData();
         }
 
-        if (event)
-        {
-            *event = ev;
-        }
-        else
-        {
-            ev->Wait();
-            DeleteEvent(ev);
-        }
+        //host memory is always mapped, the event is complete right away
+        ReturnEvent(new EmbreeEvent(0), event);
     }
 
     void EmbreeIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
+        ReturnEvent(new EmbreeEvent(0), event);
+    }
+    
 
-        if (event)
+    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+
+        //processing buffers workflow, each task:
+        //1. convert RadeonRays::ray to RTCRay
+        //2. rtcIntersect
+        //3. convert RTCRay hit result to RadeonRays::Intersection
+        Submit(numrays, [this, fireRays, fireHits](int begin, int end)
         {
-            *event = ev;
-        }
-        else
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[begin];
+            int count = end - begin;
+            switch (m_packet_width)
+            {
+            case 16: IntersectPackets<16>(src_ray, hit, count); break;
+            case 8: IntersectPackets<8>(src_ray, hit, count); break;
+            default: IntersectPackets<4>(src_ray, hit, count); break;
+            }
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+
+        //processing buffers workflow, each task:
+        //1. convert RadeonRays::ray to RTCRay
+        //2. rtcOccluded
+        //3. convert RTCRay hit result
+        Submit(numrays, [this, fireRays, fireHits](int begin, int end)
         {
-            ev->Wait();
-            DeleteEvent(ev);
-        }
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            int* hit = &static_cast<int*>(fireHits->GetData())[begin];
+            int count = end - begin;
+            switch (m_packet_width)
+            {
+            case 16: OccludePackets<16>(src_ray, hit, count); break;
+            case 8: OccludePackets<8>(src_ray, hit, count); break;
+            default: OccludePackets<4>(src_ray, hit, count); break;
+            }
+        }, waitevent, event);
     }
-    
 
-    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    //ray count of an indirect query, read once the awaited work which might produce it is done
+    static std::function<int()> IndirectCount(Buffer const* numrays, int maxrays)
+    {
+        const EmbreeBuffer* fireCount = dynamic_cast<const EmbreeBuffer*>(numrays); ThrowIf(!fireCount, "Invalid embree buffer.");
+        return [fireCount, maxrays]()
+        {
+            return std::max(std::min(*static_cast<const int*>(fireCount->GetData()), maxrays), 0);
+        };
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
         EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]() 
-        {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcIntersect
-            //3. convert RTCRay hit result to RadeonRays::Intersection
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
-#ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+        //only live rays are split into tasks, the rest of maxrays is never touched
+        Submit(IndirectCount(numrays, maxrays), [this, fireRays, fireHits](int begin, int end)
+        {
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[begin];
+            switch (m_packet_width)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+            case 16: IntersectPackets<16>(src_ray, hit, end - begin); break;
+            case 8: IntersectPackets<8>(src_ray, hit, end - begin); break;
+            default: IntersectPackets<4>(src_ray, hit, end - begin); break;
+            }
+        }, waitevent, event);
+    }
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
-                {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i+=4)
-                    {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0,}; //disable all rays
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i+j]);
-                        }
-                        rtcIntersect4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                            FillIntersection(hit[i+j], data, j);
-                    }
-                }))));
+    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+
+        Submit(IndirectCount(numrays, maxrays), [this, fireRays, fireHits](int begin, int end)
+        {
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[begin];
+            int* hit = &static_cast<int*>(fireHits->GetData())[begin];
+            switch (m_packet_width)
+            {
+            case 16: OccludePackets<16>(src_ray, hit, end - begin); break;
+            case 8: OccludePackets<8>(src_ray, hit, end - begin); break;
+            default: OccludePackets<4>(src_ray, hit, end - begin); break;
             }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::TraceCompact(const ray* src_ray, int begin, int end, QueryOutput output, void* dst) const
+    {
+        RTCRay4 data;
+        std::uint32_t bits = 0;
+        for (int j = begin; j < end; j += 4)
+        {
+            int rays_count = (j + 4) < end ? 4 : end - j; // count of valid rays
+            RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0, }; //disable all rays
+            for (int k = 0; k < 4; ++k)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
-                {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+                // Unused lanes repeat the first ray and stay disabled
+                int idx = k < rays_count ? j + k : j;
+                valid[k] = k < rays_count && src_ray[idx].IsActive() ? -1 : 0;
+                FillRTCRay(data, k, src_ray[idx]);
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcIntersectN(m_scene, &data[0], numrays, sizeof(RTCRay));
-            CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+
+            if (output == kOcclusionMask)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* src_hit = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+                rtcOccluded4(valid, m_scene, data); CheckEmbreeError();
+            }
+            else
+            {
+                rtcIntersect4(valid, m_scene, data); CheckEmbreeError();
+            }
+
+            for (int k = 0; k < rays_count; ++k)
+            {
+                bool hit = valid[k] && data.geomID[k] != RTC_INVALID_GEOMETRY_ID;
 
-                jobs.push_back(std::move(m_pool.submit([this, hit, src_hit, src_ray, count]()
+                if (output == kOcclusionMask)
+                {
+                    bits |= (hit ? 1u : 0u) << ((j + k) % 32);
+
+                    // TASK_SIZE is a multiple of 32, so words are never shared between tasks
+                    if ((j + k) % 32 == 31 || j + k == end - 1)
+                    {
+                        static_cast<std::uint32_t*>(dst)[(j + k) / 32] = bits;
+                        bits = 0;
+                    }
+                }
+                else if (output == kHitDistance)
                 {
-                    for (int i = 0; i < count; ++i)
-                        if (src_ray[i].IsActive())
-                        {
-                            FillIntersection(hit[i], src_hit[i]);
-                        }
-                })));
+                    static_cast<float*>(dst)[j + k] = hit ? data.tfar[k] : -1.f;
+                }
+                else
+                {
+                    const EmbreeSceneData* instance = hit ? static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, data.instID[k])) : nullptr;
+                    static_cast<Id*>(dst)[2 * (j + k)] = hit ? instance->mesh_id : kNullId;
+                    static_cast<Id*>(dst)[2 * (j + k) + 1] = hit ? instance->GetFace(data.primID[k]) : kNullId;
+                }
             }
-            
-#endif // INTERSECTN
+        }
+    }
 
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
-        });
+    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
-        if (event)
+        Submit(numrays, [this, fireRays, fireHits, output](int begin, int end)
         {
-            *event = ev;
-        }
-        else
-        {
-            ev->Wait();
-            DeleteEvent(ev);
-        }
+            TraceCompact(static_cast<const ray*>(fireRays->GetData()), begin, end, output, fireHits->GetData());
+        }, waitevent, event);
     }
 
-    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        QueryIntersection(rays, numrays, hits, output, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
     {
         const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
         EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]()
-        {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcOccluded
-            //3. convert RTCRay hit result
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
-#ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
+        Submit(IndirectCount(numrays, maxrays), [this, fireRays, fireHits, output](int begin, int end)
+        {
+            TraceCompact(static_cast<const ray*>(fireRays->GetData()), begin, end, output, fireHits->GetData());
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        QueryIntersection(rays, numrays, maxrays, hits, output, waitevent, event);
+    }
+
+    // Data of an optional embree buffer, nullptr if there is no buffer
+    template <typename T>
+    static T* GetData(Buffer const* buffer)
+    {
+        if (!buffer)
+        {
+            return nullptr;
+        }
+
+        const EmbreeBuffer* fireBuffer = dynamic_cast<const EmbreeBuffer*>(buffer); ThrowIf(!fireBuffer, "Invalid embree buffer.");
+        return static_cast<T*>(const_cast<void*>(fireBuffer->GetData()));
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(!rays.origins || !rays.directions, "Ray origins and directions are required.");
+        RayPlanes planes = { GetData<float const>(rays.origins), GetData<float const>(rays.directions), GetData<float const>(rays.maxt), GetData<int const>(rays.masks) };
+
+        float* t = GetData<float>(hits.t);
+        Id* primids = GetData<Id>(hits.primids);
+        Id* shapeids = GetData<Id>(hits.shapeids);
+        float* uvs = GetData<float>(hits.uvs);
 
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+        Submit(numrays, [this, planes, numrays, t, primids, shapeids, uvs](int i, int end)
+        {
+            //SoA planes are copied into RTCRay4 4 rays at a time and results are copied back the same way
+            int count = end - i;
+            RTCRay4 data;
+            for (int j = i; j < i + count; j += 4)
+            {
+                int rays_count = (j + 4) < i + count ? 4 : i + count - j; // count of valid rays
+                RTCORE_ALIGN(16) int valid[4];
+                FillRTCRay(data, planes, numrays, j, rays_count, valid);
+                rtcIntersect4(valid, m_scene, data); CheckEmbreeError();
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
+                for (int k = 0; k < rays_count; ++k)
                 {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i += 4)
+                    Id shapeid = data.instID[k];
+                    Id primid = data.primID[k];
+                    if (shapeid != RTC_INVALID_GEOMETRY_ID)
                     {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0, }; //disable all rays
-                        for (int j = 0; j < 4; ++j)
-                        {
-                            data.orgx[j] = 0;
-                            data.orgy[j] = 0;
-                            data.orgz[j] = 0;
-
-                            data.dirx[j] = 0;
-                            data.diry[j] = 0;
-                            data.dirz[j] = 0;
-
-                            data.tnear[j] = 0;
-                            data.tfar[j] = 0;
-                            data.geomID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.primID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.instID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.time[j] = 0;
-                            data.mask[j] = 0xFFFFFF;
-                        }
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i + j]);
-                        }
-                        rtcOccluded4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            if (data.instID[j] == RTC_INVALID_GEOMETRY_ID || data.geomID[j] == RTC_INVALID_GEOMETRY_ID)
-                            {
-                                hit[i + j] = RTC_INVALID_GEOMETRY_ID;
-                                continue;
-                            }
-                            hit[i + j] = data.instID[j];
-                            EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i + j]));
-                            hit[i + j] = data->mesh_id;
-                        }
+                        const EmbreeSceneData* instance = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, shapeid));
+                        shapeid = instance->mesh_id;
+                        primid = instance->GetFace(primid);
                     }
-                }))));
-            }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
+
+                    if (shapeids) shapeids[j + k] = shapeid;
+                    if (primids) primids[j + k] = primid;
+                }
+
+                if (t) memcpy(t + j, data.tfar, rays_count * sizeof(float));
+                if (uvs)
                 {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+                    memcpy(uvs + j, data.u, rays_count * sizeof(float));
+                    memcpy(uvs + numrays + j, data.v, rays_count * sizeof(float));
+                }
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcOccludedN(m_scene, &data[0], numrays, sizeof(RTCRay));
-            CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(!rays.origins || !rays.directions, "Ray origins and directions are required.");
+        RayPlanes planes = { GetData<float const>(rays.origins), GetData<float const>(rays.directions), GetData<float const>(rays.maxt), GetData<int const>(rays.masks) };
+
+        int* hitresults = GetData<int>(hits); ThrowIf(!hitresults, "Invalid embree buffer.");
+
+        Submit(numrays, [this, planes, numrays, hitresults](int i, int end)
+        {
+            int count = end - i;
+            RTCRay4 data;
+            for (int j = i; j < i + count; j += 4)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                RTCRay* hit_src = &data[i];
-                jobs.push_back(std::move(m_pool.submit([this, hit, hit_src, src_ray, count]()
+                int rays_count = (j + 4) < i + count ? 4 : i + count - j; // count of valid rays
+                RTCORE_ALIGN(16) int valid[4];
+                FillRTCRay(data, planes, numrays, j, rays_count, valid);
+                rtcOccluded4(valid, m_scene, data); CheckEmbreeError();
+
+                for (int k = 0; k < rays_count; ++k)
                 {
-                    for (int i = 0; i < count; ++i)
+                    if (data.instID[k] == RTC_INVALID_GEOMETRY_ID || data.geomID[k] == RTC_INVALID_GEOMETRY_ID)
                     {
-                        if (hit_src[i].instID == RTC_INVALID_GEOMETRY_ID || hit_src[i].geomID == RTC_INVALID_GEOMETRY_ID)
-                        {
-                            hit[i] = RTC_INVALID_GEOMETRY_ID;
-                            continue;
-                        }
-                        hit[i] = hit_src[i].instID;
-                        EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i]));
-                        hit[i] = data->mesh_id;
+                        hitresults[j + k] = RTC_INVALID_GEOMETRY_ID;
+                        continue;
                     }
-                })));
+                    hitresults[j + k] = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, data.instID[k]))->mesh_id;
+                }
             }
-#endif // INTERSECTN
+        }, waitevent, event);
+    }
 
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
-        });
+    // Hit list of the multi-hit ray traced by the current thread
+    struct MultiHitContext
+    {
+        RTCScene scene;
+        Intersection* hits;
+        int numhits;
+        int k;
+    };
+    static thread_local MultiHitContext* g_multihit = nullptr;
 
-        if (event)
+    void EmbreeIntersectionDevice::MultiHitFilter(void* ptr, RTCRay& ray)
+    {
+        // Regular queries accept every hit
+        MultiHitContext* context = g_multihit;
+        if (!context)
+            return;
+
+        Intersection* hits = context->hits;
+        int k = context->k;
+        if (context->numhits == k && ray.tfar >= hits[k - 1].uvwt.w)
         {
-            *event = ev;
+            ray.geomID = RTC_INVALID_GEOMETRY_ID;
+            return;
         }
-        else
+
+        Intersection hit;
+        const EmbreeSceneData* instance = static_cast<const EmbreeSceneData*>(rtcGetUserData(context->scene, ray.instID));
+        hit.shapeid = instance->mesh_id;
+        hit.primid = instance->GetFace(ray.primID);
+        hit.uvwt = float4(ray.u, ray.v, instance->GetHalf(ray.primID), ray.tfar);
+
+        // Both triangles of a quad are hit by rays through the shared diagonal, report the quad once
+        for (int j = 0; j < context->numhits; ++j)
         {
-            ev->Wait();
-            DeleteEvent(ev);
+            if (hits[j].primid == hit.primid && hits[j].shapeid == hit.shapeid)
+            {
+                ray.geomID = RTC_INVALID_GEOMETRY_ID;
+                return;
+            }
         }
+
+        // Sorted insert, the farthest hit drops out of a full list
+        int i = context->numhits < k ? context->numhits++ : k - 1;
+        for (; i > 0 && hits[i - 1].uvwt.w > hit.uvwt.w; --i)
+            hits[i] = hits[i - 1];
+        hits[i] = hit;
+
+        // Accepting shrinks ray.tfar to this hit which is only valid for the k-th closest one,
+        // otherwise reject so that traversal continues with the current tfar
+        if (context->numhits < k || i != k - 1)
+            ray.geomID = RTC_INVALID_GEOMETRY_ID;
     }
 
-    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
     {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays);
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits);
+        ThrowIf(!fireRays || !fireHits, "Invalid embree buffer.");
+
+        Submit(numrays, [this, fireRays, fireHits, k](int i, int end)
+        {
+            const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
+            Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i * k];
+            int count = end - i;
+            RTCRay data;
+            for (int j = 0; j < count; ++j)
+            {
+                if (!src_ray[j].IsActive())
+                    continue;
+
+                Intersection* rayhits = hit + j * k;
+                MultiHitContext context = { m_scene, rayhits, 0, k };
+                FillRTCRay(data, src_ray[j]);
+                g_multihit = &context;
+                rtcIntersect(m_scene, data);
+                g_multihit = nullptr;
+                CheckEmbreeError();
+
+                std::fill(rayhits + context.numhits, rayhits + k, Intersection());
+            }
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        // Embree 2 has no point queries
         Throw("Not implemented for embree device.");
     }
 
-    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const
     {
+        // Embree 2 scenes can't be traversed with volumes
         Throw("Not implemented for embree device.");
     }
 
@@ -502,9 +913,25 @@ namespace RadeonRays
             return m_meshes[mesh].scene;
         RTCScene result = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
         CheckEmbreeError();
-        ThrowIf(!mesh->puretriangle(), "Only triangle meshes supported by now.");
 
-        unsigned id = rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
+        // Quads go in as two triangles, (v0, v1, v2) and (v0, v2, v3), same as the other devices
+        const Mesh::Face* kFaces = mesh->GetFaceData();
+        std::vector<int>& faces = m_meshes[mesh].faces;
+        faces.clear();
+        if (!mesh->puretriangle())
+        {
+            for (int i = 0; i < mesh->num_faces(); ++i)
+            {
+                faces.push_back(i << 1);
+                if (kFaces[i].type_ == Mesh::FaceType::QUAD)
+                    faces.push_back(i << 1 | 1);
+            }
+        }
+        int numtriangles = faces.empty() ? mesh->num_faces() : static_cast<int>(faces.size());
+
+        unsigned id = rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, numtriangles, mesh->num_vertices());
+        CheckEmbreeError();
+        rtcSetIntersectionFilterFunction(result, id, &MultiHitFilter);
         CheckEmbreeError();
         
         const float3* kMeshVerts = mesh->GetVertexData();
@@ -523,19 +950,20 @@ namespace RadeonRays
         int* indices = static_cast<int*>(rtcMapBuffer(result, id, RTC_INDEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!indices, "Failed to map embree buffer.");
-        const Mesh::Face* kFaces = mesh->GetFaceData();
-        for (int i = 0; i < mesh->num_faces(); ++i)
+        for (int i = 0; i < numtriangles; ++i)
         {
-            indices[3 * i] = kFaces[i].i0;
-            indices[3 * i + 1] = kFaces[i].i1;
-            indices[3 * i + 2] = kFaces[i].i2;
+            int face = faces.empty() ? i : faces[i] >> 1;
+            int half = faces.empty() ? 0 : faces[i] & 1;
+            indices[3 * i] = kFaces[face].i0;
+            indices[3 * i + 1] = kFaces[face].idx[1 + half];
+            indices[3 * i + 2] = kFaces[face].idx[2 + half];
         }
         rtcUnmapBuffer(result, id, RTC_INDEX_BUFFER);
         CheckEmbreeError();
         rtcCommit(result);
 
         m_meshes[mesh].scene = result;
-        m_meshes[mesh].instance_count = 1;
+        m_meshes[mesh].instance_count = 0;
 
         return result;
     }
@@ -564,7 +992,7 @@ namespace RadeonRays
             m_instances[shape].mesh_id = shape->GetId();
         }
 
-        ThrowIf((state & ShapeImpl::kStateChangeMotion) ? true : false, "Not implemented for embree device");
+        //motion isn't supported by embree instances and is ignored, same as for new shapes
     }
 
     void EmbreeIntersectionDevice::FillRTCRay(RTCRay& dst, const ray& src) const
@@ -586,7 +1014,8 @@ namespace RadeonRays
         dst.mask = src.GetMask();
     }
 
-    void EmbreeIntersectionDevice::FillRTCRay(RTCRay4& dst, int i, const ray& src) const
+    template <typename Packet>
+    void EmbreeIntersectionDevice::FillRTCRay(Packet& dst, int i, const ray& src) const
     {
         dst.orgx[i] = src.o.x;
         dst.orgy[i] = src.o.y;
@@ -605,35 +1034,74 @@ namespace RadeonRays
         dst.mask[i] = src.GetMask();
     }
 
+    template <typename Packet>
+    void EmbreeIntersectionDevice::ResetRTCRay(Packet& dst, int i) const
+    {
+        dst.orgx[i] = 0;
+        dst.orgy[i] = 0;
+        dst.orgz[i] = 0;
+
+        dst.dirx[i] = 0;
+        dst.diry[i] = 0;
+        dst.dirz[i] = 0;
 
-    void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay& src) const
+        dst.tnear[i] = 0;
+        dst.tfar[i] = 0;
+        dst.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+        dst.primID[i] = RTC_INVALID_GEOMETRY_ID;
+        dst.instID[i] = RTC_INVALID_GEOMETRY_ID;
+        dst.time[i] = 0;
+        dst.mask[i] = 0xFFFFFF;
+    }
+
+
+    void EmbreeIntersectionDevice::FillRTCRay(RTCRay4& dst, RayPlanes const& src, int numrays, int i, int count, int* valid) const
     {
-        dst.shapeid = src.instID;
-        if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
+        float const* o = src.o;
+        float const* d = src.d;
+        float const* maxt = src.maxt;
+        int const* mask = src.mask;
+
+        for (int j = 0; j < 4; ++j)
         {
-            const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
-            dst.shapeid = kData->mesh_id;
+            // Unused lanes repeat the first ray and are disabled
+            int k = j < count ? i + j : i;
+            valid[j] = j < count ? -1 : 0;
+
+            dst.orgx[j] = o[k];
+            dst.orgy[j] = o[numrays + k];
+            dst.orgz[j] = o[2 * numrays + k];
+
+            dst.dirx[j] = d[k];
+            dst.diry[j] = d[numrays + k];
+            dst.dirz[j] = d[2 * numrays + k];
+
+            dst.tnear[j] = 0;
+            dst.tfar[j] = maxt ? maxt[k] : std::numeric_limits<float>::max();
+            dst.geomID[j] = RTC_INVALID_GEOMETRY_ID;
+            dst.primID[j] = RTC_INVALID_GEOMETRY_ID;
+            dst.instID[j] = RTC_INVALID_GEOMETRY_ID;
+            dst.time[j] = 0;
+            dst.mask[j] = mask ? mask[k] : 0xFFFFFFFF;
         }
-        dst.primid = src.primID;
-
-        dst.uvwt.x = src.u;
-        dst.uvwt.y = src.v;
-        dst.uvwt.z = 0;
-        dst.uvwt.w = src.tfar;
     }
-    void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay4& src, int i) const
+
+    template <typename Packet>
+    void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const Packet& src, int i) const
     {
         dst.shapeid = src.instID[i];
+        dst.primid = src.primID[i];
+        dst.uvwt.z = 0;
         if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
         {
             const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
             dst.shapeid = kData->mesh_id;
+            dst.primid = kData->GetFace(src.primID[i]);
+            dst.uvwt.z = kData->GetHalf(src.primID[i]);
         }
-        dst.primid = src.primID[i];
 
         dst.uvwt.x = src.u[i];
         dst.uvwt.y = src.v[i];
-        dst.uvwt.z = 0;
         dst.uvwt.w = src.tfar[i];
     }
 
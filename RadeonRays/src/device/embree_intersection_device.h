@@ -23,6 +23,10 @@ THE SOFTWARE.
 
 #include "intersection_device.h"
 #include <map>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #include <embree2/rtcore.h>
 #include "../async/thread_pool.h"
@@ -53,15 +57,49 @@ namespace RadeonRays
         void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
         void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+        void QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+        void QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const override;
     
     protected:
         RTCScene GetEmbreeMesh(const Mesh*);
         void UpdateShape(const ShapeImpl*);
         void FillRTCRay(RTCRay& dst, const ray& src) const;
-        void FillRTCRay(RTCRay4& dst, int i, const ray& src) const;
-        void FillIntersection(Intersection& dst, const RTCRay& src) const;
-        void FillIntersection(Intersection& dst, const RTCRay4& src, int i) const;
+        // Fill lane i of an RTCRay4/8/16 packet
+        template <typename Packet> void FillRTCRay(Packet& dst, int i, const ray& src) const;
+        // Clear lane i of a packet, lanes past the last ray are disabled but embree still reads them
+        template <typename Packet> void ResetRTCRay(Packet& dst, int i) const;
+        // Host pointers to SoA ray planes, maxt and mask are optional
+        struct RayPlanes
+        {
+            float const* o;
+            float const* d;
+            float const* maxt;
+            int const* mask;
+        };
+        // Fill count rays starting at index i of SoA planes, returns valid mask
+        void FillRTCRay(RTCRay4& dst, RayPlanes const& src, int numrays, int i, int count, int* valid) const;
+        template <typename Packet> void FillIntersection(Intersection& dst, const Packet& src, int i) const;
+        // Trace count rays as packets of N rays
+        template <int N> void IntersectPackets(const ray* src_ray, Intersection* hit, int count) const;
+        template <int N> void OccludePackets(const ray* src_ray, int* hit, int count) const;
         void CheckEmbreeError() const;
+        // Intersection filter collecting hits of multi-hit queries
+        static void MultiHitFilter(void* ptr, RTCRay& ray);
+        // Run task(begin, end) over [0, count) in TASK_SIZE chunks on the pool once waitevent is complete
+        void Submit(int count, std::function<void(int, int)>&& task, Event const* waitevent, Event** event) const;
+        // Same with the count evaluated once waitevent is complete, for counts produced on the device
+        void Submit(std::function<int()>&& getcount, std::function<void(int, int)>&& task, Event const* waitevent, Event** event) const;
+        // Called once the event of a submitted query is complete
+        void QueryDone() const;
+        // Trace rays [begin, end) and write compact output, begin is a multiple of 32
+        void TraceCompact(const ray* src_ray, int begin, int end, QueryOutput output, void* dst) const;
         
         // embree device
         RTCDevice m_device;
@@ -72,10 +110,20 @@ namespace RadeonRays
         //thread pool for parallelizing work with buffers
         mutable thread_pool<void> m_pool;
 
+        //submitted queries which are not complete yet, the destructor waits for them
+        mutable int m_num_queries;
+        mutable std::mutex m_query_mutex;
+        mutable std::condition_variable m_query_cv;
+
+        // Widest packet supported by embree and the CPU, and the one in use ("embree.packet_width" option)
+        int m_max_packet_width;
+        int m_packet_width;
+
         struct EmbreeMesh
         {
             RTCScene scene = nullptr; // scene with mesh geometry
             int instance_count = 0; //instances of the mesh
+            std::vector<int> faces; //mesh face of each embree triangle shifted left by one, low bit marks the second half of a quad. Empty for triangle meshes
         };
 
 
@@ -86,11 +134,20 @@ namespace RadeonRays
                 , mesh_id(kNullId)
                 , geom(RTC_INVALID_GEOMETRY_ID)
                 , updated(false)
+                , faces(nullptr)
+                , mesh(nullptr)
             {}
+            //mesh face of the embree triangle, quads are split into (v0, v1, v2) and (v0, v2, v3)
+            Id GetFace(unsigned prim) const { return faces ? (*faces)[prim] >> 1 : prim; }
+            //1 for the second triangle of a quad
+            float GetHalf(unsigned prim) const { return faces ? static_cast<float>((*faces)[prim] & 1) : 0.f; }
+
             RTCScene scene; //instantiated scene
             Id mesh_id; //FireRays::Shape id
             unsigned geom; //embree geometry id
             bool updated;  //shows is data updated through last IntersectionDevice::Preprocess call
+            std::vector<int> const* faces; //triangle to face mapping of the mesh, nullptr for triangle meshes
+            const Mesh* mesh; //key of the instantiated scene in m_meshes
         };
 
         //used for synchronization embree and FireRays::Shape ids
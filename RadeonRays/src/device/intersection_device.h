@@ -88,6 +88,56 @@ namespace RadeonRays
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
         virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find intersection for the rays in rays buffer and write the compact output selected into hits buffer.
+        // rays is assumed AOS with elements of type RadeonRays::ray.
+        // output is kHitDistance or kHitIds (validated by the API), inactive rays are written as misses.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+
+        // Find if the rays in rays buffer intersect any of the primitives in the scene and write the occlusion mask.
+        // output is kOcclusionMask (validated by the API), bits of inactive rays are cleared.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+
+        // Compact output queries taking the number of rays from the buffer in remote memory.
+        virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const = 0;
+
+        // Find intersection for the rays in SoA layout and write them into SoA hit buffers.
+        // Hit buffers which are nullptr are skipped.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find if the rays in SoA layout intersect any of the primitives in the scene.
+        // hits is assumed AOS with elements of type int (-1 if no intersection, 1 otherwise).
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find up to k closest intersections for the rays in rays buffer and write k of them per ray into hits buffer.
+        // hits is assumed AOS with numrays * k elements of type RadeonRays::Intersection, hits of each ray are
+        // sorted by distance and padded with misses, k is validated by the API. Inactive rays are not written.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find the closest surface point within maxdist for the float3 points in points buffer.
+        // results is assumed AOS with numpoints elements of type RadeonRays::Intersection, uvwt.w holds the distance,
+        // points with no surface within maxdist get shapeid == kNullId.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const = 0;
+
+        // Find primitives whose bounds overlap the query volumes in volumes buffer, volume selects the layout of a query.
+        // results is assumed AOS with numqueries * maxhits pairs of Ids (shapeid, primid), pairs of all queries are
+        // written back to back in query order. counts receives the number of pairs per query (int), at most maxhits.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const = 0;
     
         IntersectionDevice(IntersectionDevice const&) = delete;
         IntersectionDevice& operator = (IntersectionDevice const&) = delete;
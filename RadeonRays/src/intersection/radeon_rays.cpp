@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include "device.h"
 
 #include "../device/calc_intersection_device.h"
+#include "../device/cpu_intersection_device.h"
 #include <cassert>
 
 #if USE_OPENCL
@@ -192,6 +193,11 @@ namespace RadeonRays
             ++result;
         }
 #endif //USE_EMBREE
+        // native cpu device goes after embree
+        if (s_calc_platform & DeviceInfo::Platform::kNativeCpu)
+        {
+            ++result;
+        }
 
         return result;
     }
@@ -199,6 +205,11 @@ namespace RadeonRays
     {
 
 #ifdef USE_EMBREE
+        if (!(s_calc_platform & DeviceInfo::Platform::kEmbree))
+        {
+            return false;
+        }
+
         auto* calc = GetCalc();
         if (calc != nullptr)
         {
@@ -215,11 +226,27 @@ namespace RadeonRays
         return false;
     }
 
+    static bool IsDeviceIndexNativeCpu(uint32_t devidx)
+    {
+        // native cpu device is always the last one
+        return (s_calc_platform & DeviceInfo::Platform::kNativeCpu) &&
+            devidx + 1 == IntersectionApi::GetDeviceCount();
+    }
+
     void IntersectionApi::GetDeviceInfo(std::uint32_t devidx, DeviceInfo& devinfo)
     {
 
         auto* calc = GetCalc();
 
+        if (IsDeviceIndexNativeCpu(devidx))
+        {
+            devinfo.name = "native cpu";
+            devinfo.vendor = "amd";
+            devinfo.type = DeviceInfo::kCpu;
+            devinfo.platform = DeviceInfo::kNativeCpu;
+            return;
+        }
+
         if (IsDeviceIndexEmbree(devidx))
         {
 #ifdef USE_EMBREE
@@ -245,7 +272,11 @@ namespace RadeonRays
 
     IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
     {
-        if (IsDeviceIndexEmbree(devidx))
+        if (IsDeviceIndexNativeCpu(devidx))
+        {
+            return new IntersectionApiImpl(new CpuIntersectionDevice());
+        }
+        else if (IsDeviceIndexEmbree(devidx))
         {
 #ifdef USE_EMBREE
             return new IntersectionApiImpl(new EmbreeIntersectionDevice());
@@ -37,12 +37,38 @@ THE SOFTWARE.
 
 #include <vector>
 #include <cfloat>
+#include <algorithm>
 
 namespace RadeonRays
 {
+    // Smaller batches are traced as is, sorting doesn't pay off for them
+    static int const kMinRaysToSort = 4096;
+
+    // Map the buffer and wait for the data to become available
+    static void* MapAndWait(IntersectionDevice* device, Buffer* buffer, MapType type, size_t size)
+    {
+        void* data = nullptr;
+        Event* e = nullptr;
+        device->MapBuffer(buffer, type, 0, size, &data, &e);
+        e->Wait();
+        device->DeleteEvent(e);
+        return data;
+    }
+
+    static void UnmapAndWait(IntersectionDevice* device, Buffer* buffer, void* data)
+    {
+        Event* e = nullptr;
+        device->UnmapBuffer(buffer, data, &e);
+        e->Wait();
+        device->DeleteEvent(e);
+    }
+
     IntersectionApiImpl::IntersectionApiImpl(IntersectionDevice* device)
         : nextid_(1)
     , m_device(device)
+    , m_sorted_rays(nullptr)
+    , m_sorted_results(nullptr)
+    , m_sorted_capacity(0)
     {
         world_.hint_ = 0;
     }
@@ -59,6 +85,11 @@ namespace RadeonRays
 
     IntersectionApiImpl::~IntersectionApiImpl()
     {
+        if (m_sorted_rays)
+        {
+            m_device->DeleteBuffer(m_sorted_rays);
+            m_device->DeleteBuffer(m_sorted_results);
+        }
     }
 
     Shape* IntersectionApiImpl::CreateMesh(
@@ -127,24 +158,197 @@ namespace RadeonRays
 
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
+        if (ShouldSortRays(numrays))
+        {
+            QuerySorted<Intersection>(rays, numrays, hitinfos, waitevent, event,
+                [this](Buffer const* r, int n, Buffer* h, Event** e) { m_device->QueryIntersection(r, n, h, nullptr, e); });
+            return;
+        }
+
         m_device->QueryIntersection(rays, numrays, hitinfos, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
+        if (ShouldSortRays(numrays))
+        {
+            QuerySorted<int>(rays, numrays, hitresults, waitevent, event,
+                [this](Buffer const* r, int n, Buffer* h, Event** e) { m_device->QueryOcclusion(r, n, h, nullptr, e); });
+            return;
+        }
+
         m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
+        if (ShouldSortRays(maxrays))
+        {
+            QuerySorted<Intersection>(rays, ReadRayCount(numrays, maxrays, waitevent), hitinfos, nullptr, event,
+                [this](Buffer const* r, int n, Buffer* h, Event** e) { m_device->QueryIntersection(r, n, h, nullptr, e); });
+            return;
+        }
+
         m_device->QueryIntersection(rays, numrays, maxrays, hitinfos, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
+        if (ShouldSortRays(maxrays))
+        {
+            QuerySorted<int>(rays, ReadRayCount(numrays, maxrays, waitevent), hitresults, nullptr, event,
+                [this](Buffer const* r, int n, Buffer* h, Event** e) { m_device->QueryOcclusion(r, n, h, nullptr, e); });
+            return;
+        }
+
         m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, waitevent, event);
     }
 
+    void IntersectionApiImpl::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(output != kHitDistance && output != kHitIds, "Unsupported closest hit output.");
+        m_device->QueryIntersection(rays, numrays, hits, output, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(output != kOcclusionMask, "Unsupported occlusion output.");
+        m_device->QueryOcclusion(rays, numrays, hits, output, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(output != kHitDistance && output != kHitIds, "Unsupported closest hit output.");
+        m_device->QueryIntersection(rays, numrays, maxrays, hits, output, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(output != kOcclusionMask, "Unsupported occlusion output.");
+        m_device->QueryOcclusion(rays, numrays, maxrays, hits, output, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryIntersection(rays, numrays, hits, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(k < 1 || k > kMaxHitsPerRay, "Number of hits per ray is out of range.");
+        m_device->QueryIntersectionMulti(rays, numrays, k, hits, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(maxdist < 0.f, "Closest point search distance has to be non-negative.");
+        m_device->QueryClosestPoint(points, numpoints, maxdist, results, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(maxhits < 1, "Number of hits per query has to be positive.");
+        m_device->QueryOverlap(volumes, numqueries, volume, maxhits, results, counts, waitevent, event);
+    }
+
+    bool IntersectionApiImpl::ShouldSortRays(int maxrays) const
+    {
+        auto option = world_.options_.GetOption("query.sort_rays");
+        return option && option->AsFloat() > 0.f && maxrays >= kMinRaysToSort;
+    }
+
+    int IntersectionApiImpl::ReadRayCount(Buffer const* numrays, int maxrays, Event const* waitevent) const
+    {
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        auto buffer = const_cast<Buffer*>(numrays);
+        auto count = static_cast<int*>(MapAndWait(m_device.get(), buffer, kMapRead, sizeof(int)));
+        int n = std::min(std::max(*count, 0), maxrays);
+        UnmapAndWait(m_device.get(), buffer, count);
+
+        return n;
+    }
+
+    template <typename Result, typename Query>
+    void IntersectionApiImpl::QuerySorted(Buffer const* rays, int numrays, Buffer* results, Event const* waitevent, Event** event, Query const& query) const
+    {
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        std::lock_guard<std::mutex> lock(m_sort_mutex);
+
+        // Sort on the host and gather active rays into the scratch buffer
+        auto raybuffer = const_cast<Buffer*>(rays);
+        auto r = static_cast<ray*>(MapAndWait(m_device.get(), raybuffer, kMapRead, numrays * sizeof(ray)));
+
+        m_sorter.Sort(r, numrays);
+
+        auto const& indices = m_sorter.GetIndices();
+        int numactive = static_cast<int>(indices.size());
+
+        if (numactive > m_sorted_capacity)
+        {
+            if (m_sorted_rays)
+            {
+                m_device->DeleteBuffer(m_sorted_rays);
+                m_device->DeleteBuffer(m_sorted_results);
+            }
+
+            m_sorted_rays = m_device->CreateBuffer(numactive * sizeof(ray), nullptr);
+            m_sorted_results = m_device->CreateBuffer(numactive * sizeof(Intersection), nullptr);
+            m_sorted_capacity = numactive;
+        }
+
+        if (numactive > 0)
+        {
+            auto sorted = static_cast<ray*>(MapAndWait(m_device.get(), m_sorted_rays, kMapWrite, numactive * sizeof(ray)));
+
+            for (int i = 0; i < numactive; ++i)
+            {
+                sorted[i] = r[indices[i]];
+            }
+
+            UnmapAndWait(m_device.get(), m_sorted_rays, sorted);
+        }
+
+        UnmapAndWait(m_device.get(), raybuffer, r);
+
+        if (numactive > 0)
+        {
+            Event* e = nullptr;
+            query(m_sorted_rays, numactive, m_sorted_results, &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
+
+        // Scatter results back to the caller's order, inactive rays are left untouched
+        auto out = static_cast<Result*>(MapAndWait(m_device.get(), results, kMapWrite, numrays * sizeof(Result)));
+
+        if (numactive > 0)
+        {
+            auto sorted = static_cast<Result*>(MapAndWait(m_device.get(), m_sorted_results, kMapRead, numactive * sizeof(Result)));
+
+            for (int i = 0; i < numactive; ++i)
+            {
+                out[indices[i]] = sorted[i];
+            }
+
+            UnmapAndWait(m_device.get(), m_sorted_results, sorted);
+        }
+
+        m_device->UnmapBuffer(results, out, event);
+    }
+
     void IntersectionApiImpl::DeleteEvent(Event* event) const
     {
         m_device->DeleteEvent(event);
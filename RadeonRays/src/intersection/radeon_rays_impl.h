@@ -23,9 +23,11 @@ THE SOFTWARE.
 #define INTERSECTIONAPI_IMPL
 
 #include <atomic>
+#include <mutex>
 
 #include "radeon_rays.h"
 #include "../world/world.h"
+#include "ray_sorter.h"
 
 namespace RadeonRays
 {
@@ -105,7 +107,6 @@ namespace RadeonRays
         // Complete path:
         // Find closest intersection
         // TODO: do we need to modify rays' intersection range?
-        // TODO: SoA vs AoS?
         // The call is asynchronous. Event pointers might be nullptrs.
         void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         // Find any intersection.
@@ -114,13 +115,37 @@ namespace RadeonRays
 
         // Find closest intersection, number of rays is in remote memory
         // TODO: do we need to modify rays' intersection range?
-        // TODO: SoA vs AoS?
         // The call is asynchronous. Event pointers might be nullptrs.
         void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         // Find any intersection.
         // The call is asynchronous. Event pointer mights be nullptrs.
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+        // Find closest intersection and write the compact output selected.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        // Find any intersection and write the compact output selected.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        // Compact outputs, number of rays is in remote memory
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, QueryOutput output, Event const* waitevent, Event** event) const override;
+
+        // Find closest intersection, rays and hits are in SoA layout.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryIntersection(RaySoA const& rays, int numrays, IntersectionSoA const& hits, Event const* waitevent, Event** event) const override;
+        // Find any intersection, rays are in SoA layout.
+        // The call is asynchronous. Event pointer mights be nullptrs.
+        void QueryOcclusion(RaySoA const& rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        // Find up to k closest intersections per ray.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryIntersectionMulti(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event) const override;
+
+        void QueryClosestPoint(Buffer const* points, int numpoints, float maxdist, Buffer* results, Event const* waitevent, Event** event) const override;
+
+        void QueryOverlap(Buffer const* volumes, int numqueries, OverlapVolume volume, int maxhits, Buffer* results, Buffer* counts, Event const* waitevent, Event** event) const override;
+
         /******************************************
         Utility
         ******************************************/
@@ -139,12 +164,29 @@ namespace RadeonRays
         ~IntersectionApiImpl();
 
     private:
+        // Check if query.sort_rays is enabled and the batch is large enough to benefit
+        bool ShouldSortRays(int maxrays) const;
+        // Read the number of rays from remote memory
+        int ReadRayCount(Buffer const* numrays, int maxrays, Event const* waitevent) const;
+        // Trace active rays in sorted order and scatter results back,
+        // query is called with sorted rays, their count and a results buffer
+        template <typename Result, typename Query>
+        void QuerySorted(Buffer const* rays, int numrays, Buffer* results, Event const* waitevent, Event** event, Query const& query) const;
+
         // Container for all shapes
         World world_;
         // Shape ID tracker
         mutable std::atomic<Id> nextid_;
         // Intersection device
         std::unique_ptr<IntersectionDevice> m_device;
+
+        // Ray reordering state, shared by sorted queries
+        mutable std::mutex m_sort_mutex;
+        mutable RaySorter m_sorter;
+        // Sorted rays and their results, grown on demand
+        mutable Buffer* m_sorted_rays;
+        mutable Buffer* m_sorted_results;
+        mutable int m_sorted_capacity;
     };
 }
 
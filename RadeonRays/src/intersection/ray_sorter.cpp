@@ -0,0 +1,131 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_sorter.h"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace RadeonRays
+{
+    // Radix sort digit, octant and Morton bits take 3 passes
+    static int const kRadixBits = 10;
+    static int const kRadixSize = 1 << kRadixBits;
+
+    // Insert two zero bits after each of the lower 10 bits
+    static std::uint32_t ExpandBits(std::uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    void RaySorter::Sort(ray const* rays, int numrays)
+    {
+        m_indices.clear();
+        m_keys.clear();
+
+        // Origin bounds of active rays
+        float3 pmin(FLT_MAX, FLT_MAX, FLT_MAX);
+        float3 pmax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            if (!rays[i].IsActive())
+                continue;
+
+            pmin = vmin(pmin, rays[i].o);
+            pmax = vmax(pmax, rays[i].o);
+            m_indices.push_back(i);
+        }
+
+        int numactive = (int)m_indices.size();
+
+        if (numactive < 2)
+        {
+            return;
+        }
+
+        int const numcells = 1 << kMortonBitsPerAxis;
+        float3 extents = pmax - pmin;
+        float3 scale;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            scale[axis] = extents[axis] > 0.f ? (numcells - 1) / extents[axis] : 0.f;
+        }
+
+        m_keys.resize(numactive);
+
+        for (int i = 0; i < numactive; ++i)
+        {
+            ray const& r = rays[m_indices[i]];
+
+            std::uint32_t octant = (r.d.x < 0.f ? 1u : 0u) | (r.d.y < 0.f ? 2u : 0u) | (r.d.z < 0.f ? 4u : 0u);
+            std::uint32_t code = 0;
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                auto cell = (std::uint32_t)((r.o[axis] - pmin[axis]) * scale[axis]);
+                code |= ExpandBits(std::min(cell, (std::uint32_t)numcells - 1)) << (2 - axis);
+            }
+
+            m_keys[i] = octant << (3 * kMortonBitsPerAxis) | code;
+        }
+
+        // Stable LSD radix sort, equal keys keep the caller's order
+        m_tmpkeys.resize(numactive);
+        m_tmpindices.resize(numactive);
+
+        std::vector<int> histogram(kRadixSize);
+        int const numbits = 3 * kMortonBitsPerAxis + 3;
+
+        for (int shift = 0; shift < numbits; shift += kRadixBits)
+        {
+            std::fill(histogram.begin(), histogram.end(), 0);
+
+            for (int i = 0; i < numactive; ++i)
+            {
+                ++histogram[(m_keys[i] >> shift) & (kRadixSize - 1)];
+            }
+
+            int offset = 0;
+            for (int d = 0; d < kRadixSize; ++d)
+            {
+                int count = histogram[d];
+                histogram[d] = offset;
+                offset += count;
+            }
+
+            for (int i = 0; i < numactive; ++i)
+            {
+                int dst = histogram[(m_keys[i] >> shift) & (kRadixSize - 1)]++;
+                m_tmpkeys[dst] = m_keys[i];
+                m_tmpindices[dst] = m_indices[i];
+            }
+
+            m_keys.swap(m_tmpkeys);
+            m_indices.swap(m_tmpindices);
+        }
+    }
+}
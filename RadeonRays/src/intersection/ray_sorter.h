@@ -0,0 +1,57 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef RAY_SORTER_H
+#define RAY_SORTER_H
+
+#include "math/ray.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class reorders ray batches for better traversal coherence.
+    ///< Rays are sorted by direction octant first and by Morton code of
+    ///< the origin within the octant, so rays starting close to each other
+    ///< and heading the same way are traced together.
+    ///<
+    class RaySorter
+    {
+    public:
+        // Bits of Morton code per axis
+        static int const kMortonBitsPerAxis = 9;
+
+        // Sort active rays, inactive rays are dropped
+        void Sort(ray const* rays, int numrays);
+
+        // Indices of active rays in sorted order
+        std::vector<int> const& GetIndices() const { return m_indices; }
+
+    private:
+        std::vector<std::uint32_t> m_keys;
+        std::vector<std::uint32_t> m_tmpkeys;
+        std::vector<int> m_indices;
+        std::vector<int> m_tmpindices;
+    };
+}
+
+#endif
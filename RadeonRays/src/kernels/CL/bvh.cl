@@ -37,7 +37,10 @@ DEFINES
  TYPE DEFINITIONS
  **************************************************************************/
 #define STARTIDX(x)     (((int)(x->pmin.w)))
+#define NUMPRIMS(x)     (((int)fabs(x->pmax.w)))
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
+// Leaves store primitive count in pmax.w and are followed by their next node
+#define NEXTNODE(x, i)  (LEAFNODE(x) ? ((x).pmax.w > 0.f ? (i) + 1 : -1) : (int)((x).pmax.w))
 
 typedef struct 
 {
@@ -49,7 +52,7 @@ typedef struct
     __global Face const*          faces;
     // Shape data
     __global ShapeData const*     shapes;
-    // Extra data
+    // OR-ed shape masks of the geometry below each node, might be null
     __global int const*           extra;
 } SceneData;
 
@@ -70,26 +73,27 @@ void IntersectLeafClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
-    face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    int end = start + NUMPRIMS(node);
+
+    for (int i = start; i < end; ++i)
+    {
+        face = scenedata->faces[i];
 
 #ifdef RR_RAY_MASK
-    int shapemask = scenedata->shapes[face.shapeidx].mask;
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-    if (Ray_GetMask(r) & shapemask)
+        if (Ray_GetMask(r) & shapemask)
 #endif
 
-    {
-        if (IntersectTriangle(r, v1, v2, v3, isect))
         {
-            isect->primid = face.id;
-            isect->shapeid = scenedata->shapes[face.shapeidx].id;
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
+            {
+                isect->primid = face.id;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
+            }
         }
     }
 }
@@ -101,24 +105,25 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
-    face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    int end = start + NUMPRIMS(node);
+
+    for (int i = start; i < end; ++i)
+    {
+        face = scenedata->faces[i];
 
 #ifdef RR_RAY_MASK
-    int shapemask = scenedata->shapes[face.shapeidx].mask;
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-    if (Ray_GetMask(r) & shapemask)
+        if (Ray_GetMask(r) & shapemask)
 #endif
-    {
-        if (IntersectTriangleP(r, v1, v2, v3))
         {
-            return true;
+            if (IntersectFaceP(r, scenedata->vertices, &face))
+            {
+                return true;
+            }
         }
     }
 
@@ -142,12 +147,22 @@ void IntersectSceneClosest(SceneData const* scenedata,  ray const* r, Intersecti
         // Try intersecting against current node's bounding box.
         // If this is the leaf try to intersect against contained triangle.
         BvhNode node = scenedata->nodes[idx];
+
+#ifdef RR_RAY_MASK
+        // Skip subtrees without any shape visible to the ray
+        if (scenedata->extra && !(Ray_GetMask(r) & scenedata->extra[idx]))
+        {
+            idx = NEXTNODE(node, idx);
+            continue;
+        }
+#endif
+
         if (IntersectBox(r, invdir, node, isect->uvwt.w))
         {
             if (LEAFNODE(node))
             {
                 IntersectLeafClosest(scenedata, &node, r, isect);
-                idx = (int)(node.pmax.w);
+                idx = NEXTNODE(node, idx);
             }
             // Traverse child nodes otherwise.
             else
@@ -157,7 +172,7 @@ void IntersectSceneClosest(SceneData const* scenedata,  ray const* r, Intersecti
         }
         else
         {
-            idx = (int)(node.pmax.w);
+            idx = NEXTNODE(node, idx);
         }
     };
 }
@@ -175,6 +190,16 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
         // Try intersecting against current node's bounding box.
         // If this is the leaf try to intersect against contained triangle.
         BvhNode node = scenedata->nodes[idx];
+
+#ifdef RR_RAY_MASK
+        // Skip subtrees without any shape visible to the ray
+        if (scenedata->extra && !(Ray_GetMask(r) & scenedata->extra[idx]))
+        {
+            idx = NEXTNODE(node, idx);
+            continue;
+        }
+#endif
+
         if (IntersectBox(r, invdir, node, r->o.w))
         {
             if (LEAFNODE(node))
@@ -185,7 +210,7 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
                 }
                 else
                 {
-                    idx = (int)(node.pmax.w);
+                    idx = NEXTNODE(node, idx);
                 }
             }
             // Traverse child nodes otherwise.
@@ -196,7 +221,7 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
         }
         else
         {
-            idx = (int)(node.pmax.w);
+            idx = NEXTNODE(node, idx);
         }
     };
 
@@ -204,6 +229,73 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
 }
 
 
+// intersect Ray against the whole BVH structure collecting up to k closest hits
+int IntersectSceneMulti(SceneData const* scenedata, ray const* r, int k, Intersection* hits)
+{
+    const float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d.xyz;
+
+    // Nodes are culled against the farthest hit once k hits are found
+    float maxt = r->o.w;
+    int numhits = 0;
+
+    int idx = 0;
+
+    while (idx != -1)
+    {
+        BvhNode node = scenedata->nodes[idx];
+
+#ifdef RR_RAY_MASK
+        if (scenedata->extra && !(Ray_GetMask(r) & scenedata->extra[idx]))
+        {
+            idx = NEXTNODE(node, idx);
+            continue;
+        }
+#endif
+
+        if (IntersectBox(r, invdir, node, maxt))
+        {
+            if (LEAFNODE(node))
+            {
+                int start = STARTIDX((&node));
+                int end = start + NUMPRIMS((&node));
+
+                for (int i = start; i < end; ++i)
+                {
+                    Face face = scenedata->faces[i];
+
+#ifdef RR_RAY_MASK
+                    if (!(Ray_GetMask(r) & scenedata->shapes[face.shapeidx].mask))
+                        continue;
+#endif
+
+                    Intersection isect;
+                    isect.uvwt.w = maxt;
+
+                    if (IntersectFace(r, scenedata->vertices, &face, &isect))
+                    {
+                        isect.primid = face.id;
+                        isect.shapeid = scenedata->shapes[face.shapeidx].id;
+                        maxt = InsertHit(hits, &numhits, k, &isect, maxt);
+                    }
+                }
+
+                idx = NEXTNODE(node, idx);
+            }
+            else
+            {
+                ++idx;
+            }
+        }
+        else
+        {
+            idx = NEXTNODE(node, idx);
+        }
+    };
+
+    return numhits;
+}
+
+
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosestAMD(
 // Input
@@ -458,7 +550,8 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
-__global Intersection* hits // Hit datas
+__global Intersection* hits,  // Hit datas
+__global int const* nodemasks  // Node shape masks
 )
 {
     int global_id = get_global_id(0);
@@ -471,7 +564,7 @@ __global Intersection* hits // Hit datas
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     if (global_id < numrays)
@@ -501,7 +594,8 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process                    
-__global int* hitresults  // Hit results
+__global int* hitresults,  // Hit results
+__global int const* nodemasks  // Node shape masks
 )
 {
     int global_id = get_global_id(0);
@@ -514,7 +608,7 @@ __global int* hitresults  // Hit results
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     // Handle only working subset
@@ -541,7 +635,8 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 __global int const* numrays,     // Number of rays in the workload
-__global Intersection* hits // Hit datas
+__global Intersection* hits,  // Hit datas
+__global int const* nodemasks  // Node shape masks
 )
 {
     int global_id = get_global_id(0);
@@ -553,7 +648,7 @@ __global Intersection* hits // Hit datas
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     // Handle only working subset
@@ -585,7 +680,8 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 __global int const* numrays,     // Number of rays in the workload
-__global int* hitresults   // Hit results
+__global int* hitresults,  // Hit results
+__global int const* nodemasks  // Node shape masks
 )
 {
     int global_id = get_global_id(0);
@@ -597,7 +693,7 @@ __global int* hitresults   // Hit results
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     // Handle only working subset
@@ -612,4 +708,509 @@ __global int* hitresults   // Hit results
             hitresults[offset + global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
         }
     }
-}
\ No newline at end of file
+}
+
+// Compact outputs, values match QueryOutput
+#define OUTPUT_HIT_DISTANCE 1
+#define OUTPUT_HIT_IDS 2
+
+// Closest hit of ray idx reduced to the selected output, inactive rays are misses
+void IntersectClosestCompact(
+    SceneData const* scenedata,
+    __global ray const* rays,
+    int idx,
+    int output,
+    __global int* hits
+    )
+{
+    ray r = rays[idx];
+
+    Intersection isect;
+    isect.shapeid = -1;
+    isect.primid = -1;
+
+    if (Ray_IsActive(&r))
+    {
+        IntersectSceneClosest(scenedata, &r, &isect);
+    }
+
+    if (output == OUTPUT_HIT_DISTANCE)
+    {
+        hits[idx] = as_int(isect.shapeid != -1 ? isect.uvwt.w : -1.f);
+    }
+    else
+    {
+        hits[2 * idx] = isect.shapeid;
+        hits[2 * idx + 1] = isect.primid;
+    }
+}
+
+// Occlusion of rays [0, count) packed into bits, every 32 work items of the group write a whole word.
+// Has to be reached by all work items of the group.
+void IntersectAnyCompact(
+    SceneData const* scenedata,
+    __global ray const* rays,
+    int count,
+    __global uint* hits,
+    __local uint* mask
+    )
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+
+    if (local_id % 32 == 0)
+    {
+        mask[local_id / 32] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (global_id < count)
+    {
+        ray r = rays[global_id];
+
+        if (Ray_IsActive(&r) && IntersectSceneAny(scenedata, &r))
+        {
+            atomic_or(&mask[local_id / 32], 1u << (local_id % 32));
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (local_id % 32 == 0 && global_id < count)
+    {
+        hits[global_id / 32] = mask[local_id / 32];
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestC(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int numrays,               // Number of rays to process
+int output,                // Output selection
+__global int* hits,        // Compact hit data
+__global int const* nodemasks  // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    if (global_id < numrays)
+    {
+        IntersectClosestCompact(&scenedata, rays, global_id, output, hits);
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectAnyC(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int numrays,               // Number of rays to process
+__global uint* hits,       // Occlusion mask
+__global int const* nodemasks  // Node shape masks
+)
+{
+    __local uint mask[2];
+
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    IntersectAnyCompact(&scenedata, rays, numrays, hits, mask);
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
+__kernel void IntersectClosestCRC(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+__global int const* numrays,     // Number of rays in the workload
+int maxrays,               // Capacity of the workload
+int output,                // Output selection
+__global int* hits,        // Compact hit data
+__global int const* nodemasks  // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    if (global_id < min(*numrays, maxrays))
+    {
+        IntersectClosestCompact(&scenedata, rays, global_id, output, hits);
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
+__kernel void IntersectAnyCRC(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+__global int const* numrays,     // Number of rays in the workload
+int maxrays,               // Capacity of the workload
+__global uint* hits,       // Occlusion mask
+__global int const* nodemasks  // Node shape masks
+)
+{
+    __local uint mask[2];
+
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    IntersectAnyCompact(&scenedata, rays, min(*numrays, maxrays), hits, mask);
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestSoA(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global float const* origins,   // Ray origin planes
+__global float const* directions, // Ray direction planes
+__global float const* maxt,      // Ray max distances, might be null
+__global int const* masks,       // Ray masks, might be null
+int numrays,               // Number of rays to process
+__global float* t,         // Hit distances, might be null
+__global int* primids,     // Primitive ids, might be null
+__global int* shapeids,    // Shape ids, might be null
+__global float* uvs,       // Barycentric u plane then v plane, might be null
+__global int const* nodemasks  // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    if (global_id < numrays)
+    {
+        ray r = LoadRaySoA(origins, directions, maxt, masks, numrays, global_id);
+
+        Intersection isect;
+        IntersectSceneClosest(&scenedata, &r, &isect);
+
+        StoreHitSoA(t, primids, shapeids, uvs, numrays, global_id, &isect);
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectAnySoA(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global float const* origins,   // Ray origin planes
+__global float const* directions, // Ray direction planes
+__global float const* maxt,      // Ray max distances, might be null
+__global int const* masks,       // Ray masks, might be null
+int numrays,               // Number of rays to process
+__global int* hitresults,  // Hit results
+__global int const* nodemasks  // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    if (global_id < numrays)
+    {
+        ray r = LoadRaySoA(origins, directions, maxt, masks, numrays, global_id);
+
+        hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestMulti(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+int numrays,               // Number of rays to process
+int k,                     // Number of hits per ray, up to MAX_HITS_PER_RAY
+__global Intersection* hits,  // k hit datas per ray
+__global int const* nodemasks  // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    if (global_id < numrays)
+    {
+        // Fetch ray
+        int idx = offset + global_id;
+        ray r = rays[idx];
+
+        if (Ray_IsActive(&r))
+        {
+            Intersection isects[MAX_HITS_PER_RAY];
+            int numhits = IntersectSceneMulti(&scenedata, &r, k, isects);
+
+            WriteHits(hits + idx * k, isects, numhits, k);
+        }
+    }
+}
+
+// Find the closest surface point within sqrt(maxdistsq), nodes farther than the best point found are skipped
+void ClosestPointScene(SceneData const* scenedata, float3 p, float maxdistsq, Intersection* isect)
+{
+    isect->uvwt = make_float4(0.f, 0.f, 0.f, maxdistsq);
+    isect->shapeid = -1;
+    isect->primid = -1;
+
+    int idx = 0;
+
+    while (idx != -1)
+    {
+        BvhNode node = scenedata->nodes[idx];
+
+        if (DistanceToBoxSq(p, node) <= isect->uvwt.w)
+        {
+            if (LEAFNODE(node))
+            {
+                int start = STARTIDX((&node));
+                int end = start + NUMPRIMS((&node));
+
+                for (int i = start; i < end; ++i)
+                {
+                    Face face = scenedata->faces[i];
+                    float4 closest = ClosestPointTriangle(p,
+                        scenedata->vertices[face.idx[0]],
+                        scenedata->vertices[face.idx[1]],
+                        scenedata->vertices[face.idx[2]]);
+
+                    if (face.cnt == 4)
+                    {
+                        float4 second = ClosestPointTriangle(p,
+                            scenedata->vertices[face.idx[0]],
+                            scenedata->vertices[face.idx[2]],
+                            scenedata->vertices[face.idx3]);
+
+                        if (second.w < closest.w)
+                        {
+                            closest = second;
+                            closest.z = 1.f;
+                        }
+                    }
+
+                    if (closest.w <= isect->uvwt.w)
+                    {
+                        isect->uvwt = closest;
+                        isect->primid = face.id;
+                        isect->shapeid = scenedata->shapes[face.shapeidx].id;
+                    }
+                }
+
+                idx = NEXTNODE(node, idx);
+            }
+            else
+            {
+                ++idx;
+            }
+        }
+        else
+        {
+            idx = NEXTNODE(node, idx);
+        }
+    }
+
+    isect->uvwt.w = sqrt(isect->uvwt.w);
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void ClosestPoint(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global float3 const* points,   // Query points
+int numpoints,             // Number of points to process
+float maxdist,             // Search distance
+__global Intersection* results  // Closest point per query point
+)
+{
+    int global_id = get_global_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        0
+    };
+
+    if (global_id < numpoints)
+    {
+        Intersection isect;
+        ClosestPointScene(&scenedata, points[global_id], maxdist * maxdist, &isect);
+
+        results[global_id] = isect;
+    }
+}
+
+// Collect up to maxhits primitives overlapping the planes, returns their number
+int OverlapScene(SceneData const* scenedata, float4 const* planes, int maxhits, __global int2* hits)
+{
+    int numhits = 0;
+    int idx = 0;
+
+    while (idx != -1 && numhits < maxhits)
+    {
+        BvhNode node = scenedata->nodes[idx];
+
+        if (OverlapPlanes(planes, node.pmin.xyz, node.pmax.xyz))
+        {
+            if (LEAFNODE(node))
+            {
+                int start = STARTIDX((&node));
+                int end = start + NUMPRIMS((&node));
+
+                for (int i = start; i < end && numhits < maxhits; ++i)
+                {
+                    Face face = scenedata->faces[i];
+                    float3 v1 = scenedata->vertices[face.idx[0]];
+                    float3 v2 = scenedata->vertices[face.idx[1]];
+                    float3 v3 = scenedata->vertices[face.idx[2]];
+                    float3 pmin = min(min(v1, v2), v3);
+                    float3 pmax = max(max(v1, v2), v3);
+
+                    if (face.cnt == 4)
+                    {
+                        float3 v4 = scenedata->vertices[face.idx3];
+                        pmin = min(pmin, v4);
+                        pmax = max(pmax, v4);
+                    }
+
+                    if (OverlapPlanes(planes, pmin, pmax))
+                    {
+                        hits[numhits++] = make_int2(scenedata->shapes[face.shapeidx].id, face.id);
+                    }
+                }
+
+                idx = NEXTNODE(node, idx);
+            }
+            else
+            {
+                ++idx;
+            }
+        }
+        else
+        {
+            idx = NEXTNODE(node, idx);
+        }
+    }
+
+    return numhits;
+}
+
+// Write overlapping primitives into maxhits slots per query, the slots
+// are flagged in predicate (once per Id) to be compacted afterwards
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void Overlap(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global float4 const* volumes,  // Query volumes
+int numqueries,            // Number of queries to process
+int volume,                // Query volume type
+int maxhits,               // Number of slots per query
+__global int2* slots,      // (shapeid, primid) slots
+__global int2* predicate,  // Slot occupancy
+__global int* counts       // Number of primitives per query
+)
+{
+    int global_id = get_global_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        0
+    };
+
+    if (global_id < numqueries)
+    {
+        float4 planes[6];
+        GetOverlapPlanes(volumes, global_id, volume, planes);
+
+        int base = global_id * maxhits;
+        int numhits = OverlapScene(&scenedata, planes, maxhits, slots + base);
+
+        for (int i = 0; i < maxhits; ++i)
+        {
+            predicate[base + i] = i < numhits ? make_int2(1, 1) : make_int2(0, 0);
+        }
+
+        counts[global_id] = numhits;
+    }
+}
@@ -58,8 +58,19 @@ typedef struct
     __global ShapeData*     shapedata;
     // Root BVH idx
     int rootidx;
+    // Shape masks of the nodes
+    __global int const*     nodemasks;
 } SceneData;
 
+// Nodes whose subtrees hold no shape visible to the ray are skipped as missed
+bool NodeVisible(SceneData const* scenedata, int raymask, int idx)
+{
+#ifdef RR_RAY_MASK
+    return !scenedata->nodemasks || (raymask & scenedata->nodemasks[idx]);
+#else
+    return true;
+#endif
+}
 
 /*************************************************************************
 BVH FUNCTIONS
@@ -72,16 +83,12 @@ bool IntersectLeafClosest(
     Intersection* isect          // Intersection structure
 )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
     face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
-    if (IntersectTriangle(r, v1, v2, v3, isect))
+    if (IntersectFace(r, scenedata->vertices, &face, isect))
     {
         isect->primid = face.id;
         return true;
@@ -97,16 +104,12 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
 )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
     face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
-    if (IntersectTriangleP(r, v1, v2, v3))
+    if (IntersectFaceP(r, scenedata->vertices, &face))
     {
         return true;
     }
@@ -128,6 +131,8 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
     float3 invdirtop = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
     // We need to keep original ray around for returns from bottom hierarchy
     ray topray = *r;
+    // transform_ray drops the mask, keep it for the whole traversal
+    int raymask = Ray_GetMask(r);
 
     // Fetch top level BVH index
     int idx = scenedata->rootidx;
@@ -139,7 +144,7 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
     {
         // Try intersecting against current node's bounding box.
         BvhNode node = scenedata->nodes[idx];
-        if (IntersectBox(r, invdir, node, isect->uvwt.w))
+        if (NodeVisible(scenedata, raymask, idx) && IntersectBox(r, invdir, node, isect->uvwt.w))
         {
             if (LEAFNODE(node))
             {
@@ -168,7 +173,7 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
                     int shapemask = scenedata->shapedata[shapeidx].mask;
                     // Drill into 2nd level BVH only if the geometry is not masked vs current ray
                     // otherwise skip the subtree
-                    if (Ray_GetMask(r) && shapemask)
+                    if (raymask & shapemask)
                     {
                         // Fetch bottom level BVH index
                         idx = scenedata->shapedata[shapeidx].bvhidx;
@@ -238,6 +243,8 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
     float3 invdirtop = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
     // We need to keep original ray around for returns from bottom hierarchy
     ray topray = *r;
+    // transform_ray drops the mask, keep it for the whole traversal
+    int raymask = Ray_GetMask(r);
 
     // Fetch top level BVH index
     int idx = scenedata->rootidx;
@@ -247,7 +254,7 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
     {
         // Try intersecting against current node's bounding box.
         BvhNode node = scenedata->nodes[idx];
-        if (IntersectBox(r, invdir, node, r->o.w))
+        if (NodeVisible(scenedata, raymask, idx) && IntersectBox(r, invdir, node, r->o.w))
         {
             if (LEAFNODE(node))
             {
@@ -273,7 +280,7 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
                     int shapemask = scenedata->shapedata[shapeidx].mask;
                     // Drill into 2nd level BVH only if the geometry is not masked vs current ray
                     // otherwise skip the subtree
-                    if (Ray_GetMask(r) && shapemask)
+                    if (raymask & shapemask)
                     {
                         // Fetch bottom level BVH index
                         idx = scenedata->shapedata[shapeidx].bvhidx;
@@ -335,6 +342,102 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
 }
 
 
+// intersect Ray against the whole BVH2L structure collecting up to k closest hits
+int IntersectSceneMulti2L(SceneData* scenedata, ray* r, int k, Intersection* hits)
+{
+    // Nodes are culled against the farthest hit once k hits are found
+    float maxt = r->o.w;
+    int numhits = 0;
+
+    // Precompute invdir for bbox testing
+    float3 invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
+    float3 invdirtop = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
+    // We need to keep original ray around for returns from bottom hierarchy
+    ray topray = *r;
+    // transform_ray drops the mask, keep it for the whole traversal
+    int raymask = Ray_GetMask(r);
+
+    // Fetch top level BVH index
+    int idx = scenedata->rootidx;
+    // -1 indicates we are traversing top level
+    int topidx = -1;
+    // Current shape id
+    int shapeid = -1;
+    while (idx != -1)
+    {
+        BvhNode node = scenedata->nodes[idx];
+        if (NodeVisible(scenedata, raymask, idx) && IntersectBox(r, invdir, node, maxt))
+        {
+            if (LEAFNODE(node))
+            {
+                if (topidx != -1)
+                {
+                    // Bottom level leaf holds a single primitive
+                    Face face = scenedata->faces[STARTIDX((&node))];
+
+                    Intersection isect;
+                    isect.uvwt.w = maxt;
+
+                    if (IntersectFace(r, scenedata->vertices, &face, &isect))
+                    {
+                        isect.primid = face.id;
+                        isect.shapeid = shapeid;
+                        maxt = InsertHit(hits, &numhits, k, &isect, maxt);
+                    }
+
+                    idx = (int)(node.pmax.w);
+                }
+                else
+                {
+                    // Top level leaf, drill into the shape BVH if it is visible to the ray
+                    topidx = idx;
+                    int shapeidx = SHAPEIDX(node);
+
+                    if (raymask & scenedata->shapedata[shapeidx].mask)
+                    {
+                        idx = scenedata->shapedata[shapeidx].bvhidx;
+                        shapeid = scenedata->shapedata[shapeidx].id;
+
+                        float4 wmi0 = scenedata->shapedata[shapeidx].m0;
+                        float4 wmi1 = scenedata->shapedata[shapeidx].m1;
+                        float4 wmi2 = scenedata->shapedata[shapeidx].m2;
+                        float4 wmi3 = scenedata->shapedata[shapeidx].m3;
+
+                        *r = transform_ray(*r, wmi0, wmi1, wmi2, wmi3);
+                        invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
+                        continue;
+                    }
+                    else
+                    {
+                        idx = -1;
+                    }
+                }
+            }
+            else
+            {
+                idx = idx + 1;
+            }
+        }
+        else
+        {
+            idx = (int)(node.pmax.w);
+        }
+
+        // Return to the top level once the bottom level BVH is done
+        if (idx == -1 && topidx != -1)
+        {
+            idx = (int)(scenedata->nodes[topidx].pmax.w);
+            topidx = -1;
+            r->o = topray.o;
+            r->d = topray.d;
+            invdir = invdirtop;
+        }
+    }
+
+    return numhits;
+}
+
+
 // 2 level variants
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosest2L(
@@ -348,6 +451,7 @@ __kernel void IntersectClosest2L(
     int offset,                // Offset in rays array
     int numrays,               // Number of rays to process
     __global Intersection* hits // Hit datas
+    , __global int const* nodemasks // Node shape masks
 )
 {
 
@@ -360,7 +464,8 @@ __kernel void IntersectClosest2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        nodemasks
     };
 
     // Handle only working subset
@@ -394,6 +499,7 @@ __kernel void IntersectAny2L(
     int offset,                // Offset in rays array
     int numrays,               // Number of rays to process
     __global int* hitresults   // Hit results
+    , __global int const* nodemasks // Node shape masks
 )
 {
     int global_id = get_global_id(0);
@@ -405,7 +511,8 @@ __kernel void IntersectAny2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        nodemasks
     };
 
     // Handle only working subset
@@ -435,6 +542,7 @@ __kernel void IntersectClosestRC2L(
     __global int* numrays,     // Number of rays in the workload
     int offset,                // Offset in rays array
     __global Intersection* hits // Hit datas
+    , __global int const* nodemasks // Node shape masks
 )
 {
     int global_id = get_global_id(0);
@@ -446,7 +554,8 @@ __kernel void IntersectClosestRC2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        nodemasks
     };
 
     // Handle only working subset
@@ -480,6 +589,7 @@ __kernel void IntersectAnyRC2L(
     __global int* numrays,     // Number of rays in the workload
     int offset,                // Offset in rays array
     __global int* hitresults   // Hit results
+    , __global int const* nodemasks // Node shape masks
 )
 {
     int global_id = get_global_id(0);
@@ -491,7 +601,8 @@ __kernel void IntersectAnyRC2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        nodemasks
     };
 
     // Handle only working subset
@@ -506,4 +617,134 @@ __kernel void IntersectAnyRC2L(
             hitresults[offset + global_id] = IntersectSceneAny2L(&scenedata, &r) ? 1 : -1;
         }
     }
-}
\ No newline at end of file
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestMulti2L(
+    // Input
+    __global BvhNode* nodes,   // BVH nodes
+    __global float3* vertices, // Scene positional data
+    __global Face* faces,    // Scene indices
+    __global ShapeData* shapedata, // Transforms
+    int rootidx,               // BVH root idx
+    __global ray* rays,        // Ray workload
+    int offset,                // Offset in rays array
+    int numrays,               // Number of rays to process
+    int k,                     // Number of hits per ray, up to MAX_HITS_PER_RAY
+    __global Intersection* hits // k hit datas per ray
+    , __global int const* nodemasks // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    // Fill scene data
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapedata,
+        rootidx,
+        nodemasks
+    };
+
+    // Handle only working subset
+    if (global_id < numrays)
+    {
+        // Fetch ray
+        int idx = offset + global_id;
+        ray r = rays[idx];
+
+        if (Ray_IsActive(&r))
+        {
+            Intersection isects[MAX_HITS_PER_RAY];
+            int numhits = IntersectSceneMulti2L(&scenedata, &r, k, isects);
+
+            WriteHits(hits + idx * k, isects, numhits, k);
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestSoA2L(
+    // Input
+    __global BvhNode* nodes,   // BVH nodes
+    __global float3* vertices, // Scene positional data
+    __global Face* faces,    // Scene indices
+    __global ShapeData* shapedata, // Transforms
+    int rootidx,               // BVH root idx
+    __global float const* origins,   // Ray origin planes
+    __global float const* directions, // Ray direction planes
+    __global float const* maxt,      // Ray max distances, might be null
+    __global int const* masks,       // Ray masks, might be null
+    int numrays,               // Number of rays to process
+    __global float* t,         // Hit distances, might be null
+    __global int* primids,     // Primitive ids, might be null
+    __global int* shapeids,    // Shape ids, might be null
+    __global float* uvs        // Barycentric u plane then v plane, might be null
+    , __global int const* nodemasks // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    // Fill scene data
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapedata,
+        rootidx,
+        nodemasks
+    };
+
+    // Handle only working subset
+    if (global_id < numrays)
+    {
+        ray r = LoadRaySoA(origins, directions, maxt, masks, numrays, global_id);
+
+        Intersection isect;
+        IntersectSceneClosest2L(&scenedata, &r, &isect);
+
+        StoreHitSoA(t, primids, shapeids, uvs, numrays, global_id, &isect);
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectAnySoA2L(
+    // Input
+    __global BvhNode* nodes,   // BVH nodes
+    __global float3* vertices, // Scene positional data
+    __global Face* faces,    // Scene indices
+    __global ShapeData* shapedata, // Transforms
+    int rootidx,               // BVH root idx
+    __global float const* origins,   // Ray origin planes
+    __global float const* directions, // Ray direction planes
+    __global float const* maxt,      // Ray max distances, might be null
+    __global int const* masks,       // Ray masks, might be null
+    int numrays,               // Number of rays to process
+    __global int* hitresults   // Hit results
+    , __global int const* nodemasks // Node shape masks
+)
+{
+    int global_id = get_global_id(0);
+
+    // Fill scene data
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapedata,
+        rootidx,
+        nodemasks
+    };
+
+    // Handle only working subset
+    if (global_id < numrays)
+    {
+        ray r = LoadRaySoA(origins, directions, maxt, masks, numrays, global_id);
+
+        hitresults[global_id] = IntersectSceneAny2L(&scenedata, &r) ? 1 : -1;
+    }
+}
@@ -0,0 +1,731 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include "CL/common.cl"
+/*************************************************************************
+EXTENSIONS
+**************************************************************************/
+
+
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+#define NUMPRIMS(x, i)  ((int)((as_uint((x).origin.w) >> (24 + 4 * (i))) & 0xf))
+#define LEAFNODE(x, i)  (NUMPRIMS(x, i) != 0)
+#define LEFTCHILD(x)    ((int)((x).lbound.w))
+#define RIGHTCHILD(x)   ((int)((x).rbound.w))
+#define SHORT_STACK_SIZE 16
+
+
+typedef struct
+{
+    // Quantization origin, w: per axis step exponents and leaf sizes
+    float4 origin;
+    // Child bounds quantized to 16 bits, w: child index or first primitive
+    uint4 lbound;
+    uint4 rbound;
+} CompressedBvhNode;
+
+typedef struct
+{
+    // BVH structure
+    __global CompressedBvhNode const* nodes;
+    // Scene positional data
+    __global float3 const*         vertices;
+    // Scene indices
+    __global Face const*         faces;
+    // Shape IDs
+    __global ShapeData const*     shapes;
+    // Extra data
+    __global int const*             extra;
+} SceneData;
+
+/*************************************************************************
+HELPER FUNCTIONS
+**************************************************************************/
+// Decode child bounds relative to the node quantization grid
+bbox DecodeBounds(CompressedBvhNode const* node, uint4 qbound)
+{
+    // Exponents are stored biased as in IEEE floats,
+    // so the step is an exact power of two and so are the products below
+    uint e = as_uint(node->origin.w);
+    float3 step = as_float3((uint3)(e & 0xff, (e >> 8) & 0xff, (e >> 16) & 0xff) << 23);
+
+    bbox b;
+    b.pmin = (float4)(node->origin.xyz + convert_float3((uint3)(qbound.x & 0xffff, qbound.x >> 16, qbound.y & 0xffff)) * step, 0.f);
+    b.pmax = (float4)(node->origin.xyz + convert_float3((uint3)(qbound.y >> 16, qbound.z & 0xffff, qbound.z >> 16)) * step, 0.f);
+    return b;
+}
+
+
+
+/*************************************************************************
+BVH FUNCTIONS
+**************************************************************************/
+//  intersect a ray with leaf BVH node
+void IntersectLeafClosest(
+    SceneData const* scenedata,
+    int faceidx,
+    int numprims,
+    ray const* r,                // ray to instersect
+    Intersection* isect          // Intersection structure
+    )
+{
+    Face face;
+
+    for (int i = faceidx; i < faceidx + numprims; ++i)
+    {
+        face = scenedata->faces[i];
+
+#ifdef RR_RAY_MASK
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
+
+        if (Ray_GetMask(r) & shapemask)
+#endif
+        {
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
+            {
+                isect->primid = face.id;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
+            }
+        }
+    }
+}
+
+//  intersect a ray with leaf BVH node
+bool IntersectLeafAny(
+    SceneData const* scenedata,
+    int faceidx,
+    int numprims,
+    ray const* r                      // ray to instersect
+    )
+{
+    Face face;
+
+    for (int i = faceidx; i < faceidx + numprims; ++i)
+    {
+        face = scenedata->faces[i];
+
+#ifdef RR_RAY_MASK
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
+
+        if (Ray_GetMask(r) & shapemask)
+#endif
+        {
+            if (IntersectFaceP(r, scenedata->vertices, &face))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+#ifndef GLOBAL_STACK
+// intersect Ray against the whole BVH structure
+bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersection* isect, __global int* stack, __local int* ldsstack)
+{
+    const float3 invdir = native_recip(r->d.xyz);
+
+    isect->uvwt = make_float4(0.f, 0.f, 0.f, r->o.w);
+    isect->shapeid = -1;
+    isect->primid = -1;
+
+    if (r->o.w < 0.f)
+        return false;
+
+    __global int* gsptr = stack;
+    __local  int* lsptr = ldsstack;
+
+    *lsptr = -1;
+    lsptr += 64;
+
+    int idx = 0;
+    CompressedBvhNode node;
+
+    bool leftleaf = false;
+    bool rightleaf = false;
+    float lefthit = 0.f;
+    float righthit = 0.f;
+    int step = 0;
+
+    while (idx > -1)
+    {
+        while (idx > -1)
+        {
+            node = scenedata->nodes[idx];
+
+            leftleaf = LEAFNODE(node, 0);
+            rightleaf = LEAFNODE(node, 1);
+
+            lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.lbound), isect->uvwt.w);
+            righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.rbound), isect->uvwt.w);
+
+            if (leftleaf)
+            {
+                IntersectLeafClosest(scenedata, LEFTCHILD(node), NUMPRIMS(node, 0), r, isect);
+            }
+
+            if (rightleaf)
+            {
+                IntersectLeafClosest(scenedata, RIGHTCHILD(node), NUMPRIMS(node, 1), r, isect);
+            }
+
+            if (lefthit > 0.f && righthit > 0.f)
+            {
+                int deferred = -1;
+                if (lefthit > righthit)
+                {
+                    idx = RIGHTCHILD(node);
+                    deferred = LEFTCHILD(node);
+                }
+                else
+                {
+                    idx = LEFTCHILD(node);
+                    deferred = RIGHTCHILD(node);
+                }
+
+                if (lsptr - ldsstack >= SHORT_STACK_SIZE * 64)
+                {
+                    for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                    {
+                        gsptr[i] = ldsstack[i * 64];
+                    }
+
+                    gsptr += SHORT_STACK_SIZE;
+                    lsptr = ldsstack + 64;
+                }
+
+                *lsptr = deferred;
+                lsptr += 64;
+
+                continue;
+            }
+            else if (lefthit > 0)
+            {
+                idx = LEFTCHILD(node);
+                continue;
+            }
+            else if (righthit > 0)
+            {
+                idx = RIGHTCHILD(node);
+                continue;
+            }
+
+            lsptr -= 64;
+            idx = *(lsptr);
+        }
+
+        if (gsptr > stack)
+        {
+            gsptr -= SHORT_STACK_SIZE;
+
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+            {
+                ldsstack[i * 64] = gsptr[i];
+            }
+
+            lsptr = ldsstack + (SHORT_STACK_SIZE - 1) * 64;
+            idx = ldsstack[64 * (SHORT_STACK_SIZE - 1)];
+        }
+    }
+
+    return isect->shapeid >= 0;
+}
+#else
+// intersect Ray against the whole BVH structure
+bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersection* isect)
+{
+    const float3 invdir = native_recip(r->d.xyz);
+
+    isect->uvwt = make_float4(0.f, 0.f, 0.f, r->o.w);
+    isect->shapeid = -1;
+    isect->primid = -1;
+
+    if (r->o.w < 0.f)
+        return false;
+    
+    int stack[32];
+
+    int* sptr = stack;
+    *sptr++ = -1;
+
+    int idx = 0;
+    CompressedBvhNode node;
+
+    bool leftleaf = false;
+    bool rightleaf = false;
+    float lefthit = 0.f;
+    float righthit = 0.f;
+    int step = 0;
+
+    while (idx > -1)
+    {
+        node = scenedata->nodes[idx];
+
+        leftleaf = LEAFNODE(node, 0);
+        rightleaf = LEAFNODE(node, 1);
+
+        lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.lbound), isect->uvwt.w);
+        righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.rbound), isect->uvwt.w);
+
+        if (leftleaf)
+        {
+            IntersectLeafClosest(scenedata, LEFTCHILD(node), NUMPRIMS(node, 0), r, isect);
+        }
+
+        if (rightleaf)
+        {
+            IntersectLeafClosest(scenedata, RIGHTCHILD(node), NUMPRIMS(node, 1), r, isect);
+        }
+
+        if (lefthit > 0.f && righthit > 0.f)
+        {
+            int deferred = -1;
+            if (lefthit > righthit)
+            {
+                idx = RIGHTCHILD(node);
+                deferred = LEFTCHILD(node);
+            }
+            else
+            {
+                idx = LEFTCHILD(node);
+                deferred = RIGHTCHILD(node);
+            }
+
+                    *sptr++ = deferred;
+            continue;
+        }
+        else if (lefthit > 0)
+        {
+            idx = LEFTCHILD(node);
+            continue;
+        }
+        else if (righthit > 0)
+        {
+            idx = RIGHTCHILD(node);
+            continue;
+        }
+
+                idx = *--sptr;
+    }
+
+    return isect->shapeid >= 0;
+}
+#endif
+
+#ifndef GLOBAL_STACK
+// intersect Ray against the whole BVH structure
+bool IntersectSceneAny(SceneData const* scenedata, ray const* r, __global int* stack, __local int* ldsstack)
+{
+    const float3 invdir = native_recip(r->d.xyz);
+
+    __global int* gsptr = stack;
+    __local  int* lsptr = ldsstack;
+
+    if (r->o.w < 0.f)
+        return false;
+
+    *lsptr = -1;
+    lsptr += 64;
+
+    int idx = 0;
+    CompressedBvhNode node;
+
+    bool leftleaf = false;
+    bool rightleaf = false;
+    float lefthit = 0.f;
+    float righthit = 0.f;
+
+    while (idx > -1)
+    {
+        while (idx > -1)
+        {
+            node = scenedata->nodes[idx];
+
+            leftleaf = LEAFNODE(node, 0);
+            rightleaf = LEAFNODE(node, 1);
+
+            lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.lbound), r->o.w);
+            righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.rbound), r->o.w);
+
+            if (leftleaf)
+            {
+                if (IntersectLeafAny(scenedata, LEFTCHILD(node), NUMPRIMS(node, 0), r))
+                                    return true;
+            }
+
+            if (rightleaf)
+            {
+                if (IntersectLeafAny(scenedata, RIGHTCHILD(node), NUMPRIMS(node, 1), r))
+                                return true;
+            }
+
+            if (lefthit > 0.f && righthit > 0.f)
+            {
+                int deferred = -1;
+                if (lefthit > righthit)
+                {
+                    idx = RIGHTCHILD(node);
+                    deferred = LEFTCHILD(node);
+
+                }
+                else
+                {
+                    idx = LEFTCHILD(node);
+                    deferred = RIGHTCHILD(node);
+                }
+
+                if (lsptr - ldsstack >= SHORT_STACK_SIZE * 64)
+                {
+                    for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                    {
+                        gsptr[i] = ldsstack[i * 64];
+                    }
+
+                    gsptr += SHORT_STACK_SIZE;
+                    lsptr = ldsstack + 64;
+                }
+
+                *lsptr = deferred;
+                lsptr += 64;
+                continue;
+            }
+            else if (lefthit > 0)
+            {
+                idx = LEFTCHILD(node);
+                continue;
+            }
+            else if (righthit > 0)
+            {
+                idx = RIGHTCHILD(node);
+                continue;
+            }
+
+            lsptr -= 64;
+            idx = *(lsptr);
+        }
+
+        if (gsptr > stack)
+        {
+            gsptr -= SHORT_STACK_SIZE;
+
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+            {
+                ldsstack[i * 64] = gsptr[i];
+            }
+
+            lsptr = ldsstack + (SHORT_STACK_SIZE - 1) * 64;
+            idx = ldsstack[64 * (SHORT_STACK_SIZE - 1)];
+        }
+    }
+
+    return false;
+}
+#else
+// intersect Ray against the whole BVH structure
+bool IntersectSceneAny(SceneData const* scenedata, ray const* r)
+{
+    const float3 invdir = native_recip(r->d.xyz);
+
+    if (r->o.w < 0.f)
+        return false;
+    
+    int stack[32];
+
+    int* sptr = stack;
+    *sptr++ = -1;
+
+    int idx = 0;
+    CompressedBvhNode node;
+
+    bool leftleaf = false;
+    bool rightleaf = false;
+    float lefthit = 0.f;
+    float righthit = 0.f;
+    int step = 0;
+
+    bool found = false;
+
+    while (idx > -1)
+    {
+        node = scenedata->nodes[idx];
+
+        leftleaf = LEAFNODE(node, 0);
+        rightleaf = LEAFNODE(node, 1);
+
+        lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.lbound), r->o.w);
+        righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, DecodeBounds(&node, node.rbound), r->o.w);
+
+        if (leftleaf)
+        {
+            if (IntersectLeafAny(scenedata, LEFTCHILD(node), NUMPRIMS(node, 0), r))
+            {
+                found = true;
+                break;
+            }
+        }
+        
+        if (rightleaf)
+        {
+            if (IntersectLeafAny(scenedata, RIGHTCHILD(node), NUMPRIMS(node, 1), r))
+                    {
+                        found = true;
+                        break;
+                    }
+        }
+
+        if (lefthit > 0.f && righthit > 0.f)
+        {
+            int deferred = -1;
+            if (lefthit > righthit)
+            {
+                idx = RIGHTCHILD(node);
+                deferred = LEFTCHILD(node);
+            }
+            else
+            {
+                idx = LEFTCHILD(node);
+                deferred = RIGHTCHILD(node);
+            }
+
+                    *sptr++ = deferred;
+        }
+        else if (lefthit > 0)
+        {
+            idx = LEFTCHILD(node);
+        }
+        else if (righthit > 0)
+        {
+            idx = RIGHTCHILD(node);
+        }
+
+        if (lefthit <= 0.f && righthit <= 0.f)
+            idx = *--sptr;
+    }
+
+    return found;
+}
+
+#endif
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosest(
+    // Input
+    __global CompressedBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes, // Shape data
+    __global ray const* rays,        // Ray workload
+    int offset,                // Offset in rays array
+    int numrays,               // Number of rays to process
+    __global Intersection* hits // Hit datas
+    , __global int* stack
+    )
+{
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        0
+    };
+
+    if (global_id < numrays)
+    {
+        // Fetch ray
+        ray r = rays[global_id];
+        
+        if (Ray_IsActive(&r))
+        {
+            // Calculate closest hit
+            Intersection isect;
+#ifndef GLOBAL_STACK 
+            IntersectSceneClosest(&scenedata, &r, &isect, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id);
+#else
+            IntersectSceneClosest(&scenedata, &r, &isect);
+#endif
+
+            // Write data back in case of a hit
+            hits[global_id] = isect;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectAny(
+    // Input
+    __global CompressedBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes,     // Shape data
+    __global ray const* rays,        // Ray workload
+    int offset,                // Offset in rays array
+    int numrays,               // Number of rays to process                    
+    __global int* hitresults  // Hit results
+    , __global int* stack
+    )
+{
+
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        0
+    };
+
+    if (global_id < numrays)
+    {
+        // Fetch ray
+        ray r = rays[global_id];
+
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+#ifndef GLOBAL_STACK 
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id) ? 1 : -1;
+#else
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+#endif
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
+__kernel void IntersectClosestRC(
+    __global CompressedBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,      // Scene indices
+    __global ShapeData const* shapes,     // Shape data
+    __global ray const* rays,        // Ray workload
+    int offset,                // Offset in rays array
+    __global int const* numrays,     // Number of rays in the workload
+    __global Intersection* hits // Hit datas
+    , __global int* stack
+    )
+{
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        0
+    };
+
+    // Handle only working subset
+    if (global_id < *numrays)
+    {
+        // Fetch ray
+        ray r = rays[global_id];
+
+        if (Ray_IsActive(&r))
+        {
+            // Calculate closest hit
+            Intersection isect;
+#ifndef GLOBAL_STACK 
+            IntersectSceneClosest(&scenedata, &r, &isect, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id);
+#else
+            IntersectSceneClosest(&scenedata, &r, &isect);
+#endif
+            // Write data back in case of a hit
+            hits[global_id] = isect;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
+__kernel void IntersectAnyRC(
+    // Input
+    __global CompressedBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes,     // Shape data
+    __global ray const* rays,        // Ray workload
+    int offset,                // Offset in rays array
+    __global int const* numrays,     // Number of rays in the workload
+    __global int* hitresults   // Hit results
+    , __global int* stack
+    )
+{
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        0
+    };
+
+    // Handle only working subset
+    if (global_id < *numrays)
+    {
+        // Fetch ray
+        ray r = rays[global_id];
+
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+#ifndef GLOBAL_STACK 
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id) ? 1 : -1;
+#else
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+#endif
+        }
+    }
+}
@@ -72,10 +72,12 @@ typedef struct _Face
     int shapeidx;
     // Primitive ID
     int id;
-    // Idx count
+    // Idx count: 3 for triangles, 4 for quads
     int cnt;
+    // Fourth vertex index of a quad
+    int idx3;
 
-    int2 padding;
+    int padding;
 } Face;
 
 #ifndef APPLE
@@ -240,6 +242,32 @@ int IntersectTriangleP(ray const* r, float3 v1, float3 v2, float3 v3)
     return 1;
 }
 
+// Intersect ray against a face. Quads (v0, v1, v2, v3) are split
+// into (v0, v1, v2) and (v0, v2, v3), the second one marked by uvwt.z = 1
+int IntersectFace(ray const* r, __global float3 const* vertices, Face const* face, Intersection* isect)
+{
+    const float3 v1 = vertices[face->idx[0]];
+    const float3 v3 = vertices[face->idx[2]];
+    int hit = IntersectTriangle(r, v1, vertices[face->idx[1]], v3, isect);
+
+    if (face->cnt == 4 && IntersectTriangle(r, v1, v3, vertices[face->idx3], isect))
+    {
+        isect->uvwt.z = 1.f;
+        hit = 1;
+    }
+
+    return hit;
+}
+
+int IntersectFaceP(ray const* r, __global float3 const* vertices, Face const* face)
+{
+    const float3 v1 = vertices[face->idx[0]];
+    const float3 v3 = vertices[face->idx[2]];
+
+    return IntersectTriangleP(r, v1, vertices[face->idx[1]], v3) ||
+        (face->cnt == 4 && IntersectTriangleP(r, v1, v3, vertices[face->idx3]));
+}
+
 #ifdef AMD_MEDIA_OPS
 #pragma OPENCL EXTENSION cl_amd_media_ops2 : enable
 #endif
@@ -302,4 +330,205 @@ float Ray_GetMaxT(ray const* r)
 float Ray_GetTime(ray const* r)
 {
     return r->d.w;
-}
\ No newline at end of file
+}
+
+// Load ray idx from SoA planes (all x, then all y, then all z), maxt and masks might be null
+ray LoadRaySoA(
+    __global float const* origins,
+    __global float const* directions,
+    __global float const* maxt,
+    __global int const* masks,
+    int numrays,
+    int idx
+    )
+{
+    ray r;
+    r.o = make_float4(origins[idx], origins[numrays + idx], origins[2 * numrays + idx], maxt ? maxt[idx] : FLT_MAX);
+    r.d = make_float4(directions[idx], directions[numrays + idx], directions[2 * numrays + idx], 0.f);
+    r.extra = make_int2(masks ? masks[idx] : 0xFFFFFFFF, 1);
+    r.padding = make_int2(0, 0);
+    return r;
+}
+
+// Store hit idx into the SoA planes which are not null
+void StoreHitSoA(
+    __global float* t,
+    __global int* primids,
+    __global int* shapeids,
+    __global float* uvs,
+    int numrays,
+    int idx,
+    Intersection const* isect
+    )
+{
+    if (t) t[idx] = isect->uvwt.w;
+    if (primids) primids[idx] = isect->primid;
+    if (shapeids) shapeids[idx] = isect->shapeid;
+    if (uvs)
+    {
+        uvs[idx] = isect->uvwt.x;
+        uvs[numrays + idx] = isect->uvwt.y;
+    }
+}
+
+// Has to match kMaxHitsPerRay in radeon_rays.h
+#define MAX_HITS_PER_RAY 8
+
+// Insert the hit into the list of k closest hits sorted by distance, the farthest one
+// is dropped if the list is full. Returns the distance to look for further hits within.
+float InsertHit(Intersection* hits, int* numhits, int k, Intersection const* hit, float maxt)
+{
+    // Primitives referenced from several leaves are reported once
+    for (int i = 0; i < *numhits; ++i)
+    {
+        if (hits[i].primid == hit->primid && hits[i].shapeid == hit->shapeid)
+        {
+            return *numhits < k ? maxt : hits[k - 1].uvwt.w;
+        }
+    }
+
+    int i = *numhits < k ? (*numhits)++ : k - 1;
+
+    for (; i > 0 && hits[i - 1].uvwt.w > hit->uvwt.w; --i)
+    {
+        hits[i] = hits[i - 1];
+    }
+
+    hits[i] = *hit;
+
+    return *numhits < k ? maxt : hits[k - 1].uvwt.w;
+}
+
+// Write k hits of the ray, entries past numhits are misses
+void WriteHits(__global Intersection* out, Intersection const* hits, int numhits, int k)
+{
+    for (int i = 0; i < k; ++i)
+    {
+        if (i < numhits)
+        {
+            out[i] = hits[i];
+        }
+        else
+        {
+            out[i].shapeid = -1;
+            out[i].primid = -1;
+            out[i].uvwt = make_float4(0.f, 0.f, 0.f, 0.f);
+        }
+    }
+}
+
+// Squared distance from the point to the box, 0 inside
+float DistanceToBoxSq(float3 p, bbox box)
+{
+    float3 d = max(max(box.pmin.xyz - p, p - box.pmax.xyz), make_float3(0.f, 0.f, 0.f));
+    return dot(d, d);
+}
+
+// Closest point on the triangle, returns barycentrics of v2 and v3 and
+// squared distance to the point in w, same as ClosestPointTriangle on the CPU
+float4 ClosestPointTriangle(float3 p, float3 v1, float3 v2, float3 v3)
+{
+    float3 e1 = v2 - v1;
+    float3 e2 = v3 - v1;
+    float3 d1 = p - v1;
+    float a1 = dot(e1, d1);
+    float a2 = dot(e2, d1);
+    float b1, b2;
+
+    float3 d2 = p - v2;
+    float a3 = dot(e1, d2);
+    float a4 = dot(e2, d2);
+    float3 d3 = p - v3;
+    float a5 = dot(e1, d3);
+    float a6 = dot(e2, d3);
+
+    float va = a3 * a6 - a5 * a4;
+    float vb = a5 * a2 - a1 * a6;
+    float vc = a1 * a4 - a3 * a2;
+
+    if (a1 <= 0.f && a2 <= 0.f)
+    {
+        // Vertex v1
+        b1 = 0.f; b2 = 0.f;
+    }
+    else if (a3 >= 0.f && a4 <= a3)
+    {
+        // Vertex v2
+        b1 = 1.f; b2 = 0.f;
+    }
+    else if (vc <= 0.f && a1 >= 0.f && a3 <= 0.f)
+    {
+        // Edge v1 v2
+        b1 = a1 / (a1 - a3); b2 = 0.f;
+    }
+    else if (a6 >= 0.f && a5 <= a6)
+    {
+        // Vertex v3
+        b1 = 0.f; b2 = 1.f;
+    }
+    else if (vb <= 0.f && a2 >= 0.f && a6 <= 0.f)
+    {
+        // Edge v1 v3
+        b1 = 0.f; b2 = a2 / (a2 - a6);
+    }
+    else if (va <= 0.f && (a4 - a3) >= 0.f && (a5 - a6) >= 0.f)
+    {
+        // Edge v2 v3
+        b2 = (a4 - a3) / ((a4 - a3) + (a5 - a6));
+        b1 = 1.f - b2;
+    }
+    else
+    {
+        // Face interior
+        float denom = 1.f / (va + vb + vc);
+        b1 = vb * denom;
+        b2 = vc * denom;
+    }
+
+    float3 d = v1 + e1 * b1 + e2 * b2 - p;
+    return make_float4(b1, b2, 0.f, dot(d, d));
+}
+
+// Has to match OverlapVolume in radeon_rays.h
+#define OVERLAP_BOX 0
+#define OVERLAP_FRUSTUM 1
+
+// Read query volume as 6 planes, boxes become their face planes
+void GetOverlapPlanes(__global float4 const* volumes, int idx, int volume, float4* planes)
+{
+    if (volume == OVERLAP_BOX)
+    {
+        float4 pmin = volumes[2 * idx];
+        float4 pmax = volumes[2 * idx + 1];
+        planes[0] = make_float4(1.f, 0.f, 0.f, -pmin.x);
+        planes[1] = make_float4(-1.f, 0.f, 0.f, pmax.x);
+        planes[2] = make_float4(0.f, 1.f, 0.f, -pmin.y);
+        planes[3] = make_float4(0.f, -1.f, 0.f, pmax.y);
+        planes[4] = make_float4(0.f, 0.f, 1.f, -pmin.z);
+        planes[5] = make_float4(0.f, 0.f, -1.f, pmax.z);
+    }
+    else
+    {
+        for (int i = 0; i < 6; ++i)
+        {
+            planes[i] = volumes[6 * idx + i];
+        }
+    }
+}
+
+// Box is culled if it is fully outside of any plane, exact for box queries
+bool OverlapPlanes(float4 const* planes, float3 pmin, float3 pmax)
+{
+    for (int i = 0; i < 6; ++i)
+    {
+        float3 n = planes[i].xyz;
+        float3 d = max(n * pmin, n * pmax);
+
+        if (d.x + d.y + d.z + planes[i].w < 0.f)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -34,6 +34,7 @@ EXTENSIONS
 TYPE DEFINITIONS
 **************************************************************************/
 #define STARTIDX(x)     (((int)((x).pmin.w)))
+#define NUMPRIMS(x)     (((int)((x).pmax.w)))
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
 #define SHORT_STACK_SIZE 16
 
@@ -54,14 +55,25 @@ typedef struct
     __global Face const*         faces;
     // Shape IDs
     __global ShapeData const*     shapes;
-    // Extra data
+    // Shape masks of the node children, two per node
     __global int const*             extra;
 } SceneData;
 
 /*************************************************************************
 HELPER FUNCTIONS
 **************************************************************************/
-
+// Bit 0 is set if the left child of the node holds shapes visible to the ray, bit 1 for the right one
+int VisibleChildren(SceneData const* scenedata, ray const* r, int idx)
+{
+#ifdef RR_RAY_MASK
+    if (scenedata->extra)
+    {
+        int raymask = Ray_GetMask(r);
+        return ((raymask & scenedata->extra[2 * idx]) ? 1 : 0) | ((raymask & scenedata->extra[2 * idx + 1]) ? 2 : 0);
+    }
+#endif
+    return 3;
+}
 
 
 /*************************************************************************
@@ -71,28 +83,28 @@ BVH FUNCTIONS
 void IntersectLeafClosest(
     SceneData const* scenedata,
     int faceidx,
+    int numprims,
     ray const* r,                // ray to instersect
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
-    face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    for (int i = faceidx; i < faceidx + numprims; ++i)
+    {
+        face = scenedata->faces[i];
 
 #ifdef RR_RAY_MASK
-    int shapemask = scenedata->shapes[face.shapeidx].mask;
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-    if (Ray_GetMask(r) & shapemask)
+        if (Ray_GetMask(r) & shapemask)
 #endif
-    {
-        if (IntersectTriangle(r, v1, v2, v3, isect))
         {
-            isect->primid = face.id;
-            isect->shapeid = scenedata->shapes[face.shapeidx].id;
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
+            {
+                isect->primid = face.id;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
+            }
         }
     }
 }
@@ -101,26 +113,26 @@ void IntersectLeafClosest(
 bool IntersectLeafAny(
     SceneData const* scenedata,
     int faceidx,
+    int numprims,
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
-    face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    for (int i = faceidx; i < faceidx + numprims; ++i)
+    {
+        face = scenedata->faces[i];
 
 #ifdef RR_RAY_MASK
-    int shapemask = scenedata->shapes[face.shapeidx].mask;
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-    if (Ray_GetMask(r) & shapemask)
+        if (Ray_GetMask(r) & shapemask)
 #endif
-    {
-        if (IntersectTriangleP(r, v1, v2, v3))
         {
-            return true;
+            if (IntersectFaceP(r, scenedata->vertices, &face))
+            {
+                return true;
+            }
         }
     }
 
@@ -151,6 +163,7 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
 
     bool leftleaf = false;
     bool rightleaf = false;
+    int visible = 3;
     float lefthit = 0.f;
     float righthit = 0.f;
     int step = 0;
@@ -164,17 +177,19 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
             leftleaf = LEAFNODE(node.lbound);
             rightleaf = LEAFNODE(node.rbound);
 
-            lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, node.lbound, isect->uvwt.w);
-            righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, node.rbound, isect->uvwt.w);
+            visible = VisibleChildren(scenedata, r, idx);
 
-            if (leftleaf)
+            lefthit = (leftleaf || !(visible & 1)) ? -1.f : IntersectBoxF(r, invdir, node.lbound, isect->uvwt.w);
+            righthit = (rightleaf || !(visible & 2)) ? -1.f : IntersectBoxF(r, invdir, node.rbound, isect->uvwt.w);
+
+            if (leftleaf && (visible & 1))
             {
-                IntersectLeafClosest(scenedata, STARTIDX(node.lbound), r, isect);
+                IntersectLeafClosest(scenedata, STARTIDX(node.lbound), NUMPRIMS(node.lbound), r, isect);
             }
 
-            if (rightleaf)
+            if (rightleaf && (visible & 2))
             {
-                IntersectLeafClosest(scenedata, STARTIDX(node.rbound), r, isect);
+                IntersectLeafClosest(scenedata, STARTIDX(node.rbound), NUMPRIMS(node.rbound), r, isect);
             }
 
             if (lefthit > 0.f && righthit > 0.f)
@@ -261,6 +276,7 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
 
     bool leftleaf = false;
     bool rightleaf = false;
+    int visible = 3;
     float lefthit = 0.f;
     float righthit = 0.f;
     int step = 0;
@@ -272,17 +288,19 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
         leftleaf = LEAFNODE(node.lbound);
         rightleaf = LEAFNODE(node.rbound);
 
-        lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, node.lbound, isect->uvwt.w);
-        righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, node.rbound, isect->uvwt.w);
+        visible = VisibleChildren(scenedata, r, idx);
+
+        lefthit = (leftleaf || !(visible & 1)) ? -1.f : IntersectBoxF(r, invdir, node.lbound, isect->uvwt.w);
+        righthit = (rightleaf || !(visible & 2)) ? -1.f : IntersectBoxF(r, invdir, node.rbound, isect->uvwt.w);
 
-        if (leftleaf)
+        if (leftleaf && (visible & 1))
         {
-            IntersectLeafClosest(scenedata, STARTIDX(node.lbound), r, isect);
+            IntersectLeafClosest(scenedata, STARTIDX(node.lbound), NUMPRIMS(node.lbound), r, isect);
         }
 
-        if (rightleaf)
+        if (rightleaf && (visible & 2))
         {
-            IntersectLeafClosest(scenedata, STARTIDX(node.rbound), r, isect);
+            IntersectLeafClosest(scenedata, STARTIDX(node.rbound), NUMPRIMS(node.rbound), r, isect);
         }
 
         if (lefthit > 0.f && righthit > 0.f)
@@ -340,6 +358,7 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r, __global int* s
 
     bool leftleaf = false;
     bool rightleaf = false;
+    int visible = 3;
     float lefthit = 0.f;
     float righthit = 0.f;
 
@@ -352,18 +371,20 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r, __global int* s
             leftleaf = LEAFNODE(node.lbound);
             rightleaf = LEAFNODE(node.rbound);
 
-            lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, node.lbound, r->o.w);
-            righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, node.rbound, r->o.w);
+            visible = VisibleChildren(scenedata, r, idx);
+
+            lefthit = (leftleaf || !(visible & 1)) ? -1.f : IntersectBoxF(r, invdir, node.lbound, r->o.w);
+            righthit = (rightleaf || !(visible & 2)) ? -1.f : IntersectBoxF(r, invdir, node.rbound, r->o.w);
 
-            if (leftleaf)
+            if (leftleaf && (visible & 1))
             {
-                if (IntersectLeafAny(scenedata, STARTIDX(node.lbound), r))
+                if (IntersectLeafAny(scenedata, STARTIDX(node.lbound), NUMPRIMS(node.lbound), r))
                                     return true;
             }
 
-            if (rightleaf)
+            if (rightleaf && (visible & 2))
             {
-                if (IntersectLeafAny(scenedata, STARTIDX(node.rbound), r))
+                if (IntersectLeafAny(scenedata, STARTIDX(node.rbound), NUMPRIMS(node.rbound), r))
                                 return true;
             }
 
@@ -447,6 +468,7 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r)
 
     bool leftleaf = false;
     bool rightleaf = false;
+    int visible = 3;
     float lefthit = 0.f;
     float righthit = 0.f;
     int step = 0;
@@ -460,21 +482,23 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r)
         leftleaf = LEAFNODE(node.lbound);
         rightleaf = LEAFNODE(node.rbound);
 
-        lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, node.lbound, r->o.w);
-        righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, node.rbound, r->o.w);
+        visible = VisibleChildren(scenedata, r, idx);
 
-        if (leftleaf)
+        lefthit = (leftleaf || !(visible & 1)) ? -1.f : IntersectBoxF(r, invdir, node.lbound, r->o.w);
+        righthit = (rightleaf || !(visible & 2)) ? -1.f : IntersectBoxF(r, invdir, node.rbound, r->o.w);
+
+        if (leftleaf && (visible & 1))
         {
-            if (IntersectLeafAny(scenedata, STARTIDX(node.lbound), r))
+            if (IntersectLeafAny(scenedata, STARTIDX(node.lbound), NUMPRIMS(node.lbound), r))
             {
                 found = true;
                 break;
             }
         }
         
-        if (rightleaf)
+        if (rightleaf && (visible & 2))
         {
-            if (IntersectLeafAny(scenedata, STARTIDX(node.rbound), r))
+            if (IntersectLeafAny(scenedata, STARTIDX(node.rbound), NUMPRIMS(node.rbound), r))
                     {
                         found = true;
                         break;
@@ -527,6 +551,7 @@ __kernel void IntersectClosest(
     int numrays,               // Number of rays to process
     __global Intersection* hits // Hit datas
     , __global int* stack
+    , __global int const* nodemasks // Node children shape masks
     )
 {
     __local int ldsstack[SHORT_STACK_SIZE * 64];
@@ -542,7 +567,7 @@ __kernel void IntersectClosest(
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     if (global_id < numrays)
@@ -578,6 +603,7 @@ __kernel void IntersectAny(
     int numrays,               // Number of rays to process                    
     __global int* hitresults  // Hit results
     , __global int* stack
+    , __global int const* nodemasks // Node children shape masks
     )
 {
 
@@ -593,7 +619,7 @@ __kernel void IntersectAny(
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     if (global_id < numrays)
@@ -625,6 +651,7 @@ __kernel void IntersectClosestRC(
     __global int const* numrays,     // Number of rays in the workload
     __global Intersection* hits // Hit datas
     , __global int* stack
+    , __global int const* nodemasks // Node children shape masks
     )
 {
     __local int ldsstack[SHORT_STACK_SIZE * 64];
@@ -640,7 +667,7 @@ __kernel void IntersectClosestRC(
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     // Handle only working subset
@@ -677,6 +704,7 @@ __kernel void IntersectAnyRC(
     __global int const* numrays,     // Number of rays in the workload
     __global int* hitresults   // Hit results
     , __global int* stack
+    , __global int const* nodemasks // Node children shape masks
     )
 {
     __local int ldsstack[SHORT_STACK_SIZE * 64];
@@ -691,7 +719,7 @@ __kernel void IntersectAnyRC(
         vertices,
         faces,
         shapes,
-        0
+        nodemasks
     };
 
     // Handle only working subset
@@ -711,3 +739,99 @@ __kernel void IntersectAnyRC(
         }
     }
 }
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestSoA(
+    // Input
+    __global FatBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes, // Shape data
+    __global float const* origins,   // Ray origin planes
+    __global float const* directions, // Ray direction planes
+    __global float const* maxt,      // Ray max distances, might be null
+    __global int const* masks,       // Ray masks, might be null
+    int numrays,               // Number of rays to process
+    __global float* t,         // Hit distances, might be null
+    __global int* primids,     // Primitive ids, might be null
+    __global int* shapeids,    // Shape ids, might be null
+    __global float* uvs        // Barycentric u plane then v plane, might be null
+    , __global int* stack
+    , __global int const* nodemasks // Node children shape masks
+    )
+{
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    if (global_id < numrays)
+    {
+        ray r = LoadRaySoA(origins, directions, maxt, masks, numrays, global_id);
+
+        Intersection isect;
+#ifndef GLOBAL_STACK 
+        IntersectSceneClosest(&scenedata, &r, &isect, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id);
+#else
+        IntersectSceneClosest(&scenedata, &r, &isect);
+#endif
+
+        StoreHitSoA(t, primids, shapeids, uvs, numrays, global_id, &isect);
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectAnySoA(
+    // Input
+    __global FatBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes,     // Shape data
+    __global float const* origins,   // Ray origin planes
+    __global float const* directions, // Ray direction planes
+    __global float const* maxt,      // Ray max distances, might be null
+    __global int const* masks,       // Ray masks, might be null
+    int numrays,               // Number of rays to process
+    __global int* hitresults  // Hit results
+    , __global int* stack
+    , __global int const* nodemasks // Node children shape masks
+    )
+{
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Fill scene data 
+    SceneData scenedata =
+    {
+        nodes,
+        vertices,
+        faces,
+        shapes,
+        nodemasks
+    };
+
+    if (global_id < numrays)
+    {
+        ray r = LoadRaySoA(origins, directions, maxt, masks, numrays, global_id);
+
+#ifndef GLOBAL_STACK 
+        hitresults[global_id] = IntersectSceneAny(&scenedata, &r, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id) ? 1 : -1;
+#else
+        hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+#endif
+    }
+}
@@ -65,123 +65,170 @@ typedef struct
     __global float3 const* vertices;
     // Scene indices
     __global Face const* faces;
-    // Shape IDs
-    __global int const* shapeids;
+    // Shape data
+    __global ShapeData const* shapes;
     // Extra data
     __global int const* indices;
     // Grid desc
     __global GridDesc const* grid;
 } SceneData;
 
+typedef struct
+{
+    // Current voxel
+    int3 voxel;
+    // Voxel increment along each axis
+    int3 step;
+    // First voxel outside of the grid along each axis
+    int3 out;
+    // Distance to the next voxel boundary along each axis
+    float3 nexthit;
+    // Distance between voxel boundaries along each axis
+    float3 dt;
+} GridTraversal;
+
 /*************************************************************************
 HELPER FUNCTIONS
 **************************************************************************/
 
-float3 PosToVoxel(__global GridDesc const* grid,  float3 p)
+int3 PosToVoxel(__global GridDesc const* grid, float3 p)
+{
+    int3 v = convert_int3(floor((p - grid->bounds.pmin.xyz) * grid->voxelsizeinv));
+    return clamp(v, (int3)(0), grid->gridres.xyz - 1);
+}
+
+float3 VoxelToPos(__global GridDesc const* grid, int3 v)
+{
+    return grid->bounds.pmin.xyz + convert_float3(v) * grid->voxelsize;
+}
+
+int VoxelPlainIndex(__global GridDesc const* grid, int3 v)
 {
-    float3 res;
-    res.x = (int)clamp(floor((p.x - grid->bounds.pmin.x) * grid->voxelsizeinv.x), 0.f, (float)(grid->gridres.x - 1));
-    res.y = (int)clamp(floor((p.y - grid->bounds.pmin.y) * grid->voxelsizeinv.y), 0.f, (float)(grid->gridres.y - 1));
-    res.z = (int)clamp(floor((p.z - grid->bounds.pmin.z) * grid->voxelsizeinv.z), 0.f, (float)(grid->gridres.z - 1));
-    return res;
+    return (v.z * grid->gridres.y + v.y) * grid->gridres.x + v.x;
 }
 
-float3 VoxelToPos(__global GridDesc const* grid, float3 v)
+// Clip the ray to the box, returns false if the ray misses it
+bool ClipRay(ray const* r, float3 invdir, bbox box, float maxt, float* tenter, float* texit)
 {
-    return make_float3(grid->bounds.pmin.x + v.x * grid->voxelsize.x,
-        grid->bounds.pmin.y + v.y * grid->voxelsize.y,
-        grid->bounds.pmin.z + v.z * grid->voxelsize.z);
+    const float3 f = (box.pmax.xyz - r->o.xyz) * invdir;
+    const float3 n = (box.pmin.xyz - r->o.xyz) * invdir;
+
+    const float3 tmax = max(f, n);
+    const float3 tmin = min(f, n);
+
+    *texit = min(min(tmax.x, min(tmax.y, tmax.z)), maxt);
+    *tenter = max(max(tmin.x, max(tmin.y, tmin.z)), 0.f);
+
+    return *texit >= *tenter;
 }
 
-/*float  VoxelToPos(int x, int axis) const
+// Find the voxel the ray enters the grid at and prepare stepping data
+void InitTraversal(__global GridDesc const* grid, ray const* r, float3 invdir, float tenter, GridTraversal* tr)
 {
-    return bounds_.pmin[axis] + x * voxelsize_[axis];
-}*/
+    const int3 positive = r->d.xyz >= 0.f;
+
+    tr->voxel = PosToVoxel(grid, r->o.xyz + r->d.xyz * tenter);
+    tr->step = select((int3)(-1), (int3)(1), positive);
+    tr->out = select((int3)(-1), grid->gridres.xyz, positive);
+
+    // Axes the ray is parallel to are never stepped along
+    const float3 boundary = VoxelToPos(grid, tr->voxel + select((int3)(0), (int3)(1), positive));
+    tr->nexthit = select((boundary - r->o.xyz) * invdir, (float3)(INFINITY), r->d.xyz == 0.f);
+    tr->dt = fabs(grid->voxelsize * invdir);
+}
 
-int VoxelPlainIndex(__global GridDesc const* grid, float3 v)
+// Step into the next voxel unless the boundary is further than maxt,
+// returns false if the ray leaves the grid
+bool AdvanceTraversal(GridTraversal* tr, float maxt)
 {
-    return (int)(v.z * grid->gridres.x * grid->gridres.y + v.y * grid->gridres.x + v.x);
+    if (tr->nexthit.x < tr->nexthit.y && tr->nexthit.x < tr->nexthit.z)
+    {
+        if (tr->nexthit.x > maxt)
+            return false;
+
+        tr->voxel.x += tr->step.x;
+        tr->nexthit.x += tr->dt.x;
+        return tr->voxel.x != tr->out.x;
+    }
+    else if (tr->nexthit.y < tr->nexthit.z)
+    {
+        if (tr->nexthit.y > maxt)
+            return false;
+
+        tr->voxel.y += tr->step.y;
+        tr->nexthit.y += tr->dt.y;
+        return tr->voxel.y != tr->out.y;
+    }
+    else
+    {
+        if (tr->nexthit.z > maxt)
+            return false;
+
+        tr->voxel.z += tr->step.z;
+        tr->nexthit.z += tr->dt.z;
+        return tr->voxel.z != tr->out.z;
+    }
 }
 
 
 /*************************************************************************
-BVH FUNCTIONS
+GRID FUNCTIONS
 **************************************************************************/
 //  intersect a ray with grid voxel
-bool IntersectVoxelClosest(
+void IntersectVoxelClosest(
     SceneData const* scenedata,
     Voxel const* voxel,
     ray const* r,                // ray to instersect
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
-    bool hit = false;
 
     for (int i = voxel->startidx; i < voxel->startidx + voxel->numprims; ++i)
     {
         face = scenedata->faces[scenedata->indices[i]];
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
 
-        if (IntersectTriangle(r, v1, v2, v3, isect))
-        {
-            isect->primid = face.id;
-            isect->shapeid = scenedata->shapeids[scenedata->indices[i]];
-            isect->uvwt.z = 0;
-            hit = true;
-        }
-        else if (face.cnt == 4)
+#ifdef RR_RAY_MASK
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
+
+        if (Ray_GetMask(r) & shapemask)
+#endif
         {
-            v2 = scenedata->vertices[face.idx[3]];
-            if (IntersectTriangle(r, v3, v2, v1, isect))
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
             {
                 isect->primid = face.id;
-                isect->shapeid = scenedata->shapeids[scenedata->indices[i]];
-                isect->uvwt.z = 1;
-                hit = true;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
             }
         }
-
     }
-
-    return hit;
 }
 
-//  intersect a ray with leaf BVH node
+//  intersect a ray with grid voxel
 bool IntersectVoxelAny(
     SceneData const* scenedata,
     Voxel const* voxel,
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     for (int i = voxel->startidx; i < voxel->startidx + voxel->numprims; ++i)
     {
         face = scenedata->faces[scenedata->indices[i]];
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
 
-        if (IntersectTriangleP(r, v1, v2, v3))
-        {
-            return true;
-        }
-        else if (face.cnt == 4)
+#ifdef RR_RAY_MASK
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
+
+        if (Ray_GetMask(r) & shapemask)
+#endif
         {
-            v2 = scenedata->vertices[face.idx[3]];
-            if (IntersectTriangleP(r, v3, v2, v1))
+            if (IntersectFaceP(r, scenedata->vertices, &face))
             {
                 return true;
             }
         }
-
     }
 
     return false;
@@ -191,109 +238,35 @@ bool IntersectVoxelAny(
 bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersection* isect)
 {
     const float3 invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
+
     isect->uvwt = make_float4(0.f, 0.f, 0.f, r->o.w);
     isect->shapeid = -1;
     isect->primid = -1;
 
-    // Check the ray vs scene bounds
-    float t = IntersectBoxF(r, invdir, scenedata->grid->bounds, r->o.w);
-
-    // If no bail out
-    if (t < 0.f)
-    {
-        //printf("Bailing out at initial bbox test % d\n", get_global_id(0));
+    if (r->o.w < 0.f)
         return false;
-    }
-
-    // Find starting point
-    float3 isectpoint = r->o.xyz + r->d.xyz * t;
-    float3 gridres = make_float3(scenedata->grid->gridres.x, scenedata->grid->gridres.y, scenedata->grid->gridres.z);
-
-    // Perpare the stepping data
-    float3 nexthit;
-    float3 dt;
-    float3 out;
 
-    //for (int axis = 0; axis < 3; ++axis)
-    //{
-    // Voxel position
-    float3 voxelidx = PosToVoxel(scenedata->grid, isectpoint);
-
-    //assert(voxel[0] < gridres_[0] && voxel[1] < gridres_[1] && voxel[2] < gridres_[2]);
-
-    float3 step = r->d.xyz >= 0.f ? 1.f : -1.f;
-    float3 step01 = (step + 1.f) / 2.f;
-
-    // Next hit along this axis in parametric units
-    nexthit = t + (VoxelToPos(scenedata->grid, voxelidx + step01) - isectpoint) * invdir;
-
-    // Delta T
-    dt = scenedata->grid->voxelsize * invdir * step;
-    dt = isinf(dt) ? 0.f : dt;
-    //printf("Dt %f %f %f\n", dt.x, dt.y, dt.z);
+    // Check the ray vs grid bounds
+    float tenter, texit;
+    if (!ClipRay(r, invdir, scenedata->grid->bounds, r->o.w, &tenter, &texit))
+        return false;
 
-    // Last voxel
-    out = step > 0.f ? gridres : -1.f;
+    GridTraversal tr;
+    InitTraversal(scenedata->grid, r, invdir, tenter, &tr);
 
-    bool hit = false;
-    while ((int)voxelidx.x != (int)out.x && 
-        (int)voxelidx.y != (int)out.y && 
-        (int)voxelidx.z != (int)out.z)
+    do
     {
-        // 
-        //printf("Testing voxel %d %d %d -----> ", (int)voxelidx.x, (int)voxelidx.y, (int)voxelidx.z);
-
-        // Check current voxel
-        int idx = VoxelPlainIndex(scenedata->grid, voxelidx);
-
-        Voxel voxel = scenedata->voxels[idx];
+        Voxel voxel = scenedata->voxels[VoxelPlainIndex(scenedata->grid, tr.voxel)];
 
         if (voxel.startidx != -1)
         {
-            hit = IntersectVoxelClosest(scenedata, &voxel, r, isect);
-            //printf(" %d\n", hit);
-        }
-
-        // Advance to next one
-        int bits = (((nexthit.x < nexthit.y) ? 1 : 0) << 2) +
-            (((nexthit.x < nexthit.z) ? 1 : 0) << 1) +
-            (((nexthit.y < nexthit.z) ? 1 : 0));
-
-        const float3 cmptoaxis[8] = { 
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 0.f, 1.f },
-            { 1.f, 0.f, 0.f },
-            { 1.f, 0.f, 0.f }
-        };
-
-        // Choose axis
-        float3 stepaxis = cmptoaxis[bits];
-        float3 nexthittest = isinf(nexthit) ? 0.f : nexthit;
-
-       // printf("Next hit %f %f %f\n", nexthit.x, nexthit.y, nexthit.z);
-        //printf("Step axis %f %f %f\n", stepaxis.x, stepaxis.y, stepaxis.z);
-
-
-
-        // Early out
-        if (isect->uvwt.w < dot(nexthittest, stepaxis))
-        {
-            //printf("Bailing out at early out step % d\n", get_global_id(0));
-            break;
+            IntersectVoxelClosest(scenedata, &voxel, r, isect);
         }
 
-        // Advance current position
-        voxelidx += step * stepaxis;
+        // Voxels further than the closest hit can't contain anything closer
+    } while (AdvanceTraversal(&tr, min(isect->uvwt.w, texit)));
 
-        // Advance next hit
-        nexthit += dt * stepaxis;
-    }
-
-    return hit;
+    return isect->shapeid >= 0;
 }
 
 // intersect Ray against the whole grid structure
@@ -301,92 +274,27 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r)
 {
     const float3 invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
 
-    // Check the ray vs scene bounds
-    float t = IntersectBoxF(r, invdir, scenedata->grid->bounds, r->o.w);
-
-    // If no bail out
-    if (t < 0.f)
-    {
-        //printf("Bailing out at initial bbox test % d\n", get_global_id(0));
+    if (r->o.w < 0.f)
         return false;
-    }
-
-    // Find starting point
-    float3 isectpoint = r->o.xyz + r->d.xyz * t;
-    float3 gridres = make_float3(scenedata->grid->gridres.x, scenedata->grid->gridres.y, scenedata->grid->gridres.z);
 
-    // Perpare the stepping data
-    float3 nexthit;
-    float3 dt;
-    float3 out;
-
-    //for (int axis = 0; axis < 3; ++axis)
-    //{
-    // Voxel position
-    float3 voxelidx = PosToVoxel(scenedata->grid, isectpoint);
-
-    //assert(voxel[0] < gridres_[0] && voxel[1] < gridres_[1] && voxel[2] < gridres_[2]);
-
-    float3 step = r->d.xyz >= 0.f ? 1.f : -1.f;
-    float3 step01 = (step + 1.f) / 2.f;
-
-    // Next hit along this axis in parametric units
-    nexthit = t + (VoxelToPos(scenedata->grid, voxelidx + step01) - isectpoint) * invdir;
-
-    // Delta T
-    dt = scenedata->grid->voxelsize * invdir * step;
-    dt = isinf(dt) ? 0.f : dt;
-    //printf("Dt %f %f %f\n", dt.x, dt.y, dt.z);
+    // Check the ray vs grid bounds
+    float tenter, texit;
+    if (!ClipRay(r, invdir, scenedata->grid->bounds, r->o.w, &tenter, &texit))
+        return false;
 
-    // Last voxel
-    out = step > 0.f ? gridres : -1.f;
+    GridTraversal tr;
+    InitTraversal(scenedata->grid, r, invdir, tenter, &tr);
 
-    while ((int)voxelidx.x != (int)out.x &&
-        (int)voxelidx.y != (int)out.y &&
-        (int)voxelidx.z != (int)out.z)
+    do
     {
-        // 
-        //printf("Testing voxel %d %d %d -----> ", (int)voxelidx.x, (int)voxelidx.y, (int)voxelidx.z);
-
-        // Check current voxel
-        int idx = VoxelPlainIndex(scenedata->grid, voxelidx);
-
-        Voxel voxel = scenedata->voxels[idx];
+        Voxel voxel = scenedata->voxels[VoxelPlainIndex(scenedata->grid, tr.voxel)];
 
         if (voxel.startidx != -1)
         {
             if (IntersectVoxelAny(scenedata, &voxel, r))
                 return true;
         }
-
-        // Advance to next one
-        int bits = (((nexthit.x < nexthit.y) ? 1 : 0) << 2) +
-            (((nexthit.x < nexthit.z) ? 1 : 0) << 1) +
-            (((nexthit.y < nexthit.z) ? 1 : 0));
-
-        const float3 cmptoaxis[8] = {
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 0.f, 1.f },
-            { 1.f, 0.f, 0.f },
-            { 1.f, 0.f, 0.f }
-        };
-
-        // Choose axis
-        float3 stepaxis = cmptoaxis[bits];
-
-        // printf("Next hit %f %f %f\n", nexthit.x, nexthit.y, nexthit.z);
-        //printf("Step axis %f %f %f\n", stepaxis.x, stepaxis.y, stepaxis.z);
-
-        // Advance current position
-        voxelidx += step * stepaxis;
-
-        // Advance next hit
-        nexthit += dt * stepaxis;
-    }
+    } while (AdvanceTraversal(&tr, texit));
 
     return false;
 }
@@ -399,7 +307,7 @@ __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes, // Shape data
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
@@ -416,22 +324,25 @@ __global Intersection* hits // Hit datas
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
 
-    Intersection isect;
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[global_id + offset];
+        ray r = rays[global_id];
 
-        // Calculate closest hit
-        IntersectSceneClosest(&scenedata, &r, &isect);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect);
 
-        // Write data back in case of a hit
-        hits[global_id + offset] = isect;
+            // Write data back in case of a hit
+            hits[global_id] = isect;
+        }
     }
 }
 
@@ -443,7 +354,7 @@ __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes, // Shape data
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
@@ -460,7 +371,7 @@ __global int* hitresults  // Hit results
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
@@ -470,8 +381,11 @@ __global int* hitresults  // Hit results
         // Fetch ray
         ray r = rays[global_id];
 
-        // Calculate any intersection
-        hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        }
     }
 }
 
@@ -483,7 +397,7 @@ __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes, // Shape data
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
@@ -499,7 +413,7 @@ __global Intersection* hits // Hit datas
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
@@ -510,12 +424,15 @@ __global Intersection* hits // Hit datas
         // Fetch ray
         ray r = rays[global_id];
 
-        // Calculate closest hit
-        Intersection isect;
-        IntersectSceneClosest(&scenedata, &r, &isect);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect);
 
-        // Write data back in case of a hit
-        hits[global_id] = isect;
+            // Write data back in case of a hit
+            hits[global_id] = isect;
+        }
     }
 }
 
@@ -527,7 +444,7 @@ __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes, // Shape data
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
@@ -543,7 +460,7 @@ __global int* hitresults // Hit datas
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
@@ -554,7 +471,10 @@ __global int* hitresults // Hit datas
         // Fetch ray
         ray r = rays[global_id];
 
-        // Calculate any intersection
-        hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        }
     }
 }
\ No newline at end of file
@@ -80,13 +80,9 @@ bool IntersectLeafClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -94,7 +90,7 @@ bool IntersectLeafClosest(
     if (Ray_GetMask(r) & shapemask)
 #endif
     {
-        if (IntersectTriangle(r, v1, v2, v3, isect))
+        if (IntersectFace(r, scenedata->vertices, &face, isect))
         {
             isect->primid = face.id;
             isect->shapeid = scenedata->shapes[face.shapeidx].id;
@@ -112,13 +108,9 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -126,7 +118,7 @@ bool IntersectLeafAny(
     if (Ray_GetMask(r) & shapemask)
 #endif
     {
-        if (IntersectTriangleP(r, v1, v2, v3))
+        if (IntersectFaceP(r, scenedata->vertices, &face))
         {
             return true;
         }
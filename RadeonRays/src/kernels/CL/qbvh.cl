@@ -21,432 +21,365 @@ THE SOFTWARE.
 ********************************************************************/
 
 /*************************************************************************
-EXTENSIONS
+INCLUDES
 **************************************************************************/
-
-
+#include "CL/common.cl"
 /*************************************************************************
-DEFINES
+EXTENSIONS
 **************************************************************************/
-#define PI 3.14159265358979323846f
 
-#define LEAFNODE(x)     (((x).typecnt & 0xF) == 0)
-#define NUMPRIMS(x)     (((x).typecnt) >> 4)
 
 
 /*************************************************************************
 TYPE DEFINITIONS
 **************************************************************************/
-typedef struct _bbox
-{
-    float3 pmin;
-    float3 pmax;
-} bbox;
-
-typedef struct _ray
-{
-    float3 o;
-    float3 d;
-    float2 range;
-    float  time;
-    float  padding;
-} ray;
-
-typedef struct _Intersection
-{
-    float2 uv;
-    int instanceid;
-    int shapeid;
-    int primid;
-    int extra;
-} Intersection;
-
-
-typedef struct _BvhNode
-{
-    bbox bounds;
-    // 4-bit mask + prim count
-    uint typecnt;
+#define SHORT_STACK_SIZE 16
+#define GLOBAL_STACK_SIZE 64
+
+// Push node index onto the short stack, spilling it to global memory when full
+#define PUSH_NODE(x) \
+    { \
+        if (lsptr - ldsstack >= SHORT_STACK_SIZE * 64) \
+        { \
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i) \
+            { \
+                gsptr[i] = ldsstack[i * 64]; \
+            } \
+            gsptr += SHORT_STACK_SIZE; \
+            lsptr = ldsstack + 64; \
+        } \
+        *lsptr = (x); \
+        lsptr += 64; \
+    }
 
-    union
-    {
-        // Start primitive index in case of a leaf node
-        uint start;
-        // Children indices
-        uint c[3];
-    };
+// Order two children by distance
+#define SORT_CHILDREN(da, ca, db, cb) \
+    if ((db) < (da)) \
+    { \
+        float dt = (da); (da) = (db); (db) = dt; \
+        int ct = (ca); (ca) = (cb); (cb) = ct; \
+    }
 
-    // Next node during traversal
-    uint next;
-    uint padding;
-    uint padding1;
-    uint padding2;
-} BvhNode;
 
-typedef struct _Face
+typedef struct
 {
-    // Vertex indices
-    int idx[4];
-    // Primitive ID
-    int id;
-    // Idx count
-    int cnt;
-} Face;
-
-#define NUMPRIMS(x)     (((x).typecnt) >> 1)
-#define BVHROOTIDX(x)   (((x).start))
-#define TRANSFROMIDX(x) (((x).typecnt) >> 1)
-#define LEAFNODE(x)     (((x).typecnt & 0x1) == 0)
-
-typedef struct 
+    // Child bounds in SoA form
+    float4 bminx;
+    float4 bmaxx;
+    float4 bminy;
+    float4 bmaxy;
+    float4 bminz;
+    float4 bmaxz;
+    // Child node index or first primitive
+    int4 child;
+    // Number of primitives for leaves, 0 for internal nodes, -1 for empty slots
+    int4 count;
+} QBvhNode;
+
+typedef struct
 {
     // BVH structure
-    __global BvhNode*       nodes;
+    __global QBvhNode const*     nodes;
     // Scene positional data
-    __global float3*        vertices;
+    __global float3 const*         vertices;
     // Scene indices
-    __global Face*          faces;
+    __global Face const*         faces;
     // Shape IDs
-    __global int*           shapeids;
-
+    __global ShapeData const*     shapes;
+    // Extra data
+    __global int const*             extra;
 } SceneData;
 
-
 /*************************************************************************
 HELPER FUNCTIONS
 **************************************************************************/
-
-#ifndef APPLE
-
-float4 make_float4(float x, float y, float z, float w)
+// Intersect ray with all 4 child boxes, returns hit distance or -1.f on miss
+float4 IntersectBox4(ray const* r, float3 invdir, QBvhNode const* node, float maxt)
 {
-    float4 res;
-    res.x = x;
-    res.y = y;
-    res.z = z;
-    res.w = w;
-    return res;
+    const float4 fx = (node->bmaxx - r->o.x) * invdir.x;
+    const float4 nx = (node->bminx - r->o.x) * invdir.x;
+    const float4 fy = (node->bmaxy - r->o.y) * invdir.y;
+    const float4 ny = (node->bminy - r->o.y) * invdir.y;
+    const float4 fz = (node->bmaxz - r->o.z) * invdir.z;
+    const float4 nz = (node->bminz - r->o.z) * invdir.z;
+
+    const float4 t1 = min(min(max(fx, nx), min(max(fy, ny), max(fz, nz))), maxt);
+    const float4 t0 = max(max(min(fx, nx), max(min(fy, ny), min(fz, nz))), 0.f);
+
+    const float4 t = select(t1, t0, t0 > 0.f);
+    return select((float4)(-1.f), t, (t1 >= t0) & (node->count >= 0));
 }
 
-float3 make_float3(float x, float y, float z)
-{
-    float3 res;
-    res.x = x;
-    res.y = y;
-    res.z = z;
-    return res;
-}
 
-float2 make_float2(float x, float y)
-{
-    float2 res;
-    res.x = x;
-    res.y = y;
-    return res;
-}
 
-int2 make_int2(int x, int y)
-{
-    int2 res;
-    res.x = x;
-    res.y = y;
-    return res;
-}
-
-int3 make_int3(int x, int y, int z)
+/*************************************************************************
+BVH FUNCTIONS
+**************************************************************************/
+//  intersect a ray with leaf BVH node
+void IntersectLeafClosest(
+    SceneData const* scenedata,
+    int faceidx,
+    int numprims,
+    ray const* r,                // ray to instersect
+    Intersection* isect          // Intersection structure
+    )
 {
-    int3 res;
-    res.x = x;
-    res.y = y;
-    res.z = z;
-    return res;
-}
+    Face face;
 
-#endif
+    for (int i = faceidx; i < faceidx + numprims; ++i)
+    {
+        face = scenedata->faces[i];
 
-float3 transform_point(float3 p, float16 m)
-{
-    float3 res;
-    res.x = m.s0 * p.x + m.s1 * p.y + m.s2 * p.z + m.s3;
-    res.y = m.s4 * p.x + m.s5 * p.y + m.s6 * p.z + m.s7;
-    res.z = m.s8 * p.x + m.s9 * p.y + m.sA * p.z + m.sB;
-    return res;
-}
+#ifdef RR_RAY_MASK
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-float3 transform_vector(float3 p, float16 m)
-{
-    float3 res;
-    res.x = m.s0 * p.x + m.s1 * p.y + m.s2 * p.z;
-    res.y = m.s4 * p.x + m.s5 * p.y + m.s6 * p.z;
-    res.z = m.s8 * p.x + m.s9 * p.y + m.sA * p.z;
-    return res;
+        if (Ray_GetMask(r) & shapemask)
+#endif
+        {
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
+            {
+                isect->primid = face.id;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
+            }
+        }
+    }
 }
 
-ray transform_ray(ray r, float16 m)
+//  intersect a ray with leaf BVH node
+bool IntersectLeafAny(
+    SceneData const* scenedata,
+    int faceidx,
+    int numprims,
+    ray const* r                      // ray to instersect
+    )
 {
-    ray res;
-    res.o = transform_point(r.o, m);
-    res.d = transform_vector(r.d, m);
-    res.range = r.range;
-    res.time = r.time;
-    return res;
-}
+    Face face;
 
-// Intersect Ray against triangle
-bool IntersectTriangle(ray* r, float3 v1, float3 v2, float3 v3, float* a, float* b)
-{
-    float3 e1 = v2 - v1;
-    float3 e2 = v3 - v1;
-    float3 s1 = cross(r->d, e2);
-    float  invd = 1.f / dot(s1, e1);
-    float3 d = r->o - v1;
-    float  b1 = dot(d, s1) * invd;
-    float3 s2 = cross(d, e1);
-    float  b2 = dot(r->d, s2) * invd;   
-    float temp = dot(e2, s2) * invd;
-
-    if (b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f 
-        || temp < r->range.x || temp > r->range.y)
+    for (int i = faceidx; i < faceidx + numprims; ++i)
     {
-        return false;
-    }
-    else
-    {
-        r->range.y = temp;
-        *a = b1;
-        *b = b2;
-        return true;
-    }
-}
+        face = scenedata->faces[i];
 
-bool IntersectTriangleP(ray* r, float3 v1, float3 v2, float3 v3)
-{
-    float3 e1 = v2 - v1;
-    float3 e2 = v3 - v1;
-    float3 s1 = cross(r->d, e2);
-    float  invd = 1.f / dot(s1, e1);
-    float3 d = r->o - v1;
-    float  b1 = dot(d, s1) * invd;
-    float3 s2 = cross(d, e1);
-    float  b2 = dot(r->d, s2) * invd;   
-    float temp = dot(e2, s2) * invd;
-
-    if (b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f 
-        || temp < r->range.x || temp > r->range.y)
-    {
-        return false;
+#ifdef RR_RAY_MASK
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
+
+        if (Ray_GetMask(r) & shapemask)
+#endif
+        {
+            if (IntersectFaceP(r, scenedata->vertices, &face))
+            {
+                return true;
+            }
+        }
     }
 
-    return true;
+    return false;
 }
 
-// Intersect ray with the axis-aligned box
-bool IntersectBox(ray* r, float3 invdir, bbox box)
+// intersect Ray against the whole BVH structure
+bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersection* isect, __global int* stack, __local int* ldsstack)
 {
-    float3 f = (box.pmax - r->o) * invdir;
-    float3 n = (box.pmin - r->o) * invdir;
+    const float3 invdir = native_recip(r->d.xyz);
+
+    isect->uvwt = make_float4(0.f, 0.f, 0.f, r->o.w);
+    isect->shapeid = -1;
+    isect->primid = -1;
 
-    float3 tmax = max(f, n); 
-    float3 tmin = min(f, n); 
+    if (r->o.w < 0.f)
+        return false;
 
-    float t1 = min(min(tmax.x, min(tmax.y, tmax.z)), r->range.y);
-    float t0 = max(max(tmin.x, max(tmin.y, tmin.z)), r->range.x);
+    __global int* gsptr = stack;
+    __local  int* lsptr = ldsstack;
 
-    return (t1 >= t0);
-}
+    *lsptr = -1;
+    lsptr += 64;
 
-//  intersect a ray with leaf BVH node
-bool IntersectLeafClosest( 
-    SceneData* scenedata,
-    BvhNode* node,
-    ray* r,                      // ray to instersect
-    Intersection* isect          // Intersection structure
-    )
-{
-    bool hit = false;
-    int thishit = 0;
-    float a;
-    float b;
-    float3 v1, v2, v3, v4;
-    Face face;
+    int idx = 0;
+    QBvhNode node;
 
-    for (int i=0; i<4; ++i)
+    while (idx > -1)
     {
-        thishit = false;
+        while (idx > -1)
+        {
+            node = scenedata->nodes[idx];
 
-        face = scenedata->faces[node->start + i];
+            const float4 t = IntersectBox4(r, invdir, &node, isect->uvwt.w);
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
+            // Leaves are intersected right away
+            const int4 leafhit = (t > 0.f) & (node.count > 0);
 
-        switch (face.cnt)
-        {
-        case 3:
+            if (leafhit.x)
             {
-                // Triangle
-                if (IntersectTriangle(r, v1, v2, v3, &a, &b))
-                {
-                    thishit = 1;
-                }
+                IntersectLeafClosest(scenedata, node.child.x, node.count.x, r, isect);
+            }
+
+            if (leafhit.y)
+            {
+                IntersectLeafClosest(scenedata, node.child.y, node.count.y, r, isect);
+            }
 
-                break;
+            if (leafhit.z)
+            {
+                IntersectLeafClosest(scenedata, node.child.z, node.count.z, r, isect);
             }
-        case 4:
+
+            if (leafhit.w)
+            {
+                IntersectLeafClosest(scenedata, node.child.w, node.count.w, r, isect);
+            }
+
+            // Internal children still in range are visited front to back
+            float4 dist = select((float4)(INFINITY), t, (t > 0.f) & (t <= isect->uvwt.w) & (node.count == 0));
+            int4 child = node.child;
+
+            SORT_CHILDREN(dist.x, child.x, dist.y, child.y);
+            SORT_CHILDREN(dist.z, child.z, dist.w, child.w);
+            SORT_CHILDREN(dist.x, child.x, dist.z, child.z);
+            SORT_CHILDREN(dist.y, child.y, dist.w, child.w);
+            SORT_CHILDREN(dist.y, child.y, dist.z, child.z);
+
+            if (dist.x < INFINITY)
             {
-                // Quad
-                v4 = scenedata->vertices[face.idx[3]];
-                if (IntersectTriangle(r, v1, v2, v3, &a, &b))
+                if (dist.w < INFINITY)
                 {
-                   thishit = 1;
+                    PUSH_NODE(child.w);
                 }
-                else if (IntersectTriangle(r, v3, v4, v1, &a, &b))
+
+                if (dist.z < INFINITY)
+                {
+                    PUSH_NODE(child.z);
+                }
+
+                if (dist.y < INFINITY)
                 {
-                    thishit = 2;
+                    PUSH_NODE(child.y);
                 }
 
-                break;
+                idx = child.x;
+                continue;
             }
+
+            lsptr -= 64;
+            idx = *(lsptr);
         }
 
-        if (thishit > 0)
+        if (gsptr > stack)
         {
-            hit = true;
-            isect->uv = make_float2(a,b);
-            isect->primid = face.id;
-            isect->shapeid = scenedata->shapeids[node->start + i];
-            isect->extra = thishit - 1;
-            isect->instanceid = -1;
-        }
+            gsptr -= SHORT_STACK_SIZE;
 
-        if (i + 1 >= NUMPRIMS(*node)) return hit;
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+            {
+                ldsstack[i * 64] = gsptr[i];
+            }
+
+            lsptr = ldsstack + (SHORT_STACK_SIZE - 1) * 64;
+            idx = ldsstack[64 * (SHORT_STACK_SIZE - 1)];
+        }
     }
 
-    return hit;
+    return isect->shapeid >= 0;
 }
 
-//  intersect a ray with leaf BVH node
-bool IntersectLeafAny(
-    SceneData* scenedata,
-    BvhNode* node,
-    ray* r                      // ray to instersect
-    )
+// intersect Ray against the whole BVH structure
+bool IntersectSceneAny(SceneData const* scenedata, ray const* r, __global int* stack, __local int* ldsstack)
 {
-    float3 v1, v2, v3, v4;
-    Face face; 
+    const float3 invdir = native_recip(r->d.xyz);
 
-    for (int i = 0; i < 4; ++i)
-    {
-        face = scenedata->faces[node->start + i];
+    __global int* gsptr = stack;
+    __local  int* lsptr = ldsstack;
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
+    if (r->o.w < 0.f)
+        return false;
 
-        switch (face.cnt)
+    *lsptr = -1;
+    lsptr += 64;
+
+    int idx = 0;
+    QBvhNode node;
+
+    while (idx > -1)
+    {
+        while (idx > -1)
         {
-        case 3:
-            {
-                // Triangle
-                if (IntersectTriangleP(r, v1, v2, v3))
-                {
-                    return true;
-                }
+            node = scenedata->nodes[idx];
 
-                break;
-            }
-        case 4:
-            {
-                v4 = scenedata->vertices[face.idx[3]];
-                // Quad
-                if (IntersectTriangleP(r, v1, v2, v3) || IntersectTriangleP(r, v3, v4, v1))
-                {
-                    return true;
-                }
+            const float4 t = IntersectBox4(r, invdir, &node, r->o.w);
 
-                break;
-            }
-        }
+            const int4 leafhit = (t > 0.f) & (node.count > 0);
 
-        if (i + 1 >= NUMPRIMS(*node)) break;
-    }
+            if (leafhit.x && IntersectLeafAny(scenedata, node.child.x, node.count.x, r))
+                return true;
 
-    return false;
-}
+            if (leafhit.y && IntersectLeafAny(scenedata, node.child.y, node.count.y, r))
+                return true;
 
-// intersect Ray against the whole BVH structure
-bool IntersectSceneClosest(SceneData* scenedata,  ray* r, Intersection* isect)
-{
-    bool hit = false;
-    float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d;
+            if (leafhit.z && IntersectLeafAny(scenedata, node.child.z, node.count.z, r))
+                return true;
 
-    uint idx = 0;
-    while (idx != 0xFFFFFFFF)
-    {
-        // Try intersecting against current node's bounding box.
-        // If this is the leaf try to intersect against contained triangle.
-        BvhNode node = scenedata->nodes[idx];
-        if (IntersectBox(r, invdir, node.bounds))
-        {
-            if (LEAFNODE(node))
-            {
-                hit |= IntersectLeafClosest(scenedata, &node, r, isect);
-                idx = node.next;
-                continue;
-            }
-            // Traverse child nodes otherwise.
-            else
+            if (leafhit.w && IntersectLeafAny(scenedata, node.child.w, node.count.w, r))
+                return true;
+
+            // Any hit terminates traversal, so internal children are not sorted
+            const int4 internalhit = (t > 0.f) & (node.count == 0);
+            int next = -1;
+
+            if (internalhit.w)
             {
-                idx = idx + 1;
-                continue;
+                next = node.child.w;
             }
-        }
-        else
-        {
-            idx = node.next;
-        }
-    };
 
-    return hit;
-}
+            if (internalhit.z)
+            {
+                if (next > -1)
+                {
+                    PUSH_NODE(next);
+                }
 
-// intersect Ray against the whole BVH structure
-bool IntersectSceneAny(SceneData* scenedata,  ray* r)
-{
-    float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d;
+                next = node.child.z;
+            }
 
-    uint idx = 0;
-    while (idx != 0xFFFFFFFF)
-    {
-        // Try intersecting against current node's bounding box.
-        // If this is the leaf try to intersect against contained triangle.
-        BvhNode node = scenedata->nodes[idx];
-        if (IntersectBox(r, invdir, node.bounds))
-        {
-            if (LEAFNODE(node))
+            if (internalhit.y)
             {
-                if (IntersectLeafAny(scenedata, &node, r))
+                if (next > -1)
                 {
-                    return true;
+                    PUSH_NODE(next);
                 }
-                else
+
+                next = node.child.y;
+            }
+
+            if (internalhit.x)
+            {
+                if (next > -1)
                 {
-                    idx = node.next;
-                    continue;
+                    PUSH_NODE(next);
                 }
+
+                next = node.child.x;
             }
-            // Traverse child nodes otherwise.
-            else
+
+            if (next > -1)
             {
-                idx = idx + 1;
+                idx = next;
                 continue;
             }
+
+            lsptr -= 64;
+            idx = *(lsptr);
         }
-        else
+
+        if (gsptr > stack)
         {
-            idx = node.next;
+            gsptr -= SHORT_STACK_SIZE;
+
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+            {
+                ldsstack[i * 64] = gsptr[i];
+            }
+
+            lsptr = ldsstack + (SHORT_STACK_SIZE - 1) * 64;
+            idx = ldsstack[64 * (SHORT_STACK_SIZE - 1)];
         }
-    };
+    }
 
     return false;
 }
@@ -454,50 +387,45 @@ bool IntersectSceneAny(SceneData* scenedata,  ray* r)
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosest(
     // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,    // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
+    __global QBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes, // Shape data
+    __global ray const* rays,        // Ray workload
     int offset,                // Offset in rays array
-    int numrays,               // Number of rays to process                    
-    __global int* hitresults,  // Hit results
+    int numrays,               // Number of rays to process
     __global Intersection* hits // Hit datas
+    , __global int* stack
     )
 {
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
 
-    int global_id  = get_global_id(0);
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
-    // Handle only working subset
     if (global_id < numrays)
     {
         // Fetch ray
-        int idx = offset + global_id;
-        ray r = rays[idx];
-
-        // Calculate closest hit
-        Intersection isect;
-        int hit = (int)IntersectSceneClosest(&scenedata, &r, &isect);
-
-        // Write data back in case of a hit
-        if (hit)
-        {
-            hitresults[idx] = 1;
-            rays[idx] = r;
-            hits[idx] = isect;
-        }
-        else
+        ray r = rays[global_id];
+        
+        if (Ray_IsActive(&r))
         {
-            hitresults[idx] = 0;
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect, stack + global_id * GLOBAL_STACK_SIZE, ldsstack + local_id);
+
+            // Write data back in case of a hit
+            hits[global_id] = isect;
         }
     }
 }
@@ -505,120 +433,130 @@ __kernel void IntersectClosest(
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAny(
     // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,    // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
+    __global QBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes,     // Shape data
+    __global ray const* rays,        // Ray workload
     int offset,                // Offset in rays array
     int numrays,               // Number of rays to process                    
-    __global int* hitresults   // Hit results
+    __global int* hitresults  // Hit results
+    , __global int* stack
     )
 {
-    int global_id  = get_global_id(0);
+
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
-    // Handle only working subset
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[offset + global_id];
+        ray r = rays[global_id];
 
-        // Calculate any intersection
-        hitresults[offset + global_id] = (int)IntersectSceneAny(&scenedata, &r);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r, stack + global_id * GLOBAL_STACK_SIZE, ldsstack + local_id) ? 1 : -1;
+        }
     }
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
 __kernel void IntersectClosestRC(
-    // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,    // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
-    __global int* rayindices,
+    __global QBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,      // Scene indices
+    __global ShapeData const* shapes,     // Shape data
+    __global ray const* rays,        // Ray workload
     int offset,                // Offset in rays array
-    __global int* numrays,               // Number of rays to process                    
+    __global int const* numrays,     // Number of rays in the workload
     __global Intersection* hits // Hit datas
+    , __global int* stack
     )
 {
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
 
-    int global_id  = get_global_id(0);
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
     // Handle only working subset
     if (global_id < *numrays)
     {
         // Fetch ray
-        int idx = offset + global_id;
-        ray r = rays[idx];
-
-        // Calculate closest hit
-        Intersection isect;
-        int hit = (int)IntersectSceneClosest(&scenedata, &r, &isect);
+        ray r = rays[global_id];
 
-        // Write data back in case of a hit
-        if (hit)
+        if (Ray_IsActive(&r))
         {
-            hitresults[idx] = 1;
-            rays[idx] = r;
-            hits[idx] = isect;
-        }
-        else
-        {
-            hitresults[idx] = 0;
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect, stack + global_id * GLOBAL_STACK_SIZE, ldsstack + local_id);
+            // Write data back in case of a hit
+            hits[global_id] = isect;
         }
     }
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
 __kernel void IntersectAnyRC(
     // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,      // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
+    __global QBvhNode const* nodes,   // BVH nodes
+    __global float3 const* vertices, // Scene positional data
+    __global Face const* faces,    // Scene indices
+    __global ShapeData const* shapes,     // Shape data
+    __global ray const* rays,        // Ray workload
     int offset,                // Offset in rays array
-    __global int* numrays,     // Number of rays to process
+    __global int const* numrays,     // Number of rays in the workload
     __global int* hitresults   // Hit results
+    , __global int* stack
     )
 {
-    int global_id  = get_global_id(0);
+    __local int ldsstack[SHORT_STACK_SIZE * 64];
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
     // Handle only working subset
     if (global_id < *numrays)
     {
         // Fetch ray
-        ray r = rays[offset + global_id];
+        ray r = rays[global_id];
 
-        // Calculate any intersection
-        hitresults[offset + global_id] = (int)IntersectSceneAny(&scenedata, &r);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r, stack + global_id * GLOBAL_STACK_SIZE, ldsstack + local_id) ? 1 : -1;
+        }
     }
-}
\ No newline at end of file
+}
@@ -21,6 +21,7 @@ THE SOFTWARE.
 ********************************************************************/
 #include "bvh2lstrategy.h"
 #include "../accelerator/bvh.h"
+#include "../accelerator/linear_bvh.h"
 #include "../translator/plain_bvh_translator.h"
 #include "../world/world.h"
 #include "../primitive/mesh.h"
@@ -62,7 +63,9 @@ namespace RadeonRays
         int id;
         // Idx count
         int cnt;
-        int padding[2];
+        // Fourth vertex index of a quad
+        int idx3;
+        int padding;
     };
 
     struct Bvh2lStrategy::GpuData
@@ -77,6 +80,8 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
+        // Shape masks of the nodes
+        Calc::Buffer* nodemasks;
 
         int bvhrootidx;
 
@@ -85,6 +90,10 @@ namespace RadeonRays
         Calc::Function* occlude_func;
         Calc::Function* isect_indirect_func;
         Calc::Function* occlude_indirect_func;
+        // OpenCL only
+        Calc::Function* isect_multi_func;
+        Calc::Function* isect_soa_func;
+        Calc::Function* occlude_soa_func;
 
         GpuData(Calc::Device* d)
             : device(d)
@@ -92,12 +101,16 @@ namespace RadeonRays
             , vertices(nullptr)
             , faces(nullptr)
             , shapes(nullptr)
+            , nodemasks(nullptr)
             , bvhrootidx(-1)
             , executable(nullptr)
             , isect_func(nullptr)
             , occlude_func(nullptr)
             , isect_indirect_func(nullptr)
             , occlude_indirect_func(nullptr)
+            , isect_multi_func(nullptr)
+            , isect_soa_func(nullptr)
+            , occlude_soa_func(nullptr)
         {
         }
 
@@ -107,12 +120,19 @@ namespace RadeonRays
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
+            device->DeleteBuffer(nodemasks);
             if(executable != nullptr)
             {
                 executable->DeleteFunction(isect_func);
                 executable->DeleteFunction(occlude_func);
                 executable->DeleteFunction(isect_indirect_func);
                 executable->DeleteFunction(occlude_indirect_func);
+                if (isect_multi_func)
+                {
+                    executable->DeleteFunction(isect_multi_func);
+                    executable->DeleteFunction(isect_soa_func);
+                    executable->DeleteFunction(occlude_soa_func);
+                }
                 device->DeleteExecutable(executable);
             }
         }
@@ -177,6 +197,13 @@ namespace RadeonRays
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny2L");
         m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC2L");
         m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC2L");
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->isect_multi_func = m_gpudata->executable->CreateFunction("IntersectClosestMulti2L");
+            m_gpudata->isect_soa_func = m_gpudata->executable->CreateFunction("IntersectClosestSoA2L");
+            m_gpudata->occlude_soa_func = m_gpudata->executable->CreateFunction("IntersectAnySoA2L");
+        }
     }
 
     void Bvh2lStrategy::Preprocess(World const& world)
@@ -193,20 +220,30 @@ namespace RadeonRays
                 m_device->DeleteBuffer(m_gpudata->vertices);
                 m_device->DeleteBuffer(m_gpudata->faces);
                 m_device->DeleteBuffer(m_gpudata->shapes);
+                m_device->DeleteBuffer(m_gpudata->nodemasks);
             }
 
 
             auto builder = world.options_.GetOption("bvh.builder");
             auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+            auto parallel = world.options_.GetOption("bvh.parallel_build");
+            auto optimize = world.options_.GetOption("bvh.optimize");
 
             bool use_sah = false;
+            bool use_lbvh = false;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+            bool parallel_build = parallel ? parallel->AsFloat() > 0.f : false;
+            bool optimize_treelets = optimize && optimize->AsString() == "treelet";
 
 
             if (builder && builder->AsString() == "sah")
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             // Copy the shapes here to be able to partition them and handle more efficiently
             // #22: we need to be able to handle instances whos base shapes are not present 
@@ -262,7 +299,7 @@ namespace RadeonRays
             // Create actual BVH objects
             for (int i = 0; i < nummeshes + 1; ++i)
             {
-                m_bvhs[i].reset(new Bvh(traversal_cost, use_sah));
+                m_bvhs[i].reset(use_lbvh ? new LinearBvh(traversal_cost) : new Bvh(traversal_cost, use_sah, parallel_build));
                 m_cpudata->bvhptrs[i] = m_bvhs[i].get();
             }
 
@@ -305,6 +342,11 @@ namespace RadeonRays
                 // Build BVH for current mesh
                 m_bvhs[i]->Build(&m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]], mesh->num_faces());
 
+                if (optimize_treelets)
+                {
+                    m_bvhs[i]->OptimizeTreelets();
+                }
+
                 // Extract and store bounds. Note they are in object space and we need to translate them to world space
                 object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
 
@@ -338,6 +380,12 @@ namespace RadeonRays
 
             // Calculate top level BVH
             m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
+
+            if (optimize_treelets)
+            {
+                m_bvhs[nummeshes]->OptimizeTreelets();
+            }
+
             m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
 
             m_cpudata->translator.Flush();
@@ -430,8 +478,9 @@ namespace RadeonRays
                         facedata[myidx].idx[0] = myfaces[faceidx].idx[0] + startidx;
                         facedata[myidx].idx[1] = myfaces[faceidx].idx[1] + startidx;
                         facedata[myidx].idx[2] = myfaces[faceidx].idx[2] + startidx;
+                        facedata[myidx].idx3 = myfaces[faceidx].idx[3] + startidx;
 
-                        facedata[myidx].cnt = 3;
+                        facedata[myidx].cnt = (myfaces[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
                         facedata[myidx].id = faceidx;
                     }
                 }
@@ -493,6 +542,10 @@ namespace RadeonRays
 
             // Create face ID buffer
             m_gpudata->shapes = m_device->CreateBuffer((nummeshes + numinstances) * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
+
+            // Node masks
+            CollectNodeMasks();
+            m_gpudata->nodemasks = m_device->CreateBuffer(m_cpudata->translator.masks_.size() * sizeof(int), Calc::kRead, &m_cpudata->translator.masks_[0]);
         }
         // Refit
         else if (statechange != ShapeImpl::kStateChangeNone)
@@ -579,18 +632,33 @@ namespace RadeonRays
             // Calculate top level BVH
             auto builder = world.options_.GetOption("bvh.builder");
             auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+            auto parallel = world.options_.GetOption("bvh.parallel_build");
+            auto optimize = world.options_.GetOption("bvh.optimize");
 
             bool use_sah = false;
+            bool use_lbvh = false;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+            bool parallel_build = parallel ? parallel->AsFloat() > 0.f : false;
+            bool optimize_treelets = optimize && optimize->AsString() == "treelet";
 
 
             if (builder && builder->AsString() == "sah")
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
-            m_bvhs[nummeshes].reset(new Bvh(traversal_cost, use_sah));
+            m_bvhs[nummeshes].reset(use_lbvh ? new LinearBvh(traversal_cost) : new Bvh(traversal_cost, use_sah, parallel_build));
             m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
+
+            if (optimize_treelets)
+            {
+                m_bvhs[nummeshes]->OptimizeTreelets();
+            }
+
             m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
 
 
@@ -658,10 +726,50 @@ namespace RadeonRays
             e->Wait();
             m_device->DeleteEvent(e);
 
+            // Shape masks might have changed as well as the top level layout
+            CollectNodeMasks();
+            m_device->WriteBuffer(m_gpudata->nodemasks, 0, 0, m_cpudata->translator.masks_.size() * sizeof(int), &m_cpudata->translator.masks_[0], &e);
+
+            e->Wait();
+            m_device->DeleteEvent(e);
+
             m_device->Finish(0);
         }
     }
 
+    void Bvh2lStrategy::CollectNodeMasks() const
+    {
+        auto& translator = m_cpudata->translator;
+        auto const& shapedata = m_cpudata->shapedata;
+        auto const& mesh_faces_start_idx = m_cpudata->mesh_faces_start_idx;
+
+        // Mesh BVH is visible if the mesh itself or any of its instances is
+        std::vector<int> meshmasks(translator.roots_.size(), 0);
+        for (auto const& shape : shapedata)
+        {
+            auto iter = std::lower_bound(translator.roots_.cbegin(), translator.roots_.cend(), shape.bvhidx);
+            meshmasks[std::distance(translator.roots_.cbegin(), iter)] |= shape.mask;
+        }
+
+        int numfaces = (int)m_cpudata->bounds.size();
+        std::vector<int> facemasks(numfaces);
+        for (int i = 0; i < numfaces; ++i)
+        {
+            auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), i);
+            facemasks[i] = meshmasks[std::distance(mesh_faces_start_idx.cbegin(), iter) - 1];
+        }
+
+        // Top level leaves index shape data
+        std::vector<int> shapemasks(shapedata.size());
+        for (int i = 0; i < (int)shapedata.size(); ++i)
+        {
+            shapemasks[i] = shapedata[i].mask;
+        }
+
+        translator.ProcessMasks(facemasks.data(), 0, translator.root_);
+        translator.ProcessMasks(shapemasks.data(), translator.root_, (int)translator.nodes_.size());
+    }
+
     void Bvh2lStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
     {
         auto& func = m_gpudata->isect_func;
@@ -680,6 +788,12 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -704,6 +818,12 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -728,6 +848,12 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -752,9 +878,107 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
         m_device->Execute(func, queueidx, globalsize, localsize, event);
     }
+
+    void Bvh2lStrategy::QueryIntersectionMulti(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, std::uint32_t k, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->isect_multi_func, "Multi-hit queries are only supported on OpenCL devices.");
+
+        auto& func = m_gpudata->isect_multi_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, sizeof(k), &k);
+        func->SetArg(arg++, hits);
+
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void Bvh2lStrategy::QueryIntersectionSoA(std::uint32_t queueidx, CalcRaySoA const& rays, std::uint32_t numrays, CalcIntersectionSoA const& hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->isect_soa_func, "SoA rays are only supported on OpenCL devices.");
+
+        auto& func = m_gpudata->isect_soa_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+        func->SetArg(arg++, rays.origins);
+        func->SetArg(arg++, rays.directions);
+        SetOptionalArg(func, arg++, rays.maxt);
+        SetOptionalArg(func, arg++, rays.masks);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        SetOptionalArg(func, arg++, hits.t);
+        SetOptionalArg(func, arg++, hits.primids);
+        SetOptionalArg(func, arg++, hits.shapeids);
+        SetOptionalArg(func, arg++, hits.uvs);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void Bvh2lStrategy::QueryOcclusionSoA(std::uint32_t queueidx, CalcRaySoA const& rays, std::uint32_t numrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->occlude_soa_func, "SoA rays are only supported on OpenCL devices.");
+
+        auto& func = m_gpudata->occlude_soa_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+        func->SetArg(arg++, rays.origins);
+        func->SetArg(arg++, rays.directions);
+        SetOptionalArg(func, arg++, rays.maxt);
+        SetOptionalArg(func, arg++, rays.masks);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
 }
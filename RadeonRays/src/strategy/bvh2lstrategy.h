@@ -68,6 +68,28 @@ namespace RadeonRays
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
 
+        void QueryIntersectionMulti(std::uint32_t queueidx,
+                                    Calc::Buffer const* rays,
+                                    std::uint32_t numrays,
+                                    std::uint32_t k,
+                                    Calc::Buffer* hits,
+                                    Calc::Event const* waitevent,
+                                    Calc::Event** event) const override;
+
+        void QueryIntersectionSoA(std::uint32_t queueidx,
+                                  CalcRaySoA const& rays,
+                                  std::uint32_t numrays,
+                                  CalcIntersectionSoA const& hits,
+                                  Calc::Event const* waitevent,
+                                  Calc::Event** event) const override;
+
+        void QueryOcclusionSoA(std::uint32_t queueidx,
+                               CalcRaySoA const& rays,
+                               std::uint32_t numrays,
+                               Calc::Buffer* hits,
+                               Calc::Event const* waitevent,
+                               Calc::Event** event) const override;
+
     private:
 
         // Gpu data
@@ -76,6 +98,9 @@ namespace RadeonRays
         struct ShapeData;
         struct Face;
 
+        // OR shape masks into the translated nodes of both levels
+        void CollectNodeMasks() const;
+
         std::unique_ptr<GpuData> m_gpudata;
         std::unique_ptr<CpuData> m_cpudata;
         std::vector<std::unique_ptr<Bvh> > m_bvhs;
@@ -23,14 +23,17 @@ THE SOFTWARE.
 
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
 
 #include "../translator/plain_bvh_translator.h"
+#include "../util/bvh_cache.h"
 
 #include "device.h"
 #include "executable.h"
+#include "primitives.h"
 #include <algorithm>
 
 extern const char * _get_resource_path(const char *);
@@ -70,6 +73,8 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
+        // Geometry masks of the nodes
+        Calc::Buffer* nodemasks;
         // Counter
         Calc::Buffer* raycnt;
 
@@ -78,6 +83,23 @@ namespace RadeonRays
         Calc::Function* occlude_func;
         Calc::Function* isect_indirect_func;
         Calc::Function* occlude_indirect_func;
+        // OpenCL only
+        Calc::Function* isect_multi_func;
+        Calc::Function* isect_compact_func;
+        Calc::Function* occlude_compact_func;
+        Calc::Function* isect_compact_indirect_func;
+        Calc::Function* occlude_compact_indirect_func;
+        Calc::Function* isect_soa_func;
+        Calc::Function* occlude_soa_func;
+        Calc::Function* closest_point_func;
+        Calc::Function* overlap_func;
+
+        // Overlap query slots and their occupancy, sized for the last query
+        Calc::Buffer* overlap_slots;
+        Calc::Buffer* overlap_predicate;
+        Calc::Buffer* overlap_total;
+        std::size_t overlap_size;
+        Calc::Primitives* pp;
 
         GpuData(Calc::Device* d)
             : device(d)
@@ -85,8 +107,23 @@ namespace RadeonRays
             , vertices(nullptr)
             , faces(nullptr)
             , shapes(nullptr)
+            , nodemasks(nullptr)
             , raycnt(nullptr)
             , executable(nullptr)
+            , isect_multi_func(nullptr)
+            , isect_compact_func(nullptr)
+            , occlude_compact_func(nullptr)
+            , isect_compact_indirect_func(nullptr)
+            , occlude_compact_indirect_func(nullptr)
+            , isect_soa_func(nullptr)
+            , occlude_soa_func(nullptr)
+            , closest_point_func(nullptr)
+            , overlap_func(nullptr)
+            , overlap_slots(nullptr)
+            , overlap_predicate(nullptr)
+            , overlap_total(nullptr)
+            , overlap_size(0)
+            , pp(nullptr)
         {
         }
 
@@ -96,21 +133,78 @@ namespace RadeonRays
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
+            device->DeleteBuffer(nodemasks);
             device->DeleteBuffer(raycnt);
+            device->DeleteBuffer(overlap_slots);
+            device->DeleteBuffer(overlap_predicate);
+            device->DeleteBuffer(overlap_total);
+            if (pp)
+            {
+                device->DeletePrimitives(pp);
+            }
             if (executable)
             {
                 executable->DeleteFunction(isect_func);
                 executable->DeleteFunction(occlude_func);
                 executable->DeleteFunction(isect_indirect_func);
                 executable->DeleteFunction(occlude_indirect_func);
+                if (isect_multi_func)
+                {
+                    executable->DeleteFunction(isect_multi_func);
+                }
+                if (isect_compact_func)
+                {
+                    executable->DeleteFunction(isect_compact_func);
+                    executable->DeleteFunction(occlude_compact_func);
+                    executable->DeleteFunction(isect_compact_indirect_func);
+                    executable->DeleteFunction(occlude_compact_indirect_func);
+                }
+                if (isect_soa_func)
+                {
+                    executable->DeleteFunction(isect_soa_func);
+                    executable->DeleteFunction(occlude_soa_func);
+                }
+                if (closest_point_func)
+                {
+                    executable->DeleteFunction(closest_point_func);
+                }
+                if (overlap_func)
+                {
+                    executable->DeleteFunction(overlap_func);
+                }
                 device->DeleteExecutable(executable);
             }
         }
     };
 
+    struct BvhStrategy::CpuData
+    {
+        // Shapes in the order they were flattened, meshes first
+        std::vector<Shape const*> shapes;
+        // Start indices of shape vertices and faces in GPU buffers
+        std::vector<int> mesh_vertices_start_idx;
+        std::vector<int> mesh_faces_start_idx;
+        int nummeshes;
+        int numinstances;
+        int numvertices;
+        int numfaces;
+        // SAH cost of the BVH after the last full build
+        float built_sah_cost;
+
+        CpuData()
+            : nummeshes(0)
+            , numinstances(0)
+            , numvertices(0)
+            , numfaces(0)
+            , built_sah_cost(0.f)
+        {
+        }
+    };
+
     BvhStrategy::BvhStrategy(Calc::Device* device)
         : Strategy(device)
         , m_gpudata(new GpuData(device))
+        , m_cpudata(new CpuData)
         , m_bvh(nullptr)
     {
         std::string buildopts =
@@ -156,20 +250,54 @@ namespace RadeonRays
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
         m_gpudata->isect_indirect_func= m_gpudata->executable->CreateFunction("IntersectClosestRC");
         m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->isect_multi_func = m_gpudata->executable->CreateFunction("IntersectClosestMulti");
+            m_gpudata->isect_compact_func = m_gpudata->executable->CreateFunction("IntersectClosestC");
+            m_gpudata->occlude_compact_func = m_gpudata->executable->CreateFunction("IntersectAnyC");
+            m_gpudata->isect_compact_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestCRC");
+            m_gpudata->occlude_compact_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyCRC");
+            m_gpudata->isect_soa_func = m_gpudata->executable->CreateFunction("IntersectClosestSoA");
+            m_gpudata->occlude_soa_func = m_gpudata->executable->CreateFunction("IntersectAnySoA");
+            m_gpudata->closest_point_func = m_gpudata->executable->CreateFunction("ClosestPoint");
+            m_gpudata->overlap_func = m_gpudata->executable->CreateFunction("Overlap");
+        }
     }
 
     void BvhStrategy::Preprocess(World const& world)
     {
+        int statechange = world.GetStateChange();
+
+        // Shapes have only been moved, try to keep BVH topology
+        if (m_bvh && !world.has_changed() && statechange != ShapeImpl::kStateChangeNone)
+        {
+            auto refit = world.options_.GetOption("bvh.refit");
+
+            if (refit && refit->AsFloat() > 0.f && Refit(world))
+            {
+                return;
+            }
+        }
+
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_gpudata->bvh || world.has_changed() || statechange != ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
+            if (m_gpudata->bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
                 m_device->DeleteBuffer(m_gpudata->vertices);
                 m_device->DeleteBuffer(m_gpudata->faces);
                 m_device->DeleteBuffer(m_gpudata->shapes);
+                m_device->DeleteBuffer(m_gpudata->nodemasks);
                 m_device->DeleteBuffer(m_gpudata->raycnt);
+                // Keep the strategy consistent if the build below throws
+                m_gpudata->bvh = nullptr;
+                m_gpudata->vertices = nullptr;
+                m_gpudata->faces = nullptr;
+                m_gpudata->shapes = nullptr;
+                m_gpudata->nodemasks = nullptr;
+                m_gpudata->raycnt = nullptr;
             }
 
             int numshapes = (int)world.shapes_.size();
@@ -187,18 +315,29 @@ namespace RadeonRays
             auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
             auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
             auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
+            auto parallel = world.options_.GetOption("bvh.parallel_build");
+            auto leafsize = world.options_.GetOption("bvh.max_leaf_size");
+            auto optimize = world.options_.GetOption("bvh.optimize");
 
             bool use_sah = false;
+            bool use_lbvh = false;
             bool use_splits = false;
             int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
             float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
             float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+            bool parallel_build = parallel ? parallel->AsFloat() > 0.f : false;
+            int max_leaf_size = leafsize ? (int)leafsize->AsFloat() : 1;
+            bool optimize_treelets = optimize && optimize->AsString() == "treelet";
 
             if (builder && builder->AsString() == "sah")
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             if (splits && splits->AsFloat() > 0.f)
             {
@@ -207,7 +346,9 @@ namespace RadeonRays
 
             m_bvh.reset( use_splits ? 
                 new SplitBvh(traversal_cost, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, use_sah)
+                use_lbvh ?
+                new LinearBvh(traversal_cost) :
+                new Bvh(traversal_cost, use_sah, parallel_build, max_leaf_size)
             );
 
             // Partition the array into meshes and instances
@@ -247,50 +388,74 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
-            std::vector<ShapeData> shapedata(numshapes);
+            // Static scenes are looked up in the cache by geometry and build options
+            auto cachepath = world.options_.GetOption("bvh.cache.path");
+            std::string cachefile;
+            std::uint64_t cachekey = 0;
 
-            // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
+            if (cachepath && !cachepath->AsString().empty())
             {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                float buildopts[] = { (float)use_sah, (float)use_lbvh, (float)use_splits, (float)max_split_depth,
+                    min_overlap, traversal_cost, extra_node_budget, (float)max_leaf_size, (float)optimize_treelets };
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
+                cachekey = BvhCache::Hash(buildopts, sizeof(buildopts), BvhCache::HashShapes(shapes));
+                cachefile = BvhCache::GetFileName(cachepath->AsString(), cachekey, "bvh");
+
+                Calc::Buffer* cached[3] = { nullptr, nullptr, nullptr };
+
+                if (BvhCache::Load(m_device, cachefile, cachekey, cached, 3))
                 {
-                    // Here we directly get world space bounds
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
+                    m_gpudata->bvh = cached[0];
+                    m_gpudata->vertices = cached[1];
+                    m_gpudata->faces = cached[2];
 
-                shapedata[i].id = mesh->GetId();
-                shapedata[i].mask = mesh->GetMask();
+                    // There is no CPU side BVH to refit, next update rebuilds it
+                    m_bvh.reset(nullptr);
+
+                    std::vector<ShapeData> shapedata(numshapes);
+                    for (int i = 0; i < numshapes; ++i)
+                    {
+                        shapedata[i].id = shapes[i]->GetId();
+                        shapedata[i].mask = shapes[i]->GetMask();
+                    }
+
+                    // Create shapes buffer
+                    m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
+                    // Cached nodes carry no masks, so every node is kept and leaves do the culling
+                    std::vector<int> nodemasks(cached[0]->GetSize() / sizeof(PlainBvhTranslator::Node), ~0);
+                    m_gpudata->nodemasks = m_device->CreateBuffer(nodemasks.size() * sizeof(int), Calc::BufferType::kRead, &nodemasks[0]);
+                    // Create helper raycounter buffer
+                    m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+
+                    // Make sure everything is commited
+                    m_device->Finish(0);
+                    return;
+                }
             }
 
-            // Then we handle instances. Need to flatten them into actual geometry.
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-            {
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            // Keep the layout for refits
+            m_cpudata->shapes = shapes;
+            m_cpudata->mesh_vertices_start_idx = mesh_vertices_start_idx;
+            m_cpudata->mesh_faces_start_idx = mesh_faces_start_idx;
+            m_cpudata->nummeshes = nummeshes;
+            m_cpudata->numinstances = numinstances;
+            m_cpudata->numvertices = numvertices;
+            m_cpudata->numfaces = numfaces;
 
-                // Instance is using its own transform for base shape geometry
-                // so we need to get object space bounds and transform them manually
-                matrix m, minv;
-                instance->GetTransform(m, minv);
+            // We can't avoild allocating it here, since bounds aren't stored anywhere
+            std::vector<bbox> bounds(numfaces);
+            std::vector<ShapeData> shapedata(numshapes);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    bbox tmp;
-                    mesh->GetFaceBounds(j, true, tmp);
-                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
-                }
+            CollectBounds(&bounds[0], &shapedata[0]);
 
-                shapedata[i].id = instance->GetId();
-                shapedata[i].mask = instance->GetMask();
+            m_bvh->Build(&bounds[0], numfaces);
+
+            if (optimize_treelets)
+            {
+                m_bvh->OptimizeTreelets();
             }
 
-            m_bvh->Build(&bounds[0], numfaces);
+            m_cpudata->built_sah_cost = m_bvh->GetSahCost();
 
 #ifdef RR_PROFILE
             m_bvh->PrintStatistics(std::cout);
@@ -317,45 +482,7 @@ namespace RadeonRays
                 m_device->DeleteEvent(e);
 
                 // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
-                {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
-                }
-
-#pragma omp parallel for
-                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    instance->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
-                }
+                TransformVertices(vertexdata);
 
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
 
@@ -375,8 +502,10 @@ namespace RadeonRays
                     int id;
                     // Idx count
                     int cnt;
+                    // Fourth vertex index of a quad
+                    int idx3;
 
-                    int padding[2];
+                    int padding;
                 };
 
                 // This number is different from the number of faces for some BVHs 
@@ -430,9 +559,10 @@ namespace RadeonRays
                     facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
                     facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
                     facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx3 = myfacedata[faceidx].idx[3] + mystartidx;
 
                     facedata[i].shapeidx = shapeidx;
-                    facedata[i].cnt = 0;
+                    facedata[i].cnt = (myfacedata[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
                     facedata[i].id = faceidx;
                 }
 
@@ -444,14 +574,203 @@ namespace RadeonRays
 
             // Create shapes buffer
             m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
+            // Create node masks buffer
+            CollectNodeMasks(translator, &shapedata[0]);
+            m_gpudata->nodemasks = m_device->CreateBuffer(translator.masks_.size() * sizeof(int), Calc::BufferType::kRead, &translator.masks_[0]);
             // Create helper raycounter buffer
             m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
 
+            // Store translated data for the next runs, failing to do so is not an error
+            if (!cachefile.empty())
+            {
+                Calc::Buffer* cached[3] = { m_gpudata->bvh, m_gpudata->vertices, m_gpudata->faces };
+                BvhCache::Save(m_device, cachefile, cachekey, cached, 3);
+            }
+
             // Make sure everything is commited
             m_device->Finish(0);
         }
     }
 
+    void BvhStrategy::CollectBounds(bbox* bounds, ShapeData* shapedata) const
+    {
+        auto const& shapes = m_cpudata->shapes;
+        auto const& mesh_faces_start_idx = m_cpudata->mesh_faces_start_idx;
+        int nummeshes = m_cpudata->nummeshes;
+        int numinstances = m_cpudata->numinstances;
+
+        // We handle meshes first collecting their world space bounds
+#pragma omp parallel for
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+            for (int j = 0; j < mesh->num_faces(); ++j)
+            {
+                // Here we directly get world space bounds
+                mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
+            }
+
+            shapedata[i].id = mesh->GetId();
+            shapedata[i].mask = mesh->GetMask();
+        }
+
+        // Then we handle instances. Need to flatten them into actual geometry.
+#pragma omp parallel for
+        for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+        {
+            Instance const* instance = static_cast<Instance const*>(shapes[i]);
+            Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+            // Instance is using its own transform for base shape geometry
+            // so we need to get object space bounds and transform them manually
+            matrix m, minv;
+            instance->GetTransform(m, minv);
+
+            for (int j = 0; j < mesh->num_faces(); ++j)
+            {
+                bbox tmp;
+                mesh->GetFaceBounds(j, true, tmp);
+                bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+            }
+
+            shapedata[i].id = instance->GetId();
+            shapedata[i].mask = instance->GetMask();
+        }
+    }
+
+    void BvhStrategy::TransformVertices(float3* vertexdata) const
+    {
+        auto const& shapes = m_cpudata->shapes;
+        auto const& mesh_vertices_start_idx = m_cpudata->mesh_vertices_start_idx;
+        int nummeshes = m_cpudata->nummeshes;
+        int numinstances = m_cpudata->numinstances;
+
+        // We need to get the transform from the mesh and multiply each vertex
+#pragma omp parallel for
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            // Get the mesh
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+            // Get vertex buffer of the current mesh
+            float3 const* myvertexdata = mesh->GetVertexData();
+            // Get mesh transform
+            matrix m, minv;
+            mesh->GetTransform(m, minv);
+
+            // Iterate thru vertices multiply and append them to GPU buffer
+            for (int j = 0; j < mesh->num_vertices(); ++j)
+            {
+                vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+            }
+        }
+
+#pragma omp parallel for
+        for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+        {
+            Instance const* instance = static_cast<Instance const*>(shapes[i]);
+            // Get the mesh
+            Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            // Get vertex buffer of the current mesh
+            float3 const* myvertexdata = mesh->GetVertexData();
+            // Get instance transform
+            matrix m, minv;
+            instance->GetTransform(m, minv);
+
+            // Iterate thru vertices multiply and append them to GPU buffer
+            for (int j = 0; j < mesh->num_vertices(); ++j)
+            {
+                vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+            }
+        }
+    }
+
+    void BvhStrategy::CollectNodeMasks(PlainBvhTranslator& translator, ShapeData const* shapedata) const
+    {
+        auto const& mesh_faces_start_idx = m_cpudata->mesh_faces_start_idx;
+
+        int numindices = m_bvh->GetNumIndices();
+        int const* reordering = m_bvh->GetIndices();
+        std::vector<int> primmasks(numindices);
+
+        for (int i = 0; i < numindices; ++i)
+        {
+            auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), reordering[i]);
+            int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+            primmasks[i] = shapedata[shapeidx].mask;
+        }
+
+        translator.ProcessMasks(&primmasks[0]);
+    }
+
+    bool BvhStrategy::Refit(World const& world)
+    {
+        auto ratio = world.options_.GetOption("bvh.refit.max_sah_ratio");
+        float max_sah_ratio = ratio ? ratio->AsFloat() : 1.5f;
+
+        int numshapes = (int)m_cpudata->shapes.size();
+        int numvertices = m_cpudata->numvertices;
+        int numfaces = m_cpudata->numfaces;
+
+        std::vector<bbox> bounds(numfaces);
+        std::vector<ShapeData> shapedata(numshapes);
+
+        CollectBounds(&bounds[0], &shapedata[0]);
+
+        // Topology stays the same, only node bounds are updated
+        m_bvh->Refit(&bounds[0], numfaces);
+
+        // Refitted tree quality degrades as shapes move away from
+        // where they were during the build, rebuild if it got too bad
+        if (m_bvh->GetSahCost() > max_sah_ratio * m_cpudata->built_sah_cost)
+        {
+            return false;
+        }
+
+        PlainBvhTranslator translator;
+        translator.Process(*m_bvh);
+
+        // Buffer sizes do not change, so we update them in place
+        Calc::Event* e = nullptr;
+        m_device->WriteBuffer(m_gpudata->bvh, 0, 0, translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), &translator.nodes_[0], &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        // Update vertices
+        {
+            float3* vertexdata = nullptr;
+            m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+
+            e->Wait();
+            m_device->DeleteEvent(e);
+
+            TransformVertices(vertexdata);
+
+            m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
+
+        // IDs and masks might have been changed as well
+        m_device->WriteBuffer(m_gpudata->shapes, 0, 0, numshapes * sizeof(ShapeData), &shapedata[0], &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        CollectNodeMasks(translator, &shapedata[0]);
+        m_device->WriteBuffer(m_gpudata->nodemasks, 0, 0, translator.masks_.size() * sizeof(int), &translator.masks_[0], &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        // Make sure everything is commited
+        m_device->Finish(0);
+
+        return true;
+    }
+
     void BvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
     {
         auto& func = m_gpudata->isect_func;
@@ -469,6 +788,12 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -492,6 +817,12 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -515,6 +846,12 @@ namespace RadeonRays
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -538,10 +875,221 @@ namespace RadeonRays
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
         m_device->Execute(func, queueidx, globalsize, localsize, event);
     }
 
+    void BvhStrategy::QueryIntersectionMulti(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, std::uint32_t k, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->isect_multi_func, "Multi-hit queries are only supported on OpenCL devices.");
+
+        auto& func = m_gpudata->isect_multi_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, sizeof(k), &k);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void BvhStrategy::QueryIntersectionSoA(std::uint32_t queueidx, CalcRaySoA const& rays, std::uint32_t numrays, CalcIntersectionSoA const& hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->isect_soa_func, "SoA rays are only supported on OpenCL devices.");
+
+        auto& func = m_gpudata->isect_soa_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays.origins);
+        func->SetArg(arg++, rays.directions);
+        SetOptionalArg(func, arg++, rays.maxt);
+        SetOptionalArg(func, arg++, rays.masks);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        SetOptionalArg(func, arg++, hits.t);
+        SetOptionalArg(func, arg++, hits.primids);
+        SetOptionalArg(func, arg++, hits.shapeids);
+        SetOptionalArg(func, arg++, hits.uvs);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void BvhStrategy::QueryOcclusionSoA(std::uint32_t queueidx, CalcRaySoA const& rays, std::uint32_t numrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->occlude_soa_func, "SoA rays are only supported on OpenCL devices.");
+
+        auto& func = m_gpudata->occlude_soa_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays.origins);
+        func->SetArg(arg++, rays.directions);
+        SetOptionalArg(func, arg++, rays.maxt);
+        SetOptionalArg(func, arg++, rays.masks);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void BvhStrategy::QueryCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, QueryOutput output, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        // Compact kernels are OpenCL only
+        if (!m_gpudata->isect_compact_func)
+        {
+            Strategy::QueryCompact(queueidx, rays, numrays, maxrays, output, hits, waitevent, event);
+            return;
+        }
+
+        bool occlusion = output == kOcclusionMask;
+        auto& func = occlusion ?
+            (numrays ? m_gpudata->occlude_compact_indirect_func : m_gpudata->occlude_compact_func) :
+            (numrays ? m_gpudata->isect_compact_indirect_func : m_gpudata->isect_compact_func);
+
+        // Set args
+        int arg = 0;
+        int outputidx = (int)output;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        if (numrays)
+        {
+            func->SetArg(arg++, numrays);
+        }
+        func->SetArg(arg++, sizeof(maxrays), &maxrays);
+        if (!occlusion)
+        {
+            func->SetArg(arg++, sizeof(outputidx), &outputidx);
+        }
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void BvhStrategy::QueryClosestPoint(std::uint32_t queueidx, Calc::Buffer const* points, std::uint32_t numpoints, float maxdist, Calc::Buffer* results, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->closest_point_func, "Closest point queries are only supported on OpenCL devices.");
+
+        auto& func = m_gpudata->closest_point_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, points);
+        func->SetArg(arg++, sizeof(numpoints), &numpoints);
+        func->SetArg(arg++, sizeof(maxdist), &maxdist);
+        func->SetArg(arg++, results);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numpoints + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void BvhStrategy::QueryOverlap(std::uint32_t queueidx, Calc::Buffer const* volumes, std::uint32_t numqueries, OverlapVolume volume, std::uint32_t maxhits, Calc::Buffer* results, Calc::Buffer* counts, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->overlap_func, "Overlap queries are only supported on OpenCL devices.");
+
+        if (!m_gpudata->pp)
+        {
+            ThrowIf(!m_device->HasBuiltinPrimitives(), "This device does not support overlap queries.");
+            m_gpudata->pp = m_device->CreatePrimitives();
+        }
+
+        // Compaction processes whole buffers, so slots are reallocated whenever the size changes
+        std::size_t size = (std::size_t)numqueries * maxhits;
+        if (size != m_gpudata->overlap_size)
+        {
+            m_device->DeleteBuffer(m_gpudata->overlap_slots);
+            m_device->DeleteBuffer(m_gpudata->overlap_predicate);
+            m_gpudata->overlap_slots = nullptr;
+            m_gpudata->overlap_predicate = nullptr;
+            m_gpudata->overlap_size = 0;
+
+            m_gpudata->overlap_slots = m_device->CreateBuffer(size * 2 * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->overlap_predicate = m_device->CreateBuffer(size * 2 * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->overlap_size = size;
+        }
+
+        if (!m_gpudata->overlap_total)
+        {
+            m_gpudata->overlap_total = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+        }
+
+        auto& func = m_gpudata->overlap_func;
+
+        // Set args
+        int arg = 0;
+        int type = static_cast<int>(volume);
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, volumes);
+        func->SetArg(arg++, sizeof(numqueries), &numqueries);
+        func->SetArg(arg++, sizeof(type), &type);
+        func->SetArg(arg++, sizeof(maxhits), &maxhits);
+        func->SetArg(arg++, m_gpudata->overlap_slots);
+        func->SetArg(arg++, m_gpudata->overlap_predicate);
+        func->SetArg(arg++, counts);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numqueries + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, nullptr);
+
+        // Pack occupied slots of all queries back to back
+        m_gpudata->pp->CompactInt32(queueidx, m_gpudata->overlap_predicate, m_gpudata->overlap_slots, results, m_gpudata->overlap_total, event);
+    }
 }
@@ -31,6 +31,7 @@ THE SOFTWARE.
 namespace RadeonRays
 {
     class Bvh;
+    class PlainBvhTranslator;
     
     class BvhStrategy : public Strategy
     {
@@ -69,12 +70,73 @@ namespace RadeonRays
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
 
+        void QueryIntersectionMulti(std::uint32_t queueidx,
+                                    Calc::Buffer const* rays,
+                                    std::uint32_t numrays,
+                                    std::uint32_t k,
+                                    Calc::Buffer* hits,
+                                    Calc::Event const* waitevent,
+                                    Calc::Event** event) const override;
+
+        void QueryIntersectionSoA(std::uint32_t queueidx,
+                                  CalcRaySoA const& rays,
+                                  std::uint32_t numrays,
+                                  CalcIntersectionSoA const& hits,
+                                  Calc::Event const* waitevent,
+                                  Calc::Event** event) const override;
+
+        void QueryOcclusionSoA(std::uint32_t queueidx,
+                               CalcRaySoA const& rays,
+                               std::uint32_t numrays,
+                               Calc::Buffer* hits,
+                               Calc::Event const* waitevent,
+                               Calc::Event** event) const override;
+
+        void QueryCompact(std::uint32_t queueidx,
+                          Calc::Buffer const* rays,
+                          Calc::Buffer const* numrays,
+                          std::uint32_t maxrays,
+                          QueryOutput output,
+                          Calc::Buffer* hits,
+                          Calc::Event const* waitevent,
+                          Calc::Event** event) const override;
+
+        void QueryClosestPoint(std::uint32_t queueidx,
+                               Calc::Buffer const* points,
+                               std::uint32_t numpoints,
+                               float maxdist,
+                               Calc::Buffer* results,
+                               Calc::Event const* waitevent,
+                               Calc::Event** event) const override;
+
+        void QueryOverlap(std::uint32_t queueidx,
+                          Calc::Buffer const* volumes,
+                          std::uint32_t numqueries,
+                          OverlapVolume volume,
+                          std::uint32_t maxhits,
+                          Calc::Buffer* results,
+                          Calc::Buffer* counts,
+                          Calc::Event const* waitevent,
+                          Calc::Event** event) const override;
+
     private:
         struct GpuData;
+        struct CpuData;
         struct ShapeData;
 
+        // Calculate world space face bounds and shape data using current layout
+        void CollectBounds(bbox* bounds, ShapeData* shapedata) const;
+        // Write world space vertices using current layout
+        void TransformVertices(float3* vertexdata) const;
+        // OR shape masks into the translated nodes using current layout
+        void CollectNodeMasks(PlainBvhTranslator& translator, ShapeData const* shapedata) const;
+        // Update BVH bounds and GPU data in place, returns false if rebuild is required
+        bool Refit(World const& world);
+
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
+        // Scene layout from the last build
+        std::unique_ptr<CpuData> m_cpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
     };
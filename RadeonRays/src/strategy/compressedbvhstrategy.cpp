@@ -0,0 +1,692 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#include "compressedbvhstrategy.h"
+
+#include "calc.h"
+#include "executable.h"
+#include "../accelerator/bvh.h"
+#include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+
+#include "../translator/compressed_bvh_translator.h"
+#include "../util/bvh_cache.h"
+#include "../except/except.h"
+
+#include <algorithm>
+
+extern const char * _get_resource_path(const char *);
+
+ // Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+static int const kMaxStackSize = 48;
+static int const kMaxBatchSize = 1024 * 1024;
+
+namespace RadeonRays
+{
+    struct CompressedBvhStrategy::ShapeData
+    {
+        // Shape ID
+        Id id;
+        // Index of root bvh node
+        int bvhidx;
+        int mask;
+        int padding1;
+        // Transform
+        matrix minv;
+        // Motion blur data
+        float3 linearvelocity;
+        // Angular veocity (quaternion)
+        quaternion angularvelocity;
+    };
+
+    struct CompressedBvhStrategy::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // BVH nodes
+        Calc::Buffer* bvh;
+        // Vertex positions
+        Calc::Buffer* vertices;
+        // Indices
+        Calc::Buffer* faces;
+        // Shape IDs
+        Calc::Buffer* shapes;
+        // Counter
+        Calc::Buffer* raycnt;
+        // Traversal stack
+        Calc::Buffer* stack;
+
+        Calc::Executable* executable;
+        Calc::Function* isect_func;
+        Calc::Function* occlude_func;
+        Calc::Function* isect_indirect_func;
+        Calc::Function* occlude_indirect_func;
+
+        GpuData(Calc::Device* d)
+        : device(d)
+                          , bvh(nullptr)
+                          , vertices(nullptr)
+                          , faces(nullptr)
+                          , shapes(nullptr)
+                          , raycnt(nullptr)
+                          , stack(nullptr)
+                          , executable(nullptr)
+                          , isect_func(nullptr)
+                          , occlude_func(nullptr)
+                          , isect_indirect_func(nullptr)
+                          , occlude_indirect_func(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(bvh);
+            device->DeleteBuffer(vertices);
+            device->DeleteBuffer(faces);
+            device->DeleteBuffer(shapes);
+            device->DeleteBuffer(raycnt);
+            device->DeleteBuffer(stack);
+            executable->DeleteFunction(isect_func);
+            executable->DeleteFunction(occlude_func);
+            executable->DeleteFunction(isect_indirect_func);
+            executable->DeleteFunction(occlude_indirect_func);
+            device->DeleteExecutable(executable);
+        }
+    };
+
+    CompressedBvhStrategy::CompressedBvhStrategy(Calc::Device* device)
+        : Strategy(device)
+        , m_gpudata(new GpuData(device))
+        , m_bvh(nullptr)
+    {
+        std::string buildopts =
+#ifdef RR_RAY_MASK
+            "-D RR_RAY_MASK";
+#else
+            "";
+#endif
+
+#ifndef RR_EMBED_KERNELS
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            char const* headers[] = { "CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+
+            m_gpudata->executable = m_device->CompileExecutable(_get_resource_path("CL/cbvh.cl"), headers, numheaders, buildopts.c_str());
+        } 
+        else
+        {
+            assert(device->GetPlatform() == Calc::Platform::kVulkan);
+            m_gpudata->executable = m_device->CompileExecutable(_get_resource_path("GLSL/cbvh.comp"), nullptr, 0, buildopts.c_str());
+        }
+#else
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_cbvh_opencl, std::strlen(g_cbvh_opencl), buildopts.c_str());
+        }
+#endif
+
+#if USE_VULKAN
+        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_cbvh_vulkan, std::strlen(g_cbvh_vulkan), buildopts.c_str());
+        }
+#endif
+
+#endif
+
+        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
+        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
+        m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC");
+        m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+    }
+
+    void CompressedBvhStrategy::Preprocess(World const& world)
+    {
+
+        // If something has been changed we need to rebuild BVH
+        if (!m_gpudata->bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        {
+            if (m_gpudata->bvh)
+            {
+                m_device->DeleteBuffer(m_gpudata->bvh);
+                m_device->DeleteBuffer(m_gpudata->vertices);
+                m_device->DeleteBuffer(m_gpudata->faces);
+                m_device->DeleteBuffer(m_gpudata->shapes);
+                m_device->DeleteBuffer(m_gpudata->raycnt);
+                // Keep the strategy consistent if the build below throws
+                m_gpudata->bvh = nullptr;
+                m_gpudata->vertices = nullptr;
+                m_gpudata->faces = nullptr;
+                m_gpudata->shapes = nullptr;
+                m_gpudata->raycnt = nullptr;
+            }
+
+            // Check if we can allocate enough stack memory
+            Calc::DeviceSpec spec;
+            m_device->GetSpec(spec);
+            if (spec.max_alloc_size <= kMaxBatchSize * kMaxStackSize * sizeof(int))
+            {
+                throw ExceptionImpl("cbvh accelerator can't allocate enough stack memory, try using bvh instead");
+            }
+
+            int numshapes = (int)world.shapes_.size();
+            int numvertices = 0;
+            int numfaces = 0;
+
+            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+            std::vector<int> mesh_vertices_start_idx(numshapes);
+            std::vector<int> mesh_faces_start_idx(numshapes);
+
+            auto builder = world.options_.GetOption("bvh.builder");
+            auto splits = world.options_.GetOption("bvh.sah.use_splits");
+            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
+            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
+            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
+            auto parallel = world.options_.GetOption("bvh.parallel_build");
+            auto leafsize = world.options_.GetOption("bvh.max_leaf_size");
+            auto optimize = world.options_.GetOption("bvh.optimize");
+
+            bool use_sah = false;
+            bool use_lbvh = false;
+            bool use_splits = false;
+            int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
+            float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
+            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+            float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+            bool parallel_build = parallel ? parallel->AsFloat() > 0.f : false;
+            // Compressed nodes have limited room for leaf sizes
+            int max_leaf_size = std::min(leafsize ? (int)leafsize->AsFloat() : 1, CompressedBvhTranslator::kMaxLeafSize);
+            bool optimize_treelets = optimize && optimize->AsString() == "treelet";
+
+            if (builder && builder->AsString() == "sah")
+            {
+                use_sah = true;
+            }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
+
+            if (splits && splits->AsFloat() > 0.f)
+            {
+                use_splits = true;
+            }
+
+            m_bvh.reset(use_splits ?
+                new SplitBvh(traversal_cost, max_split_depth, min_overlap, extra_node_budget) :
+                use_lbvh ?
+                new LinearBvh(traversal_cost) :
+                new Bvh(traversal_cost, use_sah, parallel_build, max_leaf_size)
+            );
+
+            // Partition the array into meshes and instances
+            std::vector<Shape const*> shapes(world.shapes_);
+
+            auto firstinst = std::partition(shapes.begin(), shapes.end(),
+                [&](Shape const* shape)
+            {
+                return !static_cast<ShapeImpl const*>(shape)->is_instance();
+            });
+
+            // Count the number of meshes
+            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+            // Count the number of instances
+            int numinstances = (int)std::distance(firstinst, shapes.end());
+
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+
+            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+
+            // Static scenes are looked up in the cache by geometry and build options
+            auto cachepath = world.options_.GetOption("bvh.cache.path");
+            std::string cachefile;
+            std::uint64_t cachekey = 0;
+
+            if (cachepath && !cachepath->AsString().empty())
+            {
+                float buildopts[] = { (float)use_sah, (float)use_lbvh, (float)use_splits, (float)max_split_depth,
+                    min_overlap, traversal_cost, extra_node_budget, (float)max_leaf_size, (float)optimize_treelets };
+
+                cachekey = BvhCache::Hash(buildopts, sizeof(buildopts), BvhCache::HashShapes(shapes));
+                cachefile = BvhCache::GetFileName(cachepath->AsString(), cachekey, "cbvh");
+
+                Calc::Buffer* cached[3] = { nullptr, nullptr, nullptr };
+
+                if (BvhCache::Load(m_device, cachefile, cachekey, cached, 3))
+                {
+                    m_gpudata->bvh = cached[0];
+                    m_gpudata->vertices = cached[1];
+                    m_gpudata->faces = cached[2];
+
+                    m_bvh.reset(nullptr);
+
+                    std::vector<ShapeData> shapedata(numshapes);
+                    for (int i = 0; i < numshapes; ++i)
+                    {
+                        shapedata[i].id = shapes[i]->GetId();
+                        shapedata[i].mask = shapes[i]->GetMask();
+                    }
+
+                    // Create shapes buffer
+                    m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
+
+                    // Create helper raycounter buffer
+                    m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+
+                    // Stack
+                    m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
+
+                    // Make sure everything is commited
+                    m_device->Finish(0);
+                    return;
+                }
+            }
+
+            // We can't avoild allocating it here, since bounds aren't stored anywhere
+            std::vector<bbox> bounds(numfaces);
+            std::vector<ShapeData>  shapedata(numshapes);
+
+            // We handle meshes first collecting their world space bounds
+#pragma omp parallel for
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    // Here we directly get world space bounds
+                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
+                }
+
+                shapedata[i].id = mesh->GetId();
+                shapedata[i].mask = mesh->GetMask();
+            }
+
+            // Then we handle instances. Need to flatten them into actual geometry.
+#pragma omp parallel for
+            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                // Instance is using its own transform for base shape geometry
+                // so we need to get object space bounds and transform them manually
+                matrix m, minv;
+                instance->GetTransform(m, minv);
+
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    bbox tmp;
+                    mesh->GetFaceBounds(j, true, tmp);
+                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+                }
+
+                shapedata[i].id = instance->GetId();
+                shapedata[i].mask = instance->GetMask();
+            }
+
+            m_bvh->Build(&bounds[0], numfaces);
+
+            if (optimize_treelets)
+            {
+                m_bvh->OptimizeTreelets();
+            }
+
+#ifdef RR_PROFILE
+            m_bvh->PrintStatistics(std::cout);
+#endif
+
+            // Check if the tree height is reasonable
+            if (m_bvh->GetHeight() >= kMaxStackSize)
+            {
+                m_bvh.reset(nullptr);
+                throw ExceptionImpl("cbvh accelerator can cause stack overflow for this scene, try using bvh instead");
+            }
+
+            CompressedBvhTranslator translator;
+            translator.Process(*m_bvh);
+
+            // Update GPU data
+            // Copy translated nodes first
+            m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(CompressedBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+
+            // Create vertex buffer
+            {
+                // Vertices
+                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+
+                // Get the pointer to mapped data
+                float3* vertexdata = nullptr;
+                Calc::Event* e = nullptr;
+
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+
+                // Here we need to put data in world space rather than object space
+                // So we need to get the transform from the mesh and multiply each vertex
+                matrix m, minv;
+
+#pragma omp parallel for
+                for (int i = 0; i < nummeshes; ++i)
+                {
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                    // Get vertex buffer of the current mesh
+                    float3 const* myvertexdata = mesh->GetVertexData();
+                    // Get mesh transform
+                    mesh->GetTransform(m, minv);
+
+                    //#pragma omp parallel for
+                    // Iterate thru vertices multiply and append them to GPU buffer
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                    }
+                }
+
+#pragma omp parallel for
+                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                {
+                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                    // Get vertex buffer of the current mesh
+                    float3 const* myvertexdata = mesh->GetVertexData();
+                    // Get mesh transform
+                    instance->GetTransform(m, minv);
+
+                    //#pragma omp parallel for
+                    // Iterate thru vertices multiply and append them to GPU buffer
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                    }
+                }
+
+                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
+
+            // Create face buffer
+            {
+                struct Face
+                {
+                    // Up to 3 indices
+                    int idx[3];
+                    // Shape index
+                    int shapeidx;
+                    // Primitive ID within the mesh
+                    int id;
+                    // Idx count
+                    int cnt;
+                    // Fourth vertex index of a quad
+                    int idx3;
+
+                    int padding;
+                };
+
+                // This number is different from the number of faces for some BVHs 
+                auto numindices = m_bvh->GetNumIndices();
+                // Create face buffer
+                m_gpudata->faces = m_device->CreateBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
+
+                // Get the pointer to mapped data
+                Face* facedata = nullptr;
+                Calc::Event* e = nullptr;
+
+                m_device->MapBuffer(m_gpudata->faces, 0, 0, numindices * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+
+                // Here the point is to add mesh starting index to actual index contained within the mesh,
+                // getting absolute index in the buffer.
+                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
+                // is contained within bvh.primids_
+                int const* reordering = m_bvh->GetIndices();
+                for (int i = 0; i < numindices; ++i)
+                {
+                    int indextolook4 = reordering[i];
+
+                    // We need to find a shape corresponding to current face
+                    auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+
+                    // Find the index of the shape
+                    int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+                    // Get the mesh directly or out of instance
+                    Mesh const* mesh = nullptr;
+                    if (shapeidx < nummeshes)
+                    {
+                        mesh = static_cast<Mesh const*>(shapes[shapeidx]);
+                    }
+                    else
+                    {
+                        mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+                    }
+
+                    // Get vertex buffer of the current mesh
+                    Mesh::Face const* myfacedata = mesh->GetFaceData();
+                    // Find face idx
+                    int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    // Find mesh start idx
+                    int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+                    // Copy face data to GPU buffer
+                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
+                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
+                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx3 = myfacedata[faceidx].idx[3] + mystartidx;
+
+                    facedata[i].shapeidx = shapeidx;
+                    facedata[i].cnt = (myfacedata[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                    facedata[i].id = faceidx;
+                }
+
+                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
+
+            // Create shapes buffer
+            m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
+
+            // Create helper raycounter buffer
+            m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+
+            // Stack
+            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
+
+            // Store translated data for the next runs, failing to do so is not an error
+            if (!cachefile.empty())
+            {
+                Calc::Buffer* cached[3] = { m_gpudata->bvh, m_gpudata->vertices, m_gpudata->faces };
+                BvhCache::Save(m_device, cachefile, cachekey, cached, 3);
+            }
+
+            // Make sure everything is commited
+            m_device->Finish(0);
+        }
+    }
+
+    void CompressedBvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+    {
+        size_t stack_size = 4 * numrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
+        // Check if we need to relocate memory
+        if (stack_size > m_gpudata->stack->GetSize())
+        {
+            m_device->DeleteBuffer(m_gpudata->stack);
+            m_gpudata->stack = nullptr;
+            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+        }
+
+        auto& func = m_gpudata->isect_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->stack);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void CompressedBvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+    {
+        size_t stack_size = 4 * numrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
+        // Check if we need to relocate memory
+        if (stack_size > m_gpudata->stack->GetSize())
+        {
+            m_device->DeleteBuffer(m_gpudata->stack);
+            m_gpudata->stack = nullptr;
+            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+        }
+
+        auto& func = m_gpudata->occlude_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->stack);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void CompressedBvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
+        // Check if we need to relocate memory
+        if (stack_size > m_gpudata->stack->GetSize())
+        {
+            m_device->DeleteBuffer(m_gpudata->stack);
+            m_gpudata->stack = nullptr;
+            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+        }
+
+        auto& func = m_gpudata->isect_indirect_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->stack);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void CompressedBvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
+        // Check if we need to relocate memory
+        if (stack_size > m_gpudata->stack->GetSize())
+        {
+            m_device->DeleteBuffer(m_gpudata->stack);
+            m_gpudata->stack = nullptr;
+            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+        }
+
+        auto& func = m_gpudata->occlude_indirect_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->stack);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+}
@@ -25,11 +25,13 @@
 #include "executable.h"
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
 
 #include "../translator/fatnode_bvh_translator.h"
+#include "../util/bvh_cache.h"
 #include "../except/except.h"
 
 #include <algorithm>
@@ -75,12 +77,17 @@ namespace RadeonRays
         Calc::Buffer* raycnt;
         // Traversal stack
         Calc::Buffer* stack;
+        // Geometry masks of the node children, two per node
+        Calc::Buffer* nodemasks;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
         Calc::Function* isect_indirect_func;
         Calc::Function* occlude_indirect_func;
+        // OpenCL only
+        Calc::Function* isect_soa_func;
+        Calc::Function* occlude_soa_func;
 
         GpuData(Calc::Device* d)
         : device(d)
@@ -90,11 +97,14 @@ namespace RadeonRays
                           , shapes(nullptr)
                           , raycnt(nullptr)
                           , stack(nullptr)
+                          , nodemasks(nullptr)
                           , executable(nullptr)
                           , isect_func(nullptr)
                           , occlude_func(nullptr)
                           , isect_indirect_func(nullptr)
                           , occlude_indirect_func(nullptr)
+                          , isect_soa_func(nullptr)
+                          , occlude_soa_func(nullptr)
         {
         }
 
@@ -106,10 +116,16 @@ namespace RadeonRays
             device->DeleteBuffer(shapes);
             device->DeleteBuffer(raycnt);
             device->DeleteBuffer(stack);
+            device->DeleteBuffer(nodemasks);
             executable->DeleteFunction(isect_func);
             executable->DeleteFunction(occlude_func);
             executable->DeleteFunction(isect_indirect_func);
             executable->DeleteFunction(occlude_indirect_func);
+            if (isect_soa_func)
+            {
+                executable->DeleteFunction(isect_soa_func);
+                executable->DeleteFunction(occlude_soa_func);
+            }
             device->DeleteExecutable(executable);
         }
     };
@@ -161,21 +177,35 @@ namespace RadeonRays
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
         m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC");
         m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->isect_soa_func = m_gpudata->executable->CreateFunction("IntersectClosestSoA");
+            m_gpudata->occlude_soa_func = m_gpudata->executable->CreateFunction("IntersectAnySoA");
+        }
     }
 
     void FatBvhStrategy::Preprocess(World const& world)
     {
 
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_gpudata->bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
+            if (m_gpudata->bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
                 m_device->DeleteBuffer(m_gpudata->vertices);
                 m_device->DeleteBuffer(m_gpudata->faces);
                 m_device->DeleteBuffer(m_gpudata->shapes);
                 m_device->DeleteBuffer(m_gpudata->raycnt);
+                m_device->DeleteBuffer(m_gpudata->nodemasks);
+                // Keep the strategy consistent if the build below throws
+                m_gpudata->bvh = nullptr;
+                m_gpudata->vertices = nullptr;
+                m_gpudata->faces = nullptr;
+                m_gpudata->shapes = nullptr;
+                m_gpudata->raycnt = nullptr;
+                m_gpudata->nodemasks = nullptr;
             }
 
             // Check if we can allocate enough stack memory
@@ -200,18 +230,29 @@ namespace RadeonRays
             auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
             auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
             auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
+            auto parallel = world.options_.GetOption("bvh.parallel_build");
+            auto leafsize = world.options_.GetOption("bvh.max_leaf_size");
+            auto optimize = world.options_.GetOption("bvh.optimize");
 
             bool use_sah = false;
+            bool use_lbvh = false;
             bool use_splits = false;
             int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
             float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
             float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+            bool parallel_build = parallel ? parallel->AsFloat() > 0.f : false;
+            int max_leaf_size = leafsize ? (int)leafsize->AsFloat() : 1;
+            bool optimize_treelets = optimize && optimize->AsString() == "treelet";
 
             if (builder && builder->AsString() == "sah")
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             if (splits && splits->AsFloat() > 0.f)
             {
@@ -220,7 +261,9 @@ namespace RadeonRays
 
             m_bvh.reset(use_splits ?
                 new SplitBvh(traversal_cost, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, use_sah)
+                use_lbvh ?
+                new LinearBvh(traversal_cost) :
+                new Bvh(traversal_cost, use_sah, parallel_build, max_leaf_size)
             );
 
             // Partition the array into meshes and instances
@@ -260,6 +303,54 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
+            // Static scenes are looked up in the cache by geometry and build options
+            auto cachepath = world.options_.GetOption("bvh.cache.path");
+            std::string cachefile;
+            std::uint64_t cachekey = 0;
+
+            if (cachepath && !cachepath->AsString().empty())
+            {
+                float buildopts[] = { (float)use_sah, (float)use_lbvh, (float)use_splits, (float)max_split_depth,
+                    min_overlap, traversal_cost, extra_node_budget, (float)max_leaf_size, (float)optimize_treelets };
+
+                cachekey = BvhCache::Hash(buildopts, sizeof(buildopts), BvhCache::HashShapes(shapes));
+                cachefile = BvhCache::GetFileName(cachepath->AsString(), cachekey, "fatbvh");
+
+                Calc::Buffer* cached[3] = { nullptr, nullptr, nullptr };
+
+                if (BvhCache::Load(m_device, cachefile, cachekey, cached, 3))
+                {
+                    m_gpudata->bvh = cached[0];
+                    m_gpudata->vertices = cached[1];
+                    m_gpudata->faces = cached[2];
+
+                    m_bvh.reset(nullptr);
+
+                    std::vector<ShapeData> shapedata(numshapes);
+                    for (int i = 0; i < numshapes; ++i)
+                    {
+                        shapedata[i].id = shapes[i]->GetId();
+                        shapedata[i].mask = shapes[i]->GetMask();
+                    }
+
+                    // Create shapes buffer
+                    m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
+
+                    // Create helper raycounter buffer
+                    m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+
+                    // Stack
+                    m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
+
+                    // Cached nodes come without masks, make every child visible
+                    std::vector<int> nodemasks(2 * cached[0]->GetSize() / sizeof(FatNodeBvhTranslator::Node), ~0);
+                    m_gpudata->nodemasks = m_device->CreateBuffer(nodemasks.size() * sizeof(int), Calc::BufferType::kRead, &nodemasks[0]);
+
+                    // Make sure everything is commited
+                    m_device->Finish(0);
+                    return;
+                }
+            }
 
             // We can't avoild allocating it here, since bounds aren't stored anywhere
             std::vector<bbox> bounds(numfaces);
@@ -306,6 +397,11 @@ namespace RadeonRays
 
             m_bvh->Build(&bounds[0], numfaces);
 
+            if (optimize_treelets)
+            {
+                m_bvh->OptimizeTreelets();
+            }
+
 #ifdef RR_PROFILE
             m_bvh->PrintStatistics(std::cout);
 #endif
@@ -384,6 +480,9 @@ namespace RadeonRays
                 m_device->DeleteEvent(e);
             }
 
+            // Shape masks of the reordered faces
+            std::vector<int> primmasks;
+
             // Create face buffer
             {
                 struct Face
@@ -396,12 +495,15 @@ namespace RadeonRays
                     int id;
                     // Idx count
                     int cnt;
+                    // Fourth vertex index of a quad
+                    int idx3;
 
-                    int padding[2];
+                    int padding;
                 };
 
                 // This number is different from the number of faces for some BVHs 
                 auto numindices = m_bvh->GetNumIndices();
+                primmasks.resize(numindices);
                 // Create face buffer
                 m_gpudata->faces = m_device->CreateBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
 
@@ -451,10 +553,13 @@ namespace RadeonRays
                     facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
                     facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
                     facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx3 = myfacedata[faceidx].idx[3] + mystartidx;
 
                     facedata[i].shapeidx = shapeidx;
-                    facedata[i].cnt = 0;
+                    facedata[i].cnt = (myfacedata[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
                     facedata[i].id = faceidx;
+
+                    primmasks[i] = shapedata[shapeidx].mask;
                 }
 
                 m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
@@ -472,6 +577,17 @@ namespace RadeonRays
             // Stack
             m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
 
+            // Node masks
+            translator.ProcessMasks(*m_bvh, &primmasks[0]);
+            m_gpudata->nodemasks = m_device->CreateBuffer(translator.masks_.size() * sizeof(int), Calc::BufferType::kRead, &translator.masks_[0]);
+
+            // Store translated data for the next runs, failing to do so is not an error
+            if (!cachefile.empty())
+            {
+                Calc::Buffer* cached[3] = { m_gpudata->bvh, m_gpudata->vertices, m_gpudata->faces };
+                BvhCache::Save(m_device, cachefile, cachekey, cached, 3);
+            }
+
             // Make sure everything is commited
             m_device->Finish(0);
         }
@@ -504,6 +620,12 @@ namespace RadeonRays
         func->SetArg(arg++, hits);
         func->SetArg(arg++, m_gpudata->stack);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -537,6 +659,12 @@ namespace RadeonRays
         func->SetArg(arg++, hits);
         func->SetArg(arg++, m_gpudata->stack);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -570,6 +698,12 @@ namespace RadeonRays
         func->SetArg(arg++, hits);
         func->SetArg(arg++, m_gpudata->stack);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
@@ -603,9 +737,92 @@ namespace RadeonRays
         func->SetArg(arg++, hits);
         func->SetArg(arg++, m_gpudata->stack);
 
+        // GLSL kernels do not cull nodes by mask
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->nodemasks);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
         m_device->Execute(func, queueidx, globalsize, localsize, event);
     }
+
+    void FatBvhStrategy::QueryIntersectionSoA(std::uint32_t queueidx, CalcRaySoA const& rays, std::uint32_t numrays, CalcIntersectionSoA const& hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->isect_soa_func, "SoA rays are only supported on OpenCL devices.");
+
+        size_t stack_size = 4 * numrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
+        // Check if we need to relocate memory
+        if (stack_size > m_gpudata->stack->GetSize())
+        {
+            m_device->DeleteBuffer(m_gpudata->stack);
+            m_gpudata->stack = nullptr;
+            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+        }
+
+        auto& func = m_gpudata->isect_soa_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays.origins);
+        func->SetArg(arg++, rays.directions);
+        SetOptionalArg(func, arg++, rays.maxt);
+        SetOptionalArg(func, arg++, rays.masks);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        SetOptionalArg(func, arg++, hits.t);
+        SetOptionalArg(func, arg++, hits.primids);
+        SetOptionalArg(func, arg++, hits.shapeids);
+        SetOptionalArg(func, arg++, hits.uvs);
+        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void FatBvhStrategy::QueryOcclusionSoA(std::uint32_t queueidx, CalcRaySoA const& rays, std::uint32_t numrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->occlude_soa_func, "SoA rays are only supported on OpenCL devices.");
+
+        size_t stack_size = 4 * numrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
+        // Check if we need to relocate memory
+        if (stack_size > m_gpudata->stack->GetSize())
+        {
+            m_device->DeleteBuffer(m_gpudata->stack);
+            m_gpudata->stack = nullptr;
+            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+        }
+
+        auto& func = m_gpudata->occlude_soa_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays.origins);
+        func->SetArg(arg++, rays.directions);
+        SetOptionalArg(func, arg++, rays.maxt);
+        SetOptionalArg(func, arg++, rays.masks);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, m_gpudata->nodemasks);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
 }
@@ -68,6 +68,20 @@ namespace RadeonRays
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
         
+        void QueryIntersectionSoA(std::uint32_t queueidx,
+                                  CalcRaySoA const& rays,
+                                  std::uint32_t numrays,
+                                  CalcIntersectionSoA const& hits,
+                                  Calc::Event const* waitevent,
+                                  Calc::Event** event) const override;
+
+        void QueryOcclusionSoA(std::uint32_t queueidx,
+                               CalcRaySoA const& rays,
+                               std::uint32_t numrays,
+                               Calc::Buffer* hits,
+                               Calc::Event const* waitevent,
+                               Calc::Event** event) const override;
+
     private:
         struct GpuData;
         struct ShapeData;
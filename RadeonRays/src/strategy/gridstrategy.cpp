@@ -0,0 +1,588 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "gridstrategy.h"
+
+#include "calc.h"
+#include "executable.h"
+#include "../accelerator/grid.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+
+#include "../except/except.h"
+
+#include <algorithm>
+
+extern const char * _get_resource_path(const char *);
+
+ // Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct GridStrategy::ShapeData
+    {
+        // Shape ID
+        Id id;
+        // Index of root bvh node
+        int bvhidx;
+        int mask;
+        int padding1;
+        // Transform
+        matrix minv;
+        // Motion blur data
+        float3 linearvelocity;
+        // Angular veocity (quaternion)
+        quaternion angularvelocity;
+    };
+
+    struct GridStrategy::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // Voxels
+        Calc::Buffer* voxels;
+        // Grid description
+        Calc::Buffer* griddesc;
+        // Vertex positions
+        Calc::Buffer* vertices;
+        // Indices
+        Calc::Buffer* faces;
+        // Shape IDs
+        Calc::Buffer* shapes;
+        // Face indices referenced by voxels
+        Calc::Buffer* indices;
+        // Counter
+        Calc::Buffer* raycnt;
+
+        Calc::Executable* executable;
+        Calc::Function* isect_func;
+        Calc::Function* occlude_func;
+        Calc::Function* isect_indirect_func;
+        Calc::Function* occlude_indirect_func;
+
+        GpuData(Calc::Device* d)
+        : device(d)
+                          , voxels(nullptr)
+                          , griddesc(nullptr)
+                          , vertices(nullptr)
+                          , faces(nullptr)
+                          , shapes(nullptr)
+                          , indices(nullptr)
+                          , raycnt(nullptr)
+                          , executable(nullptr)
+                          , isect_func(nullptr)
+                          , occlude_func(nullptr)
+                          , isect_indirect_func(nullptr)
+                          , occlude_indirect_func(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(voxels);
+            device->DeleteBuffer(griddesc);
+            device->DeleteBuffer(vertices);
+            device->DeleteBuffer(faces);
+            device->DeleteBuffer(shapes);
+            device->DeleteBuffer(indices);
+            device->DeleteBuffer(raycnt);
+            executable->DeleteFunction(isect_func);
+            executable->DeleteFunction(occlude_func);
+            executable->DeleteFunction(isect_indirect_func);
+            executable->DeleteFunction(occlude_indirect_func);
+            device->DeleteExecutable(executable);
+        }
+    };
+
+    GridStrategy::GridStrategy(Calc::Device* device)
+        : Strategy(device)
+        , m_gpudata(new GpuData(device))
+        , m_grid(nullptr)
+    {
+        std::string buildopts =
+#ifdef RR_RAY_MASK
+            "-D RR_RAY_MASK";
+#else
+            "";
+#endif
+
+#ifndef RR_EMBED_KERNELS
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            char const* headers[] = { "CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+
+            m_gpudata->executable = m_device->CompileExecutable(_get_resource_path("CL/grid.cl"), headers, numheaders, buildopts.c_str());
+        } 
+        else
+        {
+            assert(device->GetPlatform() == Calc::Platform::kVulkan);
+            m_gpudata->executable = m_device->CompileExecutable(_get_resource_path("GLSL/grid.comp"), nullptr, 0, buildopts.c_str());
+        }
+#else
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_grid_opencl, std::strlen(g_grid_opencl), buildopts.c_str());
+        }
+#endif
+
+#if USE_VULKAN
+        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_grid_vulkan, std::strlen(g_grid_vulkan), buildopts.c_str());
+        }
+#endif
+
+#endif
+
+        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
+        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
+        m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC");
+        m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+    }
+
+    void GridStrategy::Preprocess(World const& world)
+    {
+        // If something has been changed we need to rebuild the grid
+        if (!m_gpudata->voxels || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        {
+            if (m_gpudata->voxels)
+            {
+                m_device->DeleteBuffer(m_gpudata->voxels);
+                m_device->DeleteBuffer(m_gpudata->griddesc);
+                m_device->DeleteBuffer(m_gpudata->vertices);
+                m_device->DeleteBuffer(m_gpudata->faces);
+                m_device->DeleteBuffer(m_gpudata->shapes);
+                m_device->DeleteBuffer(m_gpudata->indices);
+                m_device->DeleteBuffer(m_gpudata->raycnt);
+                // Keep the strategy consistent if the build below throws
+                m_gpudata->voxels = nullptr;
+                m_gpudata->griddesc = nullptr;
+                m_gpudata->vertices = nullptr;
+                m_gpudata->faces = nullptr;
+                m_gpudata->shapes = nullptr;
+                m_gpudata->indices = nullptr;
+                m_gpudata->raycnt = nullptr;
+            }
+
+            int numshapes = (int)world.shapes_.size();
+            int numvertices = 0;
+            int numfaces = 0;
+
+            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+            std::vector<int> mesh_vertices_start_idx(numshapes);
+            std::vector<int> mesh_faces_start_idx(numshapes);
+
+            auto density = world.options_.GetOption("grid.density");
+            auto parallel = world.options_.GetOption("grid.parallel_build");
+
+            float grid_density = density ? density->AsFloat() : 4.f;
+            bool parallel_build = parallel ? parallel->AsFloat() > 0.f : true;
+
+            m_grid.reset(new Grid(grid_density, parallel_build));
+
+            // Partition the array into meshes and instances
+            std::vector<Shape const*> shapes(world.shapes_);
+
+            auto firstinst = std::partition(shapes.begin(), shapes.end(),
+                [&](Shape const* shape)
+            {
+                return !static_cast<ShapeImpl const*>(shape)->is_instance();
+            });
+
+            // Count the number of meshes
+            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+            // Count the number of instances
+            int numinstances = (int)std::distance(firstinst, shapes.end());
+
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+
+            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+
+            // We can't avoild allocating it here, since bounds aren't stored anywhere
+            std::vector<bbox> bounds(numfaces);
+            std::vector<ShapeData>  shapedata(numshapes);
+
+            // We handle meshes first collecting their world space bounds
+#pragma omp parallel for
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    // Here we directly get world space bounds
+                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
+                }
+
+                shapedata[i].id = mesh->GetId();
+                shapedata[i].mask = mesh->GetMask();
+            }
+
+            // Then we handle instances. Need to flatten them into actual geometry.
+#pragma omp parallel for
+            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                // Instance is using its own transform for base shape geometry
+                // so we need to get object space bounds and transform them manually
+                matrix m, minv;
+                instance->GetTransform(m, minv);
+
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    bbox tmp;
+                    mesh->GetFaceBounds(j, true, tmp);
+                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+                }
+
+                shapedata[i].id = instance->GetId();
+                shapedata[i].mask = instance->GetMask();
+            }
+
+            m_grid->Build(numfaces > 0 ? &bounds[0] : nullptr, numfaces);
+
+#ifdef RR_PROFILE
+            m_grid->PrintStatistics(std::cout);
+#endif
+
+            // Update GPU data
+            // Copy voxels first
+            m_gpudata->voxels = m_device->CreateBuffer(m_grid->GetNumVoxels() * sizeof(Grid::Voxel), Calc::BufferType::kRead, const_cast<Grid::Voxel*>(m_grid->GetVoxels()));
+
+            // Create grid description
+            {
+                struct GridDesc
+                {
+                    // Grid bounds
+                    bbox bounds;
+                    // Voxel size and its inverse
+                    float3 voxelsize;
+                    float3 voxelsizeinv;
+                    // Number of voxels along each axis
+                    int gridres[4];
+                };
+
+                GridDesc desc;
+                desc.bounds = m_grid->Bounds();
+                desc.voxelsize = m_grid->GetVoxelSize();
+
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    desc.voxelsizeinv[axis] = m_grid->GetResolution(axis) / desc.bounds.extents()[axis];
+                    desc.gridres[axis] = m_grid->GetResolution(axis);
+                }
+
+                desc.voxelsizeinv.w = 0.f;
+                desc.gridres[3] = 0;
+
+                m_gpudata->griddesc = m_device->CreateBuffer(sizeof(GridDesc), Calc::BufferType::kRead, &desc);
+            }
+
+            // Create voxel references buffer, the size is never 0 as empty grid has a voxel
+            {
+                std::size_t numindices = std::max(m_grid->GetNumIndices(), (std::size_t)1);
+                m_gpudata->indices = m_device->CreateBuffer(numindices * sizeof(int), Calc::BufferType::kRead);
+
+                if (m_grid->GetNumIndices() > 0)
+                {
+                    Calc::Event* e = nullptr;
+                    m_device->WriteBuffer(m_gpudata->indices, 0, 0, m_grid->GetNumIndices() * sizeof(int), const_cast<int*>(m_grid->GetIndices()), &e);
+                    e->Wait();
+                    m_device->DeleteEvent(e);
+                }
+            }
+
+            // Create vertex buffer
+            {
+                // Vertices
+                m_gpudata->vertices = m_device->CreateBuffer(std::max(numvertices, 1) * sizeof(float3), Calc::BufferType::kRead);
+
+                // Get the pointer to mapped data
+                float3* vertexdata = nullptr;
+                Calc::Event* e = nullptr;
+
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, std::max(numvertices, 1) * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+
+                // Here we need to put data in world space rather than object space
+                // So we need to get the transform from the mesh and multiply each vertex
+                matrix m, minv;
+
+#pragma omp parallel for
+                for (int i = 0; i < nummeshes; ++i)
+                {
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                    // Get vertex buffer of the current mesh
+                    float3 const* myvertexdata = mesh->GetVertexData();
+                    // Get mesh transform
+                    mesh->GetTransform(m, minv);
+
+                    // Iterate thru vertices multiply and append them to GPU buffer
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                    }
+                }
+
+#pragma omp parallel for
+                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                {
+                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                    // Get vertex buffer of the current mesh
+                    float3 const* myvertexdata = mesh->GetVertexData();
+                    // Get mesh transform
+                    instance->GetTransform(m, minv);
+
+                    // Iterate thru vertices multiply and append them to GPU buffer
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                    }
+                }
+
+                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
+
+            // Create face buffer
+            {
+                struct Face
+                {
+                    // Up to 3 indices
+                    int idx[3];
+                    // Shape index
+                    int shapeidx;
+                    // Primitive ID within the mesh
+                    int id;
+                    // Idx count
+                    int cnt;
+                    // Fourth vertex index of a quad
+                    int idx3;
+
+                    int padding;
+                };
+
+                // Create face buffer
+                m_gpudata->faces = m_device->CreateBuffer(std::max(numfaces, 1) * sizeof(Face), Calc::BufferType::kRead);
+
+                // Get the pointer to mapped data
+                Face* facedata = nullptr;
+                Calc::Event* e = nullptr;
+
+                m_device->MapBuffer(m_gpudata->faces, 0, 0, std::max(numfaces, 1) * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+
+                // Voxels reference faces by their index in the scene,
+                // so faces are laid out shape by shape in the same order bounds were collected
+#pragma omp parallel for
+                for (int i = 0; i < numshapes; ++i)
+                {
+                    // Get the mesh directly or out of instance
+                    Mesh const* mesh = nullptr;
+                    if (i < nummeshes)
+                    {
+                        mesh = static_cast<Mesh const*>(shapes[i]);
+                    }
+                    else
+                    {
+                        mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape());
+                    }
+
+                    // Get vertex buffer of the current mesh
+                    Mesh::Face const* myfacedata = mesh->GetFaceData();
+                    // Find mesh start idx
+                    int mystartidx = mesh_vertices_start_idx[i];
+
+                    for (int j = 0; j < mesh->num_faces(); ++j)
+                    {
+                        Face& face = facedata[mesh_faces_start_idx[i] + j];
+
+                        // Copy face data to GPU buffer
+                        face.idx[0] = myfacedata[j].idx[0] + mystartidx;
+                        face.idx[1] = myfacedata[j].idx[1] + mystartidx;
+                        face.idx[2] = myfacedata[j].idx[2] + mystartidx;
+                        face.idx3 = myfacedata[j].idx[3] + mystartidx;
+
+                        face.shapeidx = i;
+                        face.cnt = (myfacedata[j].type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                        face.id = j;
+                    }
+                }
+
+                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
+
+            // Create shapes buffer
+            m_gpudata->shapes = m_device->CreateBuffer(std::max(numshapes, 1) * sizeof(ShapeData), Calc::BufferType::kRead);
+
+            if (numshapes > 0)
+            {
+                Calc::Event* e = nullptr;
+                m_device->WriteBuffer(m_gpudata->shapes, 0, 0, numshapes * sizeof(ShapeData), &shapedata[0], &e);
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
+
+            // Create helper raycounter buffer
+            m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+
+            // Make sure everything is commited
+            m_device->Finish(0);
+        }
+    }
+
+    void GridStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+    {
+        auto& func = m_gpudata->isect_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->voxels);
+        func->SetArg(arg++, m_gpudata->griddesc);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, m_gpudata->indices);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void GridStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+    {
+        auto& func = m_gpudata->occlude_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->voxels);
+        func->SetArg(arg++, m_gpudata->griddesc);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, m_gpudata->indices);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void GridStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto& func = m_gpudata->isect_indirect_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->voxels);
+        func->SetArg(arg++, m_gpudata->griddesc);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, m_gpudata->indices);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void GridStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto& func = m_gpudata->occlude_indirect_func;
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->voxels);
+        func->SetArg(arg++, m_gpudata->griddesc);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, m_gpudata->indices);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+}
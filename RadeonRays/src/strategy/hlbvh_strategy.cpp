@@ -264,6 +264,10 @@ namespace RadeonRays
                     int id;
                     // Idx count
                     int cnt;
+                    // Fourth vertex index of a quad
+                    int idx3;
+
+                    int padding;
                 };
 
                 // Create face buffer
@@ -278,6 +282,10 @@ namespace RadeonRays
                         int id;
                         // Idx count
                         int cnt;
+                        // Fourth vertex index of a quad
+                        int idx3;
+
+                        int padding;
                     };
 
                     // Create face buffer
@@ -319,6 +327,7 @@ namespace RadeonRays
                         facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
                         facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
                         facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                        facedata[i].idx3 = myfacedata[faceidx].idx[3] + mystartidx;
 
                         facedata[i].shapeidx = shapeidx;
                         facedata[i].cnt = (myfacedata[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
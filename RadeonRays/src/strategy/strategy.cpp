@@ -0,0 +1,147 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "strategy.h"
+
+#include "device.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace RadeonRays
+{
+    // Read count elements of the buffer into host memory
+    template <typename T>
+    static std::vector<T> ReadBuffer(Calc::Device* device, std::uint32_t queueidx, Calc::Buffer const* buffer, std::size_t count)
+    {
+        std::vector<T> data(count);
+
+        if (count > 0)
+        {
+            Calc::Event* e = nullptr;
+            device->ReadBuffer(buffer, queueidx, 0, count * sizeof(T), data.data(), &e);
+            e->Wait();
+            device->DeleteEvent(e);
+        }
+
+        return data;
+    }
+
+    template <typename T>
+    static void WriteBuffer(Calc::Device* device, std::uint32_t queueidx, Calc::Buffer* buffer, std::vector<T>& data)
+    {
+        if (data.empty())
+        {
+            return;
+        }
+
+        Calc::Event* e = nullptr;
+        device->WriteBuffer(buffer, queueidx, 0, data.size() * sizeof(T), data.data(), &e);
+        e->Wait();
+        device->DeleteEvent(e);
+    }
+
+    void Strategy::QueryCompact(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, QueryOutput output, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        // Without compact kernels full results are compacted on the host.
+        // They are initialized with misses, which inactive rays keep.
+        bool occlusion = output == kOcclusionMask;
+        Calc::Buffer* full_buffer = nullptr;
+
+        if (occlusion)
+        {
+            std::vector<int> misses(maxrays, -1);
+            full_buffer = m_device->CreateBuffer(maxrays * sizeof(int), Calc::BufferType::kWrite, misses.data());
+        }
+        else
+        {
+            std::vector<Intersection> misses(maxrays);
+            full_buffer = m_device->CreateBuffer(maxrays * sizeof(Intersection), Calc::BufferType::kWrite, misses.data());
+        }
+
+        Calc::Event* query_event = nullptr;
+        if (numrays)
+        {
+            if (occlusion)
+                QueryOcclusion(queueidx, rays, numrays, maxrays, full_buffer, waitevent, &query_event);
+            else
+                QueryIntersection(queueidx, rays, numrays, maxrays, full_buffer, waitevent, &query_event);
+        }
+        else
+        {
+            if (occlusion)
+                QueryOcclusion(queueidx, rays, maxrays, full_buffer, waitevent, &query_event);
+            else
+                QueryIntersection(queueidx, rays, maxrays, full_buffer, waitevent, &query_event);
+        }
+        query_event->Wait();
+
+        int count = (int)maxrays;
+        if (numrays)
+        {
+            count = std::min(std::max(ReadBuffer<int>(m_device, queueidx, numrays, 1)[0], 0), count);
+        }
+
+        if (occlusion)
+        {
+            auto occluded = ReadBuffer<int>(m_device, queueidx, full_buffer, count);
+            std::vector<std::uint32_t> mask((count + 31) / 32);
+            for (int i = 0; i < count; ++i)
+            {
+                mask[i / 32] |= (occluded[i] > 0 ? 1u : 0u) << (i % 32);
+            }
+            WriteBuffer(m_device, queueidx, hits, mask);
+        }
+        else if (output == kHitDistance)
+        {
+            auto isect = ReadBuffer<Intersection>(m_device, queueidx, full_buffer, count);
+            std::vector<float> t(count);
+            for (int i = 0; i < count; ++i)
+            {
+                t[i] = isect[i].shapeid != kNullId ? isect[i].uvwt.w : -1.f;
+            }
+            WriteBuffer(m_device, queueidx, hits, t);
+        }
+        else
+        {
+            auto isect = ReadBuffer<Intersection>(m_device, queueidx, full_buffer, count);
+            std::vector<Id> ids(2 * count);
+            for (int i = 0; i < count; ++i)
+            {
+                ids[2 * i] = isect[i].shapeid;
+                ids[2 * i + 1] = isect[i].primid;
+            }
+            WriteBuffer(m_device, queueidx, hits, ids);
+        }
+
+        m_device->DeleteBuffer(full_buffer);
+
+        // All the work is done at this point, query event is already complete
+        if (event)
+        {
+            *event = query_event;
+        }
+        else
+        {
+            m_device->DeleteEvent(query_event);
+        }
+    }
+}
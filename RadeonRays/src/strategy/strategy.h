@@ -26,11 +26,31 @@ THE SOFTWARE.
 #include "calc.h"
 #include "buffer.h"
 #include "event.h"
+#include "executable.h"
+#include "../except/except.h"
 
 namespace RadeonRays
 {
     class World;
 
+    // Calc buffers of RaySoA, maxt and masks might be nullptr
+    struct CalcRaySoA
+    {
+        Calc::Buffer const* origins;
+        Calc::Buffer const* directions;
+        Calc::Buffer const* maxt;
+        Calc::Buffer const* masks;
+    };
+
+    // Calc buffers of IntersectionSoA, buffers set to nullptr are not written
+    struct CalcIntersectionSoA
+    {
+        Calc::Buffer* t;
+        Calc::Buffer* primids;
+        Calc::Buffer* shapeids;
+        Calc::Buffer* uvs;
+    };
+
     ///< Interface for a specific intersection algorithm based on Calc.
     ///< CalcIntersectionDevice uses this interface to select different algorithms.
     class Strategy
@@ -77,10 +97,97 @@ namespace RadeonRays
                                     Calc::Event const* waitevent,
                                     Calc::Event** event) const = 0;
 
+        // Query up to k closest intersections per ray and write k of them per ray into hits buffer sorted by distance.
+        // Only some of the algorithms implement it. The call is blocking if event == nullptr, non-blocking otherwise.
+        virtual void QueryIntersectionMulti(std::uint32_t queueidx,
+                                            Calc::Buffer const* rays,
+                                            std::uint32_t numrays,
+                                            std::uint32_t k,
+                                            Calc::Buffer* hits,
+                                            Calc::Event const* waitevent,
+                                            Calc::Event** event) const
+        {
+            Throw("Multi-hit queries are not supported by this acceleration structure.");
+        }
+
+        // Query intersections for rays in SoA layout and write them into SoA hit buffers.
+        // Only some of the algorithms implement it. The call is blocking if event == nullptr, non-blocking otherwise.
+        virtual void QueryIntersectionSoA(std::uint32_t queueidx,
+                                          CalcRaySoA const& rays,
+                                          std::uint32_t numrays,
+                                          CalcIntersectionSoA const& hits,
+                                          Calc::Event const* waitevent,
+                                          Calc::Event** event) const
+        {
+            Throw("SoA rays are not supported by this acceleration structure.");
+        }
+
+        // Query occlusion for rays in SoA layout and write them into hits buffer.
+        // Only some of the algorithms implement it. The call is blocking if event == nullptr, non-blocking otherwise.
+        virtual void QueryOcclusionSoA(std::uint32_t queueidx,
+                                       CalcRaySoA const& rays,
+                                       std::uint32_t numrays,
+                                       Calc::Buffer* hits,
+                                       Calc::Event const* waitevent,
+                                       Calc::Event** event) const
+        {
+            Throw("SoA rays are not supported by this acceleration structure.");
+        }
+
+        // Query closest (kHitDistance, kHitIds) or any (kOcclusionMask) intersection and write only the selected output.
+        // numrays might be nullptr, maxrays is the number of rays then. The call is blocking if event == nullptr,
+        // non-blocking otherwise. The default runs the full query and compacts its results on the host (blocking).
+        virtual void QueryCompact(std::uint32_t queueidx,
+                                  Calc::Buffer const* rays,
+                                  Calc::Buffer const* numrays,
+                                  std::uint32_t maxrays,
+                                  QueryOutput output,
+                                  Calc::Buffer* hits,
+                                  Calc::Event const* waitevent,
+                                  Calc::Event** event) const;
+
+        virtual void QueryClosestPoint(std::uint32_t queueidx,
+                                       Calc::Buffer const* points,
+                                       std::uint32_t numpoints,
+                                       float maxdist,
+                                       Calc::Buffer* results,
+                                       Calc::Event const* waitevent,
+                                       Calc::Event** event) const
+        {
+            Throw("Closest point queries are not supported by this acceleration structure.");
+        }
+
+        virtual void QueryOverlap(std::uint32_t queueidx,
+                                  Calc::Buffer const* volumes,
+                                  std::uint32_t numqueries,
+                                  OverlapVolume volume,
+                                  std::uint32_t maxhits,
+                                  Calc::Buffer* results,
+                                  Calc::Buffer* counts,
+                                  Calc::Event const* waitevent,
+                                  Calc::Event** event) const
+        {
+            Throw("Overlap queries are not supported by this acceleration structure.");
+        }
+
         Strategy(Strategy const&) = delete;
         Strategy& operator = (Strategy const&) = delete;
 
     protected:
+        // Optional buffer argument, OpenCL kernels get a null pointer if there is no buffer
+        static void SetOptionalArg(Calc::Function* func, std::uint32_t idx, Calc::Buffer const* buffer)
+        {
+            if (buffer)
+            {
+                func->SetArg(idx, buffer);
+            }
+            else
+            {
+                void* null = nullptr;
+                func->SetArg(idx, sizeof(null), &null);
+            }
+        }
+
         Calc::Device* m_device;
     };
 }
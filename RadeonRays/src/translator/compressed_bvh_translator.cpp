@@ -0,0 +1,186 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "compressed_bvh_translator.h"
+
+#include "../except/except.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <queue>
+
+namespace RadeonRays
+{
+    static int const kMaxQuantizedValue = 0xffff;
+    // Smallest and largest exponents of normalized floats
+    static int const kMinExponent = 1;
+    static int const kMaxExponent = 254;
+
+    // Decode quantized value exactly the way kernels do
+    static float Dequantize(float origin, float step, int value)
+    {
+        float offset = (float)value * step;
+        return origin + offset;
+    }
+
+    void CompressedBvhTranslator::Process(Bvh& bvh)
+    {
+        nodecnt_ = 0;
+        // Internal node count is always less than the total one
+        nodes_.resize(std::max(bvh.m_nodecnt.load(), 1));
+
+        // Check if we have been initialized
+        assert(bvh.m_root);
+
+        // Process root
+        ProcessRootNode(bvh.m_root);
+
+        nodes_.resize(nodecnt_);
+    }
+
+    void CompressedBvhTranslator::ProcessRootNode(Bvh::Node const* root)
+    {
+        // Keep the nodes to process here
+        std::queue<std::pair<Bvh::Node const*, int> > workqueue;
+
+        workqueue.push(std::make_pair(root, 0));
+
+        while (!workqueue.empty())
+        {
+            auto current = workqueue.front();
+            workqueue.pop();
+
+            Node& node(nodes_[nodecnt_++]);
+            node.info = 0;
+
+            // Single leaf tree is stored as a node with both children referencing the leaf
+            Bvh::Node const* children[2] = { current.first, current.first };
+            if (current.first->type == Bvh::NodeType::kInternal)
+            {
+                children[0] = current.first->lc;
+                children[1] = current.first->rc;
+            }
+
+            std::int32_t* refs[2] = { &node.lchild, &node.rchild };
+
+            for (int i = 0; i < 2; ++i)
+            {
+                if (children[i]->type == Bvh::NodeType::kInternal)
+                {
+                    // Index is patched when the child is processed
+                    workqueue.push(std::make_pair(children[i], i == 0 ? nodecnt_ : -nodecnt_));
+                }
+                else
+                {
+                    ThrowIf(children[i]->numprims > kMaxLeafSize, "Leaf is too large for compressed BVH");
+
+                    *refs[i] = children[i]->startidx;
+                    node.info |= (std::uint32_t)children[i]->numprims << (24 + 4 * i);
+                }
+            }
+
+            QuantizeBounds(children[0]->bounds, children[1]->bounds, node);
+
+            if (current.second > 0)
+            {
+                nodes_[current.second - 1].lchild = nodecnt_ - 1;
+            }
+            else if (current.second < 0)
+            {
+                nodes_[-current.second - 1].rchild = nodecnt_ - 1;
+            }
+        }
+    }
+
+    void CompressedBvhTranslator::QuantizeBounds(bbox const& lbound, bbox const& rbound, Node& node) const
+    {
+        bbox const* bounds[2] = { &lbound, &rbound };
+        std::uint16_t* qbounds[2] = { node.lbound, node.rbound };
+
+        // Union of the children is the grid for both of them
+        bbox grid = bboxunion(lbound, rbound);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float origin = grid.pmin[axis];
+            float extent = grid.pmax[axis] - grid.pmin[axis];
+
+            // Start with the smallest power of two step covering the extent
+            int exponent = kMinExponent;
+            if (extent > 0.f)
+            {
+                int e = 0;
+                std::frexp(extent / kMaxQuantizedValue, &e);
+                exponent = std::min(std::max(e + 126, kMinExponent), kMaxExponent);
+            }
+
+            // Rounding of the upper bounds might not fit, use larger step then
+            for (;; ++exponent)
+            {
+                float step = std::ldexp(1.f, exponent - 127);
+                bool fits = true;
+
+                for (int i = 0; i < 2 && fits; ++i)
+                {
+                    float pmin = bounds[i]->pmin[axis];
+                    float pmax = bounds[i]->pmax[axis];
+
+                    // Round down and up making sure decoded values are outside of the bounds
+                    int qmin = (int)std::floor(((double)pmin - origin) / step);
+                    qmin = std::min(std::max(qmin, 0), kMaxQuantizedValue);
+
+                    while (qmin > 0 && Dequantize(origin, step, qmin) > pmin)
+                    {
+                        --qmin;
+                    }
+
+                    int qmax = (int)std::ceil(((double)pmax - origin) / step);
+                    qmax = std::max(qmax, qmin);
+
+                    while (qmax <= kMaxQuantizedValue && Dequantize(origin, step, qmax) < pmax)
+                    {
+                        ++qmax;
+                    }
+
+                    fits = qmax <= kMaxQuantizedValue;
+
+                    qbounds[i][axis] = (std::uint16_t)qmin;
+                    qbounds[i][axis + 3] = (std::uint16_t)std::min(qmax, kMaxQuantizedValue);
+                }
+
+                if (fits || exponent == kMaxExponent)
+                {
+                    break;
+                }
+            }
+
+            node.origin[axis] = origin;
+            node.info |= (std::uint32_t)exponent << (8 * axis);
+        }
+    }
+
+    void CompressedBvhTranslator::Flush()
+    {
+        nodecnt_ = 0;
+        nodes_.resize(0);
+    }
+}
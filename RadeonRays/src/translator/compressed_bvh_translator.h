@@ -0,0 +1,85 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef COMPRESSED_BVH_TRANSLATOR_H
+#define COMPRESSED_BVH_TRANSLATOR_H
+
+#include <cstdint>
+#include <vector>
+
+#include "radeon_rays.h"
+#include "../accelerator/bvh.h"
+
+namespace RadeonRays
+{
+    /// Compressed translator transforms regular binary BVH into the fatnode layout
+    /// with child bounds quantized to 16 bits, which makes the node 48 bytes instead of 64:
+    /// * Union of the child bounds defines quantization origin and per axis step
+    /// * Steps are powers of two, so decoding is exact and identical on every device
+    /// * Child bounds are rounded outwards, decoded boxes are never smaller than the original ones
+    /// 
+    class CompressedBvhTranslator
+    {
+    public:
+        // Leaf sizes are stored in 4 bits
+        static int const kMaxLeafSize = 15;
+
+        // Constructor
+        CompressedBvhTranslator()
+            : nodecnt_(0)
+        {
+        }
+
+        // Compressed BVH node
+        // Encoding:
+        // info bits 0-23 == biased exponents of x, y and z quantization steps (8 bits each)
+        // info bits 24-27 (28-31) == number of primitives if left (right) child is a leaf, 0 otherwise
+        // xbound == quantized min.x, min.y, min.z, max.x, max.y, max.z of x-child
+        // xchild == x-child node index if x-child is an internal node otherwise index of the first triangle
+        //
+        struct Node
+        {
+            float origin[3];
+            std::uint32_t info;
+            std::uint16_t lbound[6];
+            std::int32_t lchild;
+            std::uint16_t rbound[6];
+            std::int32_t rchild;
+        };
+
+        void Flush();
+        void Process(Bvh& bvh);
+
+        std::vector<Node> nodes_;
+        int nodecnt_;
+
+    private:
+        void ProcessRootNode(Bvh::Node const* node);
+        // Calculate node quantization grid and quantize children bounds
+        void QuantizeBounds(bbox const& lbound, bbox const& rbound, Node& node) const;
+
+        CompressedBvhTranslator(CompressedBvhTranslator const&);
+        CompressedBvhTranslator& operator =(CompressedBvhTranslator const&);
+    };
+}
+
+
+#endif // COMPRESSED_BVH_TRANSLATOR_H
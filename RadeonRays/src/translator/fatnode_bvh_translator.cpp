@@ -20,6 +20,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "fatnode_bvh_translator.h"
+#include "plain_bvh_translator.h"
 
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
@@ -46,6 +47,36 @@ namespace RadeonRays
         ProcessRootNode(bvh.m_root);
     }
 
+    void FatNodeBvhTranslator::ProcessMasks(Bvh& bvh, int const* primmasks)
+    {
+        // Masks are collected in the depth first layout, whose nodes map to the children here
+        PlainBvhTranslator plain;
+        plain.Process(bvh);
+        plain.ProcessMasks(primmasks);
+
+        // Both layouts start with the root, children come after their parent in both
+        std::vector<int> plainidx(nodes_.size());
+        masks_.assign(2 * nodes_.size(), 0);
+
+        for (int i = 0; i < nodecnt_; ++i)
+        {
+            int left = plainidx[i] + 1;
+            int right = plain.GetRightChild(plainidx[i]);
+
+            masks_[2 * i] = plain.masks_[left];
+            masks_[2 * i + 1] = plain.masks_[right];
+
+            if (nodes_[i].lbound.pmin.w == -1.f)
+            {
+                plainidx[(int)nodes_[i].lbound.pmax.w] = left;
+            }
+
+            if (nodes_[i].rbound.pmin.w == -1.f)
+            {
+                plainidx[(int)nodes_[i].rbound.pmax.w] = right;
+            }
+        }
+    }
 
     int FatNodeBvhTranslator::ProcessRootNode(Bvh::Node const* root)
     {
@@ -70,6 +101,7 @@ namespace RadeonRays
             else
             {
                 node.lbound.pmin.w = (float)(current.first->lc->startidx);
+                node.lbound.pmax.w = (float)(current.first->lc->numprims);
             }
 
             node.rbound = current.first->rc->bounds;
@@ -81,6 +113,7 @@ namespace RadeonRays
             else
             {
                 node.rbound.pmin.w = (float)(current.first->rc->startidx);
+                node.rbound.pmax.w = (float)(current.first->rc->numprims);
             }
 
             if (current.second > 0)
@@ -50,7 +50,8 @@ namespace RadeonRays
 
         // Fat BVH node
         // Encoding:
-        // xbound.pmin.w == -1.f if x-child is an internal node otherwise triangle index
+        // xbound.pmin.w == -1.f if x-child is an internal node otherwise index of the first triangle
+        // xbound.pmax.w == x-child node index if x-child is an internal node otherwise number of triangles
         //
         struct Node
         {
@@ -61,12 +62,17 @@ namespace RadeonRays
 
         void Flush();
         void Process(Bvh& bvh);
+        // OR primitive masks (indexed as the BVH primitives) into masks_, two per node
+        // for the left and the right child. Call after Process with the same bvh
+        void ProcessMasks(Bvh& bvh, int const* primmasks);
         //void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
         //void UpdateTopLevel(Bvh const& bvh);
 
         std::vector<Node> nodes_;
         std::vector<int>  extra_;
         std::vector<int>  roots_;
+        // Geometry masks of the children of every node
+        std::vector<int>  masks_;
         int nodecnt_;
         int root_;
 
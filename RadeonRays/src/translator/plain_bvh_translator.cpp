@@ -38,6 +38,7 @@ namespace RadeonRays
         int newsize = bvh.m_nodecnt;
         nodes_.resize(newsize);
         extra_.resize(newsize);
+        numprims_.resize(newsize);
 
         // Check if we have been initialized
         assert(bvh.m_root);
@@ -72,6 +73,60 @@ namespace RadeonRays
                 nodes_[i].bounds.pmin.w = -1.f;
             }
         }
+
+        // Leaves always continue to the next node in depth first order
+        // (or end the traversal if they are the last one), so their next
+        // pointer is implicit and pmax.w keeps the number of primitives.
+        // Negative count marks the last node of the tree.
+        for (int i = rootidx; i < (int)nodes_.size(); ++i)
+        {
+            if (nodes_[i].bounds.pmin.w != -1.f)
+            {
+                assert((int)nodes_[i].bounds.pmax.w == (i + 1 < (int)nodes_.size() ? i + 1 : -1));
+                nodes_[i].bounds.pmax.w = (float)(i + 1 < (int)nodes_.size() ? numprims_[i] : -numprims_[i]);
+            }
+        }
+    }
+
+    void PlainBvhTranslator::ProcessMasks(int const* primmasks)
+    {
+        ProcessMasks(primmasks, 0, (int)nodes_.size());
+    }
+
+    void PlainBvhTranslator::ProcessMasks(int const* primmasks, int begin, int end)
+    {
+        masks_.resize(nodes_.size());
+
+        // Children are placed after their parent in depth first order
+        for (int i = end - 1; i >= begin; --i)
+        {
+            bbox const& bounds = nodes_[i].bounds;
+
+            if (bounds.pmin.w != -1.f)
+            {
+                int start = (int)bounds.pmin.w;
+
+                int mask = 0;
+                for (int j = start; j < start + numprims_[i]; ++j)
+                {
+                    mask |= primmasks[j];
+                }
+
+                masks_[i] = mask;
+            }
+            else
+            {
+                masks_[i] = masks_[i + 1] | masks_[GetRightChild(i)];
+            }
+        }
+    }
+
+    int PlainBvhTranslator::GetRightChild(int idx) const
+    {
+        // Left child continues to the right one
+        int left = idx + 1;
+        bbox const& lbounds = nodes_[left].bounds;
+        return lbounds.pmin.w != -1.f ? left + 1 : (int)lbounds.pmax.w;
     }
 
     void PlainBvhTranslator::UpdateTopLevel(Bvh const& bvh)
@@ -123,6 +178,7 @@ namespace RadeonRays
 
         nodes_.resize(nodecnt);
         extra_.resize(nodecnt);
+        numprims_.resize(nodecnt);
         roots_.resize(numbvhs);
 
         for (int i = 0; i < numbvhs; ++i)
@@ -208,6 +264,7 @@ namespace RadeonRays
         {
             int startidx = n->startidx;
             extra = startidx;
+            numprims_[idx] = n->numprims;
             node.bounds.pmin.w = -1.f;
         }
         else
@@ -231,6 +288,7 @@ namespace RadeonRays
         {
             int startidx = n->startidx + offset;
             extra = startidx;
+            numprims_[idx] = n->numprims;
             node.bounds.pmin.w = -1.f;
         }
         else
@@ -250,5 +308,7 @@ namespace RadeonRays
         roots_.resize(0);
         nodes_.resize(0);
         extra_.resize(0);
+        numprims_.resize(0);
+        masks_.resize(0);
     }
 }
@@ -47,6 +47,12 @@ namespace RadeonRays
         }
 
         // Plain BVH node
+        // Encoding:
+        // bounds.pmin.w == -1.f for internal nodes otherwise index of the first triangle
+        // bounds.pmax.w is the next node index for internal nodes. Process(Bvh&) stores
+        // the number of triangles there for leaves (negative for the last node), other
+        // entry points keep the next node index for leaves as well.
+        //
         struct Node
         {
             // Node's bounding box
@@ -57,10 +63,20 @@ namespace RadeonRays
         void Process(Bvh& bvh);
         void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
         void UpdateTopLevel(Bvh const& bvh);
+        // OR primitive masks (indexed as the leaf start indices) into masks_ of every node,
+        // call after Process
+        void ProcessMasks(int const* primmasks);
+        // Same for nodes [begin, end) only, which have to hold whole trees
+        void ProcessMasks(int const* primmasks, int begin, int end);
+        // Right child of the internal node idx, the left one is idx + 1
+        int GetRightChild(int idx) const;
 
         std::vector<Node> nodes_;
         std::vector<int>  extra_;
+        std::vector<int>  numprims_;
         std::vector<int>  roots_;
+        // Geometry mask of every node
+        std::vector<int>  masks_;
         int nodecnt_;
         int root_;
 
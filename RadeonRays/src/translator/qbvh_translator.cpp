@@ -0,0 +1,208 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "qbvh_translator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <queue>
+
+namespace RadeonRays
+{
+    void QBvhTranslator::Process(Bvh& bvh)
+    {
+        nodecnt_ = 0;
+        height_ = 0;
+        // Wide tree never has more nodes than the binary one
+        nodes_.resize(std::max(bvh.m_nodecnt.load(), 1));
+
+        // Check if we have been initialized
+        assert(bvh.m_root);
+
+        // Process root
+        ProcessRootNode(bvh.m_root);
+
+        nodes_.resize(nodecnt_);
+    }
+
+    int QBvhTranslator::CollectChildren(Bvh::Node const* node, Bvh::Node const** children) const
+    {
+        int numchildren = 2;
+        children[0] = node->lc;
+        children[1] = node->rc;
+
+        while (numchildren < 4)
+        {
+            // Open internal child with the largest surface area,
+            // it is the one most likely to be visited by rays
+            int best = -1;
+            float bestarea = -1.f;
+
+            for (int i = 0; i < numchildren; ++i)
+            {
+                if (children[i]->type == Bvh::NodeType::kInternal)
+                {
+                    float area = children[i]->bounds.surface_area();
+
+                    if (area > bestarea)
+                    {
+                        best = i;
+                        bestarea = area;
+                    }
+                }
+            }
+
+            if (best < 0)
+            {
+                break;
+            }
+
+            Bvh::Node const* opened = children[best];
+            children[best] = opened->lc;
+            children[numchildren++] = opened->rc;
+        }
+
+        return numchildren;
+    }
+
+    void QBvhTranslator::ProcessRootNode(Bvh::Node const* root)
+    {
+        struct WorkItem
+        {
+            // Binary node to collapse
+            Bvh::Node const* node;
+            // Parent node and slot to patch
+            int parent;
+            int slot;
+            // Level of the node in the collapsed tree
+            int level;
+        };
+
+        // Keep the nodes to process here
+        std::queue<WorkItem> workqueue;
+
+        WorkItem rootitem = { root, -1, 0, 1 };
+        workqueue.push(rootitem);
+
+        while (!workqueue.empty())
+        {
+            auto current = workqueue.front();
+            workqueue.pop();
+
+            int nodeidx = nodecnt_++;
+            height_ = std::max(height_, current.level);
+
+            if (current.parent >= 0)
+            {
+                nodes_[current.parent].child[current.slot] = nodeidx;
+            }
+
+            // Single leaf tree is stored as a node with one leaf child
+            Bvh::Node const* children[4] = { current.node, nullptr, nullptr, nullptr };
+            int numchildren = 1;
+            if (current.node->type == Bvh::NodeType::kInternal)
+            {
+                numchildren = CollectChildren(current.node, children);
+            }
+
+            Node& node(nodes_[nodeidx]);
+
+            for (int i = 0; i < 4; ++i)
+            {
+                // Empty leaves carry nothing to intersect
+                if (i >= numchildren ||
+                    (children[i]->type != Bvh::NodeType::kInternal && children[i]->numprims == 0))
+                {
+                    // Bounds of the empty slot are never tested
+                    node.bminx[i] = node.bmaxx[i] = 0.f;
+                    node.bminy[i] = node.bmaxy[i] = 0.f;
+                    node.bminz[i] = node.bmaxz[i] = 0.f;
+                    node.child[i] = kEmptySlot;
+                    node.count[i] = kEmptySlot;
+                    continue;
+                }
+
+                bbox const& bounds = children[i]->bounds;
+                node.bminx[i] = bounds.pmin.x;
+                node.bmaxx[i] = bounds.pmax.x;
+                node.bminy[i] = bounds.pmin.y;
+                node.bmaxy[i] = bounds.pmax.y;
+                node.bminz[i] = bounds.pmin.z;
+                node.bmaxz[i] = bounds.pmax.z;
+
+                if (children[i]->type == Bvh::NodeType::kInternal)
+                {
+                    // Child index is patched once the child is placed
+                    node.child[i] = kEmptySlot;
+                    node.count[i] = 0;
+
+                    WorkItem item = { children[i], nodeidx, i, current.level + 1 };
+                    workqueue.push(item);
+                }
+                else
+                {
+                    node.child[i] = children[i]->startidx;
+                    node.count[i] = children[i]->numprims;
+                }
+            }
+        }
+    }
+
+    void QBvhTranslator::ProcessMasks(int const* primmasks)
+    {
+        int numnodes = (int)nodes_.size();
+        masks_.resize(4 * numnodes);
+
+        // Breadth first layout places children after their parent
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            Node const& node = nodes_[i];
+
+            for (int c = 0; c < 4; ++c)
+            {
+                int mask = 0;
+
+                if (node.count[c] > 0)
+                {
+                    for (int j = node.child[c]; j < node.child[c] + node.count[c]; ++j)
+                    {
+                        mask |= primmasks[j];
+                    }
+                }
+                else if (node.count[c] == 0)
+                {
+                    int const* childmasks = &masks_[4 * node.child[c]];
+                    mask = childmasks[0] | childmasks[1] | childmasks[2] | childmasks[3];
+                }
+
+                masks_[4 * i + c] = mask;
+            }
+        }
+    }
+
+    void QBvhTranslator::Flush()
+    {
+        nodecnt_ = 0;
+        height_ = 0;
+        nodes_.resize(0);
+        masks_.resize(0);
+    }
+}
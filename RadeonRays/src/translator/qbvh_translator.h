@@ -0,0 +1,92 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef QBVH_TRANSLATOR_H
+#define QBVH_TRANSLATOR_H
+
+#include <vector>
+
+#include "radeon_rays.h"
+#include "../accelerator/bvh.h"
+
+namespace RadeonRays
+{
+    /// QBVH translator collapses regular binary BVH into 4-wide tree where:
+    /// * Each node contains bounding boxes of up to 4 children in SoA form
+    /// * Children are chosen by repeatedly opening the largest internal child
+    /// * Nodes are laid out breadth first, stacked traversal only
+    /// 
+    class QBvhTranslator
+    {
+    public:
+        // Marks unused child slot
+        static int const kEmptySlot = -1;
+
+        // Constructor
+        QBvhTranslator()
+            : nodecnt_(0)
+            , height_(0)
+        {
+        }
+
+        // QBVH node (128 bytes)
+        // Encoding:
+        // count[i] > 0 if i-th child is a leaf, child[i] is the index of the first triangle then
+        // count[i] == 0 if i-th child is an internal node, child[i] is the node index then
+        // count[i] == kEmptySlot if i-th slot is not used
+        //
+        struct Node
+        {
+            float bminx[4];
+            float bmaxx[4];
+            float bminy[4];
+            float bmaxy[4];
+            float bminz[4];
+            float bmaxz[4];
+            int child[4];
+            int count[4];
+        };
+
+        void Flush();
+        void Process(Bvh& bvh);
+        // OR primitive masks (indexed as the BVH primitives) into masks_ of every child,
+        // call after Process
+        void ProcessMasks(int const* primmasks);
+
+        std::vector<Node> nodes_;
+        // Geometry masks of the children, 4 per node, 0 for empty slots
+        std::vector<int> masks_;
+        int nodecnt_;
+        // Number of node levels in the collapsed tree
+        int height_;
+
+    private:
+        void ProcessRootNode(Bvh::Node const* node);
+        // Collect up to 4 descendants of the internal node to become its children
+        int CollectChildren(Bvh::Node const* node, Bvh::Node const** children) const;
+
+        QBvhTranslator(QBvhTranslator const&);
+        QBvhTranslator& operator =(QBvhTranslator const&);
+    };
+}
+
+
+#endif // QBVH_TRANSLATOR_H
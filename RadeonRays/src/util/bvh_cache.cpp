@@ -0,0 +1,386 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "bvh_cache.h"
+
+#include "buffer.h"
+#include "event.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace RadeonRays
+{
+    static std::uint64_t const kHashPrime = 0x100000001b3ull;
+    // Arrays are aligned in the file, so mapped data is suitably aligned as well
+    static std::size_t const kArrayAlignment = 16;
+
+    struct FileHeader
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint64_t key;
+        std::uint64_t numarrays;
+    };
+
+    static char const kMagic[4] = { 'R', 'R', 'B', 'C' };
+
+    static std::size_t Align(std::size_t value)
+    {
+        return (value + kArrayAlignment - 1) & ~(kArrayAlignment - 1);
+    }
+
+    ///< Read only memory mapping of the whole file
+    class MappedFile
+    {
+    public:
+        MappedFile(std::string const& filename);
+        ~MappedFile();
+
+        char const* data() const { return m_data; }
+        std::size_t size() const { return m_size; }
+
+    private:
+        MappedFile(MappedFile const&);
+        MappedFile& operator = (MappedFile const&);
+
+        char const* m_data;
+        std::size_t m_size;
+#ifdef WIN32
+        HANDLE m_file;
+        HANDLE m_mapping;
+#endif
+    };
+
+#ifdef WIN32
+    MappedFile::MappedFile(std::string const& filename)
+        : m_data(nullptr)
+        , m_size(0)
+        , m_file(INVALID_HANDLE_VALUE)
+        , m_mapping(nullptr)
+    {
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+        if (m_file == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+        {
+            return;
+        }
+
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+        if (!m_mapping)
+        {
+            return;
+        }
+
+        m_data = static_cast<char const*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        m_size = m_data ? (std::size_t)size.QuadPart : 0;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (m_data)
+        {
+            UnmapViewOfFile(m_data);
+        }
+
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+        }
+
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_file);
+        }
+    }
+#else
+    MappedFile::MappedFile(std::string const& filename)
+        : m_data(nullptr)
+        , m_size(0)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* data = mmap(nullptr, (std::size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (data != MAP_FAILED)
+            {
+                m_data = static_cast<char const*>(data);
+                m_size = (std::size_t)st.st_size;
+            }
+        }
+
+        // Mapping stays valid after the descriptor is closed
+        close(fd);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (m_data)
+        {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+#endif
+
+    std::string BvhCache::GetFileName(std::string const& path, std::uint64_t key, std::string const& tag)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+
+        std::string filename = path;
+        if (!filename.empty() && filename.back() != '/' && filename.back() != '\\')
+        {
+            filename += '/';
+        }
+
+        return filename + name + "." + tag + ".rrbvh";
+    }
+
+    bool BvhCache::Load(Calc::Device* device, std::string const& filename, std::uint64_t key,
+        Calc::Buffer** buffers, std::size_t numbuffers)
+    {
+        MappedFile file(filename);
+
+        std::size_t offset = sizeof(FileHeader) + numbuffers * sizeof(std::uint64_t);
+        if (file.size() < offset)
+        {
+            return false;
+        }
+
+        FileHeader header;
+        std::memcpy(&header, file.data(), sizeof(FileHeader));
+
+        if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+            header.version != kVersion ||
+            header.key != key ||
+            header.numarrays != numbuffers)
+        {
+            return false;
+        }
+
+        // Validate sizes before creating anything, truncated files are treated as a miss
+        std::vector<std::uint64_t> sizes(numbuffers);
+        std::memcpy(&sizes[0], file.data() + sizeof(FileHeader), numbuffers * sizeof(std::uint64_t));
+
+        std::vector<std::size_t> offsets(numbuffers);
+        for (std::size_t i = 0; i < numbuffers; ++i)
+        {
+            offset = Align(offset);
+            offsets[i] = offset;
+            offset += (std::size_t)sizes[i];
+
+            if (sizes[i] == 0 || offset > file.size())
+            {
+                return false;
+            }
+        }
+
+        std::size_t numcreated = 0;
+        try
+        {
+            for (; numcreated < numbuffers; ++numcreated)
+            {
+                // Device only reads from the initial data
+                void* data = const_cast<char*>(file.data() + offsets[numcreated]);
+                buffers[numcreated] = device->CreateBuffer((std::size_t)sizes[numcreated], Calc::BufferType::kRead, data);
+            }
+        }
+        catch (...)
+        {
+            // Don't leak buffers created before the failure
+            for (std::size_t i = 0; i < numcreated; ++i)
+            {
+                device->DeleteBuffer(buffers[i]);
+                buffers[i] = nullptr;
+            }
+
+            throw;
+        }
+
+        return true;
+    }
+
+    bool BvhCache::Save(Calc::Device* device, std::string const& filename, std::uint64_t key,
+        Calc::Buffer* const* buffers, std::size_t numbuffers)
+    {
+        // Write into temporary file first, so other processes never see partial data
+        std::string tmpname = filename + ".tmp";
+        FILE* file = std::fopen(tmpname.c_str(), "wb");
+
+        if (!file)
+        {
+            return false;
+        }
+
+        FileHeader header;
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.key = key;
+        header.numarrays = numbuffers;
+
+        std::vector<std::uint64_t> sizes(numbuffers);
+        for (std::size_t i = 0; i < numbuffers; ++i)
+        {
+            sizes[i] = buffers[i]->GetSize();
+        }
+
+        bool ok = std::fwrite(&header, sizeof(FileHeader), 1, file) == 1 &&
+            std::fwrite(&sizes[0], sizeof(std::uint64_t), numbuffers, file) == numbuffers;
+
+        std::size_t offset = sizeof(FileHeader) + numbuffers * sizeof(std::uint64_t);
+        char const padding[kArrayAlignment] = {};
+
+        for (std::size_t i = 0; ok && i < numbuffers; ++i)
+        {
+            std::size_t numpadding = Align(offset) - offset;
+            ok = numpadding == 0 || std::fwrite(padding, 1, numpadding, file) == numpadding;
+            offset += numpadding;
+
+            void* data = nullptr;
+            Calc::Event* e = nullptr;
+            device->MapBuffer(buffers[i], 0, 0, (std::size_t)sizes[i], Calc::MapType::kMapRead, &data, &e);
+
+            e->Wait();
+            device->DeleteEvent(e);
+
+            ok = ok && std::fwrite(data, 1, (std::size_t)sizes[i], file) == sizes[i];
+            offset += (std::size_t)sizes[i];
+
+            device->UnmapBuffer(buffers[i], 0, data, &e);
+
+            e->Wait();
+            device->DeleteEvent(e);
+        }
+
+        ok = std::fclose(file) == 0 && ok;
+
+        if (ok)
+        {
+            // rename does not replace existing files on all platforms
+            std::remove(filename.c_str());
+            ok = std::rename(tmpname.c_str(), filename.c_str()) == 0;
+        }
+
+        if (!ok)
+        {
+            std::remove(tmpname.c_str());
+        }
+
+        return ok;
+    }
+
+    std::uint64_t BvhCache::HashShapes(std::vector<Shape const*> const& shapes, std::uint64_t seed)
+    {
+        std::uint64_t hash = seed;
+
+        // Instances often share base meshes, hash each of them once
+        std::map<Shape const*, std::uint64_t> meshhashes;
+
+        auto hashmesh = [&meshhashes](Mesh const* mesh)
+        {
+            auto iter = meshhashes.find(mesh);
+
+            if (iter != meshhashes.end())
+            {
+                return iter->second;
+            }
+
+            int sizes[] = { mesh->num_vertices(), mesh->num_faces() };
+            std::uint64_t meshhash = Hash(sizes, sizeof(sizes));
+            meshhash = Hash(mesh->GetVertexData(), mesh->num_vertices() * sizeof(float3), meshhash);
+            meshhash = Hash(mesh->GetFaceData(), mesh->num_faces() * sizeof(Mesh::Face), meshhash);
+
+            meshhashes[mesh] = meshhash;
+            return meshhash;
+        };
+
+        for (auto shape : shapes)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            Mesh const* mesh = shapeimpl->is_instance() ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+                static_cast<Mesh const*>(shape);
+
+            // Vertices are stored in world space, so transform is a part of the key
+            matrix m, minv;
+            shapeimpl->GetTransform(m, minv);
+
+            std::uint64_t data[] = { shapeimpl->is_instance() ? 1ull : 0ull, hashmesh(mesh) };
+            hash = Hash(data, sizeof(data), hash);
+            hash = Hash(&m, sizeof(matrix), hash);
+        }
+
+        return hash;
+    }
+
+    std::uint64_t BvhCache::Hash(void const* data, std::size_t size, std::uint64_t seed)
+    {
+        auto bytes = static_cast<unsigned char const*>(data);
+        std::uint64_t hash = seed;
+
+        // FNV style hashing of whole words, high bits are folded
+        // back after each step since multiplication only carries up
+        std::size_t numwords = size / sizeof(std::uint64_t);
+        for (std::size_t i = 0; i < numwords; ++i)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i * sizeof(std::uint64_t), sizeof(std::uint64_t));
+            hash = (hash ^ word) * kHashPrime;
+            hash ^= hash >> 32;
+        }
+
+        for (std::size_t i = numwords * sizeof(std::uint64_t); i < size; ++i)
+        {
+            hash = (hash ^ bytes[i]) * kHashPrime;
+        }
+
+        return hash;
+    }
+}
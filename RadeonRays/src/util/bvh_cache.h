@@ -0,0 +1,72 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "device.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace RadeonRays
+{
+    class Shape;
+
+    ///< The class stores translated BVH data (nodes, faces, vertices, etc)
+    ///< in a versioned binary file. Files are named after the hash of the
+    ///< geometry and build options, so static scenes can skip the build
+    ///< entirely on subsequent runs. Cached files are memory mapped on load
+    ///< and device buffers are initialized right from the mapping.
+    ///<
+    class BvhCache
+    {
+    public:
+        // Bump this each time translated node or face layout changes
+        // 2: faces carry vertex count and fourth index for quads
+        static std::uint32_t const kVersion = 2;
+        // Initial hash value
+        static std::uint64_t const kHashSeed = 0xcbf29ce484222325ull;
+
+        // Get the name of the cache file for the key within the directory,
+        // tag distinguishes data of different accelerators
+        static std::string GetFileName(std::string const& path, std::uint64_t key, std::string const& tag);
+
+        // Map the file and create read only device buffers out of its arrays,
+        // returns false if the file is missing or does not match the key
+        static bool Load(Calc::Device* device, std::string const& filename, std::uint64_t key,
+            Calc::Buffer** buffers, std::size_t numbuffers);
+
+        // Read device buffers back and store them in the file,
+        // returns false if the file can't be written
+        static bool Save(Calc::Device* device, std::string const& filename, std::uint64_t key,
+            Calc::Buffer* const* buffers, std::size_t numbuffers);
+
+        // Hash geometry and transforms of the shapes
+        static std::uint64_t HashShapes(std::vector<Shape const*> const& shapes, std::uint64_t seed = kHashSeed);
+
+        // Hash arbitrary data
+        static std::uint64_t Hash(void const* data, std::size_t size, std::uint64_t seed = kHashSeed);
+    };
+}
+
+#endif // BVH_CACHE_H
@@ -366,6 +366,76 @@ TEST_F(ApiBackendOpenCL, DISABLED_Intersection_1Ray_Masked)
 
 }
 
+#ifdef RR_RAY_MASK
+// The test checks that every accelerator skips the subtrees masked out for the ray
+TEST_F(ApiBackendOpenCL, Intersection_Masked_Accelerators)
+#else
+// The test checks that every accelerator skips the subtrees masked out for the ray
+TEST_F(ApiBackendOpenCL, DISABLED_Intersection_Masked_Accelerators)
+#endif
+{
+    auto intersect = [this](int raymask) -> Intersection
+    {
+        ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        r.SetMask(raymask);
+
+        Intersection isect;
+        auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+        auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+        EXPECT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        EXPECT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isect = *tmp;
+        EXPECT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        api_->DeleteBuffer(ray_buffer);
+        api_->DeleteBuffer(isect_buffer);
+        return isect;
+    };
+
+    for (auto acc : { "bvh", "bvh2l", "fatbvh" })
+    {
+        SCOPED_TRACE(acc);
+        api_->SetOption("acc.type", acc);
+
+        Shape* front = nullptr;
+        Shape* back = nullptr;
+        ASSERT_NO_THROW(front = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_NO_THROW(back = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+        // Back triangle is right behind the front one
+        matrix m = translation(float3(0.f, 0.f, 2.f));
+        ASSERT_NO_THROW(back->SetTransform(m, inverse(m)));
+
+        ASSERT_NO_THROW(front->SetMask(0x1));
+        ASSERT_NO_THROW(back->SetMask(0x2));
+        ASSERT_NO_THROW(api_->AttachShape(front));
+        ASSERT_NO_THROW(api_->AttachShape(back));
+        ASSERT_NO_THROW(api_->Commit());
+
+        EXPECT_EQ(intersect(0x3).shapeid, front->GetId());
+        EXPECT_EQ(intersect(0x2).shapeid, back->GetId());
+        EXPECT_EQ(intersect(0x4).shapeid, kNullId);
+
+        // Mask changes go through the refit path of two level BVH
+        ASSERT_NO_THROW(front->SetMask(0x2));
+        ASSERT_NO_THROW(back->SetMask(0x1));
+        ASSERT_NO_THROW(api_->Commit());
+
+        EXPECT_EQ(intersect(0x1).shapeid, back->GetId());
+        EXPECT_EQ(intersect(0x2).shapeid, front->GetId());
+
+        ASSERT_NO_THROW(api_->DetachShape(front));
+        ASSERT_NO_THROW(api_->DetachShape(back));
+        ASSERT_NO_THROW(api_->DeleteShape(front));
+        ASSERT_NO_THROW(api_->DeleteShape(back));
+    }
+}
+
 
 // The test creates a single triangle mesh and tests attach/detach functionality
 TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
@@ -600,6 +670,99 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+// The test checks intersection after mesh transform changes with BVH refit enabled
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedRefit)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit", 1.f));
+    // Never fall back to rebuild
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.max_sah_ratio", 1000.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    matrix m = translation(float3(0,2,0));
+    matrix minv = inverse(m);
+    // Move the mesh, this only refits the BVH
+    ASSERT_NO_THROW(mesh->SetTransform(m, minv));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, -1);
+
+    // Move the mesh back
+    m = matrix();
+    ASSERT_NO_THROW(mesh->SetTransform(m, m));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
 // The test checks intersection after geometry addition
 TEST_F(ApiBackendOpenCL, Intersection_1Ray_DynamicGeo)
 {
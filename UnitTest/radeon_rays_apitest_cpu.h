@@ -0,0 +1,425 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+/// This test suite is testing RadeonRays native CPU device functionality
+///
+
+#include "gtest/gtest.h"
+#include "radeon_rays.h"
+
+using namespace RadeonRays;
+
+#include "utils.h"
+
+// Api creation fixture, prepares api_ for further tests
+class ApiBackendCpu : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        api_ = nullptr;
+        int nativeidx = -1;
+
+        // Always use native CPU device
+        IntersectionApi::SetPlatform(DeviceInfo::kNativeCpu);
+
+        for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+        {
+            DeviceInfo devinfo;
+            IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+            if (devinfo.platform == DeviceInfo::kNativeCpu && nativeidx == -1)
+            {
+                nativeidx = idx;
+            }
+        }
+
+        ASSERT_NE(nativeidx, -1);
+
+        api_ = IntersectionApi::Create(nativeidx);
+    }
+
+    virtual void TearDown()
+    {
+        if (api_) { IntersectionApi::Delete(api_); }
+    }
+
+    void Wait()
+    {
+        e_->Wait();
+        api_->DeleteEvent(e_);
+    }
+
+    IntersectionApi* api_;
+    Event* e_;
+
+    static float const * vertices() {
+        static float const vertices[] = {
+            -1.f,-1.f,0.f,
+            1.f,-1.f,0.f,
+            0.f,1.f,0.f,
+
+        };
+        return vertices;
+    }
+    static int const * indices() {
+        static int const indices[] = { 0, 1, 2 };
+        return indices;
+    }
+
+    static int const * numfaceverts() {
+        static const int numfaceverts[] = { 3 };
+        return numfaceverts;
+    }
+};
+
+TEST_F(ApiBackendCpu, CpuDeviceIndexTest)
+{
+    IntersectionApi::SetPlatform(DeviceInfo::kNativeCpu);
+
+    ASSERT_EQ(IntersectionApi::GetDeviceCount(), 1U);
+
+#if USE_OPENCL
+    IntersectionApi::SetPlatform(DeviceInfo::kOpenCL);
+    const auto openclCount = IntersectionApi::GetDeviceCount();
+
+    IntersectionApi::SetPlatform((DeviceInfo::Platform)(DeviceInfo::kNativeCpu | DeviceInfo::kOpenCL));
+    ASSERT_EQ(IntersectionApi::GetDeviceCount(), openclCount + 1);
+
+    // Native device goes last
+    DeviceInfo devinfo;
+    IntersectionApi::GetDeviceInfo(openclCount, devinfo);
+    ASSERT_EQ(devinfo.platform, DeviceInfo::kNativeCpu);
+#endif
+    IntersectionApi::SetPlatform(DeviceInfo::kNativeCpu);
+}
+
+// The test checks whether the api has been successfully created
+TEST_F(ApiBackendCpu, SingleDevice)
+{
+    ASSERT_TRUE(api_ != nullptr);
+}
+
+// The test creates an empty scene
+TEST_F(ApiBackendCpu, EmptyScene)
+{
+    ASSERT_THROW(api_->Commit(), Exception);
+}
+
+// The test intersects a single ray with a single triangle mesh
+TEST_F(ApiBackendCpu, Intersection_1Ray)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.primid, 0);
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 1e-5f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test queries a world without faces: one never committed
+// and one whose shapes were all detached in favour of an empty mesh
+TEST_F(ApiBackendCpu, Intersection_EmptyWorld)
+{
+    ray rays[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        rays[i] = ray(float3(0.1f * i, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(4 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(4 * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(4 * sizeof(int), nullptr);
+
+    Shape* mesh = nullptr;
+    Shape* empty = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(empty = api_->CreateMesh(nullptr, 0, 0, nullptr, 0, nullptr, 0));
+
+    // Packets are traced for the second pass
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        if (pass == 1)
+        {
+            ASSERT_NO_THROW(api_->AttachShape(mesh));
+            ASSERT_NO_THROW(api_->Commit());
+        }
+        else if (pass == 2)
+        {
+            api_->SetOption("cpu.packet_size", 4.f);
+            ASSERT_NO_THROW(api_->DetachShape(mesh));
+            ASSERT_NO_THROW(api_->AttachShape(empty));
+            ASSERT_NO_THROW(api_->Commit());
+        }
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 4, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 4, occl_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4 * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+        int* occl = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 4 * sizeof(int), (void**)&occl, &e_));
+        Wait();
+
+        // Check results, only the committed triangle can be hit
+        for (int i = 0; i < 4; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, pass == 1 ? mesh->GetId() : kNullId);
+            ASSERT_EQ(occl[i] > 0, pass == 1);
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+        ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(empty));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(empty));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// The test checks geometry masks are respected by both query types
+TEST_F(ApiBackendCpu, Intersection_1Ray_Masked)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Set mask
+    ASSERT_NO_THROW(mesh->SetMask(0xFF000000));
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r.SetMask(0x000000FF);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto isect_flag_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* isect_flag = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
+    Wait();
+    int result = *isect_flag;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, kNullId);
+    ASSERT_EQ(result, kNullId);
+
+    // Make the mask overlap
+    ASSERT_NO_THROW(mesh->SetMask(0xFF0000FF));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr));
+
+    isect_flag = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
+    Wait();
+    result = *isect_flag;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_GT(result, 0);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+}
+
+// Test is checking if instance transform is applied
+TEST_F(ApiBackendCpu, Intersection_1Ray_TransformedInstance)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    // Create mesh and its instance moved up
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(0, 5, 0));
+    matrix minv = inverse(m);
+    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+
+    // Attach the instance only
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    // One ray into the base mesh location, one into the instance
+    ray rays[2];
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(0.f, 5.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, kNullId);
+    ASSERT_EQ(isect[1].shapeid, instance->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test takes the number of rays from the buffer and checks the rest is untouched
+TEST_F(ApiBackendCpu, Intersection_RayCount)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray rays[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        rays[i] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    int numrays = 2;
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), rays);
+    auto numrays_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapWrite, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    for (int i = 0; i < 3; ++i)
+    {
+        tmp[i] = Intersection();
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays_buffer, 3, isect_buffer, nullptr, nullptr));
+
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
@@ -33,6 +33,8 @@ using namespace RadeonRays;
 #include "tiny_obj_loader.h"
 #include "utils.h"
 
+#include <vector>
+
 // Api creation fixture, prepares api_ for further tests
 class ApiBackendEmbree : public ::testing::Test
 {
@@ -524,6 +526,70 @@ TEST_F(ApiBackendEmbree, Intersection_3Rays)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+// Both triangles of a quad are hit through the shared diagonal, multi-hit has to report the quad once
+TEST_F(ApiBackendEmbree, Intersection_MultiHit_QuadDiagonal)
+{
+    // Two stacked quads, the diagonal of the (v0, v1, v2), (v0, v2, v3) split is x == y
+    float const quads[] = {
+        -1.f,-1.f,0.f, 1.f,-1.f,0.f, 1.f,1.f,0.f, -1.f,1.f,0.f,
+        -1.f,-1.f,1.f, 1.f,-1.f,1.f, 1.f,1.f,1.f, -1.f,1.f,1.f
+    };
+    int const quadindices[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    int const quadfaceverts[] = { 4, 4 };
+
+    int const kNumRays = 5;
+    int const kNumHits = 3;
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(quads, 8, 3 * sizeof(float), quadindices, 0, quadfaceverts, 2));
+    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays through the diagonal, the last one is inside the first triangle
+    float const offsets[kNumRays][2] = { { 0.f, 0.f }, { 0.25f, 0.25f }, { -0.5f, -0.5f }, { 0.75f, 0.75f }, { 0.5f, -0.5f } };
+
+    ray rays[kNumRays];
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float4(offsets[i][0], offsets[i][1], -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays);
+    auto hits_buffer = api_->CreateBuffer(kNumRays * kNumHits * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersectionMulti(ray_buffer, kNumRays, kNumHits, hits_buffer, nullptr, nullptr));
+
+    Intersection* hits = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hits_buffer, kMapRead, 0, kNumRays * kNumHits * sizeof(Intersection), (void**)&hits, &e_));
+    Wait();
+
+    // One hit per quad sorted by distance, the third entry stays empty
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        Intersection const* rayhits = hits + i * kNumHits;
+
+        ASSERT_EQ(mesh->GetId(), rayhits[0].shapeid);
+        ASSERT_EQ(0, rayhits[0].primid);
+        ASSERT_NEAR(10.f, rayhits[0].uvwt.w, 1e-4f);
+
+        ASSERT_EQ(mesh->GetId(), rayhits[1].shapeid);
+        ASSERT_EQ(1, rayhits[1].primid);
+        ASSERT_NEAR(11.f, rayhits[1].uvwt.w, 1e-4f);
+
+        ASSERT_EQ(kNullId, rayhits[2].shapeid);
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(hits_buffer, hits, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hits_buffer));
+}
+
 
 // Test is checking if mesh transform is working as expected
 TEST_F(ApiBackendEmbree, Intersection_1Ray_Transformed)
@@ -1110,4 +1176,129 @@ TEST_F(ApiBackendEmbree, Intersection_1Ray_InstanceNoShape)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+// The test takes the number of rays from the buffer and checks the rest is untouched
+TEST_F(ApiBackendEmbree, Intersection_RayCount)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray rays[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        rays[i] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    int numrays = 2;
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), rays);
+    auto numrays_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(3 * sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapWrite, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    for (int i = 0; i < 3; ++i)
+    {
+        tmp[i] = Intersection();
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapWrite, 0, 3 * sizeof(int), (void**)&occl, &e_));
+    Wait();
+    for (int i = 0; i < 3; ++i)
+    {
+        occl[i] = kNullId;
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    // Intersect, occlusion query waits for the intersection one
+    Event* isect_event = nullptr;
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays_buffer, 3, isect_buffer, nullptr, &isect_event));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays_buffer, 3, occl_buffer, isect_event, &e_));
+    Wait();
+    api_->DeleteEvent(isect_event);
+
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 3 * sizeof(int), (void**)&occl, &e_));
+    Wait();
+    int occluded[3] = { occl[0], occl[1], occl[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+    ASSERT_EQ(occluded[0], mesh->GetId());
+    ASSERT_EQ(occluded[1], mesh->GetId());
+    ASSERT_EQ(occluded[2], kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// The test deletes the api while queries are still running, the device has to wait for them
+TEST_F(ApiBackendEmbree, Delete_QueriesInFlight)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    const int numrays = 100000;
+    std::vector<ray> rays(numrays, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f));
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(numrays * sizeof(int), nullptr);
+
+    // Occlusion query is chained to the intersection one, so it might not be started yet either
+    Event* isect_event = nullptr;
+    Event* occl_event = nullptr;
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &isect_event));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occl_buffer, isect_event, &occl_event));
+
+    IntersectionApi::Delete(api_);
+    api_ = nullptr;
+
+    ASSERT_TRUE(isect_event->Complete());
+    ASSERT_TRUE(occl_event->Complete());
+
+    // Bail out, objects of the deleted api are released directly
+    delete isect_event;
+    delete occl_event;
+    delete ray_buffer;
+    delete isect_buffer;
+    delete occl_buffer;
+    delete mesh;
+}
+
 #endif // USE_VULKAN
@@ -37,6 +37,8 @@ using namespace tinyobj;
 
 #include <vector>
 #include <cstdio>
+#include <cstdint>
+#include <string>
 
 // Api creation fixture, prepares api_ for further tests
 class ApiConformanceCL : public ::testing::Test
@@ -258,6 +260,44 @@ TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_Fat
 
 }
 
+TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_CompressedBvh)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "cbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_QBvh)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "qbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_Grid)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "grid");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
 TEST_F(ApiConformanceCL, DISABLED_CPU_CornellBox_1000Rays_Brutforce_HlBvh)
 {
     if (!apicpu_)
@@ -430,6 +470,490 @@ TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_AnyHit_Bruteforce)
     ExpectAnyRaysOk<10000>(api);
 }
 
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_MaxLeafSize4_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_AnyHit_MaxLeafSize4_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvh_MaxLeafSize4)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Lbvh_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_Lbvh_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.force2level", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_TreeletOptimized_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.optimize", "treelet");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvh_TreeletOptimized)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.builder", "median");
+    api->SetOption("bvh.optimize", "treelet");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_CompressedBvh)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "cbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_AnyHit_Bruteforce_CompressedBvh)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "cbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_CompressedBvh_MaxLeafSize4)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "cbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_QBvh)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "qbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_AnyHit_Bruteforce_QBvh)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "qbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_QBvh_MaxLeafSize4)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "qbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_Grid)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "grid");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_AnyHit_Bruteforce_Grid)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "grid");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Bruteforce_Grid_Sparse)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "grid");
+    api->SetOption("grid.density", 0.5f);
+    api->SetOption("grid.parallel_build", 0.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_BvhCache_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.force2level", 0.f);
+    // Fresh directory, so the first commit always misses the cache
+    TempDirectory cache;
+    ASSERT_FALSE(cache.path().empty());
+    api->SetOption("bvh.cache.path", cache.path().c_str());
+
+    // The first commit builds and stores the BVH
+    ExpectClosestRaysOk<10000>(api);
+    ASSERT_EQ(cache.files().size(), 1U);
+
+    // Reattaching the same geometry loads it from the cache
+    for (auto shape : apishapes_gpu_)
+    {
+        EXPECT_NO_THROW(api->DetachShape(shape));
+    }
+
+    for (auto shape : apishapes_gpu_)
+    {
+        EXPECT_NO_THROW(api->AttachShape(shape));
+    }
+
+    ExpectClosestRaysOk<10000>(api);
+    EXPECT_EQ(cache.files().size(), 1U);
+
+    // Don't touch the directory after it is removed
+    api->SetOption("bvh.cache.path", "");
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_BvhCache_OldVersion)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.force2level", 0.f);
+
+    TempDirectory cache;
+    ASSERT_FALSE(cache.path().empty());
+    api->SetOption("bvh.cache.path", cache.path().c_str());
+
+    ExpectClosestRaysOk<10000>(api);
+    auto files = cache.files();
+    ASSERT_EQ(files.size(), 1U);
+    std::string filename = cache.path() + "/" + files[0];
+
+    // Mark the file as written by version 1, which had a different face layout.
+    // Version follows the 4 byte magic in the header.
+    std::uint32_t const kOldVersion = 1;
+    FILE* file = std::fopen(filename.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    std::fseek(file, 4, SEEK_SET);
+    std::fwrite(&kOldVersion, sizeof(kOldVersion), 1, file);
+    std::fclose(file);
+
+    for (auto shape : apishapes_gpu_)
+    {
+        EXPECT_NO_THROW(api->DetachShape(shape));
+    }
+
+    for (auto shape : apishapes_gpu_)
+    {
+        EXPECT_NO_THROW(api->AttachShape(shape));
+    }
+
+    // The stale file is rejected, BVH is rebuilt and stored with the current version
+    ExpectClosestRaysOk<10000>(api);
+
+    std::uint32_t version = kOldVersion;
+    file = std::fopen(filename.c_str(), "rb");
+    ASSERT_NE(file, nullptr);
+    std::fseek(file, 4, SEEK_SET);
+    EXPECT_EQ(std::fread(&version, sizeof(version), 1, file), 1U);
+    std::fclose(file);
+    EXPECT_NE(version, kOldVersion);
+
+    api->SetOption("bvh.cache.path", "");
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_CompactOutputs)
+{
+    // Neither count is a multiple of the mask word or the work group size
+    int const kNumRays = 10000;
+    int const kNumIndirect = 4999;
+    int const kMaskSize = (kNumRays + 31) / 32;
+
+    auto api = apigpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    // Every 7th ray is inactive
+    std::vector<ray> r(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r[i].d = normalize(float3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+        r[i].SetActive(i % 7 != 0);
+        r[i].SetMask(0xFFFFFFFF);
+    }
+
+    // Full results of inactive rays are not written, start with misses
+    std::vector<Intersection> misses(kNumRays);
+    std::vector<int> unoccluded(kNumRays, -1);
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), r.data());
+    auto t_buffer = api->CreateBuffer(kNumRays * sizeof(float), nullptr);
+    auto indirect_t_buffer = api->CreateBuffer(kNumRays * sizeof(float), nullptr);
+    auto ids_buffer = api->CreateBuffer(2 * kNumRays * sizeof(Id), nullptr);
+    auto mask_buffer = api->CreateBuffer(kMaskSize * sizeof(int), nullptr);
+    auto indirect_mask_buffer = api->CreateBuffer(kMaskSize * sizeof(int), nullptr);
+    auto count_buffer = api->CreateBuffer(sizeof(int), (void*)&kNumIndirect);
+
+    // bvh has compact kernels, fatbvh and the two level BVH (the last one) compact on the host
+    char const* acctypes[] = { "bvh", "fatbvh", "bvh" };
+    float force2level[] = { 0.f, 0.f, 1.f };
+
+    for (int a = 0; a < 3; ++a)
+    {
+        SCOPED_TRACE(force2level[a] > 0.f ? "bvh2l" : acctypes[a]);
+        api->SetOption("acc.type", acctypes[a]);
+        api->SetOption("bvh.force2level", force2level[a]);
+        EXPECT_NO_THROW(api->Commit());
+
+        auto isect_buffer = api->CreateBuffer(kNumRays * sizeof(Intersection), misses.data());
+        auto occluded_buffer = api->CreateBuffer(kNumRays * sizeof(int), unoccluded.data());
+
+        EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryOcclusion(ray_buffer, kNumRays, occluded_buffer, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, t_buffer, kHitDistance, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, count_buffer, kNumRays, indirect_t_buffer, kHitDistance, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, ids_buffer, kHitIds, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryOcclusion(ray_buffer, kNumRays, mask_buffer, kOcclusionMask, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryOcclusion(ray_buffer, count_buffer, kNumRays, indirect_mask_buffer, kOcclusionMask, nullptr, nullptr));
+
+        Event* e = nullptr;
+        Intersection* isect = nullptr;
+        int* occluded = nullptr;
+        float* t = nullptr;
+        float* indirect_t = nullptr;
+        Id* ids = nullptr;
+        std::uint32_t* mask = nullptr;
+        std::uint32_t* indirect_mask = nullptr;
+
+        EXPECT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(occluded_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occluded, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(t_buffer, kMapRead, 0, kNumRays * sizeof(float), (void**)&t, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(indirect_t_buffer, kMapRead, 0, kNumRays * sizeof(float), (void**)&indirect_t, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(ids_buffer, kMapRead, 0, 2 * kNumRays * sizeof(Id), (void**)&ids, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(mask_buffer, kMapRead, 0, kMaskSize * sizeof(int), (void**)&mask, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(indirect_mask_buffer, kMapRead, 0, kMaskSize * sizeof(int), (void**)&indirect_mask, &e));
+        e->Wait(); api->DeleteEvent(e);
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            bool hit = isect[i].shapeid != kNullId;
+            bool masked = (mask[i / 32] >> (i % 32) & 1) != 0;
+
+            ASSERT_EQ(hit ? isect[i].uvwt.w : -1.f, t[i]);
+            ASSERT_EQ(isect[i].shapeid, ids[2 * i]);
+            ASSERT_EQ(hit ? isect[i].primid : kNullId, ids[2 * i + 1]);
+            ASSERT_EQ(occluded[i] > 0, masked);
+
+            if (i < kNumIndirect)
+            {
+                ASSERT_EQ(t[i], indirect_t[i]);
+                ASSERT_EQ(masked, (indirect_mask[i / 32] >> (i % 32) & 1) != 0);
+            }
+        }
+
+        api->UnmapBuffer(isect_buffer, isect, nullptr);
+        api->UnmapBuffer(occluded_buffer, occluded, nullptr);
+        api->UnmapBuffer(t_buffer, t, nullptr);
+        api->UnmapBuffer(indirect_t_buffer, indirect_t, nullptr);
+        api->UnmapBuffer(ids_buffer, ids, nullptr);
+        api->UnmapBuffer(mask_buffer, mask, nullptr);
+        api->UnmapBuffer(indirect_mask_buffer, indirect_mask, nullptr);
+
+        EXPECT_NO_THROW(api->DeleteBuffer(isect_buffer));
+        EXPECT_NO_THROW(api->DeleteBuffer(occluded_buffer));
+    }
+
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.force2level", 0.f);
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(t_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(indirect_t_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(ids_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(mask_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(indirect_mask_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(count_buffer));
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_SoA)
+{
+    int const kNumRays = 10000;
+
+    auto api = apigpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    // Same rays in both layouts, every 5th ray is short
+    std::vector<ray> r(kNumRays);
+    std::vector<float> origins(3 * kNumRays);
+    std::vector<float> directions(3 * kNumRays);
+    std::vector<float> maxt(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        maxt[i] = (i % 5 == 0) ? 0.5f : 1000.f;
+        r[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, maxt[i]);
+        r[i].d = normalize(float3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+        r[i].SetActive(true);
+        r[i].SetMask(0xFFFFFFFF);
+
+        for (int a = 0; a < 3; ++a)
+        {
+            origins[a * kNumRays + i] = r[i].o[a];
+            directions[a * kNumRays + i] = r[i].d[a];
+        }
+    }
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), r.data());
+    auto isect_buffer = api->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto occluded_buffer = api->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    RaySoA rays;
+    rays.origins = api->CreateBuffer(3 * kNumRays * sizeof(float), origins.data());
+    rays.directions = api->CreateBuffer(3 * kNumRays * sizeof(float), directions.data());
+    rays.maxt = api->CreateBuffer(kNumRays * sizeof(float), maxt.data());
+    rays.masks = nullptr;
+
+    // Primitive IDs are not needed
+    IntersectionSoA hits;
+    hits.t = api->CreateBuffer(kNumRays * sizeof(float), nullptr);
+    hits.primids = nullptr;
+    hits.shapeids = api->CreateBuffer(kNumRays * sizeof(Id), nullptr);
+    hits.uvs = api->CreateBuffer(2 * kNumRays * sizeof(float), nullptr);
+    auto result_buffer = api->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    // Accelerators with SoA kernels, the last one is the two level BVH
+    char const* acctypes[] = { "bvh", "fatbvh", "bvh" };
+    float force2level[] = { 0.f, 0.f, 1.f };
+
+    for (int a = 0; a < 3; ++a)
+    {
+        SCOPED_TRACE(force2level[a] > 0.f ? "bvh2l" : acctypes[a]);
+        api->SetOption("acc.type", acctypes[a]);
+        api->SetOption("bvh.force2level", force2level[a]);
+        EXPECT_NO_THROW(api->Commit());
+
+        EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryOcclusion(ray_buffer, kNumRays, occluded_buffer, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryIntersection(rays, kNumRays, hits, nullptr, nullptr));
+        EXPECT_NO_THROW(api->QueryOcclusion(rays, kNumRays, result_buffer, nullptr, nullptr));
+
+        Event* e = nullptr;
+        Intersection* isect = nullptr;
+        int* occluded = nullptr;
+        float* t = nullptr;
+        Id* shapeids = nullptr;
+        float* uvs = nullptr;
+        int* results = nullptr;
+
+        EXPECT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(occluded_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occluded, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(hits.t, kMapRead, 0, kNumRays * sizeof(float), (void**)&t, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(hits.shapeids, kMapRead, 0, kNumRays * sizeof(Id), (void**)&shapeids, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(hits.uvs, kMapRead, 0, 2 * kNumRays * sizeof(float), (void**)&uvs, &e));
+        e->Wait(); api->DeleteEvent(e);
+        EXPECT_NO_THROW(api->MapBuffer(result_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&results, &e));
+        e->Wait(); api->DeleteEvent(e);
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, shapeids[i]);
+            ASSERT_EQ(occluded[i], results[i]);
+
+            if (isect[i].shapeid != kNullId)
+            {
+                ASSERT_EQ(isect[i].uvwt.w, t[i]);
+                ASSERT_EQ(isect[i].uvwt.x, uvs[i]);
+                ASSERT_EQ(isect[i].uvwt.y, uvs[kNumRays + i]);
+            }
+        }
+
+        api->UnmapBuffer(isect_buffer, isect, nullptr);
+        api->UnmapBuffer(occluded_buffer, occluded, nullptr);
+        api->UnmapBuffer(hits.t, t, nullptr);
+        api->UnmapBuffer(hits.shapeids, shapeids, nullptr);
+        api->UnmapBuffer(hits.uvs, uvs, nullptr);
+        api->UnmapBuffer(result_buffer, results, nullptr);
+    }
+
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.force2level", 0.f);
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(occluded_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(const_cast<Buffer*>(rays.origins)));
+    EXPECT_NO_THROW(api->DeleteBuffer(const_cast<Buffer*>(rays.directions)));
+    EXPECT_NO_THROW(api->DeleteBuffer(const_cast<Buffer*>(rays.maxt)));
+    EXPECT_NO_THROW(api->DeleteBuffer(hits.t));
+    EXPECT_NO_THROW(api->DeleteBuffer(hits.shapeids));
+    EXPECT_NO_THROW(api->DeleteBuffer(hits.uvs));
+    EXPECT_NO_THROW(api->DeleteBuffer(result_buffer));
+}
+
 TEST_F(ApiConformanceCL, DISABLED_CornellBox_10000RaysRandom_ClosestHit_Events_Bruteforce)
 {
     int const kNumRays = 10000;
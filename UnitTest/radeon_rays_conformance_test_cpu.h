@@ -0,0 +1,1680 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// This test suite is testing RadeonRays native CPU device results to conform to brute force
+///
+
+#include "gtest/gtest.h"
+#include "radeon_rays.h"
+
+#include "tiny_obj_loader.h"
+#include "utils.h"
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Api creation fixture, prepares api_ for further tests
+class ApiConformanceCpu : public ::testing::Test
+{
+public:
+    static const int kMaxRaysTests = 10000;
+
+    void SetUp() override;
+    void TearDown() override;
+
+    void Wait(IntersectionApi* api)
+    {
+        e_->Wait();
+        api->DeleteEvent(e_);
+    }
+
+    void ExpectClosestIntersectionOk(const Intersection& expected, const Intersection& test) const;
+
+    template< int kNumRays> void ExpectClosestRaysOk(RadeonRays::IntersectionApi* api) const;
+
+    template< int kNumRays> void ExpectAnyRaysOk(RadeonRays::IntersectionApi* api) const;
+
+    // Random rays in SoA layout, closest and any hit
+    template< int kNumRays> void ExpectSoARaysOk(RadeonRays::IntersectionApi* api) const;
+
+    // Coherent pinhole camera rays, closest and any hit
+    template< int kWidth> void ExpectCameraRaysOk(RadeonRays::IntersectionApi* api) const;
+
+    // Grid mesh of 2 * kGrid * kGrid triangles built with and without bvh.parallel_build,
+    // leaf order and closest hits of both builds must match exactly
+    template< int kGrid> void ExpectParallelBuildOk();
+
+    // Native CPU api
+    IntersectionApi* apicpu_;
+
+    std::vector<Shape*> apishapes_cpu_;
+    std::vector<TestShape> test_shapes_;
+
+    Event* e_;
+
+    // Tinyobj data
+    std::vector<shape_t> shapes_;
+    std::vector<material_t> materials_;
+
+};
+
+inline void ApiConformanceCpu::SetUp()
+{
+    apicpu_ = nullptr;
+
+    // TODO make conformance tests across multiple backends and devices
+    IntersectionApi::SetPlatform(DeviceInfo::kNativeCpu);
+
+    //Search for native CPU
+    int cpuidx = -1;
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+        if (devinfo.platform == DeviceInfo::kNativeCpu && cpuidx == -1)
+        {
+            cpuidx = idx;
+        }
+    }
+
+    EXPECT_NE(cpuidx, -1);
+
+    apicpu_ = IntersectionApi::Create(cpuidx);
+    EXPECT_NE(apicpu_, nullptr);
+
+    // Load obj file 
+    std::string res = LoadObj(shapes_, materials_, "../Resources/CornellBox/orig.objm");
+
+    // Create meshes within IntersectionApi
+    for (int i = 0; i<(int)shapes_.size(); ++i)
+    {
+        Shape* shape = nullptr;
+
+        EXPECT_NO_THROW(shape = apicpu_->CreateMesh(&shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3, 3 * sizeof(float),
+            &shapes_[i].mesh.indices[0], 0, nullptr, (int)shapes_[i].mesh.indices.size() / 3));
+
+        EXPECT_NO_THROW(apicpu_->AttachShape(shape));
+        
+        test_shapes_.push_back({ &shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3,
+            &shapes_[i].mesh.indices[0], (int)shapes_[i].mesh.indices.size(), nullptr, (int)shapes_[i].mesh.indices.size() / 3 });
+        test_shapes_.back().shape = shape;
+
+        apishapes_cpu_.push_back(shape);
+    }
+
+    apicpu_->SetOption("bvh.builder", "sah");
+
+    srand(0xABCDEF12);
+
+}
+
+inline void ApiConformanceCpu::TearDown()
+{
+    // TearDown needs to be safe for failed api creation hence
+    // all the if( apicpu_)
+
+    // Commit update
+    if (apicpu_) { EXPECT_NO_THROW(apicpu_->Commit()); }
+
+    // Delete meshes
+    for (int i = 0; i<(int)apishapes_cpu_.size(); ++i)
+    {
+        if (apicpu_) { EXPECT_NO_THROW(apicpu_->DeleteShape(apishapes_cpu_[i])); }
+    }
+
+    if (apicpu_) { IntersectionApi::Delete(apicpu_); }
+}
+
+/*
+BEGIN CPU TESTS
+*/
+TEST_F(ApiConformanceCpu, CornellBox_1RandomRay_ClosestHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectClosestRaysOk<1>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_100RayRandom_ClosestHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectClosestRaysOk<100>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_1000RaysRandom_ClosestHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ClosestHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10RaysRandom_ClosestHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectClosestRaysOk<10>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ClosestHit_Bruteforce_SplitBvh)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.sah.use_splits", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ClosestHit_Bruteforce_MaxLeafSize4)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ClosestHit_Bruteforce_Lbvh)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "lbvh");
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_1RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectAnyRaysOk<1>(api);
+}
+TEST_F(ApiConformanceCpu, CornellBox_100RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectAnyRaysOk<100>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_1000RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectAnyRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ClosestHit_Bruteforce_Packets)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("cpu.packet_size", 16.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RandomRays_AnyHit_Bruteforce_Packets)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("cpu.packet_size", 16.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_CameraRays_Bruteforce_Packets4)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("cpu.packet_size", 4.f);
+
+    ExpectCameraRaysOk<64>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_CameraRays_Bruteforce_Packets16)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("cpu.packet_size", 16.f);
+
+    ExpectCameraRaysOk<64>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ClosestHit_Bruteforce_SortRays)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("query.sort_rays", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RandomRays_AnyHit_Bruteforce_SortRays)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("query.sort_rays", 1.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_SortRays_InactiveAndIndirect)
+{
+    int const kNumRays = 10000;
+    int const kNumActive = 8000;
+
+    std::vector<Intersection> isect_brute(kNumRays);
+    std::vector<ray> r_brute(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+    }
+
+    apicpu_->SetOption("query.sort_rays", 1.f);
+    EXPECT_NO_THROW(apicpu_->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, isect_brute.data());
+
+    auto ray_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto count_buffer = apicpu_->CreateBuffer(sizeof(int), nullptr);
+
+    ray* rays = nullptr;
+    Event* ev;
+
+    EXPECT_NO_THROW(apicpu_->MapBuffer(ray_buffer, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&rays, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    // Every third ray is inactive
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = r_brute[i].o;
+        rays[i].d = r_brute[i].d;
+        rays[i].SetActive(i % 3 != 0);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(ray_buffer, rays, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    Intersection* isect = nullptr;
+    EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapWrite, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        isect[i].shapeid = -2;
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer, isect, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    int* count = nullptr;
+    EXPECT_NO_THROW(apicpu_->MapBuffer(count_buffer, kMapWrite, 0, sizeof(int), (void**)&count, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    *count = kNumActive;
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(count_buffer, count, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    // Only the first kNumActive rays are traced
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, count_buffer, kNumRays, isect_buffer, nullptr, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        if (i % 3 != 0 && i < kNumActive)
+        {
+            ExpectClosestIntersectionOk(isect_brute[i], isect[i]);
+        }
+        else
+        {
+            ASSERT_EQ(isect[i].shapeid, -2);
+        }
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer, isect, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(count_buffer));
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_SoA_Bruteforce)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectSoARaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_SoA_Bruteforce_Packets)
+{
+    auto api = apicpu_;
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("cpu.packet_size", 8.f);
+
+    ExpectSoARaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_CompactOutputs)
+{
+    int const kNumRays = 10000;
+    int const kNumIndirect = 5000;
+    int const kMaskSize = (kNumRays + 31) / 32;
+
+    // Every 7th ray is inactive
+    std::vector<ray> r(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r[i].d = normalize(float3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+        r[i].SetActive(i % 7 != 0);
+    }
+
+    EXPECT_NO_THROW(apicpu_->Commit());
+
+    auto ray_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(ray), r.data());
+    auto isect_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto occluded_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+    auto t_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(float), nullptr);
+    auto ids_buffer = apicpu_->CreateBuffer(2 * kNumRays * sizeof(Id), nullptr);
+    auto mask_buffer = apicpu_->CreateBuffer(kMaskSize * sizeof(int), nullptr);
+    auto indirect_mask_buffer = apicpu_->CreateBuffer(kMaskSize * sizeof(int), nullptr);
+    auto count_buffer = apicpu_->CreateBuffer(sizeof(int), (void*)&kNumIndirect);
+
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->QueryOcclusion(ray_buffer, kNumRays, occluded_buffer, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, t_buffer, kHitDistance, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, ids_buffer, kHitIds, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->QueryOcclusion(ray_buffer, kNumRays, mask_buffer, kOcclusionMask, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->QueryOcclusion(ray_buffer, count_buffer, kNumRays, indirect_mask_buffer, kOcclusionMask, nullptr, nullptr));
+
+    // Occlusion mask is the only output of occlusion queries
+    EXPECT_ANY_THROW(apicpu_->QueryOcclusion(ray_buffer, kNumRays, t_buffer, kHitDistance, nullptr, nullptr));
+    EXPECT_ANY_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, mask_buffer, kOcclusionMask, nullptr, nullptr));
+
+    Event* ev;
+    Intersection* isect = nullptr;
+    int* occluded = nullptr;
+    float* t = nullptr;
+    Id* ids = nullptr;
+    std::uint32_t* mask = nullptr;
+    std::uint32_t* indirect_mask = nullptr;
+
+    EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->MapBuffer(occluded_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occluded, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->MapBuffer(t_buffer, kMapRead, 0, kNumRays * sizeof(float), (void**)&t, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->MapBuffer(ids_buffer, kMapRead, 0, 2 * kNumRays * sizeof(Id), (void**)&ids, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->MapBuffer(mask_buffer, kMapRead, 0, kMaskSize * sizeof(int), (void**)&mask, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->MapBuffer(indirect_mask_buffer, kMapRead, 0, kMaskSize * sizeof(int), (void**)&indirect_mask, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        bool active = i % 7 != 0;
+        bool hit = active && isect[i].shapeid != kNullId;
+        bool masked = (mask[i / 32] >> (i % 32) & 1) != 0;
+
+        ASSERT_EQ(hit ? isect[i].uvwt.w : -1.f, t[i]);
+        ASSERT_EQ(hit ? isect[i].shapeid : kNullId, ids[2 * i]);
+        ASSERT_EQ(hit ? isect[i].primid : kNullId, ids[2 * i + 1]);
+        ASSERT_EQ(active && occluded[i] > 0, masked);
+
+        if (i < kNumIndirect)
+        {
+            ASSERT_EQ(masked, (indirect_mask[i / 32] >> (i % 32) & 1) != 0);
+        }
+    }
+
+    apicpu_->UnmapBuffer(isect_buffer, isect, nullptr);
+    apicpu_->UnmapBuffer(occluded_buffer, occluded, nullptr);
+    apicpu_->UnmapBuffer(t_buffer, t, nullptr);
+    apicpu_->UnmapBuffer(ids_buffer, ids, nullptr);
+    apicpu_->UnmapBuffer(mask_buffer, mask, nullptr);
+    apicpu_->UnmapBuffer(indirect_mask_buffer, indirect_mask, nullptr);
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(occluded_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(t_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ids_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(mask_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(indirect_mask_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(count_buffer));
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_MaskedShapes_Bruteforce)
+{
+    int const kNumRays = 10000;
+    int const kNumLayers = 4;
+
+    // Spread shapes over layers, each ray sees a random subset of them
+    for (int i = 0; i < (int)apishapes_cpu_.size(); ++i)
+    {
+        apishapes_cpu_[i]->SetMask(1 << (i % kNumLayers));
+    }
+
+    std::vector<Intersection> isect_brute(kNumRays);
+    std::vector<ray> r_brute(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+        r_brute[i].SetMask(rand() % (1 << kNumLayers));
+
+        std::vector<TestShape> visible;
+        for (int j = 0; j < (int)test_shapes_.size(); ++j)
+        {
+            if (r_brute[i].GetMask() & (1 << (j % kNumLayers)))
+            {
+                visible.push_back(test_shapes_[j]);
+            }
+        }
+
+        TestIntersections(visible.data(), (int)visible.size(), &r_brute[i], 1, &isect_brute[i]);
+    }
+
+    auto ray_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto hit_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ray* rays = nullptr;
+    Event* ev;
+
+    EXPECT_NO_THROW(apicpu_->MapBuffer(ray_buffer, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&rays, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i] = r_brute[i];
+        rays[i].SetActive(true);
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(ray_buffer, rays, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    // Node culling has to agree with leaf tests for single rays and packets
+    for (float packetsize : { 1.f, 4.f, 16.f })
+    {
+        apicpu_->SetOption("cpu.packet_size", packetsize);
+        EXPECT_NO_THROW(apicpu_->Commit());
+
+        EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+        EXPECT_NO_THROW(apicpu_->QueryOcclusion(ray_buffer, kNumRays, hit_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        int* hits = nullptr;
+
+        EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->MapBuffer(hit_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&hits, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ExpectClosestIntersectionOk(isect_brute[i], isect[i]);
+            ASSERT_EQ(hits[i], isect_brute[i].shapeid != kNullId ? 1 : -1);
+        }
+
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer, isect, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(hit_buffer, hits, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+    }
+
+    apicpu_->SetOption("cpu.packet_size", 1.f);
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(hit_buffer));
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_MultiHit_Bruteforce)
+{
+    int const kNumRays = 1000;
+    int const kNumHits = 4;
+
+    // Single face shapes to collect every hit along the ray
+    std::vector<TestShape> faces;
+    std::vector<Id> faceprims;
+    for (auto const& shape : test_shapes_)
+    {
+        int numfaces = (int)shape.indices.size() / 3;
+        for (int i = 0; i < numfaces; ++i)
+        {
+            faces.push_back({ shape.positions.data(), (int)shape.positions.size() / 3, &shape.indices[3 * i], 3, nullptr, 1 });
+            faces.back().shape = shape.shape;
+            faceprims.push_back(i);
+        }
+    }
+
+    std::vector<ray> r_brute(kNumRays);
+    std::vector<std::vector<Intersection>> isect_brute(kNumRays);
+    std::vector<Intersection> isect_face(faces.size());
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+        r_brute[i].SetActive(true);
+
+        for (int j = 0; j < (int)faces.size(); ++j)
+        {
+            Intersection isect;
+            TestIntersections(&faces[j], 1, &r_brute[i], 1, &isect);
+            if (isect.shapeid != kNullId)
+            {
+                isect.primid = faceprims[j];
+                isect_brute[i].push_back(isect);
+            }
+        }
+
+        std::sort(isect_brute[i].begin(), isect_brute[i].end(), [](Intersection const& a, Intersection const& b) { return a.uvwt.w < b.uvwt.w; });
+    }
+
+    auto ray_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(ray), r_brute.data());
+    auto multi_buffer = apicpu_->CreateBuffer(kNumRays * kNumHits * sizeof(Intersection), nullptr);
+    auto isect_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    EXPECT_NO_THROW(apicpu_->Commit());
+    EXPECT_ANY_THROW(apicpu_->QueryIntersectionMulti(ray_buffer, kNumRays, 0, multi_buffer, nullptr, nullptr));
+    EXPECT_ANY_THROW(apicpu_->QueryIntersectionMulti(ray_buffer, kNumRays, kMaxHitsPerRay + 1, multi_buffer, nullptr, nullptr));
+
+    Event* ev;
+    Intersection* hits = nullptr;
+    Intersection* isect = nullptr;
+
+    // k hits have to be the k closest ones sorted by distance and padded with misses
+    EXPECT_NO_THROW(apicpu_->QueryIntersectionMulti(ray_buffer, kNumRays, kNumHits, multi_buffer, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->MapBuffer(multi_buffer, kMapRead, 0, kNumRays * kNumHits * sizeof(Intersection), (void**)&hits, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        auto const& expected = isect_brute[i];
+        int numhits = std::min((int)expected.size(), kNumHits);
+
+        for (int j = 0; j < kNumHits; ++j)
+        {
+            Intersection const& hit = hits[i * kNumHits + j];
+            if (j >= numhits)
+            {
+                ASSERT_EQ(hit.shapeid, kNullId);
+                continue;
+            }
+
+            ASSERT_NEAR(hit.uvwt.w, expected[j].uvwt.w, 1e-3f);
+            auto found = std::find_if(expected.begin(), expected.end(), [&hit](Intersection const& e)
+            {
+                return e.shapeid == hit.shapeid && e.primid == hit.primid;
+            });
+            ASSERT_TRUE(found != expected.end());
+            ASSERT_NEAR(hit.uvwt.w, found->uvwt.w, 1e-3f);
+        }
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(multi_buffer, hits, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    // Single hit has to match the closest hit query
+    EXPECT_NO_THROW(apicpu_->QueryIntersectionMulti(ray_buffer, kNumRays, 1, multi_buffer, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+    EXPECT_NO_THROW(apicpu_->MapBuffer(multi_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&hits, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect[i], hits[i]);
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(multi_buffer, hits, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer, isect, &ev));
+    ev->Wait(); apicpu_->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(multi_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_ClosestPoint_Bruteforce)
+{
+    int const kNumPoints = 1000;
+
+    // Distance to the segment and to the interior of the triangle plane projection
+    auto distance_to_segment = [](float3 const& p, float3 const& a, float3 const& b)
+    {
+        float3 ab = b - a;
+        float t = std::min(std::max(dot(p - a, ab) / dot(ab, ab), 0.f), 1.f);
+        return std::sqrt((a + ab * t - p).sqnorm());
+    };
+
+    auto distance_to_triangle = [&distance_to_segment](float3 const& p, float3 const& a, float3 const& b, float3 const& c)
+    {
+        float3 n = normalize(cross(b - a, c - a));
+        float h = dot(p - a, n);
+        float3 q = p - n * h;
+        bool inside = dot(cross(b - a, q - a), n) >= 0.f && dot(cross(c - b, q - b), n) >= 0.f && dot(cross(a - c, q - c), n) >= 0.f;
+        return inside ? std::abs(h) : std::min(std::min(distance_to_segment(p, a, b), distance_to_segment(p, b, c)), distance_to_segment(p, c, a));
+    };
+
+    auto vertex = [](TestShape const& shape, int idx)
+    {
+        return float3(shape.positions[3 * idx], shape.positions[3 * idx + 1], shape.positions[3 * idx + 2]);
+    };
+
+    std::vector<float3> points(kNumPoints);
+    std::vector<float> dist_brute(kNumPoints);
+
+    for (int i = 0; i < kNumPoints; ++i)
+    {
+        points[i] = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f);
+        dist_brute[i] = std::numeric_limits<float>::max();
+
+        for (auto const& shape : test_shapes_)
+        {
+            for (int j = 0; j < (int)shape.indices.size(); j += 3)
+            {
+                float d = distance_to_triangle(points[i], vertex(shape, shape.indices[j]), vertex(shape, shape.indices[j + 1]), vertex(shape, shape.indices[j + 2]));
+                dist_brute[i] = std::min(dist_brute[i], d);
+            }
+        }
+    }
+
+    auto point_buffer = apicpu_->CreateBuffer(kNumPoints * sizeof(float3), points.data());
+    auto result_buffer = apicpu_->CreateBuffer(kNumPoints * sizeof(Intersection), nullptr);
+
+    EXPECT_NO_THROW(apicpu_->Commit());
+    EXPECT_ANY_THROW(apicpu_->QueryClosestPoint(point_buffer, kNumPoints, -1.f, result_buffer, nullptr, nullptr));
+
+    for (float maxdist : { 0.1f, 1000.f })
+    {
+        Event* ev;
+        Intersection* results = nullptr;
+
+        EXPECT_NO_THROW(apicpu_->QueryClosestPoint(point_buffer, kNumPoints, maxdist, result_buffer, nullptr, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->MapBuffer(result_buffer, kMapRead, 0, kNumPoints * sizeof(Intersection), (void**)&results, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+
+        for (int i = 0; i < kNumPoints; ++i)
+        {
+            Intersection const& result = results[i];
+            if (dist_brute[i] > maxdist)
+            {
+                ASSERT_EQ(result.shapeid, kNullId);
+                continue;
+            }
+
+            ASSERT_NE(result.shapeid, kNullId);
+            ASSERT_NEAR(result.uvwt.w, dist_brute[i], 1e-4f);
+
+            // Barycentrics have to give a point on the reported triangle at the reported distance
+            auto shape = std::find_if(test_shapes_.begin(), test_shapes_.end(), [&result](TestShape const& s) { return s.shape->GetId() == result.shapeid; });
+            ASSERT_TRUE(shape != test_shapes_.end());
+
+            float3 v1 = vertex(*shape, shape->indices[3 * result.primid]);
+            float3 v2 = vertex(*shape, shape->indices[3 * result.primid + 1]);
+            float3 v3 = vertex(*shape, shape->indices[3 * result.primid + 2]);
+            float3 q = v1 + (v2 - v1) * result.uvwt.x + (v3 - v1) * result.uvwt.y;
+            ASSERT_NEAR(std::sqrt((q - points[i]).sqnorm()), result.uvwt.w, 1e-4f);
+        }
+
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(result_buffer, results, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+    }
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(point_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(result_buffer));
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_Overlap_Bruteforce)
+{
+    int const kNumQueries = 500;
+
+    // Queries are spread over the box, frustums look along z from random points
+    std::vector<float3> boxes(2 * kNumQueries);
+    std::vector<float4> frustums(6 * kNumQueries);
+
+    for (int i = 0; i < kNumQueries; ++i)
+    {
+        float3 c(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f);
+        float3 e(rand_float() * 0.5f, rand_float() * 0.5f, rand_float() * 0.5f);
+        boxes[2 * i] = c - e;
+        boxes[2 * i + 1] = c + e;
+
+        float t = rand_float() * 0.5f + 0.1f;
+        float n = rand_float() * 0.2f;
+        float f = n + rand_float() * 2.f;
+        float4 planes[6] = { float4(0.f, 0.f, 1.f, -n), float4(0.f, 0.f, -1.f, f),
+            float4(1.f, 0.f, t, 0.f), float4(-1.f, 0.f, t, 0.f), float4(0.f, 1.f, t, 0.f), float4(0.f, -1.f, t, 0.f) };
+        for (int j = 0; j < 6; ++j)
+        {
+            planes[j].w -= planes[j].x * c.x + planes[j].y * c.y + planes[j].z * c.z;
+            frustums[6 * i + j] = planes[j];
+        }
+    }
+
+    // Primitive bounds against the planes, boxes are their face planes
+    auto expected_prims = [this](float4 const* planes)
+    {
+        std::vector<std::pair<Id, Id>> prims;
+        for (auto const& shape : test_shapes_)
+        {
+            for (int j = 0; j < (int)shape.indices.size(); j += 3)
+            {
+                float3 pmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+                float3 pmax = -pmin;
+                for (int k = 0; k < 3; ++k)
+                {
+                    int idx = shape.indices[j + k];
+                    float3 v(shape.positions[3 * idx], shape.positions[3 * idx + 1], shape.positions[3 * idx + 2]);
+                    pmin = vmin(pmin, v);
+                    pmax = vmax(pmax, v);
+                }
+
+                bool inside = true;
+                for (int k = 0; k < 6 && inside; ++k)
+                {
+                    float3 p(planes[k].x >= 0.f ? pmax.x : pmin.x, planes[k].y >= 0.f ? pmax.y : pmin.y, planes[k].z >= 0.f ? pmax.z : pmin.z);
+                    inside = planes[k].x * p.x + planes[k].y * p.y + planes[k].z * p.z + planes[k].w >= 0.f;
+                }
+
+                if (inside)
+                {
+                    prims.push_back(std::make_pair(shape.shape->GetId(), j / 3));
+                }
+            }
+        }
+        std::sort(prims.begin(), prims.end());
+        return prims;
+    };
+
+    EXPECT_NO_THROW(apicpu_->Commit());
+
+    for (OverlapVolume volume : { kOverlapBox, kOverlapFrustum })
+    {
+        std::vector<std::vector<std::pair<Id, Id>>> expected(kNumQueries);
+        for (int i = 0; i < kNumQueries; ++i)
+        {
+            float4 planes[6];
+            if (volume == kOverlapBox)
+            {
+                float3 const* b = &boxes[2 * i];
+                float4 boxplanes[6] = { float4(1.f, 0.f, 0.f, -b[0].x), float4(-1.f, 0.f, 0.f, b[1].x), float4(0.f, 1.f, 0.f, -b[0].y),
+                    float4(0.f, -1.f, 0.f, b[1].y), float4(0.f, 0.f, 1.f, -b[0].z), float4(0.f, 0.f, -1.f, b[1].z) };
+                std::copy_n(boxplanes, 6, planes);
+            }
+            else
+            {
+                std::copy_n(&frustums[6 * i], 6, planes);
+            }
+            expected[i] = expected_prims(planes);
+        }
+
+        void* data = volume == kOverlapBox ? (void*)boxes.data() : (void*)frustums.data();
+        size_t size = volume == kOverlapBox ? boxes.size() * sizeof(float3) : frustums.size() * sizeof(float4);
+        auto volume_buffer = apicpu_->CreateBuffer(size, data);
+
+        // Full lists and lists clamped to a few primitives
+        for (int maxhits : { 64, 3 })
+        {
+            auto result_buffer = apicpu_->CreateBuffer(kNumQueries * maxhits * 2 * sizeof(Id), nullptr);
+            auto count_buffer = apicpu_->CreateBuffer(kNumQueries * sizeof(int), nullptr);
+
+            EXPECT_NO_THROW(apicpu_->QueryOverlap(volume_buffer, kNumQueries, volume, maxhits, result_buffer, count_buffer, nullptr, nullptr));
+
+            Event* ev;
+            Id* results = nullptr;
+            int* counts = nullptr;
+            EXPECT_NO_THROW(apicpu_->MapBuffer(result_buffer, kMapRead, 0, kNumQueries * maxhits * 2 * sizeof(Id), (void**)&results, &ev));
+            ev->Wait(); apicpu_->DeleteEvent(ev);
+            EXPECT_NO_THROW(apicpu_->MapBuffer(count_buffer, kMapRead, 0, kNumQueries * sizeof(int), (void**)&counts, &ev));
+            ev->Wait(); apicpu_->DeleteEvent(ev);
+
+            int offset = 0;
+            for (int i = 0; i < kNumQueries; ++i)
+            {
+                ASSERT_EQ(counts[i], std::min((int)expected[i].size(), maxhits));
+
+                std::vector<std::pair<Id, Id>> prims;
+                for (int j = 0; j < counts[i]; ++j)
+                {
+                    prims.push_back(std::make_pair(results[2 * (offset + j)], results[2 * (offset + j) + 1]));
+                }
+                std::sort(prims.begin(), prims.end());
+
+                ASSERT_TRUE(std::adjacent_find(prims.begin(), prims.end()) == prims.end());
+                ASSERT_TRUE(std::includes(expected[i].begin(), expected[i].end(), prims.begin(), prims.end()));
+
+                offset += counts[i];
+            }
+
+            EXPECT_NO_THROW(apicpu_->UnmapBuffer(result_buffer, results, &ev));
+            ev->Wait(); apicpu_->DeleteEvent(ev);
+            EXPECT_NO_THROW(apicpu_->UnmapBuffer(count_buffer, counts, &ev));
+            ev->Wait(); apicpu_->DeleteEvent(ev);
+
+            EXPECT_NO_THROW(apicpu_->DeleteBuffer(result_buffer));
+            EXPECT_NO_THROW(apicpu_->DeleteBuffer(count_buffer));
+        }
+
+        EXPECT_NO_THROW(apicpu_->DeleteBuffer(volume_buffer));
+    }
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_QuadMesh_Bruteforce)
+{
+    int const kGrid = 16;
+    int const kWidth = 64;
+    int const kNumRays = kWidth * kWidth;
+
+    // Bumpy grid inside the box so quads are not planar, every 5th face is a triangle
+    std::vector<float> positions;
+    std::vector<int> indices;
+    std::vector<int> numfaceverts;
+
+    for (int j = 0; j <= kGrid; ++j)
+    {
+        for (int i = 0; i <= kGrid; ++i)
+        {
+            float x = 1.6f * i / kGrid - 0.8f;
+            float z = 1.6f * j / kGrid - 0.8f;
+            positions.push_back(x);
+            positions.push_back(1.f + 0.2f * std::sin(3.f * x) * std::cos(2.f * z) + 0.05f * ((i * 7 + j * 3) % 4));
+            positions.push_back(z);
+        }
+    }
+
+    for (int j = 0; j < kGrid; ++j)
+    {
+        for (int i = 0; i < kGrid; ++i)
+        {
+            int v = j * (kGrid + 1) + i;
+            indices.push_back(v);
+            indices.push_back(v + 1);
+            indices.push_back(v + kGrid + 2);
+
+            if ((i + j) % 5 != 0)
+            {
+                indices.push_back(v + kGrid + 1);
+                numfaceverts.push_back(4);
+            }
+            else
+            {
+                numfaceverts.push_back(3);
+            }
+        }
+    }
+
+    Shape* quads = nullptr;
+    ASSERT_NO_THROW(quads = apicpu_->CreateMesh(positions.data(), (int)positions.size() / 3, 3 * sizeof(float),
+        indices.data(), 0, numfaceverts.data(), (int)numfaceverts.size()));
+    ASSERT_NO_THROW(apicpu_->AttachShape(quads));
+    apishapes_cpu_.push_back(quads);
+
+    test_shapes_.push_back({ positions.data(), (int)positions.size() / 3,
+        indices.data(), (int)indices.size(), numfaceverts.data(), (int)numfaceverts.size() });
+    test_shapes_.back().shape = quads;
+
+    // Coherent rays looking down onto the grid from under the ceiling
+    std::vector<ray> r_brute(kNumRays);
+    for (int y = 0; y < kWidth; ++y)
+    {
+        for (int x = 0; x < kWidth; ++x)
+        {
+            float px = ((x + 0.37f) / kWidth - 0.5f) * 2.f;
+            float pz = ((y + 0.61f) / kWidth - 0.5f) * 2.f;
+
+            r_brute[y * kWidth + x].o = float3(0.0137f, 1.9213f, 0.0211f, 1000.f);
+            r_brute[y * kWidth + x].d = normalize(float3(px, -1.f, pz));
+            r_brute[y * kWidth + x].SetActive(true);
+            r_brute[y * kWidth + x].SetMask(0xFFFFFFFF);
+        }
+    }
+
+    std::vector<Intersection> isect_brute(kNumRays);
+    std::unique_ptr<bool[]> any_brute(new bool[kNumRays]);
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, isect_brute.data());
+    TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, any_brute.get());
+
+    auto ray_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(ray), r_brute.data());
+    auto isect_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto result_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    // Scalar and packet traversal
+    float const packet_sizes[] = { 1.f, 16.f };
+
+    for (float packet_size : packet_sizes)
+    {
+        apicpu_->SetOption("cpu.packet_size", packet_size);
+        EXPECT_NO_THROW(apicpu_->Commit());
+
+        EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+        EXPECT_NO_THROW(apicpu_->QueryOcclusion(ray_buffer, kNumRays, result_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        int* results = nullptr;
+        Event* ev = nullptr;
+        EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->MapBuffer(result_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&results, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+
+        int quadhits = 0;
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ExpectClosestIntersectionOk(isect_brute[i], isect[i]);
+            ASSERT_EQ(any_brute[i], results[i] > 0);
+
+            if (isect[i].shapeid == quads->GetId())
+            {
+                // Same face and the same half of the quad
+                ASSERT_EQ(isect_brute[i].primid, isect[i].primid);
+                ASSERT_EQ(isect_brute[i].uvwt.z, isect[i].uvwt.z);
+                ASSERT_NEAR(isect_brute[i].uvwt.x, isect[i].uvwt.x, 1e-3f);
+                ASSERT_NEAR(isect_brute[i].uvwt.y, isect[i].uvwt.y, 1e-3f);
+                quadhits += isect[i].uvwt.z > 0.f ? 1 : 0;
+            }
+        }
+
+        // Rays have to land on both triangles of the quads
+        EXPECT_GT(quadhits, 0);
+
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer, isect, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(result_buffer, results, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+    }
+
+    apicpu_->SetOption("cpu.packet_size", 1.f);
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(result_buffer));
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_ParallelBuild_8192Triangles)
+{
+    // Above the size where the builder forks subtrees into tasks
+    ExpectParallelBuildOk<64>();
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_ParallelBuild_156800Triangles)
+{
+    // Above the size where split search bins primitives in parallel
+    ExpectParallelBuildOk<280>();
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_InvalidPacketSize)
+{
+    auto api = apicpu_;
+    api->SetOption("cpu.packet_size", 3.f);
+
+    EXPECT_ANY_THROW(api->Commit());
+
+    api->SetOption("cpu.packet_size", 1.f);
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ClosestHit_Events_Bruteforce)
+{
+    int const kNumRays = 10000;
+
+    // Make sure the ray is not on BB boundary
+    // in this case results may differ due to 
+    // different NaNs propagation in BB test
+    // TODO: fix this
+    Intersection isect_brute[kNumRays];
+    ray r_brute[kNumRays];
+
+    // generate some random vectors
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    EXPECT_NO_THROW(apicpu_->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, isect_brute);
+
+    auto ray_buffer_cpu = apicpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer_cpu = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    ray* r_cpu = nullptr;
+
+    Event* ecpu;
+    EXPECT_NO_THROW(apicpu_->MapBuffer(ray_buffer_cpu, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&r_cpu, &ecpu));
+    ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+
+    for (int i = 0; i<kNumRays; ++i)
+    {
+        r_cpu[i].o = r_brute[i].o;
+        r_cpu[i].d = r_brute[i].d;
+        r_cpu[i].SetActive(true);
+        r_cpu[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(ray_buffer_cpu, r_cpu, &ecpu));
+    ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+
+    // Intersect
+    Event* cpu_event = nullptr;
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer_cpu, kNumRays, isect_buffer_cpu, nullptr, &cpu_event));
+
+    EXPECT_NE(cpu_event, nullptr);
+
+    EXPECT_NO_THROW(cpu_event->Complete());
+    EXPECT_NO_THROW(cpu_event->Wait());
+
+    Intersection* isect_cpu = nullptr;
+
+    EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer_cpu, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect_cpu, &ecpu));
+    ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+
+    for (int i = 0; i<kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i] , isect_cpu[i]);
+    }
+
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer_cpu, isect_cpu, &ecpu));
+    ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+
+    EXPECT_NO_THROW(apicpu_->DeleteEvent(cpu_event));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer_cpu));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer_cpu));
+}
+
+TEST_F(ApiConformanceCpu, CornellBox_10000RaysRandom_ChainedEvents_Bruteforce)
+{
+    int const kNumRays = 10000;
+
+    std::vector<Intersection> isect_brute(kNumRays);
+    std::unique_ptr<bool[]> any_brute(new bool[kNumRays]);
+    std::vector<ray> r_brute(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+        r_brute[i].SetActive(true);
+        r_brute[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(apicpu_->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, isect_brute.data());
+    TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, any_brute.get());
+
+    auto ray_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(ray), r_brute.data());
+    auto isect_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto result_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+    auto numrays_buffer = apicpu_->CreateBuffer(sizeof(int), (void*)&kNumRays);
+
+    // Every query waits for the previous one, the last one is waited for only
+    Event* events[3] = { nullptr, nullptr, nullptr };
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &events[0]));
+    EXPECT_NO_THROW(apicpu_->QueryOcclusion(ray_buffer, kNumRays, result_buffer, events[0], &events[1]));
+    EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, numrays_buffer, kNumRays, isect_buffer, events[1], &events[2]));
+
+    events[2]->Wait();
+    EXPECT_TRUE(events[0]->Complete());
+    EXPECT_TRUE(events[1]->Complete());
+
+    for (Event* ev : events)
+    {
+        EXPECT_NO_THROW(apicpu_->DeleteEvent(ev));
+    }
+
+    // Host memory is mapped right away
+    Event* ev;
+    Intersection* isect = nullptr;
+    int* results = nullptr;
+    EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    EXPECT_TRUE(ev->Complete());
+    apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->MapBuffer(result_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&results, &ev));
+    EXPECT_TRUE(ev->Complete());
+    apicpu_->DeleteEvent(ev);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i], isect[i]);
+        ASSERT_EQ(any_brute[i], results[i] > 0);
+    }
+
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer, isect, &ev));
+    EXPECT_TRUE(ev->Complete());
+    apicpu_->DeleteEvent(ev);
+    EXPECT_NO_THROW(apicpu_->UnmapBuffer(result_buffer, results, &ev));
+    apicpu_->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(result_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(numrays_buffer));
+}
+
+
+inline void ApiConformanceCpu::ExpectClosestIntersectionOk(const Intersection& expected, const Intersection& test) const
+{
+    ASSERT_EQ(test.shapeid, expected.shapeid);
+
+    if (test.shapeid != kNullId)
+    {
+        // Check if the distance is the same
+        const double dist = (test.uvwt.w - expected.uvwt.w) * (test.uvwt.w - expected.uvwt.w);
+        ASSERT_NEAR(0, dist, 1e-5);
+    }
+}
+
+template<int kNumRays>
+inline void ApiConformanceCpu::ExpectClosestRaysOk(RadeonRays::IntersectionApi* api)const
+{
+    // Make sure the ray is not on BB boundary
+    // in this case results may differ due to 
+    // different NaNs propagation in BB test
+    // TODO: fix this
+    Intersection isect_brute[kNumRays];
+    ray r_brute[kNumRays];
+
+    // generate some random vectors
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    EXPECT_NO_THROW(api->Commit());
+
+    // generate the golden test results
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, isect_brute);
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer = api->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    ray* rays = nullptr;
+    Event* ev;
+
+    EXPECT_NO_THROW(api->MapBuffer(ray_buffer, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        rays[i].o = r_brute[i].o;
+        rays[i].d = r_brute[i].d;
+
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(ray_buffer, rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    // Intersect
+    EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i], isect[i]);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(isect_buffer, isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(isect_buffer));
+}
+
+template<int kNumRays>
+inline void ApiConformanceCpu::ExpectAnyRaysOk(RadeonRays::IntersectionApi* api) const
+{
+    // Make sure the ray is not on BB boundary
+    // in this case results may differ due to 
+    // different NaNs propagation in BB test
+    // TODO: fix this
+
+    bool any_brute[kNumRays];
+    ray r_brute[kNumRays];
+
+    // generate some random vectors
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    EXPECT_NO_THROW(api->Commit());
+
+    // generate the golden test results
+    TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, any_brute);
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto result_buffer = api->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ray* rays = nullptr;
+    Event* ev;
+
+    EXPECT_NO_THROW(api->MapBuffer(ray_buffer, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        rays[i].o = r_brute[i].o;
+        rays[i].d = r_brute[i].d;
+
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(ray_buffer, rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    // Intersect
+    EXPECT_NO_THROW(api->QueryOcclusion(ray_buffer, kNumRays, result_buffer, nullptr, nullptr));
+
+
+    int* results = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(result_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        ASSERT_EQ(any_brute[i], (results[i] > 0) ? true : false);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(result_buffer, results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(result_buffer));
+}
+
+template<int kWidth>
+inline void ApiConformanceCpu::ExpectCameraRaysOk(RadeonRays::IntersectionApi* api) const
+{
+    int const kNumRays = kWidth * kWidth;
+
+    std::vector<Intersection> isect_brute(kNumRays);
+    std::vector<bool> any_brute(kNumRays);
+    std::vector<ray> r_brute(kNumRays);
+
+    // Rays in row-major order so neighbouring rays go through neighbouring pixels,
+    // some of them look into the open side of the box and miss.
+    // Camera is moved off the symmetry planes of the box so rays don't hit shared edges
+    for (int y = 0; y < kWidth; ++y)
+    {
+        for (int x = 0; x < kWidth; ++x)
+        {
+            float px = ((x + 0.37f) / kWidth - 0.5f) * 1.5f;
+            float py = ((y + 0.61f) / kWidth - 0.5f) * 1.5f;
+
+            r_brute[y * kWidth + x].o = float3(0.0137f, 1.0213f, 3.5f, 1000.f);
+            r_brute[y * kWidth + x].d = normalize(float3(px, py, -1.f));
+        }
+    }
+
+    EXPECT_NO_THROW(api->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, isect_brute.data());
+
+    {
+        std::unique_ptr<bool[]> hits(new bool[kNumRays]);
+        TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, hits.get());
+        any_brute.assign(hits.get(), hits.get() + kNumRays);
+    }
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer = api->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto result_buffer = api->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ray* rays = nullptr;
+    Event* ev;
+
+    EXPECT_NO_THROW(api->MapBuffer(ray_buffer, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        rays[i].o = r_brute[i].o;
+        rays[i].d = r_brute[i].d;
+
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(ray_buffer, rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+    EXPECT_NO_THROW(api->QueryOcclusion(ray_buffer, kNumRays, result_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    int* results = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(result_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i], isect[i]);
+        ASSERT_EQ(any_brute[i], (results[i] > 0) ? true : false);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(isect_buffer, isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+    EXPECT_NO_THROW(api->UnmapBuffer(result_buffer, results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(result_buffer));
+}
+
+template<int kGrid>
+inline void ApiConformanceCpu::ExpectParallelBuildOk()
+{
+    int const kNumRays = 10000;
+    int const kNumTriangles = 2 * kGrid * kGrid;
+
+    // Bumpy grid inside the box, split into triangles
+    std::vector<float> positions;
+    std::vector<int> indices;
+
+    for (int j = 0; j <= kGrid; ++j)
+    {
+        for (int i = 0; i <= kGrid; ++i)
+        {
+            float x = 1.6f * i / kGrid - 0.8f;
+            float z = 1.6f * j / kGrid - 0.8f;
+            positions.push_back(x);
+            positions.push_back(1.f + 0.2f * std::sin(3.f * x) * std::cos(2.f * z) + 0.05f * ((i * 7 + j * 3) % 4));
+            positions.push_back(z);
+        }
+    }
+
+    for (int j = 0; j < kGrid; ++j)
+    {
+        for (int i = 0; i < kGrid; ++i)
+        {
+            int v = j * (kGrid + 1) + i;
+            int tris[6] = { v, v + 1, v + kGrid + 2, v, v + kGrid + 2, v + kGrid + 1 };
+            indices.insert(indices.end(), tris, tris + 6);
+        }
+    }
+
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = apicpu_->CreateMesh(positions.data(), (int)positions.size() / 3, 3 * sizeof(float),
+        indices.data(), 0, nullptr, kNumTriangles));
+    ASSERT_NO_THROW(apicpu_->AttachShape(grid));
+    apishapes_cpu_.push_back(grid);
+
+    int numprims = kNumTriangles;
+    for (auto const& shape : test_shapes_)
+    {
+        numprims += (int)shape.indices.size() / 3;
+    }
+
+    // Rays looking down onto the grid and random rays through the box
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        if (i % 2)
+        {
+            rays[i].o = float3(rand_float() * 1.6f - 0.8f, 1.9f, rand_float() * 1.6f - 0.8f, 1000.f);
+            rays[i].d = normalize(float3(rand_float() * 0.2f - 0.1f, -1.f, rand_float() * 0.2f - 0.1f));
+        }
+        else
+        {
+            rays[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+            rays[i].d = normalize(float3(rand_float() * 2.f - 1.f, rand_float() * 2.f - 1.f, rand_float() * 2.f - 1.f));
+        }
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    // Box around the whole scene, overlap queries report the primitives in leaf order
+    float3 box[2] = { float3(-1000.f, -1000.f, -1000.f), float3(1000.f, 1000.f, 1000.f) };
+
+    auto ray_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+    auto isect_buffer = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto volume_buffer = apicpu_->CreateBuffer(sizeof(box), box);
+    auto overlap_buffer = apicpu_->CreateBuffer(numprims * 2 * sizeof(Id), nullptr);
+    auto count_buffer = apicpu_->CreateBuffer(sizeof(int), nullptr);
+
+    std::vector<Intersection> isect[2];
+    std::vector<Id> prims[2];
+
+    for (int parallel = 0; parallel < 2; ++parallel)
+    {
+        // Options alone do not trigger a rebuild, reattach the grid
+        apicpu_->SetOption("bvh.parallel_build", (float)parallel);
+        EXPECT_NO_THROW(apicpu_->DetachShape(grid));
+        EXPECT_NO_THROW(apicpu_->AttachShape(grid));
+        EXPECT_NO_THROW(apicpu_->Commit());
+
+        EXPECT_NO_THROW(apicpu_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+        EXPECT_NO_THROW(apicpu_->QueryOverlap(volume_buffer, 1, kOverlapBox, numprims, overlap_buffer, count_buffer, nullptr, nullptr));
+
+        Event* ev;
+        Intersection* hits = nullptr;
+        Id* results = nullptr;
+        int* count = nullptr;
+        EXPECT_NO_THROW(apicpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&hits, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->MapBuffer(overlap_buffer, kMapRead, 0, numprims * 2 * sizeof(Id), (void**)&results, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->MapBuffer(count_buffer, kMapRead, 0, sizeof(int), (void**)&count, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+
+        ASSERT_EQ(*count, numprims);
+        isect[parallel].assign(hits, hits + kNumRays);
+        prims[parallel].assign(results, results + 2 * numprims);
+
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer, hits, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(overlap_buffer, results, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+        EXPECT_NO_THROW(apicpu_->UnmapBuffer(count_buffer, count, &ev));
+        ev->Wait(); apicpu_->DeleteEvent(ev);
+    }
+
+    apicpu_->SetOption("bvh.parallel_build", 0.f);
+
+    // Both builds produce the same tree
+    ASSERT_TRUE(prims[0] == prims[1]);
+
+    int numhits = 0;
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(isect[0][i].shapeid, isect[1][i].shapeid);
+        ASSERT_EQ(isect[0][i].primid, isect[1][i].primid);
+        ASSERT_EQ(isect[0][i].uvwt.w, isect[1][i].uvwt.w);
+        numhits += isect[0][i].shapeid == grid->GetId() ? 1 : 0;
+    }
+
+    EXPECT_GT(numhits, 0);
+
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(volume_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(overlap_buffer));
+    EXPECT_NO_THROW(apicpu_->DeleteBuffer(count_buffer));
+}
+
+template<int kNumRays>
+inline void ApiConformanceCpu::ExpectSoARaysOk(RadeonRays::IntersectionApi* api) const
+{
+    std::vector<Intersection> isect_brute(kNumRays);
+    std::unique_ptr<bool[]> any_brute(new bool[kNumRays]);
+    std::vector<ray> r_brute(kNumRays);
+
+    // Rays in SoA layout, every 5th ray is short
+    std::vector<float> origins(3 * kNumRays);
+    std::vector<float> directions(3 * kNumRays);
+    std::vector<float> maxt(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float t = (i % 5 == 0) ? 0.5f : 1000.f;
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, t);
+        r_brute[i].d = normalize(float3(rand_float() - 0.5f, rand_float() - 0.5f, rand_float() - 0.5f));
+
+        for (int a = 0; a < 3; ++a)
+        {
+            origins[a * kNumRays + i] = r_brute[i].o[a];
+            directions[a * kNumRays + i] = r_brute[i].d[a];
+        }
+
+        maxt[i] = t;
+    }
+
+    EXPECT_NO_THROW(api->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, isect_brute.data());
+    TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, any_brute.get());
+
+    RaySoA rays;
+    rays.origins = api->CreateBuffer(3 * kNumRays * sizeof(float), origins.data());
+    rays.directions = api->CreateBuffer(3 * kNumRays * sizeof(float), directions.data());
+    rays.maxt = api->CreateBuffer(kNumRays * sizeof(float), maxt.data());
+    rays.masks = nullptr;
+
+    // Primitive IDs are not needed
+    IntersectionSoA hits;
+    hits.t = api->CreateBuffer(kNumRays * sizeof(float), nullptr);
+    hits.primids = nullptr;
+    hits.shapeids = api->CreateBuffer(kNumRays * sizeof(Id), nullptr);
+    hits.uvs = api->CreateBuffer(2 * kNumRays * sizeof(float), nullptr);
+    auto result_buffer = api->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    Event* ev;
+    EXPECT_NO_THROW(api->QueryIntersection(rays, kNumRays, hits, nullptr, nullptr));
+    EXPECT_NO_THROW(api->QueryOcclusion(rays, kNumRays, result_buffer, nullptr, nullptr));
+
+    float* t = nullptr;
+    Id* shapeids = nullptr;
+    float* uvs = nullptr;
+    int* results = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(hits.t, kMapRead, 0, kNumRays * sizeof(float), (void**)&t, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+    EXPECT_NO_THROW(api->MapBuffer(hits.shapeids, kMapRead, 0, kNumRays * sizeof(Id), (void**)&shapeids, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+    EXPECT_NO_THROW(api->MapBuffer(hits.uvs, kMapRead, 0, 2 * kNumRays * sizeof(float), (void**)&uvs, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+    EXPECT_NO_THROW(api->MapBuffer(result_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    int numhits = 0;
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        // Brute force ignores max distance
+        bool expected = isect_brute[i].shapeid != kNullId && isect_brute[i].uvwt.w <= maxt[i];
+        ASSERT_EQ(expected ? isect_brute[i].shapeid : kNullId, shapeids[i]);
+
+        if (expected)
+        {
+            ASSERT_NEAR(isect_brute[i].uvwt.w, t[i], 1e-3f);
+            ASSERT_NEAR(isect_brute[i].uvwt.x, uvs[i], 1e-3f);
+            ASSERT_NEAR(isect_brute[i].uvwt.y, uvs[kNumRays + i], 1e-3f);
+            ASSERT_GT(results[i], 0);
+            ++numhits;
+        }
+        else if (maxt[i] > 1.f)
+        {
+            ASSERT_EQ(any_brute[i], results[i] > 0);
+        }
+    }
+
+    EXPECT_GT(numhits, 0);
+
+    EXPECT_NO_THROW(api->UnmapBuffer(hits.t, t, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+    EXPECT_NO_THROW(api->UnmapBuffer(hits.shapeids, shapeids, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+    EXPECT_NO_THROW(api->UnmapBuffer(hits.uvs, uvs, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+    EXPECT_NO_THROW(api->UnmapBuffer(result_buffer, results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    EXPECT_NO_THROW(api->DeleteBuffer(const_cast<Buffer*>(rays.origins)));
+    EXPECT_NO_THROW(api->DeleteBuffer(const_cast<Buffer*>(rays.directions)));
+    EXPECT_NO_THROW(api->DeleteBuffer(const_cast<Buffer*>(rays.maxt)));
+    EXPECT_NO_THROW(api->DeleteBuffer(hits.t));
+    EXPECT_NO_THROW(api->DeleteBuffer(hits.shapeids));
+    EXPECT_NO_THROW(api->DeleteBuffer(hits.uvs));
+    EXPECT_NO_THROW(api->DeleteBuffer(result_buffer));
+}
@@ -35,6 +35,8 @@ using namespace tinyobj;
 
 #include <vector>
 #include <cstdio>
+#include <chrono>
+#include <iostream>
 
 // Api creation fixture, prepares api_ for further tests
 class ApiConformanceEmbree : public ::testing::Test
@@ -337,6 +339,50 @@ TEST_F(ApiConformanceEmbree, CornellBox_10000RaysRandom_ClosestHit_Events_Brutef
 }
 
 
+TEST_F(ApiConformanceEmbree, CornellBox_10000RaysRandom_ClosestHit_PacketWidth)
+{
+    int const kNumRays = 1 << 20;
+    int const kNumRuns = 5;
+
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        rays[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    auto ray_buffer = apigpu_->CreateBuffer(kNumRays * sizeof(ray), rays.data());
+    auto isect_buffer = apigpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    // 0 is the widest supported packet, unsupported widths fall back to it
+    float const widths[] = { 4.f, 8.f, 16.f, 0.f };
+    for (auto width : widths)
+    {
+        apigpu_->SetOption("embree.packet_width", width);
+        ExpectClosestRaysOk<10000>(apigpu_);
+
+        double total = 0.0;
+        for (int i = 0; i <= kNumRuns; ++i)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            EXPECT_NO_THROW(apigpu_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+            auto delta = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+            // First run warms up caches
+            if (i > 0)
+            {
+                total += delta;
+            }
+        }
+
+        std::cout << "Packet width " << width << ": " << kNumRays * kNumRuns / total * 1e-6 << " Mrays/s\n";
+    }
+
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(isect_buffer));
+}
+
+
 inline void ApiConformanceEmbree::ExpectClosestIntersectionOk(const Intersection& expected, const Intersection& test) const
 {
     ASSERT_EQ(test.shapeid, expected.shapeid);
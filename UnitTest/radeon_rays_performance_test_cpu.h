@@ -0,0 +1,270 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+/// This test suite is measuring RadeonRays native CPU device performance
+///
+#include "gtest/gtest.h"
+#include "radeon_rays.h"
+
+using namespace RadeonRays;
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+// Api creation fixture, builds a procedural cave: a bumpy sphere seen from the inside,
+// so that every secondary ray hits something
+class ApiPerformanceCpu : public ::testing::Test
+{
+public:
+    static int const kCaveSlices = 720;
+    static int const kCaveStacks = 360;
+    static int const kWidth = 512;
+    static int const kHeight = 512;
+    static float constexpr kPi = 3.14159265f;
+
+    virtual void SetUp()
+    {
+        IntersectionApi::SetPlatform(DeviceInfo::kNativeCpu);
+
+        int cpuidx = -1;
+        for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+        {
+            DeviceInfo devinfo;
+            IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+            if (devinfo.platform == DeviceInfo::kNativeCpu)
+            {
+                cpuidx = idx;
+            }
+        }
+
+        ASSERT_NE(cpuidx, -1);
+        ASSERT_NO_THROW(api_ = IntersectionApi::Create(cpuidx));
+
+        for (int j = 0; j <= kCaveStacks; ++j)
+        {
+            for (int i = 0; i <= kCaveSlices; ++i)
+            {
+                float theta = kPi * j / kCaveStacks;
+                float phi = 2.f * kPi * (i % kCaveSlices) / kCaveSlices;
+                float r = 10.f + 0.5f * std::sin(7.f * phi) * std::sin(5.f * theta) + 0.2f * std::sin(31.f * phi + 17.f * theta);
+
+                vertices_.push_back(r * std::sin(theta) * std::cos(phi));
+                vertices_.push_back(r * std::cos(theta));
+                vertices_.push_back(r * std::sin(theta) * std::sin(phi));
+            }
+        }
+
+        for (int j = 0; j < kCaveStacks; ++j)
+        {
+            for (int i = 0; i < kCaveSlices; ++i)
+            {
+                int v0 = j * (kCaveSlices + 1) + i;
+                int v1 = v0 + 1;
+                int v2 = v0 + kCaveSlices + 1;
+                int v3 = v2 + 1;
+
+                int face[] = { v0, v2, v1, v1, v2, v3 };
+                indices_.insert(indices_.end(), face, face + 6);
+            }
+        }
+
+        Shape* shape = nullptr;
+        ASSERT_NO_THROW(shape = api_->CreateMesh(&vertices_[0], (int)vertices_.size() / 3, 3 * sizeof(float),
+            &indices_[0], 0, nullptr, (int)indices_.size() / 3));
+        ASSERT_NO_THROW(api_->AttachShape(shape));
+        apishapes_.push_back(shape);
+
+        ASSERT_NO_THROW(api_->Commit());
+    }
+
+    virtual void TearDown()
+    {
+        for (int i = 0; i < (int)apishapes_.size(); ++i)
+        {
+            ASSERT_NO_THROW(api_->DeleteShape(apishapes_[i]));
+        }
+
+        IntersectionApi::Delete(api_);
+    }
+
+    // Trace camera rays from the center of the cave and bounce them diffusely
+    // numbounces times, returns the rays of the last bounce
+    std::vector<ray> GenerateBounceRays(int numbounces)
+    {
+        std::vector<ray> rays(kWidth * kHeight);
+
+        for (int y = 0; y < kHeight; ++y)
+        {
+            for (int x = 0; x < kWidth; ++x)
+            {
+                float3 d(((x + 0.5f) / kWidth - 0.5f) * 2.f, ((y + 0.5f) / kHeight - 0.5f) * 2.f, 1.f);
+                rays[y * kWidth + x] = ray(float3(0.f, 0.f, 0.f), normalize(d));
+            }
+        }
+
+        std::mt19937 rng(0x12345);
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+        std::vector<Intersection> isect(rays.size());
+
+        for (int b = 0; b < numbounces; ++b)
+        {
+            Trace(rays, isect);
+
+            for (int i = 0; i < (int)rays.size(); ++i)
+            {
+                if (isect[i].shapeid == kNullId)
+                {
+                    rays[i].SetActive(false);
+                    continue;
+                }
+
+                int const* face = &indices_[3 * isect[i].primid];
+                float3 p[3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    p[k] = float3(vertices_[3 * face[k]], vertices_[3 * face[k] + 1], vertices_[3 * face[k] + 2]);
+                }
+
+                float3 n = normalize(cross(p[1] - p[0], p[2] - p[0]));
+                if (dot(n, rays[i].d) > 0.f)
+                {
+                    n = -n;
+                }
+
+                float3 o = rays[i].o + rays[i].d * isect[i].uvwt.w + n * 1e-3f;
+
+                // Uniform direction in the hemisphere around the normal
+                float3 d;
+                do
+                {
+                    d = float3(dist(rng) * 2.f - 1.f, dist(rng) * 2.f - 1.f, dist(rng) * 2.f - 1.f);
+                } while (d.sqnorm() > 1.f || d.sqnorm() < 1e-4f);
+
+                d = normalize(d);
+                if (dot(d, n) < 0.f)
+                {
+                    d = -d;
+                }
+
+                rays[i] = ray(o, d);
+            }
+        }
+
+        return rays;
+    }
+
+    // Trace rays and return closest hits
+    void Trace(std::vector<ray> const& rays, std::vector<Intersection>& isect)
+    {
+        int numrays = (int)rays.size();
+        auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), (void*)rays.data());
+        auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+        Event* ev = nullptr;
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &ev));
+        ev->Wait(); api_->DeleteEvent(ev);
+
+        Intersection* data = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&data, &ev));
+        ev->Wait(); api_->DeleteEvent(ev);
+
+        isect.assign(data, data + numrays);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, data, &ev));
+        ev->Wait(); api_->DeleteEvent(ev);
+
+        api_->DeleteBuffer(ray_buffer);
+        api_->DeleteBuffer(isect_buffer);
+    }
+
+    // Average time of a closest hit query over a few runs
+    double MeasureQueryTime(std::vector<ray> const& rays, int numruns)
+    {
+        int numrays = (int)rays.size();
+        auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), (void*)rays.data());
+        auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+        double total = 0.0;
+        for (int i = 0; i <= numruns; ++i)
+        {
+            Event* ev = nullptr;
+            auto start = std::chrono::high_resolution_clock::now();
+            api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &ev);
+            ev->Wait();
+            auto delta = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            api_->DeleteEvent(ev);
+
+            // First run warms up caches
+            if (i > 0)
+            {
+                total += delta;
+            }
+        }
+
+        api_->DeleteBuffer(ray_buffer);
+        api_->DeleteBuffer(isect_buffer);
+
+        return total / numruns;
+    }
+
+    // Api
+    IntersectionApi* api_;
+
+    std::vector<Shape*> apishapes_;
+    std::vector<float> vertices_;
+    std::vector<int> indices_;
+};
+
+TEST_F(ApiPerformanceCpu, SortRays_SecondaryRays)
+{
+    for (int bounce = 1; bounce <= 3; ++bounce)
+    {
+        auto rays = GenerateBounceRays(bounce);
+
+        std::vector<Intersection> reference;
+        std::vector<Intersection> sorted;
+
+        api_->SetOption("query.sort_rays", 0.f);
+        Trace(rays, reference);
+        double unsorted_time = MeasureQueryTime(rays, 3);
+
+        api_->SetOption("query.sort_rays", 1.f);
+        Trace(rays, sorted);
+        double sorted_time = MeasureQueryTime(rays, 3);
+
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            if (rays[i].IsActive())
+            {
+                ASSERT_EQ(reference[i].primid, sorted[i].primid);
+            }
+        }
+
+        std::cout << "Bounce " << bounce << " rays (" << rays.size() << "): unsorted " << unsorted_time
+            << " ms, sorted " << sorted_time << " ms\n";
+    }
+}
@@ -36,6 +36,11 @@ THE SOFTWARE.
 //#include "radeon_rays_performance_test_vk.h"
 #endif
 
+#include "radeon_rays_apitest_cpu.h"
+#include "radeon_rays_conformance_test_cpu.h"
+#include "thread_pool_test.h"
+//#include "radeon_rays_performance_test_cpu.h"
+
 #if USE_EMBREE
 #include "radeon_rays_apitest_embree.h"
 #include "radeon_rays_conformance_test_embree.h"
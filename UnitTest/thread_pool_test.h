@@ -0,0 +1,152 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+/// This test suite is testing the thread pool used by the CPU devices
+///
+
+#include "gtest/gtest.h"
+#include "RadeonRays/src/async/thread_pool.h"
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+
+using namespace RadeonRays;
+
+TEST(ThreadPool, Submit)
+{
+    thread_pool<int> pool;
+
+    std::vector<std::future<int> > results;
+    for (int i = 0; i < 100; ++i)
+    {
+        results.push_back(pool.submit([i]() { return i * i; }));
+    }
+
+    for (int i = 0; i < 100; ++i)
+    {
+        ASSERT_EQ(i * i, results[i].get());
+    }
+}
+
+TEST(ThreadPool, ParallelFor)
+{
+    thread_pool<void> pool;
+
+    int const kCount = 100003;
+    std::vector<std::atomic<int> > visits(kCount);
+    for (auto& v : visits) v = 0;
+
+    pool.parallel_for(0, kCount, 64, [&visits](int begin, int end)
+    {
+        ASSERT_LE(end - begin, 64);
+        for (int i = begin; i < end; ++i)
+            ++visits[i];
+    });
+
+    for (int i = 0; i < kCount; ++i)
+    {
+        ASSERT_EQ(1, visits[i].load());
+    }
+
+    // Empty range is a no-op
+    pool.parallel_for(5, 5, 64, [](int, int) { FAIL(); });
+}
+
+TEST(ThreadPool, ParallelFor_Nested)
+{
+    thread_pool<void> pool(2);
+
+    // Tasks waiting on their own parallel_for must not starve the pool
+    std::atomic<int> sum(0);
+    std::vector<std::future<void> > jobs;
+    for (int i = 0; i < 8; ++i)
+    {
+        jobs.push_back(pool.submit([&pool, &sum]()
+        {
+            pool.parallel_for(0, 1000, 10, [&sum](int begin, int end) { sum += end - begin; });
+        }));
+    }
+
+    std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) { j.get(); });
+    ASSERT_EQ(8000, sum.load());
+}
+
+TEST(ThreadPool, ParallelFor_Exception)
+{
+    thread_pool<void> pool;
+
+    EXPECT_THROW(pool.parallel_for(0, 1000, 1, [](int begin, int)
+    {
+        if (begin == 500)
+            throw std::runtime_error("chunk failed");
+    }), std::runtime_error);
+
+    // Pool is still usable afterwards
+    std::atomic<int> count(0);
+    pool.parallel_for(0, 1000, 1, [&count](int, int) { ++count; });
+    ASSERT_EQ(1000, count.load());
+}
+
+// Time from issuing a small batch to its completion after the workers went idle
+TEST(ThreadPool, DispatchLatency)
+{
+    thread_pool<void> pool;
+
+    int const kIterations = 100;
+    std::vector<double> submit_times;
+    std::vector<double> parallel_for_times;
+
+    for (int i = 0; i < kIterations; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+        auto start = std::chrono::high_resolution_clock::now();
+        pool.submit([]() {}).wait();
+        auto delta = std::chrono::high_resolution_clock::now() - start;
+        submit_times.push_back(std::chrono::duration<double, std::milli>(delta).count());
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+        std::atomic<int> count(0);
+        start = std::chrono::high_resolution_clock::now();
+        pool.parallel_for(0, 4 * pool.num_threads(), 1, [&count](int, int) { ++count; });
+        delta = std::chrono::high_resolution_clock::now() - start;
+        parallel_for_times.push_back(std::chrono::duration<double, std::milli>(delta).count());
+    }
+
+    std::sort(submit_times.begin(), submit_times.end());
+    std::sort(parallel_for_times.begin(), parallel_for_times.end());
+
+    std::cout << "Dispatch latency after idle, ms (median / 90th percentile): submit "
+        << submit_times[kIterations / 2] << " / " << submit_times[kIterations * 9 / 10]
+        << ", parallel_for " << parallel_for_times[kIterations / 2] << " / " << parallel_for_times[kIterations * 9 / 10] << "\n";
+
+    // Polling workers would sleep through most of the idle gap
+    EXPECT_LT(submit_times[kIterations / 2], 1.0);
+    EXPECT_LT(parallel_for_times[kIterations / 2], 1.0);
+}
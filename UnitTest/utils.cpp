@@ -2,6 +2,17 @@
 #include "RadeonRays/src/primitive/mesh.h"
 #include "RadeonRays/src/primitive/instance.h"
 #include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
 
 using namespace RadeonRays;
 
@@ -74,9 +85,9 @@ bool TestOcclusion(const TestShape& shape, const RadeonRays::ray& r)
 
         for (int t = 0; t < knum_verts - 2; ++t)
         {
-            // only tris and quad supported
+            // only tris and quad supported, quads are split into (v0, v1, v2) and (v0, v2, v3)
             assert(t == 0 || t == 1);
-            float3 v0 = tverts[0 + t];
+            float3 v0 = tverts[0];
             float3 e1 = tverts[1 + t] - v0;
             float3 e2 = tverts[2 + t] - v0;
 
@@ -123,9 +134,9 @@ void TestIntersection(const TestShape& shape, const RadeonRays::ray& r, RadeonRa
 
         for (int t = 0; t < knum_verts - 2; ++t)
         {
-            // only tris and quad supported
+            // only tris and quad supported, quads are split into (v0, v1, v2) and (v0, v2, v3)
             assert(t == 0 || t == 1);
-            float3 v0 = tverts[0 + t];
+            float3 v0 = tverts[0];
             float3 e1 = tverts[1 + t] - v0;
             float3 e2 = tverts[2 + t] - v0;
 
@@ -154,11 +165,106 @@ void TestIntersection(const TestShape& shape, const RadeonRays::ray& r, RadeonRa
 
             if (temp > 0.f && temp < isect.uvwt.w)
             {
-                isect.uvwt = float4(b1, b2, 0, temp);
+                isect.uvwt = float4(b1, b2, (float)t, temp);
                 isect.shapeid = shape.shape->GetId();
-                isect.primid = i + t;
+                isect.primid = i;
+            }
+        }
+
+    }
+}
+
+#ifdef WIN32
+TempDirectory::TempDirectory()
+{
+    char temp[MAX_PATH];
+    char name[MAX_PATH];
+    if (GetTempPathA(MAX_PATH, temp) && GetTempFileNameA(temp, "rr", 0, name))
+    {
+        // GetTempFileName creates a file to reserve the name, replace it with a directory
+        DeleteFileA(name);
+        if (CreateDirectoryA(name, nullptr))
+        {
+            m_path = name;
+        }
+    }
+}
+
+std::vector<std::string> TempDirectory::files() const
+{
+    std::vector<std::string> result;
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((m_path + "\\*").c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                result.push_back(data.cFileName);
+            }
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+    return result;
+}
+
+TempDirectory::~TempDirectory()
+{
+    if (m_path.empty())
+    {
+        return;
+    }
+
+    for (auto const& file : files())
+    {
+        DeleteFileA((m_path + "\\" + file).c_str());
+    }
+    RemoveDirectoryA(m_path.c_str());
+}
+#else
+TempDirectory::TempDirectory()
+{
+    char const* temp = std::getenv("TMPDIR");
+    std::string pattern = std::string(temp ? temp : "/tmp") + "/rrXXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back(0);
+    if (mkdtemp(&name[0]))
+    {
+        m_path = &name[0];
+    }
+}
+
+std::vector<std::string> TempDirectory::files() const
+{
+    std::vector<std::string> result;
+    DIR* dir = opendir(m_path.c_str());
+    if (dir)
+    {
+        while (dirent* entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..")
+            {
+                result.push_back(name);
             }
         }
+        closedir(dir);
+    }
+    return result;
+}
 
+TempDirectory::~TempDirectory()
+{
+    if (m_path.empty())
+    {
+        return;
     }
-}
\ No newline at end of file
+
+    for (auto const& file : files())
+    {
+        std::remove((m_path + "/" + file).c_str());
+    }
+    rmdir(m_path.c_str());
+}
+#endif
@@ -1,5 +1,7 @@
 #pragma once
 #include "radeon_rays.h"
+#include <string>
+#include <vector>
 
 struct TestShape
 {
@@ -28,3 +30,21 @@ struct TestShape
 // test functions, perform tests using unoptimised CPU for validating the fast paths
 void TestOcclusions(const TestShape* shapes, int numshapes, RadeonRays::ray const * rays, int numrays, bool* hits);
 void TestIntersections(const TestShape* shapes, int numshapes, RadeonRays::ray const * rays, int numrays, RadeonRays::Intersection* results);
+
+// Uniquely named directory in the system temp folder, removed with its files on destruction
+class TempDirectory
+{
+public:
+    TempDirectory();
+    ~TempDirectory();
+
+    std::string const& path() const { return m_path; }
+    // Names of the files in the directory
+    std::vector<std::string> files() const;
+
+private:
+    TempDirectory(TempDirectory const&);
+    TempDirectory& operator = (TempDirectory const&);
+
+    std::string m_path;
+};